@@ -1,7 +1,31 @@
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <fenv.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) && defined(__linux__)
+#define CALC_HAVE_JIT 1 // Native code for hot programs (see jit_compile)
+#endif
+#include <gmp.h>
 #include <pango/pango.h>
 #include <glib/gkeyfile.h>
 
@@ -13,10 +37,27 @@ GtkWidget *display;
 GtkTextBuffer *text_buffer;
 char current_input[256] = "";
 char expression[1024] = ""; // Full expression being built
-char history_buffer[4096] = ""; // Accumulated calculation history
 double result = 0;
+char result_text[256] = ""; // Exact decimal text of the last result, if known
 gboolean has_result = FALSE;
 
+// Calculation history as a persistent list, newest entry first. An entry is
+// never changed once linked, so undo snapshots share all the entries they have
+// in common and keeping one costs a single reference.
+typedef struct HistoryEntry HistoryEntry;
+struct HistoryEntry {
+    HistoryEntry *older;
+    int refs;
+    long count;   // Entries from this one back to the oldest
+    double value; // Result shown on the line (NAN for errors, definitions and notes)
+    char text[];  // One line, without the newline
+};
+
+HistoryEntry *history = NULL;
+
+// Most recent history lines put in the display; older ones stay in the list
+#define HISTORY_VISIBLE_LINES 500
+
 // Precision menu items
 GtkWidget *precision_0, *precision_1, *precision_2, *precision_3, *precision_4;
 GtkWidget *precision_6, *precision_8, *precision_10;
@@ -24,12 +65,42 @@ GtkWidget *precision_6, *precision_8, *precision_10;
 // Display height menu items
 GtkWidget *display_auto, *display_small, *display_medium, *display_large;
 
+// Arithmetic mode menu items
+GtkWidget *arithmetic_fast, *arithmetic_exact, *arithmetic_interval, *arithmetic_complex, *arithmetic_programmer;
+
+// Programmer mode menu items
+GtkWidget *base_10, *base_16, *base_8, *base_2;
+GtkWidget *width_8, *width_16, *width_32, *width_64;
+GtkWidget *integers_signed, *integers_unsigned;
+
+// Plot menu items
+GtkWidget *plot_hidden, *plot_beside;
+
 // Precision variable (font sizes now calculated dynamically)
 int result_precision = 6; // Default 6 decimal places
 
 // Display height variable (in pixels, 0 = auto-scale)
 int display_height = 0; // Default 0 = auto-scale based on window size
 
+// Arithmetic mode
+#define ARITHMETIC_FAST 0     // Hardware doubles
+#define ARITHMETIC_EXACT 1    // Exact decimal with big rationals
+#define ARITHMETIC_INTERVAL 2 // Doubles plus rigorous [lo, hi] error bounds
+#define ARITHMETIC_COMPLEX 3  // Complex doubles, with i as the imaginary unit
+#define ARITHMETIC_PROGRAMMER 4 // Fixed-width integers with bitwise operators
+int arithmetic_mode = ARITHMETIC_FAST;
+
+// Programmer mode: integer width in bits, signedness and the base results are shown in
+int programmer_width = 64;
+int programmer_signed = 1;
+int programmer_base = 16;
+
+// Plot panel beside the display (0 = hidden)
+int show_plot = 0;
+
+// Typing latency budget in milliseconds (key press to pixels on screen)
+int latency_budget = 50;
+
 // Window size variables
 int window_width = 200;   // Default width
 int window_height = 300;  // Default height
@@ -37,11 +108,20 @@ int window_height = 300;  // Default height
 // Configuration file path
 #define CONFIG_FILE ".calculator_config"
 
+// Largest magnitude below which every integer is exactly representable as a double
+#define EXACT_DOUBLE_LIMIT 9007199254740992.0 // 2^53
+
 // Function prototypes
 void update_ui_scaling(GtkWidget *window);
 void close_open_menus(GtkWidget *window);
 void clear_calculator(void);
 gboolean save_settings_idle(gpointer data);
+void trace_record_key(const GdkEventKey *event);
+void frame_latency_key_started(void);
+void frame_latency_key_finished(void);
+void frame_latency_updated(void);
+void frame_latency_scrolled(void);
+int evaluation_pending(void);
 
 // Safe string operations with bounds checking
 int safe_strcat(char *dest, const char *src, size_t dest_size) {
@@ -75,6 +155,12 @@ void save_settings() {
     g_key_file_set_integer(keyfile, "Settings", "display_height", display_height);
     g_key_file_set_integer(keyfile, "Settings", "window_width", window_width);
     g_key_file_set_integer(keyfile, "Settings", "window_height", window_height);
+    g_key_file_set_integer(keyfile, "Settings", "arithmetic_mode", arithmetic_mode);
+    g_key_file_set_integer(keyfile, "Settings", "show_plot", show_plot);
+    g_key_file_set_integer(keyfile, "Settings", "latency_budget", latency_budget);
+    g_key_file_set_integer(keyfile, "Settings", "programmer_width", programmer_width);
+    g_key_file_set_integer(keyfile, "Settings", "programmer_signed", programmer_signed);
+    g_key_file_set_integer(keyfile, "Settings", "programmer_base", programmer_base);
 
     // Get config directory
     config_dir = g_build_filename(g_get_home_dir(), NULL);
@@ -131,6 +217,52 @@ void load_settings() {
             g_error_free(error);
             error = NULL;
         }
+
+        arithmetic_mode = g_key_file_get_integer(keyfile, "Settings", "arithmetic_mode", &error);
+        if (error) {
+            g_error_free(error);
+            error = NULL;
+            // Older versions stored a flag for exact arithmetic instead of the mode
+            arithmetic_mode = g_key_file_get_integer(keyfile, "Settings", "exact_arithmetic", &error) ?
+                ARITHMETIC_EXACT : ARITHMETIC_FAST; // default (hardware doubles)
+            if (error) {
+                g_error_free(error);
+                error = NULL;
+            }
+        }
+
+        show_plot = g_key_file_get_integer(keyfile, "Settings", "show_plot", &error);
+        if (error) {
+            show_plot = 0; // default (hidden)
+            g_error_free(error);
+            error = NULL;
+        }
+
+        latency_budget = g_key_file_get_integer(keyfile, "Settings", "latency_budget", &error);
+        if (error) {
+            latency_budget = 50; // default (ms)
+            g_error_free(error);
+            error = NULL;
+        }
+
+        programmer_width = g_key_file_get_integer(keyfile, "Settings", "programmer_width", &error);
+        if (error || (programmer_width != 8 && programmer_width != 16 && programmer_width != 32)) {
+            programmer_width = 64; // default
+            g_clear_error(&error);
+        }
+
+        programmer_signed = g_key_file_get_integer(keyfile, "Settings", "programmer_signed", &error);
+        if (error) {
+            programmer_signed = 1; // default (two's complement)
+            g_error_free(error);
+            error = NULL;
+        }
+
+        programmer_base = g_key_file_get_integer(keyfile, "Settings", "programmer_base", &error);
+        if (error || (programmer_base != 2 && programmer_base != 8 && programmer_base != 10)) {
+            programmer_base = 16; // default
+            g_clear_error(&error);
+        }
     } else {
         // File doesn't exist, use defaults
         g_error_free(error);
@@ -394,6 +526,44 @@ void update_display_height_menu_labels() {
         display_height == 160 ? "<span foreground=\"#4A90E2\">Large (160px)</span>" : "Large (160px)");
 }
 
+// Function to update arithmetic mode menu labels to show current selection
+void update_arithmetic_menu_labels() {
+    gtk_menu_item_set_label(GTK_MENU_ITEM(arithmetic_fast),
+        arithmetic_mode == ARITHMETIC_FAST ? "<span foreground=\"#4A90E2\">Fast (double)</span>" : "Fast (double)");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(arithmetic_exact),
+        arithmetic_mode == ARITHMETIC_EXACT ? "<span foreground=\"#4A90E2\">Exact decimal</span>" : "Exact decimal");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(arithmetic_interval),
+        arithmetic_mode == ARITHMETIC_INTERVAL ? "<span foreground=\"#4A90E2\">Interval bounds</span>" : "Interval bounds");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(arithmetic_complex),
+        arithmetic_mode == ARITHMETIC_COMPLEX ? "<span foreground=\"#4A90E2\">Complex</span>" : "Complex");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(arithmetic_programmer),
+        arithmetic_mode == ARITHMETIC_PROGRAMMER ? "<span foreground=\"#4A90E2\">Programmer</span>" : "Programmer");
+}
+
+// Function to update programmer mode menu labels to show current selection
+void update_programmer_menu_labels() {
+    gtk_menu_item_set_label(GTK_MENU_ITEM(base_10),
+        programmer_base == 10 ? "<span foreground=\"#4A90E2\">Decimal</span>" : "Decimal");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(base_16),
+        programmer_base == 16 ? "<span foreground=\"#4A90E2\">Hexadecimal</span>" : "Hexadecimal");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(base_8),
+        programmer_base == 8 ? "<span foreground=\"#4A90E2\">Octal</span>" : "Octal");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(base_2),
+        programmer_base == 2 ? "<span foreground=\"#4A90E2\">Binary</span>" : "Binary");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(width_8),
+        programmer_width == 8 ? "<span foreground=\"#4A90E2\">8-bit</span>" : "8-bit");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(width_16),
+        programmer_width == 16 ? "<span foreground=\"#4A90E2\">16-bit</span>" : "16-bit");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(width_32),
+        programmer_width == 32 ? "<span foreground=\"#4A90E2\">32-bit</span>" : "32-bit");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(width_64),
+        programmer_width == 64 ? "<span foreground=\"#4A90E2\">64-bit</span>" : "64-bit");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(integers_signed),
+        programmer_signed ? "<span foreground=\"#4A90E2\">Signed</span>" : "Signed");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(integers_unsigned),
+        !programmer_signed ? "<span foreground=\"#4A90E2\">Unsigned</span>" : "Unsigned");
+}
+
 // Idle callback to save settings without blocking menu operations
 gboolean save_settings_idle(gpointer data) {
     (void)data;
@@ -440,68 +610,265 @@ void on_display_height_changed(GtkMenuItem *menuitem, gpointer user_data) {
     }
 }
 
+// Menu callback for arithmetic mode changes
+void on_arithmetic_changed(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    int new_mode = GPOINTER_TO_INT(user_data);
+
+    // Only update if mode actually changed
+    if (arithmetic_mode != new_mode) {
+        arithmetic_mode = new_mode;
+        strcpy(result_text, "");
+
+        // Update menu labels immediately to show new selection
+        update_arithmetic_menu_labels();
+
+        // Defer settings save to avoid blocking during menu operation
+        g_idle_add(save_settings_idle, NULL);
+    }
+}
+
+// Menu callbacks for the programmer mode base, width and signedness
+void on_programmer_base_changed(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    int new_base = GPOINTER_TO_INT(user_data);
+    if (programmer_base != new_base) {
+        programmer_base = new_base;
+        update_programmer_menu_labels();
+        g_idle_add(save_settings_idle, NULL);
+    }
+}
+
+void on_programmer_width_changed(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    int new_width = GPOINTER_TO_INT(user_data);
+    if (evaluation_pending()) {
+        return; // The pending evaluation is reading it
+    }
+    if (programmer_width != new_width) {
+        programmer_width = new_width;
+        update_programmer_menu_labels();
+        g_idle_add(save_settings_idle, NULL);
+    }
+}
+
+void on_programmer_signed_changed(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    int new_signed = GPOINTER_TO_INT(user_data);
+    if (evaluation_pending()) {
+        return; // The pending evaluation is reading it
+    }
+    if (programmer_signed != new_signed) {
+        programmer_signed = new_signed;
+        update_programmer_menu_labels();
+        g_idle_add(save_settings_idle, NULL);
+    }
+}
+
 // Function to auto-scroll display to bottom
 gboolean scroll_display_to_bottom(gpointer data) {
     (void)data;
     GtkTextIter end;
     gtk_text_buffer_get_end_iter(text_buffer, &end);
     gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(display), &end, 0.0, FALSE, 0.0, 0.0);
+    frame_latency_scrolled();
     return FALSE; // Don't repeat
 }
 
-// Function to update display (shows current expression being built)
-void update_display() {
-    char display_text[2048] = "";
+HistoryEntry *history_retain(HistoryEntry *entry) {
+    if (entry != NULL) {
+        entry->refs++;
+    }
+    return entry;
+}
 
-    // Build complete display: history + current expression
-    if (strlen(history_buffer) > 0) {
-        strcpy(display_text, history_buffer);
+// Drop a reference, freeing the entries no other list still shares
+void history_release(HistoryEntry *entry) {
+    while (entry != NULL && --entry->refs == 0) {
+        HistoryEntry *older = entry->older;
+        free(entry);
+        entry = older;
     }
+}
 
-    // Add current expression + current input
-    char current_expr[1024] = "";
-    if (strlen(expression) > 0) {
-        strcpy(current_expr, expression);
-        if (strlen(current_input) > 0) {
-            if (strlen(current_expr) > 0) {
-                strcat(current_expr, " ");
-            }
-            strcat(current_expr, current_input);
-        }
-    } else if (strlen(current_input) > 0) {
-        strcpy(current_expr, current_input);
+// Undo snapshots: the shared history plus a copy of the short edit line
+typedef struct {
+    HistoryEntry *history; // Holds a reference
+    char *line;            // expression, current_input and result_text, each NUL-terminated
+    double result;
+    gboolean has_result;
+} UndoState;
+
+typedef struct {
+    UndoState *states;
+    int count;
+    int capacity;
+} UndoStack;
+
+UndoStack undo_stack = { NULL, 0, 0 };
+UndoStack redo_stack = { NULL, 0, 0 };
+UndoState undo_current = { NULL, NULL, 0, FALSE }; // What the display shows now
+
+int undo_capture(UndoState *state) {
+    size_t expr_len = strlen(expression) + 1;
+    size_t input_len = strlen(current_input) + 1;
+    size_t text_len = strlen(result_text) + 1;
+    state->line = malloc(expr_len + input_len + text_len);
+    if (state->line == NULL) {
+        return 0;
     }
+    memcpy(state->line, expression, expr_len);
+    memcpy(state->line + expr_len, current_input, input_len);
+    memcpy(state->line + expr_len + input_len, result_text, text_len);
+    state->history = history_retain(history);
+    state->result = result;
+    state->has_result = has_result;
+    return 1;
+}
 
-    if (strlen(current_expr) > 0) {
-        if (strlen(display_text) > 0) {
-            strcat(display_text, current_expr);
-        } else {
-            strcpy(display_text, current_expr);
+void undo_free_state(UndoState *state) {
+    history_release(state->history);
+    free(state->line);
+    state->history = NULL;
+    state->line = NULL;
+}
+
+// Whether the calculator still looks the way a snapshot recorded it
+int undo_matches(const UndoState *state) {
+    const char *input = state->line + strlen(state->line) + 1;
+    return state->history == history && state->has_result == has_result &&
+           strcmp(state->line, expression) == 0 && strcmp(input, current_input) == 0;
+}
+
+void undo_restore(const UndoState *state) {
+    const char *input = state->line + strlen(state->line) + 1;
+    strcpy(expression, state->line);
+    strcpy(current_input, input);
+    strcpy(result_text, input + strlen(input) + 1);
+    HistoryEntry *previous = history;
+    history = history_retain(state->history);
+    history_release(previous);
+    result = state->result;
+    has_result = state->has_result;
+}
+
+int undo_push(UndoStack *stack, UndoState *state) {
+    if (stack->count == stack->capacity) {
+        int capacity = stack->capacity > 0 ? stack->capacity * 2 : 64;
+        UndoState *states = realloc(stack->states, sizeof(UndoState) * capacity);
+        if (states == NULL) {
+            return 0;
         }
+        stack->states = states;
+        stack->capacity = capacity;
+    }
+    stack->states[stack->count++] = *state;
+    return 1;
+}
+
+void undo_clear(UndoStack *stack) {
+    while (stack->count > 0) {
+        undo_free_state(&stack->states[--stack->count]);
+    }
+}
+
+// Called whenever the display is redrawn: a change since the last snapshot
+// becomes one undo step and forgets anything that could have been redone
+void undo_note_change(void) {
+    if (undo_current.line != NULL && undo_matches(&undo_current)) {
+        return;
     }
+    UndoState state;
+    if (!undo_capture(&state)) {
+        return;
+    }
+    if (undo_current.line != NULL && !undo_push(&undo_stack, &undo_current)) {
+        undo_free_state(&undo_current);
+    }
+    undo_current = state;
+    undo_clear(&redo_stack);
+}
+
+// Function to update display (shows current expression being built)
+void update_display() {
+    undo_note_change();
+
+    // Build complete display: the latest history lines + current expression
+    GString *display_text = g_string_new(NULL);
+    HistoryEntry *visible[HISTORY_VISIBLE_LINES];
+    int visible_count = 0;
+    for (HistoryEntry *entry = history; entry != NULL && visible_count < HISTORY_VISIBLE_LINES; entry = entry->older) {
+        visible[visible_count++] = entry;
+    }
+    while (visible_count > 0) {
+        g_string_append(display_text, visible[--visible_count]->text);
+        g_string_append_c(display_text, '\n');
+    }
+
+    // Add current expression + current input
+    g_string_append(display_text, expression);
+    if (strlen(expression) > 0 && strlen(current_input) > 0) {
+        g_string_append_c(display_text, ' ');
+    }
+    g_string_append(display_text, current_input);
 
     // Set the complete display text
-    gtk_text_buffer_set_text(text_buffer, display_text, -1);
+    gtk_text_buffer_set_text(text_buffer, display_text->str, -1);
+    g_string_free(display_text, TRUE);
+    frame_latency_updated();
 
     // Auto-scroll to show the latest content
     g_idle_add(scroll_display_to_bottom, NULL);
 }
 
-// Function to append to calculation history
-void append_to_history(const char *text) {
-    char history_text[1024];
-
-    snprintf(history_text, sizeof(history_text), "%s\n", text);
+// Make an entry on top of older, taking over the caller's reference to older
+HistoryEntry *history_link(HistoryEntry *older, const char *text, size_t length, double value) {
+    HistoryEntry *entry = malloc(sizeof(HistoryEntry) + length + 1);
+    if (entry == NULL) {
+        return NULL;
+    }
+    memcpy(entry->text, text, length);
+    entry->text[length] = '\0';
+    entry->refs = 1;
+    entry->count = older != NULL ? older->count + 1 : 1;
+    entry->value = value;
+    entry->older = older;
+    return entry;
+}
 
-    // Append to history buffer
-    if (strlen(history_buffer) + strlen(history_text) < sizeof(history_buffer) - 1) {
-        strcat(history_buffer, history_text);
+// Function to append a result line to calculation history
+void append_value_to_history(const char *text, double value) {
+    HistoryEntry *entry = history_link(history, text, strlen(text), value);
+    if (entry != NULL) {
+        history = entry;
     }
 
     // Update display with new history
     update_display();
 }
 
+// Function to append to calculation history
+void append_to_history(const char *text) {
+    append_value_to_history(text, NAN);
+}
+
+// Undo moves a snapshot from the undo stack to the redo stack; redo moves it back
+void undo_step(UndoStack *from, UndoStack *to) {
+    undo_note_change();
+    if (from->count == 0 || !undo_push(to, &undo_current)) {
+        return;
+    }
+    undo_current = from->states[--from->count];
+    undo_restore(&undo_current);
+    update_display();
+}
+
+// Forget the history; snapshots that still share it keep it alive for undo
+void clear_history(void) {
+    history_release(history);
+    history = NULL;
+}
+
 // Function to clear calculator (keeps calculation history)
 void clear_calculator() {
     strcpy(current_input, "");
@@ -544,9 +911,9 @@ int would_create_consecutive_ops(const char *expr, const char *current, char op)
         return 0;
     }
 
-    // Allow operators at the start of expression (but not +)
+    // Allow operators at the start of expression (but not + or an argument or row separator)
     if (strlen(expr) == 0) {
-        return op == '+';  // Block unary + at start, allow - and others
+        return op == '+' || op == ',' || op == ';';  // Block unary + at start, allow - and others
     }
 
     // Check the last character in the expression (ignoring spaces)
@@ -560,17 +927,17 @@ int would_create_consecutive_ops(const char *expr, const char *current, char op)
         }
     }
 
-    // If last character is an operator, don't allow another operator
-    // Exception: allow '-' after binary operators (+, *, /) for unary minus
-    // Exception: allow '(' and ')' anywhere (parentheses have special rules)
-    if (last_char && (*last_char == '+' || *last_char == '-' || *last_char == '*' || *last_char == '/')) {
-        // Parentheses are always allowed
-        if (op == '(' || op == ')') {
+    // If last character is an operator (or ',' or ';'), don't allow another operator
+    // Exception: allow '-' after binary operators (+, *, /, ^) for unary minus, and '~' after any
+    // Exception: allow parentheses and brackets anywhere (they have special rules)
+    if (last_char && strchr("+-*/^,;=%&|<>~", *last_char) != NULL) {
+        // Parentheses and brackets are always allowed
+        if (op == '(' || op == ')' || op == '[' || op == ']') {
             return 0;
         }
-        // Only allow '-' after +, *, / (but not after another -)
-        if (op == '-' && *last_char != '-') {
-            return 0;  // Allow unary minus after binary operators
+        // Only allow '-' after +, *, /, ^ (but not after another -)
+        if ((op == '-' && *last_char != '-') || op == '~') {
+            return 0;  // Allow unary minus and complement after binary operators
         }
         return 1;  // Block all other operator combinations
     }
@@ -583,18 +950,20 @@ void on_operation_clicked(GtkWidget *widget, gpointer data) {
 
     // Start new expression with result if we had a previous calculation
     if (has_result) {
-        // Special case: opening parenthesis after result should start new calculation
-        if (*op == '(') {
+        // Special case: opening parenthesis or bracket after result should start new calculation
+        if (*op == '(' || *op == '[') {
             // Clear everything and start fresh with parenthesis
-            strcpy(expression, "(");
+            snprintf(expression, sizeof(expression), "%c", *op);
             strcpy(current_input, "");
             has_result = FALSE;
             update_display();
             return;
         } else {
             // Normal operators: use result as starting point
-            if (result == (int)result) {
-                sprintf(expression, "%d", (int)result);
+            if (strlen(result_text) > 0) {
+                strcpy(expression, result_text);
+            } else if (result == floor(result) && fabs(result) < EXACT_DOUBLE_LIMIT) {
+                sprintf(expression, "%.0f", result);
             } else {
                 sprintf(expression, "%.*f", result_precision, result);
             }
@@ -609,8 +978,8 @@ void on_operation_clicked(GtkWidget *widget, gpointer data) {
         return; // Ignore this operator input
     }
 
-    // Special handling for parentheses - can be added anywhere
-    if (*op == '(' || *op == ')') {
+    // Special handling for parentheses and brackets - can be added anywhere
+    if (*op == '(' || *op == ')' || *op == '[' || *op == ']') {
         // If we have current input, append it to expression first
         if (strlen(current_input) > 0) {
             if (strlen(expression) > 0) {
@@ -621,7 +990,7 @@ void on_operation_clicked(GtkWidget *widget, gpointer data) {
         }
 
         // Add space before parenthesis if there's content (except for opening at start)
-        if (strlen(expression) > 0 && *op == ')') {
+        if (strlen(expression) > 0 && (*op == ')' || *op == ']')) {
             strcat(expression, " ");
         }
 
@@ -633,511 +1002,10171 @@ void on_operation_clicked(GtkWidget *widget, gpointer data) {
         }
         strcat(expression, current_input);
         strcat(expression, " ");
-        strncat(expression, op, 1);
+        strcat(expression, op); // Shifts are two characters
         strcpy(current_input, "");
     } else if (strlen(expression) > 0) {
         // Operator after expression (e.g., after closing parenthesis)
         // Allow operators to be added to continue the expression
         strcat(expression, " ");
-        strncat(expression, op, 1);
+        strcat(expression, op);
         // current_input stays empty, ready for next number
     } else if (strlen(expression) == 0 && strlen(current_input) == 0) {
         // Starting expression with operator (mainly for unary minus)
-        strncat(expression, op, 1);
+        strcat(expression, op);
     }
     update_display();
 }
 
-// Stack-based expression evaluator with parentheses support
+// Compiled expression: operations in postfix order, shared by every evaluation mode
+typedef enum {
+    OP_PUSH,  // Push literal value
+    OP_LOAD,  // Push the cached value of a variable slot
+    OP_PARAM, // Push a parameter of the user function being evaluated
+    OP_CALL,  // Call a user function slot with the top arg_count values
+    OP_BUILTIN, // Apply built-in function slot to the top arg_count values
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_POW,   // Raise the second value from the top to the power of the top
+    OP_NEG,   // Negate the top value
+    OP_MATRIX, // Push a new slot x arg_count matrix, filled by the OP_ELEMENTs that follow
+    OP_ELEMENT, // Store the top value as the next element of the matrix below it
+    OP_MOD,   // Integer operators of programmer mode
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_SHL,
+    OP_SHR,
+    OP_NOT    // Complement the bits of the top value
+} CalcOpcode;
+
 typedef struct {
-    double *data;
-    int top;
-    int capacity;
-} DoubleStack;
+    CalcOpcode op;
+    double value; // Literal value (OP_PUSH only)
+    long long int_value; // Literal value for the integer path
+    int slot;     // Symbol slot (OP_LOAD, OP_CALL), parameter index (OP_PARAM) or rows (OP_MATRIX);
+                  // for OP_PUSH, 1 when int_value holds the literal exactly
+    int arg_count; // Number of arguments (OP_CALL) or columns (OP_MATRIX)
+    int start;    // Offset of the literal, name or operator in the source expression
+    int length;   // Length of the source text
+} CalcInstr;
 
 typedef struct {
-    char *data;
-    int top;
+    CalcInstr *code;
+    int count;
     int capacity;
-} CharStack;
-
-void init_double_stack(DoubleStack *stack, int capacity) {
-    stack->data = malloc(sizeof(double) * capacity);
-    stack->top = -1;
-    stack->capacity = capacity;
+    int integer_only; // Every literal is an integer that fits in 64 bits
+    const char *source; // Text the program was compiled from (literals are re-read from it)
+    long hot_rows;      // Rows evaluated on the columnar path, for the JIT
+    int jit_tried;
+    void *jit;          // Native code for the columnar path, or NULL
+    size_t jit_size;
+} CalcProgram;
+
+// Evaluation error codes
+typedef enum {
+    CALC_OK = 0,
+    CALC_ERR_STACK_OVERFLOW,
+    CALC_ERR_MISMATCHED_PAREN,
+    CALC_ERR_MISSING_OPERAND,
+    CALC_ERR_DIVISION_BY_ZERO,
+    CALC_ERR_OVERFLOW,
+    CALC_ERR_INVALID_CHARACTER,
+    CALC_ERR_OUT_OF_MEMORY,
+    CALC_ERR_UNDEFINED_NAME,
+    CALC_ERR_ARGUMENT_COUNT,
+    CALC_ERR_INVALID_DEFINITION,
+    CALC_ERR_CIRCULAR_DEFINITION,
+    CALC_ERR_NEGATIVE_ROOT,
+    CALC_ERR_LOG_DOMAIN,
+    CALC_ERR_ARC_DOMAIN,
+    CALC_ERR_POWER_DOMAIN,
+    CALC_ERR_MISSING_OPERATOR,
+    CALC_ERR_DIMENSION,
+    CALC_ERR_SINGULAR_MATRIX,
+    CALC_ERR_NOT_INTEGER,
+    CALC_ERR_FACTORIAL_DOMAIN,
+    CALC_ERR_CANCELLED,
+    CALC_ERR_NO_UNKNOWN,
+    CALC_ERR_NO_SOLUTION
+} CalcError;
+
+// Result of evaluating an expression
+typedef struct {
+    double value;
+    long long int_value; // Exact result when is_integer is set
+    int is_integer;
+    CalcError error;
+    int error_offset; // Byte offset in the expression where the error was found
+} CalcResult;
+
+const char *calc_error_message(CalcError error) {
+    switch (error) {
+        case CALC_OK: return "ok";
+        case CALC_ERR_STACK_OVERFLOW: return "expression too deeply nested";
+        case CALC_ERR_MISMATCHED_PAREN: return "mismatched parenthesis";
+        case CALC_ERR_MISSING_OPERAND: return "missing operand";
+        case CALC_ERR_DIVISION_BY_ZERO: return "division by zero";
+        case CALC_ERR_OVERFLOW: return "overflow";
+        case CALC_ERR_INVALID_CHARACTER: return "invalid character";
+        case CALC_ERR_OUT_OF_MEMORY: return "out of memory";
+        case CALC_ERR_UNDEFINED_NAME: return "undefined name";
+        case CALC_ERR_ARGUMENT_COUNT: return "wrong number of arguments";
+        case CALC_ERR_INVALID_DEFINITION: return "invalid definition";
+        case CALC_ERR_CIRCULAR_DEFINITION: return "circular definition";
+        case CALC_ERR_NEGATIVE_ROOT: return "square root of a negative number";
+        case CALC_ERR_LOG_DOMAIN: return "logarithm of zero or a negative number";
+        case CALC_ERR_ARC_DOMAIN: return "argument outside [-1, 1]";
+        case CALC_ERR_POWER_DOMAIN: return "fractional power of a negative number";
+        case CALC_ERR_MISSING_OPERATOR: return "missing operator";
+        case CALC_ERR_DIMENSION: return "matrix dimensions don't match";
+        case CALC_ERR_SINGULAR_MATRIX: return "matrix is singular";
+        case CALC_ERR_NOT_INTEGER: return "not an integer";
+        case CALC_ERR_FACTORIAL_DOMAIN: return "factorial of a negative integer";
+        case CALC_ERR_CANCELLED: return "cancelled";
+        case CALC_ERR_NO_UNKNOWN: return "nothing to solve for";
+        case CALC_ERR_NO_SOLUTION: return "no solution found";
+        default: return "syntax error";
+    }
 }
 
-void init_char_stack(CharStack *stack, int capacity) {
-    stack->data = malloc(sizeof(char) * capacity);
-    stack->top = -1;
-    stack->capacity = capacity;
-}
+// Maximum number of values the evaluator keeps on its stack
+#define MAX_EVAL_DEPTH 100
 
-int push_double(DoubleStack *stack, double value) {
-    if (stack->top >= stack->capacity - 1) {
-        return 0; // Stack full
-    }
-    stack->data[++stack->top] = value;
-    return 1; // Success
+// Maximum nesting of user function calls
+#define MAX_CALL_DEPTH 64
+
+// Cancel flag of the evaluation job the calling thread works for, or NULL on
+// threads that aren't running one (the main loop, plots, the worksheet). Each
+// job has its own flag, so a cancel ends with its job. Only function calls can
+// make one expression run long (each level of f(x) = g(x) + g(x) doubles the
+// work), so the evaluators check it there.
+__thread gint *evaluation_cancel_flag = NULL;
+
+static inline int evaluation_cancelled(void) {
+    return evaluation_cancel_flag != NULL && g_atomic_int_get(evaluation_cancel_flag);
 }
 
-int push_char(CharStack *stack, char value) {
-    if (stack->top >= stack->capacity - 1) {
-        return 0; // Stack full
+// Whether a function call at call_depth may go ahead
+static inline CalcError call_permitted(int call_depth) {
+    if (call_depth >= MAX_CALL_DEPTH) {
+        return CALC_ERR_STACK_OVERFLOW;
     }
-    stack->data[++stack->top] = value;
-    return 1; // Success
+    return evaluation_cancelled() ? CALC_ERR_CANCELLED : CALC_OK;
 }
 
-double pop_double(DoubleStack *stack) {
-    return stack->top >= 0 ? stack->data[stack->top--] : 0;
-}
+// Symbol table of variables and user functions.
+// Names are resolved to slots when an expression is compiled, so evaluation
+// only indexes symbol_values[] and never compares strings.
+#define MAX_SYMBOLS 256
+#define MAX_SYMBOL_NAME 32
+#define MAX_FUNCTION_PARAMS 8
+#define ANS_SLOT 0 // Built-in variable holding the last result
 
-char pop_char(CharStack *stack) {
-    return stack->top >= 0 ? stack->data[stack->top--] : '\0';
-}
+typedef enum {
+    SYMBOL_VARIABLE,
+    SYMBOL_FUNCTION
+} SymbolKind;
 
-char peek_char(CharStack *stack) {
-    return stack->top >= 0 ? stack->data[stack->top] : '\0';
+typedef struct {
+    char name[MAX_SYMBOL_NAME];
+    SymbolKind kind;
+    int param_count;
+    char *source;     // Definition text (owned), NULL for built-ins
+    CalcProgram body; // Compiled definition
+} Symbol;
+
+Symbol symbols[MAX_SYMBOLS] = { { "ans", SYMBOL_VARIABLE, 0, NULL, { NULL, 0, 0, 1, NULL, 0, 0, NULL, 0 } } };
+double symbol_values[MAX_SYMBOLS]; // Cached variable values, indexed by slot
+int symbol_count = 1;
+
+// A defined variable's value as the integer, rational and interval evaluators
+// see it, cached with symbol_values so that they read it instead of re-running
+// the definition (a chain v2 = v1 + v1, v3 = v2 + v2, ... would double the work
+// at every link). Built-ins such as ans only have their double value.
+typedef struct {
+    int has_int64;            // The definition ran on the exact integer path
+    long long int64;
+    int rational_ready;       // rational has been initialized
+    CalcError rational_error; // CALC_OK when rational holds the exact value
+    mpq_t rational;
+    double lo, hi;            // Interval bounds
+} SymbolExact;
+
+SymbolExact symbol_exact[MAX_SYMBOLS];
+
+// A definition being made: compiled on the main thread, run with the variables
+// that depend on it by an evaluation job, and committed to the table by the main
+// thread when the job finishes (see symbol_commit). Until then the new symbol
+// and the values it changes live here, and only the job's thread reads them in
+// place of the table's. The main thread writes the table only between jobs, and
+// one job runs at a time, so the job reads a table that holds still and the
+// main loop never sees half a definition.
+typedef struct {
+    int slot;                          // symbol_count for a new symbol
+    int body_offset;                   // Offset of the body in the definition line
+    Symbol symbol;                     // The new definition (source and body owned until committed)
+    unsigned char staged[MAX_SYMBOLS]; // Variables whose values below replace the table's
+    double values[MAX_SYMBOLS];
+    SymbolExact exact[MAX_SYMBOLS];
+} SymbolUpdate;
+
+__thread SymbolUpdate *symbol_update = NULL; // The definition the calling thread is making, if any
+
+// The evaluators read the table through these, so a job sees its own definition
+static inline const Symbol *symbol_at(int slot) {
+    const SymbolUpdate *update = symbol_update;
+    return update != NULL && slot == update->slot ? &update->symbol : &symbols[slot];
 }
 
-int get_precedence(char op) {
-    switch (op) {
-        case '+':
-        case '-': return 1;
-        case '*':
-        case '/': return 2;
-        default: return 0;
-    }
+static inline double symbol_value(int slot) {
+    const SymbolUpdate *update = symbol_update;
+    return update != NULL && update->staged[slot] ? update->values[slot] : symbol_values[slot];
 }
 
-double evaluate_expression(const char *expr) {
-    DoubleStack values;
-    CharStack ops;
-    init_double_stack(&values, 100);
-    init_char_stack(&ops, 100);
+static inline const SymbolExact *symbol_exact_at(int slot) {
+    const SymbolUpdate *update = symbol_update;
+    return update != NULL && update->staged[slot] ? &update->exact[slot] : &symbol_exact[slot];
+}
 
-    int i = 0;
-    while (expr[i] != '\0') {
-        if (expr[i] == ' ') {
-            i++;
-            continue;
+int find_symbol(const char *name, int length) {
+    for (int slot = 0; slot < symbol_count; slot++) {
+        if ((int)strlen(symbols[slot].name) == length && strncmp(symbols[slot].name, name, length) == 0) {
+            return slot;
         }
+    }
+    const SymbolUpdate *update = symbol_update;
+    if (update != NULL && update->slot == symbol_count && (int)strlen(update->symbol.name) == length &&
+        strncmp(update->symbol.name, name, length) == 0) {
+        return update->slot;
+    }
+    return -1;
+}
 
-        if ((expr[i] >= '0' && expr[i] <= '9') || expr[i] == '.') {
-            // Parse number
-            double num = 0;
-            int decimal_place = 0;
-            double decimal_multiplier = 1;
-
-            while ((expr[i] >= '0' && expr[i] <= '9') || expr[i] == '.') {
-                if (expr[i] == '.') {
-                    decimal_place = 1;
-                } else {
-                    if (decimal_place) {
-                        decimal_multiplier *= 0.1;
-                        num += (expr[i] - '0') * decimal_multiplier;
-                    } else {
-                        num = num * 10 + (expr[i] - '0');
-                    }
-                }
-                i++;
-            }
-            if (!push_double(&values, num)) {
-                free(values.data);
-                free(ops.data);
-                return NAN; // Stack overflow
-            }
-            continue;
-        }
+int is_name_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
 
-        if (expr[i] == '(') {
-            if (!push_char(&ops, expr[i])) {
-                free(values.data);
-                free(ops.data);
-                return NAN; // Stack overflow
-            }
-        } else if (expr[i] == ')') {
-            while (ops.top >= 0 && peek_char(&ops) != '(') {
-                char op = pop_char(&ops);
-                if (values.top < 1) {
-                    // Not enough operands
-                    free(values.data);
-                    free(ops.data);
-                    return NAN;
-                }
-                double b = pop_double(&values);
-                double a = pop_double(&values);
-                double result_val;
-                switch (op) {
-                    case '+': result_val = a + b; break;
-                    case '-': result_val = a - b; break;
-                    case '*': result_val = a * b; break;
-                    case '/': result_val = b != 0 ? a / b : 0; break;
-                    default: result_val = 0; break;
-                }
-                if (!push_double(&values, result_val)) {
-                    free(values.data);
-                    free(ops.data);
-                    return NAN; // Stack overflow
-                }
-            }
-            if (ops.top < 0 || peek_char(&ops) != '(') {
-                // Mismatched parenthesis
-                free(values.data);
-                free(ops.data);
-                return NAN;
-            }
-            pop_char(&ops); // Remove '('
-        } else if (expr[i] == '+' || expr[i] == '-' || expr[i] == '*' || expr[i] == '/') {
-            // Check if this is a unary operator
-            int is_unary = 0;
-            if ((expr[i] == '+' || expr[i] == '-') && i > 0) {
-                // Look backwards to find the previous non-space character
-                int j = i - 1;
-                while (j >= 0 && expr[j] == ' ') {
-                    j--;
-                }
-                if (j < 0 || expr[j] == '(' || expr[j] == '+' || expr[j] == '-' ||
-                    expr[j] == '*' || expr[j] == '/') {
-                    is_unary = 1;
-                    if (expr[i] == '-') {
-                        // Unary minus: push 0 and treat as subtraction
-                        if (!push_double(&values, 0)) {
-                            free(values.data);
-                            free(ops.data);
-                            return NAN; // Stack overflow
-                        }
-                    }
-                    // For unary +, skip it entirely (no-op)
-                    if (expr[i] == '+') {
-                        i++; // Skip this character
-                        continue;
-                    }
-                }
-            } else if ((expr[i] == '+' || expr[i] == '-') && i == 0) {
-                // At start of expression
-                is_unary = 1;
-                if (expr[i] == '-') {
-                    if (!push_double(&values, 0)) {
-                        free(values.data);
-                        free(ops.data);
-                        return NAN; // Stack overflow
-                    }
-                }
-                // For unary +, skip it entirely (no-op)
-                if (expr[i] == '+') {
-                    i++; // Skip this character
-                    continue;
-                }
-            }
+int is_name_char(char c) {
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
 
-            if (!is_unary) {
-                while (ops.top >= 0 && get_precedence(peek_char(&ops)) >= get_precedence(expr[i])) {
-                    if (values.top < 1) {
-                        // Not enough operands
-                        free(values.data);
-                        free(ops.data);
-                        return NAN;
-                    }
-                    char op = pop_char(&ops);
-                    double b = pop_double(&values);
-                    double a = pop_double(&values);
-                    double result_val;
-                    switch (op) {
-                        case '+': result_val = a + b; break;
-                        case '-': result_val = a - b; break;
-                        case '*': result_val = a * b; break;
-                        case '/': result_val = b != 0 ? a / b : 0; break;
-                        default: result_val = 0; break;
-                    }
-                    if (!push_double(&values, result_val)) {
-                        free(values.data);
-                        free(ops.data);
-                        return NAN; // Stack overflow
-                    }
-                }
-            }
-            if (!push_char(&ops, expr[i])) {
-                free(values.data);
-                free(ops.data);
-                return NAN; // Stack overflow
-            }
-        }
-        i++;
+// Factorial and gamma. n! for every n whose factorial is a finite double is
+// a table lookup: each entry is n! correctly rounded, and exact up to 22!, so
+// the integer path reads 0! to 20! from it too. Other arguments use the
+// Lanczos approximation of gamma(x + 1).
+#define FACTORIAL_TABLE_SIZE 171 // 170! is the largest finite double
+#define FACTORIAL_INT64_MAX 20   // 20! is the largest that fits in 64 bits
+
+const double factorial_table[FACTORIAL_TABLE_SIZE] = {
+    1.0, 1.0, 2.0, 6.0,
+    24.0, 120.0, 720.0, 5040.0,
+    40320.0, 362880.0, 3628800.0, 39916800.0,
+    479001600.0, 6227020800.0, 87178291200.0, 1307674368000.0,
+    20922789888000.0, 355687428096000.0, 6402373705728000.0, 1.21645100408832e+17,
+    2.43290200817664e+18, 5.109094217170944e+19, 1.1240007277776077e+21, 2.585201673888498e+22,
+    6.204484017332394e+23, 1.5511210043330986e+25, 4.0329146112660565e+26, 1.0888869450418352e+28,
+    3.0488834461171387e+29, 8.841761993739702e+30, 2.6525285981219107e+32, 8.222838654177922e+33,
+    2.631308369336935e+35, 8.683317618811886e+36, 2.9523279903960416e+38, 1.0333147966386145e+40,
+    3.7199332678990125e+41, 1.3763753091226346e+43, 5.230226174666011e+44, 2.0397882081197444e+46,
+    8.159152832478977e+47, 3.345252661316381e+49, 1.40500611775288e+51, 6.041526306337383e+52,
+    2.658271574788449e+54, 1.1962222086548019e+56, 5.502622159812089e+57, 2.5862324151116818e+59,
+    1.2413915592536073e+61, 6.082818640342675e+62, 3.0414093201713376e+64, 1.5511187532873822e+66,
+    8.065817517094388e+67, 4.2748832840600255e+69, 2.308436973392414e+71, 1.2696403353658276e+73,
+    7.109985878048635e+74, 4.0526919504877214e+76, 2.3505613312828785e+78, 1.3868311854568984e+80,
+    8.32098711274139e+81, 5.075802138772248e+83, 3.146997326038794e+85, 1.98260831540444e+87,
+    1.2688693218588417e+89, 8.247650592082472e+90, 5.443449390774431e+92, 3.647111091818868e+94,
+    2.4800355424368305e+96, 1.711224524281413e+98, 1.1978571669969892e+100, 8.504785885678623e+101,
+    6.1234458376886085e+103, 4.4701154615126844e+105, 3.307885441519386e+107, 2.48091408113954e+109,
+    1.8854947016660504e+111, 1.4518309202828587e+113, 1.1324281178206297e+115, 8.946182130782976e+116,
+    7.156945704626381e+118, 5.797126020747368e+120, 4.753643337012842e+122, 3.945523969720659e+124,
+    3.314240134565353e+126, 2.81710411438055e+128, 2.4227095383672734e+130, 2.107757298379528e+132,
+    1.8548264225739844e+134, 1.650795516090846e+136, 1.4857159644817615e+138, 1.352001527678403e+140,
+    1.2438414054641308e+142, 1.1567725070816416e+144, 1.087366156656743e+146, 1.032997848823906e+148,
+    9.916779348709496e+149, 9.619275968248212e+151, 9.426890448883248e+153, 9.332621544394415e+155,
+    9.332621544394415e+157, 9.42594775983836e+159, 9.614466715035127e+161, 9.90290071648618e+163,
+    1.0299016745145628e+166, 1.081396758240291e+168, 1.1462805637347084e+170, 1.226520203196138e+172,
+    1.324641819451829e+174, 1.4438595832024937e+176, 1.588245541522743e+178, 1.7629525510902446e+180,
+    1.974506857221074e+182, 2.2311927486598138e+184, 2.5435597334721877e+186, 2.925093693493016e+188,
+    3.393108684451898e+190, 3.969937160808721e+192, 4.684525849754291e+194, 5.574585761207606e+196,
+    6.689502913449127e+198, 8.094298525273444e+200, 9.875044200833601e+202, 1.214630436702533e+205,
+    1.506141741511141e+207, 1.882677176888926e+209, 2.372173242880047e+211, 3.0126600184576594e+213,
+    3.856204823625804e+215, 4.974504222477287e+217, 6.466855489220474e+219, 8.47158069087882e+221,
+    1.1182486511960043e+224, 1.4872707060906857e+226, 1.9929427461615188e+228, 2.6904727073180504e+230,
+    3.659042881952549e+232, 5.012888748274992e+234, 6.917786472619489e+236, 9.615723196941089e+238,
+    1.3462012475717526e+241, 1.898143759076171e+243, 2.695364137888163e+245, 3.854370717180073e+247,
+    5.5502938327393044e+249, 8.047926057471992e+251, 1.1749972043909107e+254, 1.727245890454639e+256,
+    2.5563239178728654e+258, 3.80892263763057e+260, 5.713383956445855e+262, 8.62720977423324e+264,
+    1.3113358856834524e+267, 2.0063439050956823e+269, 3.0897696138473508e+271, 4.789142901463394e+273,
+    7.471062926282894e+275, 1.1729568794264145e+278, 1.853271869493735e+280, 2.9467022724950384e+282,
+    4.7147236359920616e+284, 7.590705053947219e+286, 1.2296942187394494e+289, 2.0044015765453026e+291,
+    3.287218585534296e+293, 5.423910666131589e+295, 9.003691705778438e+297, 1.503616514864999e+300,
+    2.5260757449731984e+302, 4.269068009004705e+304, 7.257415615307999e+306,
+};
+
+// Lanczos coefficients for g = 7 with 9 terms, good to about 15 digits
+#define LANCZOS_G 7.0
+#define LANCZOS_TERMS 9
+
+const double lanczos_coefficients[LANCZOS_TERMS] = {
+    0.99999999999980993, 676.5203681218851, -1259.1392167224028, 771.32342877765313, -176.61502916214059,
+    12.507343278686905, -0.13857109526572012, 9.9843695780195716e-6, 1.5056327351493116e-7,
+};
+
+// gamma(x) for x >= 1/2
+double lanczos_gamma(double x) {
+    x -= 1;
+    double sum = lanczos_coefficients[0];
+    for (int k = 1; k < LANCZOS_TERMS; k++) {
+        sum += lanczos_coefficients[k] / (x + k);
     }
+    double t = x + LANCZOS_G + 0.5;
+    // t^(x + 1/2) e^-t in two halves, so it only overflows when gamma does
+    double half_power = pow(t, (x + 0.5) / 2);
+    return sqrt(2 * M_PI) * half_power * (half_power * exp(-t)) * sum;
+}
 
-    // Process remaining operations
-    while (ops.top >= 0) {
-        if (values.top < 1) {
-            // Not enough operands
-            free(values.data);
-            free(ops.data);
-            return NAN;
-        }
-        char op = pop_char(&ops);
-        double b = pop_double(&values);
-        double a = pop_double(&values);
-        double result_val;
-        switch (op) {
-            case '+': result_val = a + b; break;
-            case '-': result_val = a - b; break;
-            case '*': result_val = a * b; break;
-            case '/': result_val = b != 0 ? a / b : 0; break;
-            default: result_val = 0; break;
-        }
-        if (!push_double(&values, result_val)) {
-            free(values.data);
-            free(ops.data);
-            return NAN; // Stack overflow
-        }
+// gamma(x) for real x: the table at positive integers, reflection below 1/2.
+// The poles at zero and the negative integers are left to the domain checks.
+double gamma_real(double x) {
+    if (x == floor(x) && x >= 1 && x <= FACTORIAL_TABLE_SIZE) {
+        return factorial_table[(int)x - 1];
+    }
+    if (x < 0.5) {
+        double reduced = x - 2 * floor(x / 2); // sin(pi x) from an argument in [0, 2)
+        return M_PI / (sin(M_PI * reduced) * lanczos_gamma(1 - x));
     }
+    return lanczos_gamma(x);
+}
 
-    // Check for leftover opening parentheses (mismatched)
-    for (int j = 0; j <= ops.top; j++) {
-        if (ops.data[j] == '(') {
-            free(values.data);
-            free(ops.data);
-            return NAN;
-        }
+// digamma(x) = gamma'(x) / gamma(x): the recurrence psi(x) = psi(x + 1) - 1/x
+// up to x >= 6, then the asymptotic series; reflection below zero
+double digamma(double x) {
+    if (x <= 0) {
+        double reduced = x - 2 * floor(x / 2);
+        return digamma(1 - x) - M_PI * cos(M_PI * reduced) / sin(M_PI * reduced);
     }
+    double shift = 0;
+    for (; x < 6; x++) {
+        shift -= 1 / x;
+    }
+    double r = 1 / (x * x);
+    return shift + log(x) - 0.5 / x - r * (1.0 / 12 - r * (1.0 / 120 - r * (1.0 / 252 - r / 240)));
+}
 
-    double result = values.top >= 0 ? values.data[values.top] : 0;
+// Complex values for the complex arithmetic mode. Batches keep the real and
+// imaginary parts in separate arrays instead (see run_program_complex_block).
+typedef struct {
+    double re;
+    double im;
+} Complex;
 
-    // Free allocated memory
-    free(values.data);
-    free(ops.data);
+static inline Complex complex_make(double re, double im) {
+    Complex z = { re, im };
+    return z;
+}
 
-    return result;
+static inline Complex complex_multiply(Complex a, Complex b) {
+    return complex_make(a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re);
 }
 
-// Function to handle equals button click
-void on_equals_clicked(GtkWidget *widget, gpointer data) {
-    // If we have a result displayed and no new input, start fresh new calculation
-    if (has_result && strlen(current_input) == 0 && strlen(expression) == 0) {
-        has_result = FALSE;
-        strcpy(history_buffer, "");  // Clear history for fresh start
-        update_display();
-        return;
+// The textbook formula when |b|^2 is a normal number, which is what the batch
+// kernel vectorises; otherwise Smith's method, which can't overflow early
+Complex complex_divide(Complex a, Complex b) {
+    double d = b.re * b.re + b.im * b.im;
+    if (d >= DBL_MIN && d <= DBL_MAX) {
+        return complex_make((a.re * b.re + a.im * b.im) / d, (a.im * b.re - a.re * b.im) / d);
+    }
+    if (fabs(b.re) >= fabs(b.im)) {
+        double r = b.im / b.re;
+        double t = b.re + b.im * r;
+        return complex_make((a.re + a.im * r) / t, (a.im - a.re * r) / t);
     }
+    double r = b.re / b.im;
+    double t = b.re * r + b.im;
+    return complex_make((a.re * r + a.im) / t, (a.im * r - a.re) / t);
+}
 
-    // Check if we have something to evaluate
-    if (strlen(current_input) > 0 || strlen(expression) > 0) {
-        // Complete the expression with any remaining input
-        if (strlen(current_input) > 0) {
-            if (strlen(expression) > 0) {
-                if (!safe_strcat(expression, " ", sizeof(expression))) return;
-            }
-            if (!safe_strcat(expression, current_input, sizeof(expression))) return;
-        }
+static inline double complex_abs(Complex z) {
+    return hypot(z.re, z.im);
+}
 
-        // Only evaluate if we have a complete expression
-        if (strlen(expression) > 0) {
-            // Evaluate the expression
-            double calc_result = evaluate_expression(expression);
-
-            // Check for evaluation errors (NaN or other issues)
-            if (isnan(calc_result) || isinf(calc_result)) {
-                // Show syntax error for invalid expressions
-                char error_str[512];
-                sprintf(error_str, "%s = syntax error", expression);
-                has_result = FALSE;
-                strcpy(expression, "");
-                strcpy(current_input, "");
-                append_to_history(error_str);
-                return;
-            }
+Complex complex_exp(Complex z) {
+    double m = exp(z.re);
+    return z.im == 0 ? complex_make(m, 0) : complex_make(m * cos(z.im), m * sin(z.im));
+}
 
-            // Show the full expression with result
-            char result_str[512];
-            if (calc_result == (int)calc_result) {
-                sprintf(result_str, "%s = %d", expression, (int)calc_result);
-            } else {
-                // Calculate appropriate precision for display
-                int display_precision = result_precision;
-                double abs_result = fabs(calc_result);
-
-                // For numbers less than 1, use significant digit precision
-                if (abs_result < 1.0 && abs_result > 0.0) {
-                    // Find how many decimal places needed for significant digits
-                    double log_val = log10(abs_result);
-                    int first_sig_digit_pos = -floor(log_val); // Position after decimal
-                    display_precision = first_sig_digit_pos + (result_precision - 1);
-
-                    // Cap at reasonable maximum to prevent excessive output
-                    if (display_precision > 12) {
-                        display_precision = 12;
-                    }
-                }
+// Phase in (-pi, pi]. Negating a real number leaves a -0 imaginary part, and
+// adding +0 turns it back into +0 so that arg(-1) is pi rather than -pi.
+static inline double complex_arg(Complex z) {
+    return atan2(z.im + 0.0, z.re);
+}
 
-                sprintf(result_str, "%s = %.*f", expression, display_precision, calc_result);
-            }
+Complex complex_ln(Complex z) {
+    return complex_make(log(complex_abs(z)), complex_arg(z));
+}
 
-            // Store result for next calculation
-            result = calc_result;
-            has_result = TRUE;
+// Principal square root, without cancellation in either part
+Complex complex_sqrt(Complex z) {
+    if (z.re == 0 && z.im == 0) {
+        return complex_make(0, z.im);
+    }
+    double t = sqrt((complex_abs(z) + fabs(z.re)) / 2);
+    if (z.re >= 0) {
+        return complex_make(t, z.im / (2 * t));
+    }
+    return complex_make(fabs(z.im) / (2 * t), z.im < 0 ? -t : t);
+}
 
-            // Clear expression and current input for next calculation (before adding to history)
-            strcpy(expression, "");
-            strcpy(current_input, "");
+Complex complex_sin(Complex z) {
+    return complex_make(sin(z.re) * cosh(z.im), cos(z.re) * sinh(z.im));
+}
 
-            // Add to history
-            append_to_history(result_str);
-        }
-    }
+Complex complex_cos(Complex z) {
+    return complex_make(cos(z.re) * cosh(z.im), -sin(z.re) * sinh(z.im));
 }
 
-// Function to handle clear button click
-void on_clear_clicked(GtkWidget *widget, gpointer data) {
-    (void)widget; (void)data;
-    clear_calculator();
+// asin(z) = -i ln(iz + sqrt(1 - z^2))
+Complex complex_asin(Complex z) {
+    Complex one_minus_sq = complex_make(1 - (z.re * z.re - z.im * z.im), -2 * z.re * z.im);
+    Complex root = complex_sqrt(one_minus_sq);
+    Complex w = complex_ln(complex_make(root.re - z.im, root.im + z.re));
+    return complex_make(w.im, -w.re);
 }
 
-// Function to handle decimal point
-void on_decimal_clicked(GtkWidget *widget, gpointer data) {
-    if (has_result) {
-        strcpy(expression, "");
-        has_result = FALSE;
-    }
+// Integer powers by repeated squaring, so (1 + 2i)^2 is exactly -3 + 4i
+#define MAX_COMPLEX_INTEGER_POWER 1024
 
-    if (strchr(current_input, '.') == NULL) {
-        if (strlen(current_input) == 0) {
-            strcat(current_input, "0");
+CalcError complex_power(Complex *args) {
+    Complex a = args[0];
+    Complex b = args[1];
+    if (a.re == 0 && a.im == 0) {
+        if (b.re == 0 && b.im == 0) {
+            args[0] = complex_make(1, 0);
+            return CALC_OK;
         }
-        strcat(current_input, ".");
-        update_display();
+        if (b.im != 0 || b.re < 0) {
+            return CALC_ERR_DIVISION_BY_ZERO;
+        }
+        args[0] = complex_make(0, 0);
+        return CALC_OK;
+    }
+    if (b.im == 0 && b.re == floor(b.re) && fabs(b.re) <= MAX_COMPLEX_INTEGER_POWER) {
+        int n = (int)fabs(b.re);
+        Complex result = complex_make(1, 0);
+        while (n > 0) {
+            if (n & 1) result = complex_multiply(result, a);
+            n >>= 1;
+            if (n > 0) a = complex_multiply(a, a);
+        }
+        args[0] = b.re < 0 ? complex_divide(complex_make(1, 0), result) : result;
+        return CALC_OK;
     }
+    Complex l = complex_ln(a);
+    args[0] = complex_exp(complex_multiply(b, l));
+    return CALC_OK;
 }
 
-// Function to handle backspace (delete one character)
-void on_backspace_clicked(GtkWidget *widget, gpointer data) {
-    size_t len = strlen(current_input);
-    if (len > 0) {
+// Complex kernels of the built-ins: the result goes in args[0]
+CalcError complex_builtin_sin(Complex *args) { args[0] = complex_sin(args[0]); return CALC_OK; }
+CalcError complex_builtin_cos(Complex *args) { args[0] = complex_cos(args[0]); return CALC_OK; }
+CalcError complex_builtin_exp(Complex *args) { args[0] = complex_exp(args[0]); return CALC_OK; }
+CalcError complex_builtin_sqrt(Complex *args) { args[0] = complex_sqrt(args[0]); return CALC_OK; }
+CalcError complex_builtin_sq(Complex *args) { args[0] = complex_multiply(args[0], args[0]); return CALC_OK; }
+CalcError complex_builtin_asin(Complex *args) { args[0] = complex_asin(args[0]); return CALC_OK; }
+CalcError complex_builtin_abs(Complex *args) { args[0] = complex_make(complex_abs(args[0]), 0); return CALC_OK; }
+CalcError complex_builtin_arg(Complex *args) { args[0] = complex_make(complex_arg(args[0]), 0); return CALC_OK; }
+CalcError complex_builtin_conj(Complex *args) { args[0].im = -args[0].im; return CALC_OK; }
+CalcError complex_builtin_re(Complex *args) { args[0].im = 0; return CALC_OK; }
+CalcError complex_builtin_im(Complex *args) { args[0] = complex_make(args[0].im, 0); return CALC_OK; }
+
+CalcError complex_builtin_tan(Complex *args) {
+    Complex c = complex_cos(args[0]);
+    if (c.re == 0 && c.im == 0) {
+        return CALC_ERR_DIVISION_BY_ZERO;
+    }
+    args[0] = complex_divide(complex_sin(args[0]), c);
+    return CALC_OK;
+}
+
+CalcError complex_builtin_acos(Complex *args) {
+    Complex w = complex_asin(args[0]);
+    args[0] = complex_make(M_PI / 2 - w.re, -w.im);
+    return CALC_OK;
+}
+
+// atan(z) = (i/2) (ln(1 - iz) - ln(1 + iz)), undefined at +-i
+CalcError complex_builtin_atan(Complex *args) {
+    Complex z = args[0];
+    if (z.re == 0 && fabs(z.im) == 1) {
+        return CALC_ERR_LOG_DOMAIN;
+    }
+    Complex a = complex_ln(complex_make(1 + z.im, -z.re));
+    Complex b = complex_ln(complex_make(1 - z.im, z.re));
+    args[0] = complex_make((b.im - a.im) / 2, (a.re - b.re) / 2);
+    return CALC_OK;
+}
+
+CalcError complex_builtin_ln(Complex *args) {
+    if (args[0].re == 0 && args[0].im == 0) {
+        return CALC_ERR_LOG_DOMAIN;
+    }
+    args[0] = complex_ln(args[0]);
+    return CALC_OK;
+}
+
+CalcError complex_builtin_log(Complex *args) {
+    CalcError error = complex_builtin_ln(args);
+    args[0] = complex_make(args[0].re / M_LN10, args[0].im / M_LN10);
+    return error;
+}
+
+CalcError complex_builtin_recip(Complex *args) {
+    if (args[0].re == 0 && args[0].im == 0) {
+        return CALC_ERR_DIVISION_BY_ZERO;
+    }
+    args[0] = complex_divide(complex_make(1, 0), args[0]);
+    return CALC_OK;
+}
+
+// A number is its own transpose and determinant
+CalcError complex_builtin_number(Complex *args) {
+    (void)args;
+    return CALC_OK;
+}
+
+// solve(a, b) of two numbers is b / a
+CalcError complex_builtin_solve(Complex *args) {
+    if (args[0].re == 0 && args[0].im == 0) {
+        return CALC_ERR_DIVISION_BY_ZERO;
+    }
+    args[0] = complex_divide(args[1], args[0]);
+    return CALC_OK;
+}
+
+// The same Lanczos sum as lanczos_gamma, for Re z >= 1/2
+Complex complex_lanczos_gamma(Complex z) {
+    z.re -= 1;
+    Complex sum = complex_make(lanczos_coefficients[0], 0);
+    for (int k = 1; k < LANCZOS_TERMS; k++) {
+        Complex term = complex_divide(complex_make(lanczos_coefficients[k], 0), complex_make(z.re + k, z.im));
+        sum = complex_make(sum.re + term.re, sum.im + term.im);
+    }
+    Complex t = complex_make(z.re + LANCZOS_G + 0.5, z.im);
+    Complex l = complex_ln(t);
+    Complex power = complex_multiply(complex_make(z.re + 0.5, z.im), l);
+    Complex scale = complex_exp(complex_make(power.re - t.re, power.im - t.im));
+    return complex_multiply(complex_make(sqrt(2 * M_PI) * scale.re, sqrt(2 * M_PI) * scale.im), sum);
+}
+
+// Real arguments take the real path, so integers still come from the table
+CalcError complex_builtin_gamma(Complex *args) {
+    Complex z = args[0];
+    if (z.im == 0) {
+        if (z.re <= 0 && z.re == floor(z.re)) {
+            return CALC_ERR_FACTORIAL_DOMAIN;
+        }
+        args[0] = complex_make(gamma_real(z.re), 0);
+        return CALC_OK;
+    }
+    if (z.re >= 0.5) {
+        args[0] = complex_lanczos_gamma(z);
+        return CALC_OK;
+    }
+    // Reflection: gamma(z) = pi / (sin(pi z) gamma(1 - z))
+    Complex s = complex_sin(complex_make(M_PI * z.re, M_PI * z.im));
+    Complex g = complex_lanczos_gamma(complex_make(1 - z.re, -z.im));
+    args[0] = complex_divide(complex_make(M_PI, 0), complex_multiply(s, g));
+    return CALC_OK;
+}
+
+CalcError complex_builtin_fact(Complex *args) {
+    args[0].re += 1;
+    return complex_builtin_gamma(args);
+}
+
+// Matrices. The matrix evaluator's stack holds numbers and matrices; a matrix
+// is a row-major block of doubles carved out of an arena, and the arena is
+// released in one go once the expression has been evaluated and formatted.
+#define MATRIX_CHUNK_DOUBLES (1 << 17) // Arena chunk size (1 MiB) unless one matrix needs more
+#define MATRIX_ALIGN 64                // Bytes: every matrix starts on a cache line
+#define MATRIX_BLOCK_K 128             // Rows of B per multiply pass
+#define MATRIX_BLOCK_N 256             // Columns of B per pass: the K x N panel (256 KiB) stays in cache
+#define MATRIX_TILE 32                 // Transpose tile edge
+#define MATRIX_PANEL 64                // Columns factored at a time by LU decomposition
+#define MATRIX_PARALLEL_MIN 8000000    // Multiply-adds worth splitting across threads
+#define MATRIX_MAX_THREADS 8
+#define MATRIX_MAX_INTEGER_POWER 1024
+
+typedef struct {
+    int rows;
+    int cols;
+    double *data;  // rows * cols elements, or NULL for a number
+    double number; // Value of a number
+    int filled;    // Elements written so far while a literal is built
+} MatrixValue;
+
+typedef struct MatrixChunk MatrixChunk;
+
+struct MatrixChunk {
+    MatrixChunk *next;
+    double *data;
+    size_t used; // Doubles handed out
+    size_t capacity;
+};
+
+typedef struct {
+    MatrixChunk *chunks; // Newest first
+} MatrixArena;
+
+static inline MatrixValue matrix_number(double value) {
+    MatrixValue v = { 0, 0, NULL, value, 0 };
+    return v;
+}
+
+// Bump-allocate count doubles (uninitialised), or NULL when out of memory
+double *matrix_arena_alloc(MatrixArena *arena, size_t count) {
+    size_t rounded = (count + 7) & ~(size_t)7; // Whole cache lines keep the next block aligned
+    MatrixChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->capacity - chunk->used < rounded) {
+        size_t capacity = MAX(rounded, (size_t)MATRIX_CHUNK_DOUBLES);
+        chunk = malloc(sizeof(MatrixChunk));
+        double *data = chunk != NULL ? aligned_alloc(MATRIX_ALIGN, capacity * sizeof(double)) : NULL;
+        if (data == NULL) {
+            free(chunk);
+            return NULL;
+        }
+        chunk->data = data;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    double *p = chunk->data + chunk->used;
+    chunk->used += rounded;
+    return p;
+}
+
+void matrix_arena_release(MatrixArena *arena) {
+    while (arena->chunks != NULL) {
+        MatrixChunk *next = arena->chunks->next;
+        free(arena->chunks->data);
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+// A new rows x cols matrix in the arena; its elements are left for the caller
+CalcError matrix_new(MatrixArena *arena, int rows, int cols, MatrixValue *out) {
+    double *data = matrix_arena_alloc(arena, (size_t)rows * cols);
+    if (data == NULL) {
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    out->rows = rows;
+    out->cols = cols;
+    out->data = data;
+    out->number = 0;
+    out->filled = rows * cols;
+    return CALC_OK;
+}
+
+CalcError matrix_identity(MatrixArena *arena, int n, MatrixValue *out) {
+    CalcError error = matrix_new(arena, n, n, out);
+    if (error == CALC_OK) {
+        memset(out->data, 0, sizeof(double) * n * n);
+        for (int i = 0; i < n; i++) {
+            out->data[(size_t)i * n + i] = 1;
+        }
+    }
+    return error;
+}
+
+// y[0..n) += a * x[0..n)
+static inline void matrix_axpy(double *y, const double *x, double a, int n) {
+    int j = 0;
+#ifdef __SSE2__
+    const __m128d va = _mm_set1_pd(a);
+    for (; j + 4 <= n; j += 4) {
+        _mm_storeu_pd(y + j, _mm_add_pd(_mm_loadu_pd(y + j), _mm_mul_pd(va, _mm_loadu_pd(x + j))));
+        _mm_storeu_pd(y + j + 2, _mm_add_pd(_mm_loadu_pd(y + j + 2), _mm_mul_pd(va, _mm_loadu_pd(x + j + 2))));
+    }
+#endif
+    for (; j < n; j++) {
+        y[j] += a * x[j];
+    }
+}
+
+// C += alpha * A * B, where A is m x k, B is k x n and C is m x n, each with
+// its own row stride so that the operands can be blocks of larger matrices
+typedef struct {
+    int m, n, k;
+    double alpha;
+    const double *a;
+    int lda;
+    const double *b;
+    int ldb;
+    double *c;
+    int ldc;
+} MatrixProduct;
+
+#ifdef __SSE2__
+// One 4 x 4 tile of C, accumulated in eight registers over rows p0..p1 of B
+static inline void matrix_tile_4x4(const MatrixProduct *mp, int i, int j, int p0, int p1) {
+    __m128d c00 = _mm_setzero_pd(), c01 = _mm_setzero_pd();
+    __m128d c10 = _mm_setzero_pd(), c11 = _mm_setzero_pd();
+    __m128d c20 = _mm_setzero_pd(), c21 = _mm_setzero_pd();
+    __m128d c30 = _mm_setzero_pd(), c31 = _mm_setzero_pd();
+    const double *a = mp->a + (size_t)i * mp->lda;
+    int lda = mp->lda;
+    for (int p = p0; p < p1; p++) {
+        const double *b = mp->b + (size_t)p * mp->ldb + j;
+        __m128d b0 = _mm_loadu_pd(b);
+        __m128d b1 = _mm_loadu_pd(b + 2);
+        __m128d a0 = _mm_set1_pd(a[p]);
+        __m128d a1 = _mm_set1_pd(a[lda + p]);
+        __m128d a2 = _mm_set1_pd(a[2 * lda + p]);
+        __m128d a3 = _mm_set1_pd(a[3 * lda + p]);
+        c00 = _mm_add_pd(c00, _mm_mul_pd(a0, b0));
+        c01 = _mm_add_pd(c01, _mm_mul_pd(a0, b1));
+        c10 = _mm_add_pd(c10, _mm_mul_pd(a1, b0));
+        c11 = _mm_add_pd(c11, _mm_mul_pd(a1, b1));
+        c20 = _mm_add_pd(c20, _mm_mul_pd(a2, b0));
+        c21 = _mm_add_pd(c21, _mm_mul_pd(a2, b1));
+        c30 = _mm_add_pd(c30, _mm_mul_pd(a3, b0));
+        c31 = _mm_add_pd(c31, _mm_mul_pd(a3, b1));
+    }
+    const __m128d alpha = _mm_set1_pd(mp->alpha);
+    __m128d sums[8] = { c00, c01, c10, c11, c20, c21, c30, c31 };
+    for (int r = 0; r < 4; r++) {
+        double *c = mp->c + (size_t)(i + r) * mp->ldc + j;
+        _mm_storeu_pd(c, _mm_add_pd(_mm_loadu_pd(c), _mm_mul_pd(alpha, sums[2 * r])));
+        _mm_storeu_pd(c + 2, _mm_add_pd(_mm_loadu_pd(c + 2), _mm_mul_pd(alpha, sums[2 * r + 1])));
+    }
+}
+#endif
+
+// Rows row_start..row_end of the product. A K x N panel of B is reused by
+// every band of four rows of A before moving on, so B is read from memory
+// once per pass instead of once per row.
+void matrix_multiply_rows(const MatrixProduct *mp, int row_start, int row_end) {
+    for (int p0 = 0; p0 < mp->k; p0 += MATRIX_BLOCK_K) {
+        int p1 = MIN(p0 + MATRIX_BLOCK_K, mp->k);
+        for (int j0 = 0; j0 < mp->n; j0 += MATRIX_BLOCK_N) {
+            int j1 = MIN(j0 + MATRIX_BLOCK_N, mp->n);
+            int i = row_start;
+            for (; i + 4 <= row_end; i += 4) {
+                int j = j0;
+#ifdef __SSE2__
+                for (; j + 4 <= j1; j += 4) {
+                    matrix_tile_4x4(mp, i, j, p0, p1);
+                }
+#endif
+                for (; j < j1; j++) {
+                    for (int r = i; r < i + 4; r++) {
+                        double sum = 0;
+                        for (int p = p0; p < p1; p++) {
+                            sum += mp->a[(size_t)r * mp->lda + p] * mp->b[(size_t)p * mp->ldb + j];
+                        }
+                        mp->c[(size_t)r * mp->ldc + j] += mp->alpha * sum;
+                    }
+                }
+            }
+            for (; i < row_end; i++) {
+                for (int p = p0; p < p1; p++) {
+                    matrix_axpy(mp->c + (size_t)i * mp->ldc + j0, mp->b + (size_t)p * mp->ldb + j0,
+                                mp->alpha * mp->a[(size_t)i * mp->lda + p], j1 - j0);
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    const MatrixProduct *product;
+    int row_start;
+    int row_end;
+} MatrixBand;
+
+gpointer matrix_band_worker(gpointer data) {
+    MatrixBand *band = data;
+    matrix_multiply_rows(band->product, band->row_start, band->row_end);
+    return NULL;
+}
+
+// C += alpha * A * B, splitting large products into bands of rows across threads
+void matrix_multiply_add(const MatrixProduct *mp) {
+    if (mp->m <= 0 || mp->n <= 0 || mp->k <= 0) {
+        return;
+    }
+    int threads = 1;
+    if ((double)mp->m * mp->n * mp->k >= MATRIX_PARALLEL_MIN) {
+        threads = MAX(MIN((int)g_get_num_processors(), MATRIX_MAX_THREADS), 1);
+    }
+    int per_thread = (mp->m + threads - 1) / threads;
+    per_thread = (per_thread + 3) / 4 * 4; // Whole bands of four rows
+
+    MatrixBand bands[MATRIX_MAX_THREADS];
+    GThread *workers[MATRIX_MAX_THREADS];
+    int band_count = 0;
+    for (int start = 0; start < mp->m; start += per_thread) {
+        bands[band_count].product = mp;
+        bands[band_count].row_start = start;
+        bands[band_count].row_end = MIN(start + per_thread, mp->m);
+        band_count++;
+    }
+
+    // The calling thread multiplies the first band itself
+    for (int t = 1; t < band_count; t++) {
+        workers[t] = g_thread_new("matrix", matrix_band_worker, &bands[t]);
+    }
+    matrix_band_worker(&bands[0]);
+    for (int t = 1; t < band_count; t++) {
+        g_thread_join(workers[t]);
+    }
+}
+
+// out (cols x rows) = transpose of a (rows x cols), a tile at a time so both
+// sides are walked within a few cache lines
+void matrix_transpose(const double *a, int rows, int cols, double *out) {
+    for (int i0 = 0; i0 < rows; i0 += MATRIX_TILE) {
+        int i1 = MIN(i0 + MATRIX_TILE, rows);
+        for (int j0 = 0; j0 < cols; j0 += MATRIX_TILE) {
+            int j1 = MIN(j0 + MATRIX_TILE, cols);
+            for (int i = i0; i < i1; i++) {
+                for (int j = j0; j < j1; j++) {
+                    out[(size_t)j * rows + i] = a[(size_t)i * cols + j];
+                }
+            }
+        }
+    }
+}
+
+// Factor the n x n matrix a in place into a unit lower triangle L (below the
+// diagonal) and U, with partial pivoting: row i of the result is row perm[i]
+// of the original. Columns are factored a panel at a time, and the rest of
+// the matrix is then updated with one blocked multiply, which is where nearly
+// all of the work goes. Returns the sign of the permutation, or 0 when a
+// pivot is exactly zero (the matrix is singular).
+int matrix_lu(double *a, int n, int *perm) {
+    int sign = 1;
+    for (int i = 0; i < n; i++) {
+        perm[i] = i;
+    }
+    for (int k0 = 0; k0 < n; k0 += MATRIX_PANEL) {
+        int k1 = MIN(k0 + MATRIX_PANEL, n);
+        for (int k = k0; k < k1; k++) {
+            int pivot = k;
+            for (int i = k + 1; i < n; i++) {
+                if (fabs(a[(size_t)i * n + k]) > fabs(a[(size_t)pivot * n + k])) {
+                    pivot = i;
+                }
+            }
+            if (a[(size_t)pivot * n + k] == 0) {
+                return 0;
+            }
+            if (pivot != k) {
+                double *row_k = a + (size_t)k * n;
+                double *row_p = a + (size_t)pivot * n;
+                for (int j = 0; j < n; j++) {
+                    double t = row_k[j];
+                    row_k[j] = row_p[j];
+                    row_p[j] = t;
+                }
+                int t = perm[k];
+                perm[k] = perm[pivot];
+                perm[pivot] = t;
+                sign = -sign;
+            }
+            const double *row_k = a + (size_t)k * n;
+            for (int i = k + 1; i < n; i++) {
+                double *row_i = a + (size_t)i * n;
+                double l = row_i[k] /= row_k[k];
+                if (l != 0) {
+                    matrix_axpy(row_i + k + 1, row_k + k + 1, -l, k1 - k - 1);
+                }
+            }
+        }
+        if (k1 == n) {
+            break;
+        }
+        // U12 = L11^-1 A12: the panel's rows of the trailing columns
+        for (int k = k0; k < k1; k++) {
+            for (int i = k + 1; i < k1; i++) {
+                matrix_axpy(a + (size_t)i * n + k1, a + (size_t)k * n + k1, -a[(size_t)i * n + k], n - k1);
+            }
+        }
+        // A22 -= L21 U12
+        MatrixProduct mp = { n - k1, n - k1, k1 - k0, -1,
+                             a + (size_t)k1 * n + k0, n,
+                             a + (size_t)k0 * n + k1, n,
+                             a + (size_t)k1 * n + k1, n };
+        matrix_multiply_add(&mp);
+    }
+    return sign;
+}
+
+// Overwrite the n x m right-hand sides x with the solution of LU x = x, where
+// lu comes from matrix_lu and x is already permuted. Each sweep handles a
+// panel of rows: the rows solved so far are applied with one multiply, then
+// the panel itself by substitution.
+void matrix_lu_solve(const double *lu, int n, double *x, int m) {
+    for (int i0 = 0; i0 < n; i0 += MATRIX_PANEL) {
+        int i1 = MIN(i0 + MATRIX_PANEL, n);
+        MatrixProduct mp = { i1 - i0, m, i0, -1, lu + (size_t)i0 * n, n, x, m, x + (size_t)i0 * m, m };
+        matrix_multiply_add(&mp);
+        for (int i = i0; i < i1; i++) {
+            for (int k = i0; k < i; k++) {
+                matrix_axpy(x + (size_t)i * m, x + (size_t)k * m, -lu[(size_t)i * n + k], m);
+            }
+        }
+    }
+    for (int i1 = n; i1 > 0; i1 -= MATRIX_PANEL) {
+        int i0 = MAX(i1 - MATRIX_PANEL, 0);
+        MatrixProduct mp = { i1 - i0, m, n - i1, -1, lu + (size_t)i0 * n + i1, n,
+                             x + (size_t)i1 * m, m, x + (size_t)i0 * m, m };
+        matrix_multiply_add(&mp);
+        for (int i = i1 - 1; i >= i0; i--) {
+            double *row = x + (size_t)i * m;
+            for (int k = i + 1; k < i1; k++) {
+                matrix_axpy(row, x + (size_t)k * m, -lu[(size_t)i * n + k], m);
+            }
+            double pivot = lu[(size_t)i * n + i];
+            for (int j = 0; j < m; j++) {
+                row[j] /= pivot;
+            }
+        }
+    }
+}
+
+// LU factors of a square matrix, in the arena; perm must hold a.rows entries
+CalcError matrix_factor(MatrixArena *arena, const MatrixValue *a, double **lu, int *perm, int *sign) {
+    if (a->rows != a->cols) {
+        return CALC_ERR_DIMENSION;
+    }
+    *lu = matrix_arena_alloc(arena, (size_t)a->rows * a->cols);
+    if (*lu == NULL) {
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    memcpy(*lu, a->data, sizeof(double) * a->rows * a->cols);
+    *sign = matrix_lu(*lu, a->rows, perm);
+    return CALC_OK;
+}
+
+// x = a^-1 b for a square matrix a and a matrix b with as many rows
+CalcError matrix_solve(MatrixArena *arena, const MatrixValue *a, const MatrixValue *b, MatrixValue *x) {
+    if (a->rows != a->cols || b->rows != a->rows) {
+        return CALC_ERR_DIMENSION;
+    }
+    int n = a->rows;
+    int *perm = malloc(sizeof(int) * n);
+    if (perm == NULL) {
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    double *lu;
+    int sign;
+    CalcError error = matrix_factor(arena, a, &lu, perm, &sign);
+    if (error == CALC_OK && sign == 0) {
+        error = CALC_ERR_SINGULAR_MATRIX;
+    }
+    MatrixValue solution;
+    if (error == CALC_OK) {
+        error = matrix_new(arena, n, b->cols, &solution);
+    }
+    if (error == CALC_OK) {
+        for (int i = 0; i < n; i++) {
+            memcpy(solution.data + (size_t)i * b->cols, b->data + (size_t)perm[i] * b->cols, sizeof(double) * b->cols);
+        }
+        matrix_lu_solve(lu, n, solution.data, b->cols);
+        *x = solution;
+    }
+    free(perm);
+    return error;
+}
+
+// out = a * b for two matrices
+CalcError matrix_product(MatrixArena *arena, const MatrixValue *a, const MatrixValue *b, MatrixValue *out) {
+    if (a->cols != b->rows) {
+        return CALC_ERR_DIMENSION;
+    }
+    MatrixValue c;
+    CalcError error = matrix_new(arena, a->rows, b->cols, &c);
+    if (error != CALC_OK) {
+        return error;
+    }
+    memset(c.data, 0, sizeof(double) * c.rows * c.cols);
+    MatrixProduct mp = { a->rows, b->cols, a->cols, 1, a->data, a->cols, b->data, b->cols, c.data, c.cols };
+    matrix_multiply_add(&mp);
+    *out = c;
+    return CALC_OK;
+}
+
+// Integer powers of a square matrix by repeated squaring; negative powers
+// invert first
+CalcError matrix_power(MatrixArena *arena, MatrixValue *a, double exponent) {
+    if (a->rows != a->cols) {
+        return CALC_ERR_DIMENSION;
+    }
+    if (exponent != floor(exponent) || fabs(exponent) > MATRIX_MAX_INTEGER_POWER) {
+        return CALC_ERR_POWER_DOMAIN;
+    }
+    MatrixValue base = *a;
+    MatrixValue result;
+    CalcError error = CALC_OK;
+    if (exponent < 0) {
+        MatrixValue identity;
+        error = matrix_identity(arena, a->rows, &identity);
+        if (error == CALC_OK) {
+            error = matrix_solve(arena, a, &identity, &base);
+        }
+    }
+    if (error == CALC_OK) {
+        error = matrix_identity(arena, a->rows, &result);
+    }
+    int n = (int)fabs(exponent);
+    int first = 1; // result is still the identity
+    while (error == CALC_OK && n > 0) {
+        if (n & 1) {
+            if (first) {
+                result = base;
+                first = 0;
+            } else {
+                error = matrix_product(arena, &result, &base, &result);
+            }
+        }
+        n >>= 1;
+        if (error == CALC_OK && n > 0) {
+            error = matrix_product(arena, &base, &base, &base);
+        }
+    }
+    if (error == CALC_OK) {
+        *a = result;
+    }
+    return error;
+}
+
+// Matrix kernels of the built-ins: called when an argument is a matrix, with
+// the result in args[0]
+CalcError matrix_builtin_transpose(MatrixArena *arena, MatrixValue *args) {
+    MatrixValue t;
+    CalcError error = matrix_new(arena, args[0].cols, args[0].rows, &t);
+    if (error == CALC_OK) {
+        matrix_transpose(args[0].data, args[0].rows, args[0].cols, t.data);
+        args[0] = t;
+    }
+    return error;
+}
+
+CalcError matrix_builtin_det(MatrixArena *arena, MatrixValue *args) {
+    int *perm = malloc(sizeof(int) * MAX(args[0].rows, 1));
+    if (perm == NULL) {
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    double *lu;
+    int sign;
+    CalcError error = matrix_factor(arena, &args[0], &lu, perm, &sign);
+    if (error == CALC_OK) {
+        int n = args[0].rows;
+        double det = sign;
+        for (int i = 0; i < n && sign != 0; i++) {
+            det *= lu[(size_t)i * n + i];
+        }
+        args[0] = matrix_number(det);
+    }
+    free(perm);
+    return error;
+}
+
+CalcError matrix_builtin_inv(MatrixArena *arena, MatrixValue *args) {
+    if (args[0].rows != args[0].cols) {
+        return CALC_ERR_DIMENSION;
+    }
+    MatrixValue identity;
+    CalcError error = matrix_identity(arena, args[0].rows, &identity);
+    return error != CALC_OK ? error : matrix_solve(arena, &args[0], &identity, &args[0]);
+}
+
+CalcError matrix_builtin_solve(MatrixArena *arena, MatrixValue *args) {
+    if (args[0].data == NULL) {
+        // A number: every element of b divided by it
+        MatrixValue x;
+        CalcError error = args[0].number == 0 ? CALC_ERR_DIVISION_BY_ZERO
+                                              : matrix_new(arena, args[1].rows, args[1].cols, &x);
+        if (error == CALC_OK) {
+            for (int k = 0; k < x.rows * x.cols; k++) {
+                x.data[k] = args[1].data[k] / args[0].number;
+            }
+            args[0] = x;
+        }
+        return error;
+    }
+    if (args[1].data == NULL) {
+        return CALC_ERR_DIMENSION;
+    }
+    return matrix_solve(arena, &args[0], &args[1], &args[0]);
+}
+
+// Dual numbers for the equation solver: a value and its derivative with respect
+// to the unknown. Evaluating a program on duals carries the exact derivative
+// along with every step (forward-mode automatic differentiation).
+typedef struct {
+    double value;
+    double slope;
+} Dual;
+
+static inline Dual dual_make(double value, double slope) {
+    Dual d = { value, slope };
+    return d;
+}
+
+// Dual kernels of the built-ins: f(a) and f'(a) a' (domains are checked on the values first)
+Dual dual_builtin_sin(const Dual *a) { return dual_make(sin(a->value), cos(a->value) * a->slope); }
+Dual dual_builtin_cos(const Dual *a) { return dual_make(cos(a->value), -sin(a->value) * a->slope); }
+Dual dual_builtin_atan(const Dual *a) { return dual_make(atan(a->value), a->slope / (1 + a->value * a->value)); }
+Dual dual_builtin_ln(const Dual *a) { return dual_make(log(a->value), a->slope / a->value); }
+Dual dual_builtin_log(const Dual *a) { return dual_make(log10(a->value), a->slope / (a->value * M_LN10)); }
+Dual dual_builtin_sq(const Dual *a) { return dual_make(a->value * a->value, 2 * a->value * a->slope); }
+Dual dual_builtin_re(const Dual *a) { return *a; }
+Dual dual_builtin_im(const Dual *a) { return dual_make(a->value - a->value, 0); }
+Dual dual_builtin_arg(const Dual *a) { return dual_make(atan2(0.0, a->value), 0); }
+
+Dual dual_builtin_tan(const Dual *a) {
+    double t = tan(a->value);
+    return dual_make(t, (1 + t * t) * a->slope);
+}
+
+Dual dual_builtin_asin(const Dual *a) {
+    return dual_make(asin(a->value), a->slope / sqrt(1 - a->value * a->value));
+}
+
+Dual dual_builtin_acos(const Dual *a) {
+    return dual_make(acos(a->value), -a->slope / sqrt(1 - a->value * a->value));
+}
+
+Dual dual_builtin_exp(const Dual *a) {
+    double e = exp(a->value);
+    return dual_make(e, e * a->slope);
+}
+
+Dual dual_builtin_sqrt(const Dual *a) {
+    double r = sqrt(a->value);
+    return dual_make(r, a->slope / (2 * r));
+}
+
+Dual dual_builtin_recip(const Dual *a) {
+    double r = 1 / a->value;
+    return dual_make(r, -a->slope * r * r);
+}
+
+Dual dual_builtin_abs(const Dual *a) {
+    return dual_make(fabs(a->value), a->value < 0 ? -a->slope : a->slope);
+}
+
+// a^b, with b a^(b-1) a' alone when the exponent is constant so negative bases work
+Dual dual_builtin_pow(const Dual *args) {
+    Dual a = args[0];
+    Dual b = args[1];
+    double p = pow(a.value, b.value);
+    double slope = b.slope == 0 ? 0 : p * log(a.value) * b.slope;
+    if (a.slope != 0) {
+        slope += b.value * pow(a.value, b.value - 1) * a.slope;
+    }
+    return dual_make(p, slope);
+}
+
+// solve(a, b) on numbers is b / a
+Dual dual_builtin_solve(const Dual *args) {
+    double q = args[1].value / args[0].value;
+    return dual_make(q, (args[1].slope - q * args[0].slope) / args[0].value);
+}
+
+Dual dual_builtin_gamma(const Dual *a) {
+    double g = gamma_real(a->value);
+    return dual_make(g, a->slope == 0 ? 0 : g * digamma(a->value) * a->slope);
+}
+
+Dual dual_builtin_fact(const Dual *a) {
+    double g = gamma_real(a->value + 1);
+    return dual_make(g, a->slope == 0 ? 0 : g * digamma(a->value + 1) * a->slope);
+}
+
+// Built-in scientific functions, dispatched through a table rather than a switch.
+// Each has a scalar kernel for single evaluations, a batch kernel for evaluating
+// a column of rows at once, and an optional domain check so invalid arguments
+// report a precise error instead of producing NaN. The complex kernel serves
+// the complex mode and handles its own domain, the matrix kernel (if any)
+// takes over when an argument is a matrix, and the dual kernel gives the
+// derivative for the equation solver.
+typedef enum {
+    BOUND_NONE,       // No cheap bound: interval mode reports the whole line
+    BOUND_INCREASING, // Monotonically increasing over its domain
+    BOUND_DECREASING, // Monotonically decreasing over its domain
+    BOUND_RECIPROCAL, // Decreasing on each side of zero
+    BOUND_SQUARE,     // Decreasing below zero, increasing above
+    BOUND_PERIODIC,   // sin or cos: endpoints plus any peak or trough inside
+    BOUND_BRANCHES,   // tan: increasing between poles at odd multiples of pi/2
+    BOUND_GAMMA,      // gamma or fact: increasing once gamma's argument reaches 2
+    BOUND_POWER       // pow: monotone in each argument for a positive base
+} BoundShape;
+
+typedef struct {
+    const char *name;
+    int arity;
+    double (*scalar)(const double *args);
+    void (*batch)(const double *const *args, double *out, int n);
+    CalcError (*domain)(const double *args); // NULL when every argument is valid
+    BoundShape bound;
+    CalcError (*complex_kernel)(Complex *args); // Result in args[0]
+    CalcError (*matrix_kernel)(MatrixArena *arena, MatrixValue *args); // Result in args[0], NULL for numbers only
+    Dual (*dual_kernel)(const Dual *args);
+} BuiltinFunction;
+
+// Scalar and batch kernels for a one-argument libm function
+#define UNARY_BUILTIN(name, expr) \
+    double builtin_##name(const double *args) { \
+        double x = args[0]; \
+        return (expr); \
+    } \
+    void builtin_##name##_batch(const double *const *args, double *out, int n) { \
+        const double *in = args[0]; \
+        for (int i = 0; i < n; i++) { \
+            double x = in[i]; \
+            out[i] = (expr); \
+        } \
+    }
+
+UNARY_BUILTIN(sin, sin(x))
+UNARY_BUILTIN(cos, cos(x))
+UNARY_BUILTIN(tan, tan(x))
+UNARY_BUILTIN(asin, asin(x))
+UNARY_BUILTIN(acos, acos(x))
+UNARY_BUILTIN(atan, atan(x))
+UNARY_BUILTIN(ln, log(x))
+UNARY_BUILTIN(log, log10(x))
+UNARY_BUILTIN(exp, exp(x))
+UNARY_BUILTIN(abs, fabs(x))
+UNARY_BUILTIN(arg, atan2(0.0, x))
+UNARY_BUILTIN(re, x)
+
+// Real numbers are their own conjugate and have no imaginary part
+double builtin_im(const double *args) { return args[0] - args[0]; }
+
+void builtin_im_batch(const double *const *args, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = args[0][i] - args[0][i];
+    }
+}
+
+double builtin_sqrt(const double *args) { return sqrt(args[0]); }
+double builtin_sq(const double *args) { return args[0] * args[0]; }
+double builtin_recip(const double *args) { return 1.0 / args[0]; }
+double builtin_pow(const double *args) { return pow(args[0], args[1]); }
+double builtin_solve(const double *args) { return args[1] / args[0]; }
+double builtin_gamma(const double *args) { return gamma_real(args[0]); }
+double builtin_fact(const double *args) { return gamma_real(args[0] + 1); }
+
+// Square root, square and reciprocal map onto single SSE2 instructions, two rows at a time
+void builtin_sqrt_batch(const double *const *args, double *out, int n) {
+    const double *in = args[0];
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_sqrt_pd(_mm_loadu_pd(in + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = sqrt(in[i]);
+    }
+}
+
+void builtin_sq_batch(const double *const *args, double *out, int n) {
+    const double *in = args[0];
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(in + i);
+        _mm_storeu_pd(out + i, _mm_mul_pd(x, x));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = in[i] * in[i];
+    }
+}
+
+void builtin_recip_batch(const double *const *args, double *out, int n) {
+    const double *in = args[0];
+    int i = 0;
+#ifdef __SSE2__
+    const __m128d one = _mm_set1_pd(1.0);
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(out + i, _mm_div_pd(one, _mm_loadu_pd(in + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = 1.0 / in[i];
+    }
+}
+
+void builtin_pow_batch(const double *const *args, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = pow(args[0][i], args[1][i]);
+    }
+}
+
+void builtin_solve_batch(const double *const *args, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = args[1][i] / args[0][i];
+    }
+}
+
+void builtin_gamma_batch(const double *const *args, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = gamma_real(args[0][i]);
+    }
+}
+
+void builtin_fact_batch(const double *const *args, double *out, int n) {
+    for (int i = 0; i < n; i++) {
+        out[i] = gamma_real(args[0][i] + 1);
+    }
+}
+
+CalcError domain_non_negative(const double *args) {
+    return args[0] < 0 ? CALC_ERR_NEGATIVE_ROOT : CALC_OK;
+}
+
+CalcError domain_positive(const double *args) {
+    return args[0] <= 0 ? CALC_ERR_LOG_DOMAIN : CALC_OK;
+}
+
+CalcError domain_unit(const double *args) {
+    return args[0] < -1 || args[0] > 1 ? CALC_ERR_ARC_DOMAIN : CALC_OK;
+}
+
+CalcError domain_non_zero(const double *args) {
+    return args[0] == 0 ? CALC_ERR_DIVISION_BY_ZERO : CALC_OK;
+}
+
+// gamma has poles at zero and the negative integers, so n! at the negative integers
+CalcError domain_gamma(const double *args) {
+    return args[0] <= 0 && args[0] == floor(args[0]) ? CALC_ERR_FACTORIAL_DOMAIN : CALC_OK;
+}
+
+CalcError domain_factorial(const double *args) {
+    return args[0] < 0 && args[0] == floor(args[0]) ? CALC_ERR_FACTORIAL_DOMAIN : CALC_OK;
+}
+
+CalcError domain_power(const double *args) {
+    if (args[0] == 0 && args[1] < 0) {
+        return CALC_ERR_DIVISION_BY_ZERO;
+    }
+    if (args[0] < 0 && args[1] != floor(args[1])) {
+        return CALC_ERR_POWER_DOMAIN;
+    }
+    return CALC_OK;
+}
+
+const BuiltinFunction builtin_functions[] = {
+    { "sin",       1, builtin_sin,   builtin_sin_batch,   NULL,                BOUND_PERIODIC,   complex_builtin_sin,    NULL,                     dual_builtin_sin },
+    { "cos",       1, builtin_cos,   builtin_cos_batch,   NULL,                BOUND_PERIODIC,   complex_builtin_cos,    NULL,                     dual_builtin_cos },
+    { "tan",       1, builtin_tan,   builtin_tan_batch,   NULL,                BOUND_BRANCHES,   complex_builtin_tan,    NULL,                     dual_builtin_tan },
+    { "asin",      1, builtin_asin,  builtin_asin_batch,  domain_unit,         BOUND_INCREASING, complex_builtin_asin,   NULL,                     dual_builtin_asin },
+    { "acos",      1, builtin_acos,  builtin_acos_batch,  domain_unit,         BOUND_DECREASING, complex_builtin_acos,   NULL,                     dual_builtin_acos },
+    { "atan",      1, builtin_atan,  builtin_atan_batch,  NULL,                BOUND_INCREASING, complex_builtin_atan,   NULL,                     dual_builtin_atan },
+    { "ln",        1, builtin_ln,    builtin_ln_batch,    domain_positive,     BOUND_INCREASING, complex_builtin_ln,     NULL,                     dual_builtin_ln },
+    { "log",       1, builtin_log,   builtin_log_batch,   domain_positive,     BOUND_INCREASING, complex_builtin_log,    NULL,                     dual_builtin_log },
+    { "exp",       1, builtin_exp,   builtin_exp_batch,   NULL,                BOUND_INCREASING, complex_builtin_exp,    NULL,                     dual_builtin_exp },
+    { "sqrt",      1, builtin_sqrt,  builtin_sqrt_batch,  domain_non_negative, BOUND_INCREASING, complex_builtin_sqrt,   NULL,                     dual_builtin_sqrt },
+    { "sq",        1, builtin_sq,    builtin_sq_batch,    NULL,                BOUND_SQUARE,     complex_builtin_sq,     NULL,                     dual_builtin_sq },
+    { "recip",     1, builtin_recip, builtin_recip_batch, domain_non_zero,     BOUND_RECIPROCAL, complex_builtin_recip,  NULL,                     dual_builtin_recip },
+    { "pow",       2, builtin_pow,   builtin_pow_batch,   domain_power,        BOUND_POWER,      complex_power,          NULL,                     dual_builtin_pow },
+    { "abs",       1, builtin_abs,   builtin_abs_batch,   NULL,                BOUND_SQUARE,     complex_builtin_abs,    NULL,                     dual_builtin_abs },
+    { "arg",       1, builtin_arg,   builtin_arg_batch,   NULL,                BOUND_DECREASING, complex_builtin_arg,    NULL,                     dual_builtin_arg },
+    { "conj",      1, builtin_re,    builtin_re_batch,    NULL,                BOUND_INCREASING, complex_builtin_conj,   NULL,                     dual_builtin_re },
+    { "re",        1, builtin_re,    builtin_re_batch,    NULL,                BOUND_INCREASING, complex_builtin_re,     NULL,                     dual_builtin_re },
+    { "im",        1, builtin_im,    builtin_im_batch,    NULL,                BOUND_INCREASING, complex_builtin_im,     NULL,                     dual_builtin_im },
+    { "transpose", 1, builtin_re,    builtin_re_batch,    NULL,                BOUND_INCREASING, complex_builtin_number, matrix_builtin_transpose, dual_builtin_re },
+    { "det",       1, builtin_re,    builtin_re_batch,    NULL,                BOUND_INCREASING, complex_builtin_number, matrix_builtin_det,       dual_builtin_re },
+    { "inv",       1, builtin_recip, builtin_recip_batch, domain_non_zero,     BOUND_RECIPROCAL, complex_builtin_recip,  matrix_builtin_inv,       dual_builtin_recip },
+    { "solve",     2, builtin_solve, builtin_solve_batch, domain_non_zero,     BOUND_NONE,       complex_builtin_solve,  matrix_builtin_solve,     dual_builtin_solve },
+    { "gamma",     1, builtin_gamma, builtin_gamma_batch, domain_gamma,        BOUND_GAMMA,      complex_builtin_gamma,  NULL,                     dual_builtin_gamma },
+    { "fact",      1, builtin_fact,  builtin_fact_batch,  domain_factorial,    BOUND_GAMMA,      complex_builtin_fact,   NULL,                     dual_builtin_fact },
+};
+#define BUILTIN_COUNT ((int)(sizeof(builtin_functions) / sizeof(builtin_functions[0])))
+
+int find_builtin(const char *name, int length) {
+    for (int k = 0; k < BUILTIN_COUNT; k++) {
+        if ((int)strlen(builtin_functions[k].name) == length && strncmp(builtin_functions[k].name, name, length) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// Names visible while compiling: the parameters of the function being defined
+typedef struct {
+    char (*params)[MAX_SYMBOL_NAME];
+    int param_count;
+    int imaginary_unit; // Parameter a number suffixed with "i" is multiplied by, or -1
+    int matrices;       // Accept [a, b; c, d] matrix literals
+    int programmer;     // Integer literals in any base and C's integer operators
+} CompileScope;
+
+void init_program(CalcProgram *prog) {
+    prog->code = NULL;
+    prog->count = 0;
+    prog->capacity = 0;
+    prog->integer_only = 1;
+    prog->source = NULL;
+    prog->hot_rows = 0;
+    prog->jit_tried = 0;
+    prog->jit = NULL;
+    prog->jit_size = 0;
+}
+
+void free_program(CalcProgram *prog) {
+    free(prog->code);
+#ifdef CALC_HAVE_JIT
+    if (prog->jit != NULL) {
+        munmap(prog->jit, prog->jit_size);
+    }
+#endif
+    init_program(prog);
+}
+
+// Append an instruction (literal values are filled in by the caller)
+static inline int emit_instr(CalcProgram *prog, CalcOpcode op, int slot, int arg_count, int start, int length) {
+    if (prog->count >= prog->capacity) {
+        int new_capacity = prog->capacity > 0 ? prog->capacity * 2 : 32;
+        CalcInstr *code = realloc(prog->code, sizeof(CalcInstr) * new_capacity);
+        if (code == NULL) {
+            return 0; // Out of memory
+        }
+        prog->code = code;
+        prog->capacity = new_capacity;
+    }
+    CalcInstr *instr = &prog->code[prog->count++];
+    instr->op = op;
+    instr->value = 0;
+    instr->int_value = 0;
+    instr->slot = slot;
+    instr->arg_count = arg_count;
+    instr->start = start;
+    instr->length = length;
+    return 1;
+}
+
+// Change in stack depth when an instruction runs
+static inline int instr_stack_effect(const CalcInstr *instr) {
+    switch (instr->op) {
+        case OP_PUSH:
+        case OP_LOAD:
+        case OP_PARAM:
+        case OP_MATRIX: return 1;
+        case OP_CALL:
+        case OP_BUILTIN: return 1 - instr->arg_count;
+        case OP_NEG:
+        case OP_NOT: return 0;
+        default: return -1; // Binary operators
+    }
+}
+
+// Binary operators, indexed by character. Each side has a binding power: an
+// operand between two operators goes to the side that binds tighter, so equal
+// powers on both sides would be ambiguous. A higher left power makes an
+// operator right-associative. Characters that aren't operators have no power.
+typedef struct {
+    int left_power;
+    int right_power;
+    CalcOpcode op;
+} InfixOperator;
+
+const InfixOperator infix_operators[128] = {
+    ['+'] = { 10, 11, OP_ADD },
+    ['-'] = { 10, 11, OP_SUB },
+    ['*'] = { 20, 21, OP_MUL },
+    ['/'] = { 20, 21, OP_DIV },
+    ['^'] = { 41, 40, OP_POW }, // 2^3^2 = 2^9
+};
+
+// Operand power of unary minus: looser than ^ so -2^2 = -4, tighter than * and /
+#define PREFIX_POWER 30
+
+static inline const InfixOperator *find_infix_operator(char symbol) {
+    unsigned char c = (unsigned char)symbol;
+    return c < 128 && infix_operators[c].left_power > 0 ? &infix_operators[c] : NULL;
+}
+
+// Programmer mode follows C: | binds loosest, then ^, &, the shifts, + and -,
+// and * / % tightest. ^ is exclusive or, as in C, rather than a power.
+const InfixOperator programmer_operators[128] = {
+    ['|'] = { 2, 3, OP_OR },
+    ['^'] = { 4, 5, OP_XOR },
+    ['&'] = { 6, 7, OP_AND },
+    ['<'] = { 8, 9, OP_SHL }, // <<
+    ['>'] = { 8, 9, OP_SHR }, // >>
+    ['+'] = { 10, 11, OP_ADD },
+    ['-'] = { 10, 11, OP_SUB },
+    ['*'] = { 20, 21, OP_MUL },
+    ['/'] = { 20, 21, OP_DIV },
+    ['%'] = { 20, 21, OP_MOD },
+};
+
+// The operator starting at s in the given dialect, setting *length to its
+// length in characters (shifts are written twice: << and >>)
+static inline const InfixOperator *find_operator(const char *s, int programmer, int *length) {
+    unsigned char c = (unsigned char)s[0];
+    *length = 1;
+    if (!programmer) {
+        return find_infix_operator(s[0]);
+    }
+    if (c >= 128 || programmer_operators[c].left_power == 0 || ((c == '<' || c == '>') && s[1] != s[0])) {
+        return NULL;
+    }
+    *length = 1 + (c == '<' || c == '>');
+    return &programmer_operators[c];
+}
+
+// Something waiting for the operand being parsed: an operator that is emitted
+// once its right operand is complete, or an unclosed parenthesis, call or matrix
+typedef enum {
+    FRAME_PREFIX,
+    FRAME_INFIX,
+    FRAME_GROUP,
+    FRAME_CALL,
+    FRAME_MATRIX
+} FrameKind;
+
+typedef struct {
+    FrameKind kind;
+    CalcOpcode op; // Instruction emitted when the frame is reduced
+    int power;     // Right binding power of an operator (0 for groups and calls)
+    int start;     // Offset of the operator, '(', '[' or function name
+    int open;      // Offset of the '(' (calls) or index of the OP_MATRIX (matrices)
+    int length;    // Length of the function name (calls)
+    int slot;      // Function slot (calls) or rows completed so far (matrices)
+    int arity;     // Parameters the function takes (calls) or columns, -1 until the first row ends (matrices)
+    int args;      // Arguments completed so far (calls) or elements in the current row (matrices)
+} ParseFrame;
+
+typedef struct {
+    const char *expr;
+    const CompileScope *scope;
+    CalcProgram *prog;
+    int depth;         // Values on the stack once the emitted code has run
+    ParseFrame frames[MAX_EVAL_DEPTH];
+    int top;           // Innermost pending frame, -1 if none
+    CalcError error;   // First error found
+    int *error_offset;
+} Parser;
+
+// Record an error (only the first one is kept)
+static inline void parser_error(Parser *p, CalcError error, int offset) {
+    if (p->error == CALC_OK) {
+        p->error = error;
+        *p->error_offset = offset;
+    }
+}
+
+// Append one instruction and track the stack depth it leaves
+static inline CalcInstr *parser_emit(Parser *p, CalcOpcode op, int slot, int arg_count, int start, int length) {
+    if (!emit_instr(p->prog, op, slot, arg_count, start, length)) {
+        parser_error(p, CALC_ERR_OUT_OF_MEMORY, start);
+        return NULL;
+    }
+    CalcInstr *instr = &p->prog->code[p->prog->count - 1];
+    p->depth += instr_stack_effect(instr);
+    if (p->depth > MAX_EVAL_DEPTH) {
+        parser_error(p, CALC_ERR_STACK_OVERFLOW, start);
+        return NULL;
+    }
+    return instr;
+}
+
+// Open a frame; callers opening a call fill in the remaining fields
+static inline ParseFrame *parser_push(Parser *p, FrameKind kind, CalcOpcode op, int power, int start) {
+    if (p->top >= MAX_EVAL_DEPTH - 1) {
+        parser_error(p, CALC_ERR_STACK_OVERFLOW, start);
+        return NULL;
+    }
+    ParseFrame *frame = &p->frames[++p->top];
+    frame->kind = kind;
+    frame->op = op;
+    frame->power = power;
+    frame->start = start;
+    return frame;
+}
+
+// Close the innermost frame: the only place operators and calls are emitted
+static inline void parser_reduce(Parser *p) {
+    const ParseFrame *frame = &p->frames[p->top--];
+    if (frame->kind == FRAME_CALL) {
+        if (frame->args != frame->arity) {
+            parser_error(p, CALC_ERR_ARGUMENT_COUNT, frame->start);
+            return;
+        }
+        parser_emit(p, frame->op, frame->slot, frame->args, frame->start, frame->length);
+    } else if (frame->kind != FRAME_GROUP) {
+        parser_emit(p, frame->op, 0, 0, frame->start, 1);
+    }
+}
+
+// Reduce pending operators that bind tighter than min_power, stopping at the
+// innermost parenthesis or call
+static inline void parser_reduce_operators(Parser *p, int min_power) {
+    while (p->error == CALC_OK && p->top >= 0 && p->frames[p->top].kind <= FRAME_INFIX &&
+           p->frames[p->top].power > min_power) {
+        parser_reduce(p);
+    }
+}
+
+// Store the element just parsed in the innermost matrix literal. ';' and ']'
+// also end its row, which must be as long as the first.
+static inline void parser_matrix_element(Parser *p, ParseFrame *frame, char c, int i) {
+    parser_emit(p, OP_ELEMENT, 0, 0, i, 1);
+    frame->args++;
+    if (c == ',') {
+        return;
+    }
+    if (frame->arity < 0) {
+        frame->arity = frame->args;
+    } else if (frame->args != frame->arity) {
+        parser_error(p, CALC_ERR_DIMENSION, i);
+        return;
+    }
+    frame->slot++;
+    frame->args = 0;
+}
+
+// Digit values of the characters 0-9, a-f and A-F, plus one, so that 0 marks
+// a character that isn't a digit in any base
+const unsigned char radix_digit_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Read an integer literal at text: decimal, or hexadecimal, octal or binary
+// after 0x, 0o or 0b. Stores its 64 bits in *out and returns its length, or 0
+// if there are no digits; *overflow is set when it needs more than 64 bits.
+static inline int scan_radix_literal(const char *text, uint64_t *out, int *overflow) {
+    int i = 0;
+    unsigned base = 10;
+    if (text[0] == '0') {
+        char prefix = text[1] | 0x20;
+        base = prefix == 'x' ? 16 : prefix == 'o' ? 8 : prefix == 'b' ? 2 : 10;
+        i = base != 10 ? 2 : 0;
+    }
+    int digits = i;
+    uint64_t value = 0;
+    int wrapped = 0;
+    for (unsigned d; (d = radix_digit_values[(unsigned char)text[i]] - 1u) < base; i++) {
+        wrapped |= __builtin_mul_overflow(value, base, &value) | __builtin_add_overflow(value, d, &value);
+    }
+    *out = value;
+    *overflow = wrapped;
+    return i > digits ? i : 0;
+}
+
+// Parse an integer literal in programmer mode; returns the offset just past it
+static inline int parse_radix_number(Parser *p, int i) {
+    uint64_t value;
+    int overflow;
+    int length = scan_radix_literal(p->expr + i, &value, &overflow);
+    char next = p->expr[i + length];
+    if (next == '.') {
+        parser_error(p, CALC_ERR_NOT_INTEGER, i);
+    } else if (length == 0 || is_name_char(next)) {
+        parser_error(p, CALC_ERR_INVALID_CHARACTER, i + (length > 0 ? length : 1)); // "0x", "0b2" or "12ab"
+    } else if (overflow) {
+        parser_error(p, CALC_ERR_OVERFLOW, i);
+    }
+    CalcInstr *instr = parser_emit(p, OP_PUSH, 1, 0, i, length);
+    if (instr != NULL) {
+        instr->value = (double)(int64_t)value;
+        instr->int_value = (long long)value;
+    }
+    return i + length;
+}
+
+#define MAX_LITERAL_EXPONENT 10000 // Exponents written in literals stay below this
+
+// Decimal text to double. Up to 19 significant digits scaled by at most 10^22
+// take one multiply or divide, which is exact because both operands are
+// (Clinger's fast path); anything else goes to strtod.
+double parse_decimal(const char *text, char **end) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = text;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+') {
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int significant = 0;
+    int exponent = 0;
+    for (; *p >= '0' && *p <= '9'; p++, digits++) {
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+        significant += significant > 0 || *p != '0';
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, digits++) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            significant += significant > 0 || *p != '0';
+            exponent--;
+        }
+    }
+    if (digits == 0 || significant > 19) {
+        return strtod(text, end);
+    }
+    if (*p == 'e' || *p == 'E') {
+        const char *q = p + 1;
+        int exponent_negative = *q == '-';
+        if (*q == '-' || *q == '+') {
+            q++;
+        }
+        if (*q < '0' || *q > '9') {
+            return strtod(text, end);
+        }
+        int written = 0;
+        for (; *q >= '0' && *q <= '9' && written < MAX_LITERAL_EXPONENT; q++) {
+            written = written * 10 + (*q - '0');
+        }
+        exponent += exponent_negative ? -written : written;
+        p = q;
+    }
+    if (mantissa > (1ULL << 53) || exponent < -22 || exponent > 22 || (*p >= '0' && *p <= '9')) {
+        return strtod(text, end);
+    }
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / powers_of_ten[-exponent] : value * powers_of_ten[exponent];
+    *end = (char *)p;
+    return negative ? -value : value;
+}
+
+// Parse a number at expr[i]; returns the offset just past it. The value is
+// read from the whole literal at once so it is the double nearest the text.
+static inline int parse_number(Parser *p, int i) {
+    const char *expr = p->expr;
+    int start = i;
+    int decimal_place = 0;
+    long long int_num = 0;
+    int exact = 1;
+
+    while ((expr[i] >= '0' && expr[i] <= '9') || (expr[i] == '.' && !decimal_place)) {
+        if (expr[i] == '.') {
+            decimal_place = 1;
+            exact = 0;
+            p->prog->integer_only = 0;
+        } else if (!decimal_place) {
+            if (__builtin_mul_overflow(int_num, 10, &int_num) ||
+                __builtin_add_overflow(int_num, expr[i] - '0', &int_num)) {
+                exact = 0;
+                p->prog->integer_only = 0; // Too large for the integer path
+            }
+        }
+        i++;
+    }
+    // An exponent needs digits: in "2e" or "2ex" the e is left to be read as a name
+    int sign = (expr[i] == 'e' || expr[i] == 'E') && (expr[i + 1] == '+' || expr[i + 1] == '-');
+    if ((expr[i] == 'e' || expr[i] == 'E') && expr[i + 1 + sign] >= '0' && expr[i + 1 + sign] <= '9') {
+        int exponent_start = i;
+        int exponent = 0;
+        for (i += 1 + sign; expr[i] >= '0' && expr[i] <= '9'; i++) {
+            if (exponent < MAX_LITERAL_EXPONENT) {
+                exponent = exponent * 10 + (expr[i] - '0');
+            }
+        }
+        if (exponent >= MAX_LITERAL_EXPONENT) {
+            parser_error(p, CALC_ERR_OVERFLOW, exponent_start);
+        }
+        exact = 0;
+        p->prog->integer_only = 0;
+    }
+
+    char *end;
+    CalcInstr *instr = parser_emit(p, OP_PUSH, exact, 0, start, i - start);
+    if (instr != NULL) {
+        instr->value = parse_decimal(expr + start, &end);
+        instr->int_value = int_num;
+    }
+    return i;
+}
+
+// Parse a name at expr[i]: a parameter or variable is emitted, while a function
+// call opens a frame that collects its arguments (and sets *called).
+// Returns the offset just past the name, or past the '(' of a call.
+int parse_identifier(Parser *p, int i, int *called) {
+    const char *expr = p->expr;
+    int start = i;
+    while (is_name_char(expr[i])) {
+        i++;
+    }
+    int length = i - start;
+    int next = i;
+    while (expr[next] == ' ' || expr[next] == '\t') {
+        next++;
+    }
+    *called = expr[next] == '(';
+
+    int param = -1;
+    for (int k = 0; p->scope != NULL && k < p->scope->param_count; k++) {
+        if ((int)strlen(p->scope->params[k]) == length && strncmp(p->scope->params[k], expr + start, length) == 0) {
+            param = k;
+            break;
+        }
+    }
+    // Built-in functions win over symbols; a parameter only shadows one when not called
+    int builtin = find_builtin(expr + start, length);
+    int is_builtin = builtin >= 0 && (param < 0 || *called);
+    int slot = param < 0 && !is_builtin ? find_symbol(expr + start, length) : -1;
+
+    if (is_builtin || (param < 0 && slot >= 0 && symbol_at(slot)->kind == SYMBOL_FUNCTION)) {
+        if (!*called) {
+            parser_error(p, CALC_ERR_ARGUMENT_COUNT, start); // Function used without arguments
+            return i;
+        }
+        ParseFrame *frame = parser_push(p, FRAME_CALL, is_builtin ? OP_BUILTIN : OP_CALL, 0, start);
+        if (frame == NULL) {
+            return i;
+        }
+        if (is_builtin) {
+            if (builtin_functions[builtin].scalar != builtin_fact) {
+                p->prog->integer_only = 0; // Built-ins are evaluated in floating point
+            }
+            frame->slot = builtin;
+            frame->arity = builtin_functions[builtin].arity;
+            frame->length = (int)strlen(builtin_functions[builtin].name);
+        } else {
+            frame->slot = slot;
+            frame->arity = symbol_at(slot)->param_count;
+            frame->length = (int)strlen(symbol_at(slot)->name);
+        }
+        frame->open = next;
+        frame->args = 0;
+        return next + 1;
+    }
+    *called = 0;
+    if (param < 0 && (slot < 0 || expr[next] == '(')) {
+        parser_error(p, CALC_ERR_UNDEFINED_NAME, start);
+        return i;
+    }
+    parser_emit(p, param >= 0 ? OP_PARAM : OP_LOAD, param >= 0 ? param : slot, 0, start, length);
+    return i;
+}
+
+// Report a character that can't start an operand. previous is the offset of
+// the token before it, blamed when the expression ends too early.
+void parser_operand_error(Parser *p, int i, int previous) {
+    char c = p->expr[i];
+    int length;
+    if (c == '\0') {
+        parser_error(p, CALC_ERR_MISSING_OPERAND, previous);
+    } else if (c == ')') {
+        for (int k = p->top; k >= 0; k--) {
+            if (p->frames[k].kind >= FRAME_GROUP) {
+                parser_error(p, CALC_ERR_MISSING_OPERAND, i); // "()"
+                return;
+            }
+        }
+        parser_error(p, CALC_ERR_MISMATCHED_PAREN, i);
+    } else if (c == ',' || find_operator(p->expr + i, p->scope != NULL && p->scope->programmer, &length) != NULL ||
+               ((c == ';' || c == ']') && p->scope != NULL && p->scope->matrices)) {
+        parser_error(p, CALC_ERR_MISSING_OPERAND, i);
+    } else {
+        parser_error(p, CALC_ERR_INVALID_CHARACTER, i);
+    }
+}
+
+// Compile an infix expression into a postfix program, resolving names against
+// the function parameters in scope (if any) and then the symbol table.
+// The source is read once, left to right, alternating between expecting an
+// operand and expecting an operator. Pending operators, parentheses and calls
+// wait on an explicit stack until their binding power says they are complete,
+// so deeply nested input costs no more per character than flat input.
+// On failure the program is left empty and *error_offset points at the problem.
+CalcError compile_expression_scoped(const char *expr, const CompileScope *scope, CalcProgram *prog, int *error_offset) {
+    Parser p;
+    p.expr = expr;
+    p.scope = scope;
+    p.prog = prog;
+    p.depth = 0;
+    p.top = -1;
+    p.error = CALC_OK;
+    p.error_offset = error_offset;
+    init_program(prog);
+    prog->source = expr;
+
+    int i = 0;
+    while (expr[i] == ' ' || expr[i] == '\t') {
+        i++;
+    }
+    if (expr[i] == '\0') {
+        return CALC_OK; // An empty expression evaluates to 0
+    }
+    // Nearly every instruction comes from a different token, so the source length is a good first size
+    int length = (int)strlen(expr);
+    prog->code = malloc(sizeof(CalcInstr) * length);
+    if (prog->code == NULL) {
+        *error_offset = 0;
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    prog->capacity = length;
+
+    int matrices = scope != NULL && scope->matrices;
+    int programmer = scope != NULL && scope->programmer;
+    int expect_operand = 1;
+    int previous = 0; // Start of the last token read
+    while (p.error == CALC_OK) {
+        char c = expr[i];
+        if (c == ' ' || c == '\t') {
+            i++;
+            continue;
+        }
+        int start = i;
+
+        if (expect_operand) {
+            if (programmer && ((c >= '0' && c <= '9') || c == '.')) {
+                i = parse_radix_number(&p, i);
+                expect_operand = 0;
+            } else if ((c >= '0' && c <= '9') || c == '.') {
+                i = parse_number(&p, i);
+                expect_operand = 0;
+                // "4i" is an imaginary literal where the scope has an imaginary unit
+                if (scope != NULL && scope->imaginary_unit >= 0 && expr[i] == 'i' && !is_name_char(expr[i + 1]) &&
+                    p.error == CALC_OK) {
+                    parser_emit(&p, OP_PARAM, scope->imaginary_unit, 0, i, 1);
+                    parser_emit(&p, OP_MUL, 0, 0, i, 1);
+                    i++;
+                }
+            } else if (is_name_start(c)) {
+                int called;
+                i = parse_identifier(&p, i, &called);
+                expect_operand = called;
+            } else if (c == '(') {
+                parser_push(&p, FRAME_GROUP, OP_PUSH, 0, i); // Groups emit nothing
+                i++;
+            } else if (c == '[' && matrices) {
+                // The shape is filled in once the closing ']' is reached
+                ParseFrame *frame = parser_emit(&p, OP_MATRIX, 0, 0, i, 1) != NULL
+                                        ? parser_push(&p, FRAME_MATRIX, OP_MATRIX, 0, i)
+                                        : NULL;
+                if (frame != NULL) {
+                    frame->open = p.prog->count - 1;
+                    frame->slot = 0;
+                    frame->arity = -1;
+                    frame->args = 0;
+                }
+                i++;
+            } else if (c == '-' || (c == '~' && programmer)) {
+                parser_push(&p, FRAME_PREFIX, c == '-' ? OP_NEG : OP_NOT, PREFIX_POWER, i);
+                i++;
+            } else if (c == '+') {
+                i++; // Unary plus emits nothing
+            } else if (c == ')' && p.top >= 0 && p.frames[p.top].kind == FRAME_CALL && p.frames[p.top].args == 0) {
+                parser_reduce(&p); // "f()": a call without arguments
+                i++;
+                expect_operand = 0;
+            } else {
+                parser_operand_error(&p, i, previous);
+            }
+        } else {
+            int op_length;
+            const InfixOperator *infix = find_operator(expr + i, programmer, &op_length);
+            if (c == '!') {
+                // Postfix factorial of the operand just completed, so -3! = -(3!) and 2^3! = 2^6.
+                // It keeps the program on the integer path, which reads small factorials from a table.
+                parser_emit(&p, OP_BUILTIN, find_builtin("fact", 4), 1, i, 1);
+                i++;
+            } else if (infix != NULL) {
+                // Operators on the left that bind the operand tighter are complete
+                parser_reduce_operators(&p, infix->left_power);
+                parser_push(&p, FRAME_INFIX, infix->op, infix->right_power, i);
+                i += op_length;
+                expect_operand = 1;
+            } else if (c == ')' || c == ',' || c == '\0' || (matrices && (c == ';' || c == ']'))) {
+                parser_reduce_operators(&p, 0);
+                if (p.error != CALC_OK) {
+                    break;
+                }
+                ParseFrame *frame = p.top >= 0 ? &p.frames[p.top] : NULL;
+                if (c == '\0') {
+                    if (frame != NULL) {
+                        parser_error(&p, CALC_ERR_MISMATCHED_PAREN, frame->kind == FRAME_CALL ? frame->open : frame->start);
+                    }
+                    break;
+                }
+                if (frame != NULL && frame->kind == FRAME_MATRIX) {
+                    if (c == ')') {
+                        parser_error(&p, CALC_ERR_MISMATCHED_PAREN, i);
+                    } else {
+                        parser_matrix_element(&p, frame, c, i);
+                        if (c != ']') {
+                            expect_operand = 1;
+                        } else if (p.error == CALC_OK) {
+                            p.prog->code[frame->open].slot = frame->slot;
+                            p.prog->code[frame->open].arg_count = frame->arity;
+                            p.top--;
+                        }
+                    }
+                } else if (c == ']') {
+                    parser_error(&p, CALC_ERR_MISMATCHED_PAREN, i);
+                } else if (c == ';') {
+                    parser_error(&p, CALC_ERR_INVALID_CHARACTER, i); // Not in a matrix
+                } else if (c == ',') {
+                    if (frame == NULL || frame->kind != FRAME_CALL) {
+                        parser_error(&p, CALC_ERR_INVALID_CHARACTER, i); // Not in a call
+                    } else {
+                        frame->args++;
+                        expect_operand = 1;
+                    }
+                } else if (frame == NULL) {
+                    parser_error(&p, CALC_ERR_MISMATCHED_PAREN, i);
+                } else {
+                    frame->args++;
+                    parser_reduce(&p);
+                }
+                i++;
+            } else if (c == '(' || is_name_start(c) || (c >= '0' && c <= '9') || c == '.') {
+                parser_error(&p, CALC_ERR_MISSING_OPERATOR, i);
+            } else {
+                parser_error(&p, CALC_ERR_INVALID_CHARACTER, i);
+            }
+        }
+        previous = start;
+    }
+
+    if (p.error != CALC_OK) {
+        free_program(prog);
+    }
+    return p.error;
+}
+
+// Compile an expression that may only refer to global names
+CalcError compile_expression(const char *expr, CalcProgram *prog, int *error_offset) {
+    return compile_expression_scoped(expr, NULL, prog, error_offset);
+}
+
+// Run a compiled program using hardware doubles
+CalcError run_program_with(const CalcProgram *prog, const double *params, int call_depth,
+                           double *out, int *error_offset) {
+    double values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        switch (instr->op) {
+            case OP_PUSH:
+                values[++top] = instr->value;
+                continue;
+            case OP_LOAD:
+                // A variable whose definition stopped evaluating is cached as NAN
+                if (isnan(symbol_value(instr->slot))) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_UNDEFINED_NAME;
+                }
+                values[++top] = symbol_value(instr->slot);
+                continue;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_CALL: {
+                CalcError error = call_permitted(call_depth);
+                if (error != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                top -= instr->arg_count - 1;
+                error = run_program_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1,
+                                                   &values[top], error_offset);
+                if (error != CALC_OK) {
+                    *error_offset = instr->start; // Report the call site
+                    return error;
+                }
+                continue;
+            }
+            case OP_BUILTIN: {
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                top -= fn->arity - 1;
+                CalcError error = fn->domain != NULL ? fn->domain(&values[top]) : CALC_OK;
+                if (error != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                values[top] = fn->scalar(&values[top]);
+                if (isinf(values[top])) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_OVERFLOW;
+                }
+                continue;
+            }
+            case OP_NEG:
+                values[top] = -values[top];
+                continue;
+            default:
+                break;
+        }
+        double b = values[top--];
+        double a = values[top];
+        switch (instr->op) {
+            case OP_ADD: values[top] = a + b; break;
+            case OP_SUB: values[top] = a - b; break;
+            case OP_MUL: values[top] = a * b; break;
+            case OP_DIV:
+                if (b == 0) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_DIVISION_BY_ZERO;
+                }
+                values[top] = a / b;
+                break;
+            case OP_POW: {
+                CalcError error = domain_power(&values[top]);
+                if (error != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                values[top] = pow(a, b);
+                break;
+            }
+            default: values[top] = 0; break;
+        }
+        if (isinf(values[top])) {
+            *error_offset = instr->start;
+            return CALC_ERR_OVERFLOW;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : 0;
+    return CALC_OK;
+}
+
+CalcError run_program(const CalcProgram *prog, double *out, int *error_offset) {
+    return run_program_with(prog, NULL, 0, out, error_offset);
+}
+
+// Evaluate an expression in doubles (NAN on any error)
+double evaluate_expression(const char *expr) {
+    CalcProgram prog;
+    int offset;
+    double value = NAN;
+    if (compile_expression(expr, &prog, &offset) != CALC_OK) {
+        return NAN;
+    }
+    if (run_program(&prog, &value, &offset) != CALC_OK) {
+        value = NAN;
+    }
+    free_program(&prog);
+    return value;
+}
+
+// Native x86-64 code for hot programs on the columnar path.
+// A program that has been run over JIT_HOT_ROWS rows is compiled into a loop
+// over the rows with the evaluation stack held in xmm0-xmm13, so no value ever
+// touches memory between loading the inputs and storing the result. The code is
+// built in an anonymous mapping that is made executable only once it is written.
+// Errors are left to the interpreter: a block that raises an IEEE exception or
+// produces a non-finite value is simply evaluated again by run_program_block.
+#define JIT_HOT_ROWS 4096
+#define JIT_MAX_DEPTH 14 // xmm14 and xmm15 are scratch
+
+typedef void (*JitFunction)(const double *const *params, double *out, long n);
+
+int jit_enabled = 1; // Cleared by CALCULATOR_NO_JIT in the environment
+
+typedef struct {
+    unsigned char *code;
+    size_t length;
+    size_t capacity;
+    int failed;
+} JitBuffer;
+
+void jit_emit(JitBuffer *buf, const unsigned char *bytes, size_t n) {
+    if (buf->length + n > buf->capacity) {
+        size_t new_capacity = MAX(buf->capacity * 2, buf->length + n + 256);
+        unsigned char *grown = realloc(buf->code, new_capacity);
+        if (grown == NULL) {
+            buf->failed = 1;
+            return;
+        }
+        buf->code = grown;
+        buf->capacity = new_capacity;
+    }
+    memcpy(buf->code + buf->length, bytes, n);
+    buf->length += n;
+}
+
+void jit_emit_u8(JitBuffer *buf, unsigned char byte) {
+    jit_emit(buf, &byte, 1);
+}
+
+void jit_emit_u32(JitBuffer *buf, uint32_t value) {
+    unsigned char bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    jit_emit(buf, bytes, 4);
+}
+
+void jit_emit_u64(JitBuffer *buf, uint64_t value) {
+    jit_emit_u32(buf, (uint32_t)value);
+    jit_emit_u32(buf, (uint32_t)(value >> 32));
+}
+
+// mov rax, imm64
+void jit_mov_rax(JitBuffer *buf, uint64_t value) {
+    unsigned char op[2] = { 0x48, 0xB8 };
+    jit_emit(buf, op, 2);
+    jit_emit_u64(buf, value);
+}
+
+// Scalar-double SSE instruction "F2 [REX] 0F opcode modrm" between two xmm registers
+void jit_sse_reg(JitBuffer *buf, unsigned char opcode, int dest, int src) {
+    jit_emit_u8(buf, 0xF2);
+    if (dest >= 8 || src >= 8) {
+        jit_emit_u8(buf, 0x40 | (dest >= 8 ? 4 : 0) | (src >= 8 ? 1 : 0));
+    }
+    unsigned char op[3] = { 0x0F, opcode, 0xC0 | (dest & 7) << 3 | (src & 7) };
+    jit_emit(buf, op, 3);
+}
+
+// xorpd xmm, xmm ("66 [REX] 0F 57 modrm")
+void jit_xorpd(JitBuffer *buf, int dest, int src) {
+    jit_emit_u8(buf, 0x66);
+    if (dest >= 8 || src >= 8) {
+        jit_emit_u8(buf, 0x40 | (dest >= 8 ? 4 : 0) | (src >= 8 ? 1 : 0));
+    }
+    unsigned char op[3] = { 0x0F, 0x57, 0xC0 | (dest & 7) << 3 | (src & 7) };
+    jit_emit(buf, op, 3);
+}
+
+// movq xmm, rax
+void jit_movq_from_rax(JitBuffer *buf, int dest) {
+    unsigned char op[5] = { 0x66, dest >= 8 ? 0x4C : 0x48, 0x0F, 0x6E, 0xC0 | (dest & 7) << 3 };
+    jit_emit(buf, op, 5);
+}
+
+// movsd xmm, [rax] or movsd xmm, [rax + rcx*8]
+void jit_load_rax(JitBuffer *buf, int dest, int indexed) {
+    jit_emit_u8(buf, 0xF2);
+    if (dest >= 8) {
+        jit_emit_u8(buf, 0x44);
+    }
+    unsigned char op[3] = { 0x0F, 0x10, (indexed ? 0x04 : 0x00) | (dest & 7) << 3 };
+    jit_emit(buf, op, 3);
+    if (indexed) {
+        jit_emit_u8(buf, 0xC8); // SIB: rax + rcx*8
+    }
+}
+
+// Can the JIT compile this program, and how deep does its stack get?
+int jit_supported(const CalcProgram *prog) {
+    int depth = 0;
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        switch (instr->op) {
+            case OP_PUSH:
+            case OP_LOAD:
+            case OP_PARAM:
+                if (++depth > JIT_MAX_DEPTH) {
+                    return 0;
+                }
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+                depth--;
+                break;
+            case OP_NEG:
+                break;
+            case OP_BUILTIN: {
+                double (*scalar)(const double *) = builtin_functions[instr->slot].scalar;
+                if (scalar != builtin_sqrt && scalar != builtin_sq && scalar != builtin_recip) {
+                    return 0; // Only built-ins that are single instructions
+                }
+                break;
+            }
+            default:
+                return 0; // User function calls stay in the interpreter
+        }
+    }
+    return depth == 1;
+}
+
+// Compile a program to native code; returns 0 if it can't be compiled
+int jit_compile(CalcProgram *prog) {
+#ifdef CALC_HAVE_JIT
+    if (!jit_supported(prog)) {
+        return 0;
+    }
+    JitBuffer buf = { NULL, 0, 0, 0 };
+
+    // test rdx, rdx; jle done; xor ecx, ecx
+    static const unsigned char prologue[] = { 0x48, 0x85, 0xD2, 0x0F, 0x8E };
+    jit_emit(&buf, prologue, sizeof(prologue));
+    size_t skip_fixup = buf.length;
+    jit_emit_u32(&buf, 0);
+    static const unsigned char clear_rcx[] = { 0x31, 0xC9 };
+    jit_emit(&buf, clear_rcx, sizeof(clear_rcx));
+    size_t loop_start = buf.length;
+
+    int top = -1;
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        uint64_t bits;
+        switch (instr->op) {
+            case OP_PUSH:
+                memcpy(&bits, &instr->value, sizeof(bits));
+                jit_mov_rax(&buf, bits);
+                jit_movq_from_rax(&buf, ++top);
+                break;
+            case OP_LOAD:
+                // Read the variable live so redefinitions are seen without recompiling.
+                // Native code reads the table itself: blocks (plots, the solver,
+                // columns) never run inside a definition's job.
+                jit_mov_rax(&buf, (uint64_t)(uintptr_t)&symbol_values[instr->slot]);
+                jit_load_rax(&buf, ++top, 0);
+                break;
+            case OP_PARAM: {
+                // mov rax, [rdi + 8*slot]; movsd xmm, [rax + rcx*8]
+                static const unsigned char load_column[] = { 0x48, 0x8B, 0x87 };
+                jit_emit(&buf, load_column, sizeof(load_column));
+                jit_emit_u32(&buf, (uint32_t)(instr->slot * 8));
+                jit_load_rax(&buf, ++top, 1);
+                break;
+            }
+            case OP_ADD: jit_sse_reg(&buf, 0x58, top - 1, top); top--; break;
+            case OP_SUB: jit_sse_reg(&buf, 0x5C, top - 1, top); top--; break;
+            case OP_MUL: jit_sse_reg(&buf, 0x59, top - 1, top); top--; break;
+            case OP_DIV: jit_sse_reg(&buf, 0x5E, top - 1, top); top--; break;
+            case OP_NEG:
+                // Flip the sign bit so -0 and NaNs come out as in the interpreter
+                jit_mov_rax(&buf, 0x8000000000000000ULL);
+                jit_movq_from_rax(&buf, 15);
+                jit_xorpd(&buf, top, 15);
+                break;
+            case OP_BUILTIN: {
+                double (*scalar)(const double *) = builtin_functions[instr->slot].scalar;
+                if (scalar == builtin_sqrt) {
+                    jit_sse_reg(&buf, 0x51, top, top);
+                } else if (scalar == builtin_sq) {
+                    jit_sse_reg(&buf, 0x59, top, top);
+                } else {
+                    double one = 1.0;
+                    memcpy(&bits, &one, sizeof(bits));
+                    jit_mov_rax(&buf, bits);
+                    jit_movq_from_rax(&buf, 15);
+                    jit_sse_reg(&buf, 0x5E, 15, top); // xmm15 = 1 / x
+                    jit_sse_reg(&buf, 0x10, top, 15);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // movsd [rsi + rcx*8], xmm0; inc rcx; cmp rcx, rdx; jl loop_start
+    static const unsigned char store_and_step[] = { 0xF2, 0x0F, 0x11, 0x04, 0xCE, 0x48, 0xFF, 0xC1,
+                                                    0x48, 0x39, 0xD1, 0x0F, 0x8C };
+    jit_emit(&buf, store_and_step, sizeof(store_and_step));
+    jit_emit_u32(&buf, (uint32_t)(loop_start - (buf.length + 4)));
+    size_t done = buf.length;
+    jit_emit_u8(&buf, 0xC3); // ret
+    if (buf.failed) {
+        free(buf.code);
+        return 0;
+    }
+    uint32_t skip = (uint32_t)(done - (skip_fixup + 4));
+    memcpy(buf.code + skip_fixup, &skip, sizeof(skip));
+
+    // Write the code, then flip the mapping to read+execute (never writable and executable)
+    void *mapping = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        free(buf.code);
+        return 0;
+    }
+    memcpy(mapping, buf.code, buf.length);
+    free(buf.code);
+    if (mprotect(mapping, buf.length, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mapping, buf.length);
+        return 0;
+    }
+    prog->jit = mapping;
+    prog->jit_size = buf.length;
+    return 1;
+#else
+    (void)prog;
+    return 0;
+#endif
+}
+
+// Count rows run through the columnar path and compile the program once it is hot.
+// Call from one thread before fanning a program out to workers.
+void jit_note_rows(CalcProgram *prog, long rows) {
+    prog->hot_rows += rows;
+    if (prog->hot_rows >= JIT_HOT_ROWS && !prog->jit_tried && jit_enabled) {
+        prog->jit_tried = 1;
+        jit_compile(prog);
+    }
+}
+
+// Run a block with native code; returns 0 if the interpreter must redo it
+int jit_run_block(const CalcProgram *prog, const double *const *params, int n, double *out) {
+#ifdef CALC_HAVE_JIT
+    feclearexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW);
+    ((JitFunction)prog->jit)(params, out, n);
+    if (fetestexcept(FE_DIVBYZERO | FE_INVALID | FE_OVERFLOW)) {
+        return 0;
+    }
+    for (int r = 0; r < n; r++) {
+        if (!isfinite(out[r])) {
+            return 0; // e.g. a variable whose definition failed
+        }
+    }
+    return 1;
+#else
+    (void)prog; (void)params; (void)n; (void)out;
+    return 0;
+#endif
+}
+
+// Columnar evaluation: run a program for many rows at once, COLUMN_BLOCK rows per
+// pass, so every instruction is a tight loop over a block and built-ins use their
+// batch kernels. Rows that fail are NAN with the reason in errors[].
+#define COLUMN_BLOCK 256
+
+// Record why rows of a block stopped being finite (the first error per row wins)
+void flag_block_errors(const double *values, int n, CalcError error, CalcError *errors) {
+    for (int r = 0; r < n; r++) {
+        if (!isfinite(values[r]) && errors[r] == CALC_OK) {
+            errors[r] = error;
+        }
+    }
+}
+
+void run_program_block(const CalcProgram *prog, const double *const *params, int n, int call_depth,
+                       double *out, CalcError *errors) {
+    // Size the block stack from the program's maximum depth
+    int depth = 0;
+    int max_depth = 1;
+    for (int pc = 0; pc < prog->count; pc++) {
+        depth += instr_stack_effect(&prog->code[pc]);
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+    }
+    double (*values)[COLUMN_BLOCK] = malloc(sizeof(*values) * max_depth);
+    if (values == NULL) {
+        for (int r = 0; r < n; r++) {
+            out[r] = NAN;
+            errors[r] = CALC_ERR_OUT_OF_MEMORY;
+        }
+        return;
+    }
+
+    int top = -1;
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        const double *args[MAX_FUNCTION_PARAMS];
+        double result[COLUMN_BLOCK];
+        switch (instr->op) {
+            case OP_PUSH:
+            case OP_LOAD: {
+                double v = instr->op == OP_PUSH ? instr->value : symbol_value(instr->slot);
+                top++;
+                for (int r = 0; r < n; r++) {
+                    values[top][r] = v;
+                }
+                flag_block_errors(values[top], n, instr->op == OP_PUSH ? CALC_ERR_OVERFLOW : CALC_ERR_UNDEFINED_NAME,
+                                  errors);
+                continue;
+            }
+            case OP_PARAM:
+                memcpy(values[++top], params[instr->slot], sizeof(double) * n);
+                continue;
+            case OP_CALL:
+                top -= instr->arg_count - 1;
+                if (call_depth >= MAX_CALL_DEPTH) {
+                    for (int r = 0; r < n; r++) {
+                        values[top][r] = NAN;
+                    }
+                    flag_block_errors(values[top], n, CALC_ERR_STACK_OVERFLOW, errors);
+                    continue;
+                }
+                for (int k = 0; k < instr->arg_count; k++) {
+                    args[k] = values[top + k];
+                }
+                run_program_block(&symbol_at(instr->slot)->body, args, n, call_depth + 1, result, errors);
+                memcpy(values[top], result, sizeof(double) * n);
+                continue;
+            case OP_BUILTIN: {
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                top -= fn->arity - 1;
+                for (int k = 0; k < fn->arity; k++) {
+                    args[k] = values[top + k];
+                }
+                fn->batch(args, result, n);
+                // Only rows that went non-finite need the scalar domain check
+                for (int r = 0; r < n; r++) {
+                    if (!isfinite(result[r]) && errors[r] == CALC_OK) {
+                        double row_args[MAX_FUNCTION_PARAMS];
+                        for (int k = 0; k < fn->arity; k++) {
+                            row_args[k] = args[k][r];
+                        }
+                        errors[r] = fn->domain != NULL ? fn->domain(row_args) : CALC_OK;
+                        if (errors[r] == CALC_OK) {
+                            errors[r] = CALC_ERR_OVERFLOW;
+                        }
+                    }
+                }
+                memcpy(values[top], result, sizeof(double) * n);
+                continue;
+            }
+            case OP_NEG:
+                for (int r = 0; r < n; r++) {
+                    values[top][r] = -values[top][r];
+                }
+                continue;
+            default:
+                break;
+        }
+        double *b = values[top--];
+        double *a = values[top];
+        CalcError error = CALC_ERR_OVERFLOW;
+        switch (instr->op) {
+            case OP_ADD: for (int r = 0; r < n; r++) a[r] += b[r]; break;
+            case OP_SUB: for (int r = 0; r < n; r++) a[r] -= b[r]; break;
+            case OP_MUL: for (int r = 0; r < n; r++) a[r] *= b[r]; break;
+            case OP_DIV:
+                for (int r = 0; r < n; r++) {
+                    if (b[r] == 0 && errors[r] == CALC_OK) {
+                        errors[r] = CALC_ERR_DIVISION_BY_ZERO;
+                    }
+                    a[r] /= b[r];
+                }
+                break;
+            case OP_POW:
+                for (int r = 0; r < n; r++) {
+                    double row_args[2] = { a[r], b[r] };
+                    CalcError row_error = domain_power(row_args);
+                    if (row_error != CALC_OK && errors[r] == CALC_OK) {
+                        errors[r] = row_error;
+                    }
+                    a[r] = pow(a[r], b[r]);
+                }
+                break;
+            default: break;
+        }
+        flag_block_errors(a, n, error, errors);
+    }
+
+    for (int r = 0; r < n; r++) {
+        out[r] = top >= 0 && errors[r] == CALC_OK ? values[top][r] : (errors[r] == CALC_OK ? 0 : NAN);
+    }
+    free(values);
+}
+
+// Evaluate a program for any number of rows; params[k] is the column for parameter k
+void run_program_columns(const CalcProgram *prog, const double *const *params, int param_count, long rows,
+                         double *out, CalcError *errors) {
+    for (long start = 0; start < rows; start += COLUMN_BLOCK) {
+        int n = rows - start < COLUMN_BLOCK ? (int)(rows - start) : COLUMN_BLOCK;
+        const double *block_params[MAX_FUNCTION_PARAMS];
+        for (int k = 0; k < param_count; k++) {
+            block_params[k] = params[k] + start;
+        }
+        for (int r = 0; r < n; r++) {
+            errors[start + r] = CALC_OK;
+        }
+        if (prog->jit != NULL && jit_run_block(prog, block_params, n, out + start)) {
+            continue;
+        }
+        run_program_block(prog, block_params, n, 0, out + start, errors + start);
+    }
+}
+
+// a^b by repeated squaring; returns 0 on overflow or a negative exponent
+int int64_power(long long a, long long b, long long *out) {
+    long long result = 1;
+    if (b < 0) {
+        return 0;
+    }
+    while (b > 0) {
+        if ((b & 1) && __builtin_mul_overflow(result, a, &result)) return 0;
+        b >>= 1;
+        if (b > 0 && __builtin_mul_overflow(a, a, &a)) return 0;
+    }
+    *out = result;
+    return 1;
+}
+
+// Run an integer-only program with checked 64-bit arithmetic.
+// Returns 0 when a step overflows, a division leaves a remainder or a value
+// is not an integer, in which case the caller falls back to floating point.
+int run_program_int64_with(const CalcProgram *prog, const long long *params, int call_depth, long long *out) {
+    long long values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    if (!prog->integer_only || call_permitted(call_depth) != CALC_OK) {
+        return 0;
+    }
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        switch (instr->op) {
+            case OP_PUSH:
+                values[++top] = instr->int_value;
+                continue;
+            case OP_LOAD: {
+                // Definitions give their exact value; other values must be whole numbers
+                const SymbolExact *exact = symbol_exact_at(instr->slot);
+                double v = symbol_value(instr->slot);
+                if (symbol_at(instr->slot)->source != NULL) {
+                    if (!exact->has_int64) return 0;
+                    values[++top] = exact->int64;
+                } else if (v == floor(v) && fabs(v) < EXACT_DOUBLE_LIMIT) {
+                    values[++top] = (long long)v;
+                } else {
+                    return 0;
+                }
+                continue;
+            }
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_CALL:
+                top -= instr->arg_count - 1;
+                if (!run_program_int64_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1, &values[top])) {
+                    return 0;
+                }
+                continue;
+            case OP_NEG:
+                if (values[top] == LLONG_MIN) return 0;
+                values[top] = -values[top];
+                continue;
+            case OP_BUILTIN:
+                // Only n! is compiled into integer programs
+                if (builtin_functions[instr->slot].scalar != builtin_fact || values[top] < 0 ||
+                    values[top] > FACTORIAL_INT64_MAX) return 0;
+                values[top] = (long long)factorial_table[values[top]];
+                continue;
+            default:
+                break;
+        }
+        long long b = values[top--];
+        long long a = values[top];
+        switch (instr->op) {
+            case OP_ADD:
+                if (__builtin_add_overflow(a, b, &values[top])) return 0;
+                break;
+            case OP_SUB:
+                if (__builtin_sub_overflow(a, b, &values[top])) return 0;
+                break;
+            case OP_MUL:
+                if (__builtin_mul_overflow(a, b, &values[top])) return 0;
+                break;
+            case OP_DIV:
+                if (b == 0 || (a == LLONG_MIN && b == -1) || a % b != 0) return 0;
+                values[top] = a / b;
+                break;
+            case OP_POW:
+                if (!int64_power(a, b, &values[top])) return 0;
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : 0;
+    return 1;
+}
+
+int run_program_int64(const CalcProgram *prog, long long *out) {
+    return run_program_int64_with(prog, NULL, 0, out);
+}
+
+// Run a compiled program, using the exact integer path when all operands are integers
+CalcResult run_program_result(const CalcProgram *prog) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    if (run_program_int64(prog, &res.int_value)) {
+        res.is_integer = 1;
+        res.value = (double)res.int_value;
+    } else {
+        res.error = run_program(prog, &res.value, &res.error_offset);
+    }
+    return res;
+}
+
+// Evaluate an expression, using the exact integer path when all operands are integers
+CalcResult evaluate_expression_result(const char *expr) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    CalcProgram prog;
+    res.error = compile_expression(expr, &prog, &res.error_offset);
+    if (res.error != CALC_OK) {
+        return res;
+    }
+    res = run_program_result(&prog);
+    free_program(&prog);
+    return res;
+}
+
+// Complex evaluation. Programs are compiled with the imaginary unit as a
+// parameter (complex_scope), so the compiler and the other modes need no
+// complex opcodes; variables and function bodies stay real until used here.
+char complex_unit_name[1][MAX_SYMBOL_NAME] = { "i" };
+const CompileScope complex_scope = { complex_unit_name, 1, 0, 0, 0 };
+const Complex complex_unit = { 0, 1 };
+
+CalcError run_program_complex_with(const CalcProgram *prog, const Complex *params, int call_depth,
+                                   Complex *out, int *error_offset) {
+    Complex values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        CalcError error = CALC_OK;
+        switch (instr->op) {
+            case OP_PUSH:
+                values[++top] = complex_make(instr->value, 0);
+                continue;
+            case OP_LOAD:
+                if (isnan(symbol_value(instr->slot))) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_UNDEFINED_NAME;
+                }
+                values[++top] = complex_make(symbol_value(instr->slot), 0);
+                continue;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_CALL:
+                if ((error = call_permitted(call_depth)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                top -= instr->arg_count - 1;
+                error = run_program_complex_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1,
+                                                 &values[top], error_offset);
+                break;
+            case OP_BUILTIN: {
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                top -= fn->arity - 1;
+                error = fn->complex_kernel(&values[top]);
+                break;
+            }
+            case OP_NEG:
+                values[top] = complex_make(-values[top].re, -values[top].im);
+                continue;
+            default: {
+                Complex b = values[top--];
+                Complex a = values[top];
+                switch (instr->op) {
+                    case OP_ADD: values[top] = complex_make(a.re + b.re, a.im + b.im); break;
+                    case OP_SUB: values[top] = complex_make(a.re - b.re, a.im - b.im); break;
+                    case OP_MUL: values[top] = complex_multiply(a, b); break;
+                    case OP_DIV:
+                        if (b.re == 0 && b.im == 0) {
+                            error = CALC_ERR_DIVISION_BY_ZERO;
+                        } else {
+                            values[top] = complex_divide(a, b);
+                        }
+                        break;
+                    case OP_POW:
+                        error = complex_power(&values[top]);
+                        break;
+                    default: values[top] = complex_make(0, 0); break;
+                }
+                break;
+            }
+        }
+        if (error == CALC_OK && (isinf(values[top].re) || isinf(values[top].im))) {
+            error = CALC_ERR_OVERFLOW;
+        }
+        if (error != CALC_OK) {
+            *error_offset = instr->start; // Calls report the call site
+            return error;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : complex_make(0, 0);
+    return CALC_OK;
+}
+
+CalcError evaluate_expression_complex(const char *expr, Complex *out, int *error_offset) {
+    CalcProgram prog;
+    CalcError error = compile_expression_scoped(expr, &complex_scope, &prog, error_offset);
+    if (error != CALC_OK) {
+        return error;
+    }
+    error = run_program_complex_with(&prog, &complex_unit, 0, out, error_offset);
+    free_program(&prog);
+    return error;
+}
+
+// Multiply and divide a block of complex rows held as separate real and
+// imaginary arrays, two rows per SSE2 instruction. The result replaces a.
+void complex_multiply_block(double *a_re, double *a_im, const double *b_re, const double *b_im, int n) {
+    int r = 0;
+#ifdef __SSE2__
+    for (; r + 2 <= n; r += 2) {
+        __m128d ar = _mm_loadu_pd(a_re + r), ai = _mm_loadu_pd(a_im + r);
+        __m128d br = _mm_loadu_pd(b_re + r), bi = _mm_loadu_pd(b_im + r);
+        _mm_storeu_pd(a_re + r, _mm_sub_pd(_mm_mul_pd(ar, br), _mm_mul_pd(ai, bi)));
+        _mm_storeu_pd(a_im + r, _mm_add_pd(_mm_mul_pd(ar, bi), _mm_mul_pd(ai, br)));
+    }
+#endif
+    for (; r < n; r++) {
+        Complex z = complex_multiply(complex_make(a_re[r], a_im[r]), complex_make(b_re[r], b_im[r]));
+        a_re[r] = z.re;
+        a_im[r] = z.im;
+    }
+}
+
+void complex_divide_block(double *a_re, double *a_im, const double *b_re, const double *b_im, int n,
+                          CalcError *errors) {
+    int r = 0;
+#ifdef __SSE2__
+    for (; r + 2 <= n; r += 2) {
+        __m128d ar = _mm_loadu_pd(a_re + r), ai = _mm_loadu_pd(a_im + r);
+        __m128d br = _mm_loadu_pd(b_re + r), bi = _mm_loadu_pd(b_im + r);
+        __m128d d = _mm_add_pd(_mm_mul_pd(br, br), _mm_mul_pd(bi, bi));
+        // Rows whose |b|^2 is zero, subnormal or infinite take the scalar path below
+        int normal = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(d, _mm_set1_pd(DBL_MIN)),
+                                                _mm_cmple_pd(d, _mm_set1_pd(DBL_MAX))));
+        if (normal != 3) {
+            break;
+        }
+        _mm_storeu_pd(a_re + r, _mm_div_pd(_mm_add_pd(_mm_mul_pd(ar, br), _mm_mul_pd(ai, bi)), d));
+        _mm_storeu_pd(a_im + r, _mm_div_pd(_mm_sub_pd(_mm_mul_pd(ai, br), _mm_mul_pd(ar, bi)), d));
+    }
+#endif
+    for (; r < n; r++) {
+        if (b_re[r] == 0 && b_im[r] == 0 && errors[r] == CALC_OK) {
+            errors[r] = CALC_ERR_DIVISION_BY_ZERO;
+        }
+        Complex z = complex_divide(complex_make(a_re[r], a_im[r]), complex_make(b_re[r], b_im[r]));
+        a_re[r] = z.re;
+        a_im[r] = z.im;
+    }
+}
+
+// Record why rows of a complex block stopped being finite (the first error per row wins)
+void flag_complex_block_errors(const double *re, const double *im, int n, CalcError error, CalcError *errors) {
+    for (int r = 0; r < n; r++) {
+        if ((!isfinite(re[r]) || !isfinite(im[r])) && errors[r] == CALC_OK) {
+            errors[r] = error;
+        }
+    }
+}
+
+// Columnar complex evaluation, as run_program_block, with the stack split into
+// a real and an imaginary array per level so the arithmetic runs on plain
+// double vectors instead of interleaved pairs
+void run_program_complex_block(const CalcProgram *prog, const double *const *params_re,
+                               const double *const *params_im, int n, int call_depth,
+                               double *out_re, double *out_im, CalcError *errors) {
+    int depth = 0;
+    int max_depth = 1;
+    for (int pc = 0; pc < prog->count; pc++) {
+        depth += instr_stack_effect(&prog->code[pc]);
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+    }
+    double (*values_re)[COLUMN_BLOCK] = malloc(sizeof(*values_re) * max_depth);
+    double (*values_im)[COLUMN_BLOCK] = malloc(sizeof(*values_im) * max_depth);
+    if (values_re == NULL || values_im == NULL) {
+        free(values_re);
+        free(values_im);
+        for (int r = 0; r < n; r++) {
+            out_re[r] = out_im[r] = NAN;
+            errors[r] = CALC_ERR_OUT_OF_MEMORY;
+        }
+        return;
+    }
+
+    int top = -1;
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        switch (instr->op) {
+            case OP_PUSH:
+            case OP_LOAD: {
+                double v = instr->op == OP_PUSH ? instr->value : symbol_value(instr->slot);
+                top++;
+                for (int r = 0; r < n; r++) {
+                    values_re[top][r] = v;
+                    values_im[top][r] = 0;
+                }
+                flag_block_errors(values_re[top], n, instr->op == OP_PUSH ? CALC_ERR_OVERFLOW : CALC_ERR_UNDEFINED_NAME,
+                                  errors);
+                continue;
+            }
+            case OP_PARAM:
+                top++;
+                memcpy(values_re[top], params_re[instr->slot], sizeof(double) * n);
+                memcpy(values_im[top], params_im[instr->slot], sizeof(double) * n);
+                continue;
+            case OP_CALL: {
+                top -= instr->arg_count - 1;
+                if (call_depth >= MAX_CALL_DEPTH) {
+                    for (int r = 0; r < n; r++) {
+                        values_re[top][r] = NAN;
+                    }
+                    flag_block_errors(values_re[top], n, CALC_ERR_STACK_OVERFLOW, errors);
+                    continue;
+                }
+                const double *args_re[MAX_FUNCTION_PARAMS];
+                const double *args_im[MAX_FUNCTION_PARAMS];
+                double result_re[COLUMN_BLOCK], result_im[COLUMN_BLOCK];
+                for (int k = 0; k < instr->arg_count; k++) {
+                    args_re[k] = values_re[top + k];
+                    args_im[k] = values_im[top + k];
+                }
+                run_program_complex_block(&symbol_at(instr->slot)->body, args_re, args_im, n, call_depth + 1,
+                                          result_re, result_im, errors);
+                memcpy(values_re[top], result_re, sizeof(double) * n);
+                memcpy(values_im[top], result_im, sizeof(double) * n);
+                continue;
+            }
+            case OP_BUILTIN: {
+                // Transcendental kernels don't vectorise; each row runs the scalar one
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                top -= fn->arity - 1;
+                for (int r = 0; r < n; r++) {
+                    Complex args[MAX_FUNCTION_PARAMS];
+                    for (int k = 0; k < fn->arity; k++) {
+                        args[k] = complex_make(values_re[top + k][r], values_im[top + k][r]);
+                    }
+                    CalcError error = fn->complex_kernel(args);
+                    if (error != CALC_OK && errors[r] == CALC_OK) {
+                        errors[r] = error;
+                    }
+                    values_re[top][r] = args[0].re;
+                    values_im[top][r] = args[0].im;
+                }
+                flag_complex_block_errors(values_re[top], values_im[top], n, CALC_ERR_OVERFLOW, errors);
+                continue;
+            }
+            case OP_NEG:
+                for (int r = 0; r < n; r++) {
+                    values_re[top][r] = -values_re[top][r];
+                    values_im[top][r] = -values_im[top][r];
+                }
+                continue;
+            default:
+                break;
+        }
+        top--;
+        double *a_re = values_re[top], *a_im = values_im[top];
+        const double *b_re = values_re[top + 1], *b_im = values_im[top + 1];
+        switch (instr->op) {
+            case OP_ADD:
+                for (int r = 0; r < n; r++) a_re[r] += b_re[r];
+                for (int r = 0; r < n; r++) a_im[r] += b_im[r];
+                break;
+            case OP_SUB:
+                for (int r = 0; r < n; r++) a_re[r] -= b_re[r];
+                for (int r = 0; r < n; r++) a_im[r] -= b_im[r];
+                break;
+            case OP_MUL:
+                complex_multiply_block(a_re, a_im, b_re, b_im, n);
+                break;
+            case OP_DIV:
+                complex_divide_block(a_re, a_im, b_re, b_im, n, errors);
+                break;
+            case OP_POW:
+                for (int r = 0; r < n; r++) {
+                    Complex args[2] = { complex_make(a_re[r], a_im[r]), complex_make(b_re[r], b_im[r]) };
+                    CalcError error = complex_power(args);
+                    if (error != CALC_OK && errors[r] == CALC_OK) {
+                        errors[r] = error;
+                    }
+                    a_re[r] = args[0].re;
+                    a_im[r] = args[0].im;
+                }
+                break;
+            default: break;
+        }
+        flag_complex_block_errors(a_re, a_im, n, CALC_ERR_OVERFLOW, errors);
+    }
+
+    for (int r = 0; r < n; r++) {
+        int ok = top >= 0 && errors[r] == CALC_OK;
+        out_re[r] = ok ? values_re[top][r] : (errors[r] == CALC_OK ? 0 : NAN);
+        out_im[r] = ok ? values_im[top][r] : (errors[r] == CALC_OK ? 0 : NAN);
+    }
+    free(values_re);
+    free(values_im);
+}
+
+void run_program_complex_columns(const CalcProgram *prog, const double *const *params_re,
+                                 const double *const *params_im, int param_count, long rows,
+                                 double *out_re, double *out_im, CalcError *errors) {
+    for (long start = 0; start < rows; start += COLUMN_BLOCK) {
+        int n = rows - start < COLUMN_BLOCK ? (int)(rows - start) : COLUMN_BLOCK;
+        const double *block_re[MAX_FUNCTION_PARAMS];
+        const double *block_im[MAX_FUNCTION_PARAMS];
+        for (int k = 0; k < param_count; k++) {
+            block_re[k] = params_re[k] + start;
+            block_im[k] = params_im[k] + start;
+        }
+        for (int r = 0; r < n; r++) {
+            errors[start + r] = CALC_OK;
+        }
+        run_program_complex_block(prog, block_re, block_im, n, 0, out_re + start, out_im + start, errors + start);
+    }
+}
+
+// Matrix evaluation. Programs are compiled with matrix literals enabled
+// (matrix_scope); numbers follow the usual double rules, so an expression
+// without a matrix evaluates exactly as it would in fast mode.
+const CompileScope matrix_scope = { NULL, 0, -1, 1, 0 };
+
+// Fails on the first element that is infinite or NaN
+CalcError matrix_check_finite(const MatrixValue *v) {
+    if (v->data == NULL) {
+        return isinf(v->number) ? CALC_ERR_OVERFLOW : CALC_OK;
+    }
+    for (int k = 0; k < v->rows * v->cols; k++) {
+        if (!isfinite(v->data[k])) {
+            return CALC_ERR_OVERFLOW;
+        }
+    }
+    return CALC_OK;
+}
+
+// a = a op b. Sums need equal shapes, products a number or matching inner
+// dimensions, and a matrix can only be divided by a number.
+CalcError matrix_binary(MatrixArena *arena, CalcOpcode op, MatrixValue *a, const MatrixValue *b) {
+    if (a->data == NULL && b->data == NULL) {
+        double args[2] = { a->number, b->number };
+        switch (op) {
+            case OP_ADD: a->number = args[0] + args[1]; break;
+            case OP_SUB: a->number = args[0] - args[1]; break;
+            case OP_MUL: a->number = args[0] * args[1]; break;
+            case OP_DIV:
+                if (args[1] == 0) {
+                    return CALC_ERR_DIVISION_BY_ZERO;
+                }
+                a->number = args[0] / args[1];
+                break;
+            case OP_POW: {
+                CalcError error = domain_power(args);
+                if (error != CALC_OK) {
+                    return error;
+                }
+                a->number = pow(args[0], args[1]);
+                break;
+            }
+            default: a->number = 0; break;
+        }
+        return CALC_OK;
+    }
+
+    MatrixValue c;
+    CalcError error = CALC_OK;
+    switch (op) {
+        case OP_ADD:
+        case OP_SUB:
+            if (a->data == NULL || b->data == NULL || a->rows != b->rows || a->cols != b->cols) {
+                return CALC_ERR_DIMENSION;
+            }
+            error = matrix_new(arena, a->rows, a->cols, &c);
+            if (error == CALC_OK) {
+                memcpy(c.data, a->data, sizeof(double) * c.rows * c.cols);
+                for (int i = 0; i < c.rows; i++) {
+                    matrix_axpy(c.data + (size_t)i * c.cols, b->data + (size_t)i * c.cols, op == OP_ADD ? 1 : -1,
+                                c.cols);
+                }
+            }
+            break;
+        case OP_MUL: {
+            if (a->data != NULL && b->data != NULL) {
+                error = matrix_product(arena, a, b, &c);
+                break;
+            }
+            // A number times a matrix, either way round
+            const MatrixValue *m = a->data != NULL ? a : b;
+            double scale = a->data != NULL ? b->number : a->number;
+            error = matrix_new(arena, m->rows, m->cols, &c);
+            for (int k = 0; error == CALC_OK && k < c.rows * c.cols; k++) {
+                c.data[k] = m->data[k] * scale;
+            }
+            break;
+        }
+        case OP_DIV:
+            if (a->data == NULL || b->data != NULL) {
+                return CALC_ERR_DIMENSION;
+            }
+            if (b->number == 0) {
+                return CALC_ERR_DIVISION_BY_ZERO;
+            }
+            error = matrix_new(arena, a->rows, a->cols, &c);
+            for (int k = 0; error == CALC_OK && k < c.rows * c.cols; k++) {
+                c.data[k] = a->data[k] / b->number;
+            }
+            break;
+        case OP_POW:
+            if (a->data == NULL || b->data != NULL) {
+                return CALC_ERR_DIMENSION;
+            }
+            c = *a;
+            error = matrix_power(arena, &c, b->number);
+            break;
+        default:
+            return CALC_ERR_DIMENSION;
+    }
+    if (error == CALC_OK) {
+        *a = c;
+    }
+    return error;
+}
+
+// Apply a built-in: numbers go through its scalar kernel, matrices through
+// its matrix kernel (built-ins without one only take numbers)
+CalcError matrix_apply_builtin(MatrixArena *arena, const BuiltinFunction *fn, MatrixValue *args) {
+    int numbers = 1;
+    for (int k = 0; k < fn->arity; k++) {
+        numbers = numbers && args[k].data == NULL;
+    }
+    if (!numbers) {
+        return fn->matrix_kernel != NULL ? fn->matrix_kernel(arena, args) : CALC_ERR_DIMENSION;
+    }
+    double xs[MAX_FUNCTION_PARAMS];
+    for (int k = 0; k < fn->arity; k++) {
+        xs[k] = args[k].number;
+    }
+    CalcError error = fn->domain != NULL ? fn->domain(xs) : CALC_OK;
+    if (error == CALC_OK) {
+        args[0] = matrix_number(fn->scalar(xs));
+    }
+    return error;
+}
+
+CalcError run_program_matrix_with(const CalcProgram *prog, MatrixArena *arena, const MatrixValue *params,
+                                  int call_depth, MatrixValue *out, int *error_offset) {
+    MatrixValue values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        CalcError error = CALC_OK;
+        switch (instr->op) {
+            case OP_PUSH:
+                values[++top] = matrix_number(instr->value);
+                continue;
+            case OP_LOAD:
+                if (isnan(symbol_value(instr->slot))) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_UNDEFINED_NAME;
+                }
+                values[++top] = matrix_number(symbol_value(instr->slot));
+                continue;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_MATRIX:
+                error = matrix_new(arena, instr->slot, instr->arg_count, &values[++top]);
+                values[top].filled = 0;
+                break;
+            case OP_ELEMENT: {
+                MatrixValue element = values[top--];
+                if (element.data != NULL) {
+                    error = CALC_ERR_DIMENSION; // Matrices don't nest
+                } else {
+                    values[top].data[values[top].filled++] = element.number;
+                }
+                break;
+            }
+            case OP_CALL:
+                if ((error = call_permitted(call_depth)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                top -= instr->arg_count - 1;
+                error = run_program_matrix_with(&symbol_at(instr->slot)->body, arena, &values[top], call_depth + 1,
+                                                &values[top], error_offset);
+                break;
+            case OP_BUILTIN: {
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                top -= fn->arity - 1;
+                error = matrix_apply_builtin(arena, fn, &values[top]);
+                break;
+            }
+            case OP_NEG:
+                if (values[top].data == NULL) {
+                    values[top].number = -values[top].number;
+                } else {
+                    MatrixValue minus_one = matrix_number(-1);
+                    error = matrix_binary(arena, OP_MUL, &values[top], &minus_one);
+                }
+                break;
+            default: {
+                MatrixValue b = values[top--];
+                error = matrix_binary(arena, instr->op, &values[top], &b);
+                break;
+            }
+        }
+        if (error == CALC_OK && instr->op != OP_MATRIX && instr->op != OP_ELEMENT) {
+            error = matrix_check_finite(&values[top]);
+        }
+        if (error != CALC_OK) {
+            *error_offset = instr->start; // Calls report the call site
+            return error;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : matrix_number(0);
+    return CALC_OK;
+}
+
+// Evaluate an expression that may contain matrix literals. The result's
+// elements live in the arena, which the caller releases once done with them.
+CalcError evaluate_expression_matrix(const char *expr, MatrixArena *arena, MatrixValue *out, int *error_offset) {
+    CalcProgram prog;
+    CalcError error = compile_expression_scoped(expr, &matrix_scope, &prog, error_offset);
+    if (error != CALC_OK) {
+        return error;
+    }
+    error = run_program_matrix_with(&prog, arena, NULL, 0, out, error_offset);
+    free_program(&prog);
+    return error;
+}
+
+// Programmer mode. Values are two's complement integers of programmer_width
+// bits that wrap around like C's fixed-width types. Each is held as a 64-bit
+// pattern already wrapped to the width (sign-extended when signed), so every
+// operator is a machine instruction plus a wrap, with no detour via double.
+const CompileScope programmer_scope = { NULL, 0, -1, 0, 1 };
+
+// Reduce a 64-bit result to the width: keep the low bits, then sign- or zero-extend
+static inline uint64_t programmer_wrap(uint64_t v) {
+    int shift = 64 - programmer_width;
+    return programmer_signed ? (uint64_t)((int64_t)(v << shift) >> shift) : (v << shift) >> shift;
+}
+
+// The value a pattern stands for, for built-ins and the decimal display
+static inline double programmer_to_double(uint64_t v) {
+    return programmer_signed ? (double)(int64_t)v : (double)v;
+}
+
+// Variables and built-in results come in as doubles, which must be whole
+// numbers that fit in 64 bits (signed or unsigned) before they are wrapped
+CalcError programmer_from_double(double v, uint64_t *out) {
+    if (v != floor(v)) {
+        return isnan(v) ? CALC_ERR_UNDEFINED_NAME : isinf(v) ? CALC_ERR_OVERFLOW : CALC_ERR_NOT_INTEGER;
+    }
+    if (v < -9223372036854775808.0 || v >= 18446744073709551616.0) {
+        return CALC_ERR_OVERFLOW;
+    }
+    *out = programmer_wrap(v < 0 ? (uint64_t)(int64_t)v : (uint64_t)v);
+    return CALC_OK;
+}
+
+// Shift by a count that may be negative (a shift the other way) or at least
+// the width, where everything is shifted out. Right shifts of signed values
+// are arithmetic, as the pattern is already sign-extended.
+static inline uint64_t programmer_shift(uint64_t v, uint64_t count, int left) {
+    if (programmer_signed && (int64_t)count < 0) {
+        count = 0 - count;
+        left = !left;
+    }
+    if (count >= 64) {
+        count = 64;
+    }
+    if (left) {
+        return count >= 64 ? 0 : v << count;
+    }
+    if (programmer_signed) {
+        return (uint64_t)((int64_t)v >> (count >= 64 ? 63 : count));
+    }
+    return count >= 64 ? 0 : v >> count;
+}
+
+// a^b modulo 2^64 by repeated squaring; the low bits of a product only depend
+// on the low bits of its factors, so wrapping once at the end is enough.
+// Negative exponents leave a fraction unless a is 1 or -1.
+CalcError programmer_power(uint64_t a, uint64_t b, uint64_t *out) {
+    if (programmer_signed && (int64_t)b < 0) {
+        if (a == 0) {
+            return CALC_ERR_DIVISION_BY_ZERO;
+        }
+        if (a != 1 && (int64_t)a != -1) {
+            return CALC_ERR_NOT_INTEGER;
+        }
+        *out = a == 1 || (b & 1) ? a : 1;
+        return CALC_OK;
+    }
+    uint64_t result = 1;
+    while (b > 0) {
+        if (b & 1) result *= a;
+        b >>= 1;
+        a *= a;
+    }
+    *out = result;
+    return CALC_OK;
+}
+
+// a = a op b, wrapped to the width
+static inline CalcError programmer_binary(CalcOpcode op, uint64_t *a, uint64_t b) {
+    uint64_t x = *a;
+    uint64_t result;
+    switch (op) {
+        case OP_ADD: result = x + b; break;
+        case OP_SUB: result = x - b; break;
+        case OP_MUL: result = x * b; break;
+        case OP_DIV:
+        case OP_MOD:
+            if (b == 0) {
+                return CALC_ERR_DIVISION_BY_ZERO;
+            }
+            if (!programmer_signed) {
+                result = op == OP_DIV ? x / b : x % b;
+            } else if ((int64_t)b == -1) {
+                result = op == OP_DIV ? 0 - x : 0; // The most negative value wraps to itself
+            } else {
+                result = op == OP_DIV ? (uint64_t)((int64_t)x / (int64_t)b) : (uint64_t)((int64_t)x % (int64_t)b);
+            }
+            break;
+        case OP_AND: result = x & b; break;
+        case OP_OR: result = x | b; break;
+        case OP_XOR: result = x ^ b; break;
+        case OP_SHL: result = programmer_shift(x, b, 1); break;
+        case OP_SHR: result = programmer_shift(x, b, 0); break;
+        case OP_POW: {
+            CalcError error = programmer_power(x, b, &result);
+            if (error != CALC_OK) {
+                return error;
+            }
+            break;
+        }
+        default: return CALC_ERR_INVALID_CHARACTER;
+    }
+    *a = programmer_wrap(result);
+    return CALC_OK;
+}
+
+// Run a program on fixed-width integers. User function bodies are compiled
+// as ordinary expressions and run here too, so their / divides integers.
+CalcError run_program_programmer_with(const CalcProgram *prog, const uint64_t *params, int call_depth,
+                                      uint64_t *out, int *error_offset) {
+    uint64_t values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        CalcError error = CALC_OK;
+        switch (instr->op) {
+            case OP_PUSH:
+                if (instr->slot) {
+                    values[++top] = programmer_wrap((uint64_t)instr->int_value);
+                } else {
+                    error = programmer_from_double(instr->value, &values[++top]);
+                }
+                break;
+            case OP_LOAD:
+                error = programmer_from_double(symbol_value(instr->slot), &values[++top]);
+                break;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                break;
+            case OP_CALL:
+                if ((error = call_permitted(call_depth)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                top -= instr->arg_count - 1;
+                error = run_program_programmer_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1,
+                                                    &values[top], error_offset);
+                break;
+            case OP_BUILTIN: {
+                // Built-ins are evaluated in floating point and must come back whole
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                double args[MAX_FUNCTION_PARAMS];
+                top -= fn->arity - 1;
+                for (int k = 0; k < fn->arity; k++) {
+                    args[k] = programmer_to_double(values[top + k]);
+                }
+                error = fn->domain != NULL ? fn->domain(args) : CALC_OK;
+                if (error == CALC_OK) {
+                    error = programmer_from_double(fn->scalar(args), &values[top]);
+                }
+                break;
+            }
+            case OP_NEG:
+                values[top] = programmer_wrap(0 - values[top]);
+                break;
+            case OP_NOT:
+                values[top] = programmer_wrap(~values[top]);
+                break;
+            case OP_MATRIX:
+            case OP_ELEMENT:
+                error = CALC_ERR_DIMENSION; // Not compiled in programmer scope
+                break;
+            default: {
+                uint64_t b = values[top--];
+                error = programmer_binary(instr->op, &values[top], b);
+                break;
+            }
+        }
+        if (error != CALC_OK) {
+            *error_offset = instr->start; // Calls report the call site
+            return error;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : 0;
+    return CALC_OK;
+}
+
+// Evaluate an expression in programmer mode. A lone literal, which is what
+// base conversion amounts to, is read directly without compiling.
+CalcError evaluate_expression_programmer(const char *expr, uint64_t *out, int *error_offset) {
+    int i = 0;
+    while (expr[i] == ' ' || expr[i] == '\t') {
+        i++;
+    }
+    uint64_t value;
+    int overflow;
+    int length = scan_radix_literal(expr + i, &value, &overflow);
+    if (length > 0 && !overflow) {
+        int end = i + length;
+        while (expr[end] == ' ' || expr[end] == '\t' || expr[end] == '\n') {
+            end++;
+        }
+        if (expr[end] == '\0') {
+            *out = programmer_wrap(value);
+            return CALC_OK;
+        }
+    }
+
+    CalcProgram prog;
+    CalcError error = compile_expression_scoped(expr, &programmer_scope, &prog, error_offset);
+    if (error != CALC_OK) {
+        return error;
+    }
+    error = run_program_programmer_with(&prog, NULL, 0, out, error_offset);
+    free_program(&prog);
+    return error;
+}
+
+// Digit tables for formatting: a pair of decimal digits or four binary digits
+// per lookup, so the loops below only branch on the number of digits
+const char decimal_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+const char hex_digit_chars[17] = "0123456789abcdef";
+const char binary_nibbles[16][4] = {
+    "0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+    "1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111",
+};
+
+// Write the digits of v in base 2, 8, 10 or 16 so they end just before end;
+// returns where they start. The number of digits comes from the highest set
+// bit (powers of two) or two digits per step (decimal).
+static inline char *format_radix_digits(uint64_t v, int base, char *end) {
+    char *p = end;
+    int bits = 64 - __builtin_clzll(v | 1);
+    switch (base) {
+        case 2:
+            // Whole nibbles, including the leading zeros of the top one, which are then skipped
+            for (int k = 0; k < bits; k += 4, v >>= 4) {
+                p -= 4;
+                memcpy(p, binary_nibbles[v & 15], 4);
+            }
+            return end - bits;
+        case 8:
+            for (int k = 0; k < bits; k += 3, v >>= 3) {
+                *--p = hex_digit_chars[v & 7];
+            }
+            return p;
+        case 16:
+            for (int k = 0; k < bits; k += 4, v >>= 4) {
+                *--p = hex_digit_chars[v & 15];
+            }
+            return p;
+        default:
+            while (v >= 100) {
+                uint64_t q = v / 100;
+                p -= 2;
+                memcpy(p, &decimal_digit_pairs[(v - q * 100) * 2], 2);
+                v = q;
+            }
+            if (v >= 10) {
+                p -= 2;
+                memcpy(p, &decimal_digit_pairs[v * 2], 2);
+            } else {
+                *--p = (char)('0' + v);
+            }
+            return p;
+    }
+}
+
+// Format a programmer mode value in base 2, 8, 10 or 16. Decimal shows the
+// signed or unsigned value; the other bases show the bits of the width behind
+// a 0b, 0o or 0x prefix, so -1 in 8 bits is 0xff. Returns the length written
+// (buf needs PROGRAMMER_FORMAT_SIZE bytes).
+#define PROGRAMMER_FORMAT_SIZE 72
+
+int format_programmer(uint64_t v, int base, char *buf) {
+    char digits[PROGRAMMER_FORMAT_SIZE];
+    char *end = digits + sizeof(digits);
+    char *start;
+    int length = 0;
+    if (base == 10) {
+        int negative = programmer_signed && (int64_t)v < 0;
+        start = format_radix_digits(negative ? 0 - v : v, 10, end);
+        buf[0] = '-';
+        length = negative;
+    } else {
+        uint64_t mask = ~0ULL >> (64 - programmer_width);
+        start = format_radix_digits(v & mask, base, end);
+        buf[0] = '0';
+        buf[1] = base == 16 ? 'x' : base == 8 ? 'o' : 'b';
+        length = 2;
+    }
+    memcpy(buf + length, start, end - start);
+    length += (int)(end - start);
+    buf[length] = '\0';
+    return length;
+}
+
+// Interval arithmetic with directed rounding.
+// An interval [lo, hi] is stored as the pair (-lo, hi) and every operation runs
+// with the FPU rounding upward, so rounding -lo up is rounding lo down and both
+// bounds move outward with a single packed instruction.
+#ifdef __SSE2__
+typedef __m128d Interval;
+
+static inline Interval interval_make(double neg_lo, double hi) {
+    return _mm_set_pd(hi, neg_lo);
+}
+
+static inline double interval_lo(Interval x) {
+    return -_mm_cvtsd_f64(x);
+}
+
+static inline double interval_hi(Interval x) {
+    return _mm_cvtsd_f64(_mm_unpackhi_pd(x, x));
+}
+
+static inline Interval interval_add(Interval a, Interval b) {
+    return _mm_add_pd(a, b);
+}
+
+static inline Interval interval_sub(Interval a, Interval b) {
+    // [a.lo - b.hi, a.hi - b.lo] = (-a.lo + b.hi, a.hi + -b.lo)
+    return _mm_add_pd(a, _mm_shuffle_pd(b, b, 1));
+}
+
+static inline Interval interval_neg(Interval a) {
+    // [-a.hi, -a.lo] = (a.hi, -a.lo): swapping the lanes is exact
+    return _mm_shuffle_pd(a, a, 1);
+}
+
+// Product or quotient from the endpoint combinations of a and b: each lane pair
+// (-u*v, u*v) is rounded up, so the lane-wise maximum gives (-lo, hi)
+static inline Interval interval_combine(Interval a, Interval b, int divide) {
+    const __m128d sign = _mm_set_pd(0.0, -0.0);
+    __m128d a_lo = _mm_unpacklo_pd(a, a);                  // (-a.lo, -a.lo)
+    __m128d a_hi = _mm_unpackhi_pd(a, a);                  // (a.hi, a.hi)
+    __m128d u_lo = _mm_xor_pd(a_lo, _mm_set_pd(-0.0, 0.0)); // (-a.lo, a.lo)
+    __m128d u_hi = _mm_xor_pd(a_hi, sign);                 // (-a.hi, a.hi)
+    __m128d b_lo = _mm_xor_pd(_mm_unpacklo_pd(b, b), _mm_set1_pd(-0.0)); // (b.lo, b.lo)
+    __m128d b_hi = _mm_unpackhi_pd(b, b);                  // (b.hi, b.hi)
+    if (divide) {
+        return _mm_max_pd(_mm_max_pd(_mm_div_pd(u_lo, b_lo), _mm_div_pd(u_lo, b_hi)),
+                          _mm_max_pd(_mm_div_pd(u_hi, b_lo), _mm_div_pd(u_hi, b_hi)));
+    }
+    return _mm_max_pd(_mm_max_pd(_mm_mul_pd(u_lo, b_lo), _mm_mul_pd(u_lo, b_hi)),
+                      _mm_max_pd(_mm_mul_pd(u_hi, b_lo), _mm_mul_pd(u_hi, b_hi)));
+}
+#else
+typedef struct {
+    double neg_lo;
+    double hi;
+} Interval;
+
+static inline Interval interval_make(double neg_lo, double hi) {
+    Interval x = { neg_lo, hi };
+    return x;
+}
+
+static inline double interval_lo(Interval x) {
+    return -x.neg_lo;
+}
+
+static inline double interval_hi(Interval x) {
+    return x.hi;
+}
+
+static inline Interval interval_add(Interval a, Interval b) {
+    return interval_make(a.neg_lo + b.neg_lo, a.hi + b.hi);
+}
+
+static inline Interval interval_sub(Interval a, Interval b) {
+    return interval_make(a.neg_lo + b.hi, a.hi + b.neg_lo);
+}
+
+static inline Interval interval_neg(Interval a) {
+    return interval_make(a.hi, a.neg_lo);
+}
+
+static inline Interval interval_combine(Interval a, Interval b, int divide) {
+    double u[2] = { -a.neg_lo, a.hi };
+    double v[2] = { -b.neg_lo, b.hi };
+    Interval r = interval_make(-INFINITY, -INFINITY);
+    for (int k = 0; k < 4; k++) {
+        double x = u[k >> 1], y = v[k & 1];
+        double up = divide ? x / y : x * y;
+        double down = divide ? -x / y : -x * y;
+        r.hi = fmax(r.hi, up);
+        r.neg_lo = fmax(r.neg_lo, down);
+    }
+    return r;
+}
+#endif
+
+// Bound a one-argument built-in over an interval from its values at the endpoints.
+// libm is not correctly rounded, so the bounds are widened by two ulps each way.
+// Past MAX_PERIODIC_ARGUMENT the peaks of sin and cos can no longer be placed
+// reliably with a double pi, so they bound to [-1, 1].
+#define MAX_PERIODIC_ARGUMENT 1048576.0
+#define GAMMA_RELATIVE_ERROR 1e-12
+
+Interval interval_builtin(const BuiltinFunction *fn, Interval x) {
+    double lo = interval_lo(x);
+    double hi = interval_hi(x);
+    double a, b;
+    switch (fn->bound) {
+        case BOUND_INCREASING:
+            a = fn->scalar(&lo);
+            b = fn->scalar(&hi);
+            break;
+        case BOUND_DECREASING:
+            a = fn->scalar(&hi);
+            b = fn->scalar(&lo);
+            break;
+        case BOUND_RECIPROCAL:
+            if (lo <= 0 && hi >= 0) {
+                return interval_make(INFINITY, INFINITY);
+            }
+            a = fn->scalar(&hi);
+            b = fn->scalar(&lo);
+            break;
+        case BOUND_SQUARE: {
+            double near = lo > 0 ? lo : (hi < 0 ? hi : 0);
+            double far = fabs(lo) > fabs(hi) ? lo : hi;
+            a = fn->scalar(&near);
+            b = fn->scalar(&far);
+            break;
+        }
+        case BOUND_PERIODIC: {
+            // cos(x) = sin(x + pi/2); sin peaks at pi/2 + 2k*pi and bottoms out at -pi/2 + 2k*pi
+            double shift = fn->scalar == builtin_cos ? M_PI / 2 : 0;
+            if (!(hi - lo < 2 * M_PI) || fabs(lo) > MAX_PERIODIC_ARGUMENT || fabs(hi) > MAX_PERIODIC_ARGUMENT) {
+                return interval_make(1.0, 1.0);
+            }
+            a = fn->scalar(&lo);
+            b = fn->scalar(&hi);
+            if (a > b) {
+                double t = a;
+                a = b;
+                b = t;
+            }
+            if (floor((hi + shift - M_PI / 2) / (2 * M_PI)) != floor((lo + shift - M_PI / 2) / (2 * M_PI))) {
+                b = 1.0; // A peak lies inside
+            }
+            if (floor((hi + shift + M_PI / 2) / (2 * M_PI)) != floor((lo + shift + M_PI / 2) / (2 * M_PI))) {
+                a = -1.0; // A trough lies inside
+            }
+            break;
+        }
+        case BOUND_BRANCHES:
+            if (fabs(lo) > MAX_PERIODIC_ARGUMENT || fabs(hi) > MAX_PERIODIC_ARGUMENT ||
+                floor((hi - M_PI / 2) / M_PI) != floor((lo - M_PI / 2) / M_PI)) {
+                return interval_make(INFINITY, INFINITY); // Interval may contain a pole
+            }
+            a = fn->scalar(&lo);
+            b = fn->scalar(&hi);
+            if (a > b) {
+                return interval_make(INFINITY, INFINITY); // Endpoint too close to a pole to tell
+            }
+            break;
+        case BOUND_GAMMA:
+            // gamma has its minimum near 1.46 and poles at the non-positive integers
+            if (lo < (fn->scalar == builtin_fact ? 1 : 2)) {
+                return interval_make(INFINITY, INFINITY);
+            }
+            // The Lanczos approximation is good to about 1e-13 relative, well short of two ulps
+            a = fn->scalar(&lo) * (1 - GAMMA_RELATIVE_ERROR);
+            b = fn->scalar(&hi) * (1 + GAMMA_RELATIVE_ERROR);
+            break;
+        default:
+            return interval_make(INFINITY, INFINITY);
+    }
+    if (isnan(a) || isnan(b)) {
+        return interval_make(INFINITY, INFINITY); // Interval leaves the domain
+    }
+    a = nextafter(nextafter(a, -INFINITY), -INFINITY);
+    b = nextafter(nextafter(b, INFINITY), INFINITY);
+    if (fn->bound == BOUND_PERIODIC) {
+        a = fmax(a, -1.0);
+        b = fmin(b, 1.0);
+    }
+    return interval_make(-a, b);
+}
+
+// Bound a^b when b is a single integer, by square-and-multiply (wider than
+// necessary for even powers of an interval containing zero). For a positive
+// base a^b is monotone in each argument, so any other exponent is bounded from
+// the four corners; otherwise it gives the whole line.
+#define MAX_INTERVAL_EXPONENT 1024
+
+Interval interval_power(Interval a, Interval b) {
+    double n = interval_hi(b);
+    if (interval_lo(b) != n || n != floor(n) || fabs(n) > MAX_INTERVAL_EXPONENT) {
+        if (!(interval_lo(a) > 0)) {
+            return interval_make(INFINITY, INFINITY);
+        }
+        double corners[4] = {
+            pow(interval_lo(a), interval_lo(b)), pow(interval_lo(a), interval_hi(b)),
+            pow(interval_hi(a), interval_lo(b)), pow(interval_hi(a), interval_hi(b))
+        };
+        double lo = fmin(fmin(corners[0], corners[1]), fmin(corners[2], corners[3]));
+        double hi = fmax(fmax(corners[0], corners[1]), fmax(corners[2], corners[3]));
+        if (isnan(lo) || isnan(hi)) {
+            return interval_make(INFINITY, INFINITY);
+        }
+        lo = nextafter(nextafter(lo, -INFINITY), -INFINITY);
+        hi = nextafter(nextafter(hi, INFINITY), INFINITY);
+        return interval_make(-lo, hi);
+    }
+    Interval one = interval_make(-1.0, 1.0);
+    Interval result = one;
+    for (int e = (int)fabs(n); e > 0; e >>= 1) {
+        if (e & 1) {
+            result = interval_combine(result, a, 0);
+        }
+        a = interval_combine(a, a, 0);
+    }
+    if (n < 0) {
+        if (interval_lo(result) <= 0 && interval_hi(result) >= 0) {
+            return interval_make(INFINITY, INFINITY); // Reciprocal of an interval containing zero
+        }
+        result = interval_combine(one, result, 1);
+    }
+    return result;
+}
+
+// Run a compiled program on intervals, bounding the exact real result.
+// Must be called with the FPU rounding upward.
+void run_program_interval_with(const CalcProgram *prog, const Interval *params, int call_depth, Interval *out) {
+    Interval values[MAX_EVAL_DEPTH];
+    int top = -1;
+    char literal[130];
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        switch (instr->op) {
+            case OP_PUSH:
+                if (instr->length > (int)sizeof(literal) - 2) {
+                    values[++top] = interval_make(-instr->value, instr->value);
+                    continue;
+                }
+                // Parse the literal rounded up, and its negation rounded up (= -lo)
+                literal[0] = '-';
+                memcpy(literal + 1, prog->source + instr->start, instr->length);
+                literal[instr->length + 1] = '\0';
+                values[++top] = interval_make(strtod(literal, NULL), strtod(literal + 1, NULL));
+                continue;
+            case OP_LOAD:
+                // Definitions give their bounds, so their rounding error is bounded too
+                if (symbol_at(instr->slot)->source != NULL) {
+                    const SymbolExact *exact = symbol_exact_at(instr->slot);
+                    values[++top] = interval_make(-exact->lo, exact->hi);
+                } else {
+                    double v = symbol_value(instr->slot);
+                    values[++top] = interval_make(-v, v);
+                }
+                continue;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_CALL:
+                top -= instr->arg_count - 1;
+                if (call_permitted(call_depth) == CALC_OK) {
+                    run_program_interval_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1, &values[top]);
+                } else {
+                    values[top] = interval_make(INFINITY, INFINITY);
+                }
+                continue;
+            case OP_BUILTIN:
+                top -= instr->arg_count - 1;
+                if (builtin_functions[instr->slot].bound == BOUND_POWER) {
+                    values[top] = interval_power(values[top], values[top + 1]);
+                } else {
+                    values[top] = interval_builtin(&builtin_functions[instr->slot], values[top]);
+                }
+                continue;
+            case OP_NEG:
+                values[top] = interval_neg(values[top]);
+                continue;
+            default:
+                break;
+        }
+        Interval b = values[top--];
+        Interval a = values[top];
+        switch (instr->op) {
+            case OP_ADD: values[top] = interval_add(a, b); break;
+            case OP_SUB: values[top] = interval_sub(a, b); break;
+            case OP_MUL: values[top] = interval_combine(a, b, 0); break;
+            case OP_DIV:
+                if (interval_lo(b) > 0 || interval_hi(b) < 0) {
+                    values[top] = interval_combine(a, b, 1);
+                } else {
+                    values[top] = interval_make(INFINITY, INFINITY); // Divisor contains zero
+                }
+                break;
+            case OP_POW:
+                values[top] = interval_power(a, b);
+                break;
+            default: values[top] = interval_make(0, 0); break;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : interval_make(0, 0);
+}
+
+// Needs -frounding-math (see the Makefile): without it GCC assumes the default
+// rounding mode and may constant-fold or move arithmetic across fesetround.
+int run_program_interval(const CalcProgram *prog, double *lo, double *hi) {
+    Interval bounds;
+    int saved_rounding = fegetround();
+    fesetround(FE_UPWARD);
+    run_program_interval_with(prog, NULL, 0, &bounds);
+    fesetround(saved_rounding);
+
+    *lo = interval_lo(bounds);
+    *hi = interval_hi(bounds);
+    return 1;
+}
+
+// Evaluate an expression on intervals, returning bounds on the exact result
+int evaluate_expression_interval(const char *expr, double *lo, double *hi) {
+    CalcProgram prog;
+    int offset;
+    if (compile_expression(expr, &prog, &offset) != CALC_OK) {
+        return 0;
+    }
+    run_program_interval(&prog, lo, hi);
+    free_program(&prog);
+    return 1;
+}
+
+// Convert a decimal literal from the source expression into an exact rational.
+// Every digit counts, so long literals are collected on the heap.
+CalcError literal_to_rational(const CalcInstr *instr, const char *expr, mpq_t out) {
+    char stack_digits[128];
+    char *digits = instr->length < (int)sizeof(stack_digits) ? stack_digits : malloc(instr->length + 1);
+    if (digits == NULL) {
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    int count = 0;
+    int fraction_digits = 0;
+    int in_fraction = 0;
+    int k = 0;
+    for (; k < instr->length && (expr[instr->start + k] | 0x20) != 'e'; k++) {
+        char c = expr[instr->start + k];
+        if (c == '.') {
+            in_fraction = 1;
+        } else {
+            digits[count++] = c;
+            fraction_digits += in_fraction;
+        }
+    }
+    digits[count] = '\0';
+    if (k < instr->length) {
+        fraction_digits -= atoi(expr + instr->start + k + 1); // The exponent moves the point
+    }
+
+    if (count == 0) {
+        mpq_set_ui(out, 0, 1);
+    } else {
+        mpz_set_str(mpq_numref(out), digits, 10);
+        if (fraction_digits < 0) {
+            mpz_t scale;
+            mpz_init(scale);
+            mpz_ui_pow_ui(scale, 10, -fraction_digits);
+            mpz_mul(mpq_numref(out), mpq_numref(out), scale);
+            mpz_clear(scale);
+            fraction_digits = 0;
+        }
+        mpz_ui_pow_ui(mpq_denref(out), 10, fraction_digits);
+        mpq_canonicalize(out);
+    }
+    if (digits != stack_digits) {
+        free(digits);
+    }
+    return CALC_OK;
+}
+
+// Largest power computed exactly, in bits of the result
+#define MAX_EXACT_POWER_BITS (1 << 20)
+
+// a = a^b: exact for integer exponents, otherwise on the nearest doubles like a built-in
+CalcError rational_power(mpq_t a, mpq_t b) {
+    if (mpz_cmp_ui(mpq_denref(b), 1) != 0 || !mpz_fits_slong_p(mpq_numref(b))) {
+        double args[2] = { mpq_get_d(a), mpq_get_d(b) };
+        CalcError error = domain_power(args);
+        double value = pow(args[0], args[1]);
+        if (error == CALC_OK && !isfinite(value)) {
+            error = CALC_ERR_OVERFLOW;
+        }
+        if (error == CALC_OK) {
+            mpq_set_d(a, value);
+        }
+        return error;
+    }
+    long n = mpz_get_si(mpq_numref(b));
+    if (mpq_sgn(a) == 0) {
+        if (n < 0) {
+            return CALC_ERR_DIVISION_BY_ZERO;
+        }
+        mpq_set_ui(a, n == 0, 1); // 0^0 = 1
+        return CALC_OK;
+    }
+    unsigned long e = n < 0 ? -(unsigned long)n : (unsigned long)n;
+    size_t bits = mpz_sizeinbase(mpq_numref(a), 2) + mpz_sizeinbase(mpq_denref(a), 2);
+    if (e > 0 && bits > MAX_EXACT_POWER_BITS / e) {
+        return CALC_ERR_OVERFLOW;
+    }
+    // Powers of a reduced fraction stay reduced
+    mpz_pow_ui(mpq_numref(a), mpq_numref(a), e);
+    mpz_pow_ui(mpq_denref(a), mpq_denref(a), e);
+    if (n < 0) {
+        mpq_inv(a, a);
+    }
+    return CALC_OK;
+}
+
+// Largest n whose factorial is computed exactly (about 1.5 million bits)
+#define MAX_EXACT_FACTORIAL 100000
+
+// Product of the odd numbers in (low, high]. The range is split in halves so
+// that the big multiplications are between numbers of similar size, which is
+// where GMP's subquadratic algorithms pay off.
+void odd_product(mpz_t out, unsigned long low, unsigned long high) {
+    if (high - low <= 32) {
+        mpz_set_ui(out, 1);
+        for (unsigned long k = low + 1 + (low & 1); k <= high; k += 2) {
+            mpz_mul_ui(out, out, k);
+        }
+        return;
+    }
+    unsigned long mid = low + (high - low) / 2;
+    mpz_t upper;
+    mpz_init(upper);
+    odd_product(out, low, mid);
+    odd_product(upper, mid, high);
+    mpz_mul(out, out, upper);
+    mpz_clear(upper);
+}
+
+// n! by splitting off its power of two: n! = 2^(n - popcount(n)) times the
+// product over k >= 0 of the odd numbers up to n / 2^k. Walking k downward,
+// each level's odd product extends the one above it by the odd numbers in
+// (n / 2^(k+1), n / 2^k], so every odd factor is multiplied in once and then
+// squared up through the levels instead of being multiplied in repeatedly.
+void exact_factorial(mpz_t out, unsigned long n) {
+    mpz_t level, part;
+    mpz_inits(level, part, NULL);
+    mpz_set_ui(level, 1);
+    mpz_set_ui(out, 1);
+    for (int k = n > 0 ? 63 - __builtin_clzll(n) : 0; k >= 0; k--) {
+        odd_product(part, n >> (k + 1), n >> k);
+        mpz_mul(level, level, part);
+        mpz_mul(out, out, level);
+    }
+    mpz_mul_2exp(out, out, n - __builtin_popcountl(n));
+    mpz_clears(level, part, NULL);
+}
+
+// Run a compiled program using exact rational arithmetic
+CalcError run_program_rational_with(const CalcProgram *prog, mpq_t *params, int call_depth,
+                                    mpq_t out, int *error_offset) {
+    mpq_t values[MAX_EVAL_DEPTH];
+    int top = -1;
+    int initialized = 0;
+    CalcError error = CALC_OK;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        if (instr->op == OP_PUSH || instr->op == OP_LOAD || instr->op == OP_PARAM) {
+            top++;
+            if (top >= initialized) {
+                mpq_init(values[initialized++]);
+            }
+        }
+        switch (instr->op) {
+            case OP_PUSH:
+                if ((error = literal_to_rational(instr, prog->source, values[top])) != CALC_OK) {
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                continue;
+            case OP_LOAD:
+                // Definitions give their exact value so "rate = 0.07" stays exact
+                if (symbol_at(instr->slot)->source != NULL) {
+                    const SymbolExact *exact = symbol_exact_at(instr->slot);
+                    if ((error = exact->rational_error) != CALC_OK) {
+                        *error_offset = instr->start;
+                        goto done;
+                    }
+                    mpq_set(values[top], exact->rational);
+                } else {
+                    mpq_set_d(values[top], symbol_value(instr->slot));
+                }
+                continue;
+            case OP_PARAM:
+                mpq_set(values[top], params[instr->slot]);
+                continue;
+            case OP_CALL: {
+                if ((error = call_permitted(call_depth)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                top -= instr->arg_count - 1;
+                while (top >= initialized) {
+                    mpq_init(values[initialized++]); // Zero-argument call
+                }
+                mpq_t call_result;
+                mpq_init(call_result);
+                error = run_program_rational_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1,
+                                                  call_result, error_offset);
+                mpq_swap(values[top], call_result);
+                mpq_clear(call_result);
+                if (error != CALC_OK) {
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                continue;
+            }
+            case OP_BUILTIN: {
+                // Built-ins have no exact form; evaluate them on the nearest doubles
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                double args[MAX_FUNCTION_PARAMS];
+                top -= fn->arity - 1;
+                // except factorials of whole numbers, which are computed exactly
+                if (fn->scalar == builtin_fact && mpz_cmp_ui(mpq_denref(values[top]), 1) == 0 &&
+                    mpq_sgn(values[top]) >= 0) {
+                    if (mpz_cmp_ui(mpq_numref(values[top]), MAX_EXACT_FACTORIAL) > 0) {
+                        error = CALC_ERR_OVERFLOW;
+                        *error_offset = instr->start;
+                        goto done;
+                    }
+                    exact_factorial(mpq_numref(values[top]), mpz_get_ui(mpq_numref(values[top])));
+                    continue;
+                }
+                for (int k = 0; k < fn->arity; k++) {
+                    args[k] = mpq_get_d(values[top + k]);
+                }
+                error = fn->domain != NULL ? fn->domain(args) : CALC_OK;
+                double value = fn->scalar(args);
+                if (error == CALC_OK && !isfinite(value)) {
+                    error = CALC_ERR_OVERFLOW;
+                }
+                if (error != CALC_OK) {
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                mpq_set_d(values[top], value);
+                continue;
+            }
+            case OP_NEG:
+                mpq_neg(values[top], values[top]);
+                continue;
+            default:
+                break;
+        }
+        mpq_ptr b = values[top--];
+        mpq_ptr a = values[top];
+        switch (instr->op) {
+            case OP_ADD: mpq_add(a, a, b); break;
+            case OP_SUB: mpq_sub(a, a, b); break;
+            case OP_MUL: mpq_mul(a, a, b); break;
+            case OP_DIV:
+                if (mpq_sgn(b) == 0) {
+                    error = CALC_ERR_DIVISION_BY_ZERO;
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                mpq_div(a, a, b);
+                break;
+            case OP_POW:
+                if ((error = rational_power(a, b)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    goto done;
+                }
+                break;
+            default: mpq_set_ui(a, 0, 1); break;
+        }
+    }
+
+    if (top >= 0) {
+        mpq_set(out, values[top]);
+    } else {
+        mpq_set_ui(out, 0, 1);
+    }
+
+done:
+    for (int k = 0; k < initialized; k++) {
+        mpq_clear(values[k]);
+    }
+    return error;
+}
+
+CalcError run_program_rational(const CalcProgram *prog, mpq_t out, int *error_offset) {
+    return run_program_rational_with(prog, NULL, 0, out, error_offset);
+}
+
+// Longest fraction printed in full when a rational has a terminating decimal expansion
+#define MAX_EXACT_FRACTION_DIGITS 100
+
+// Format a rational as a decimal string: exact when the expansion terminates,
+// otherwise rounded half away from zero to the given number of places
+int format_rational(mpq_t value, int precision, char *buf, size_t size) {
+    mpz_t rest, scaled, twice_den;
+    mpz_inits(rest, scaled, twice_den, NULL);
+
+    // A reduced fraction terminates iff its denominator is 2^a * 5^b
+    mpz_set(rest, mpq_denref(value));
+    mp_bitcnt_t twos = mpz_scan1(rest, 0);
+    mpz_tdiv_q_2exp(rest, rest, twos);
+    mpz_t five;
+    mpz_init_set_ui(five, 5);
+    mp_bitcnt_t fives = mpz_remove(rest, rest, five);
+    mpz_clear(five);
+
+    int places = precision;
+    if (mpz_cmp_ui(rest, 1) == 0) {
+        int exact_places = (int)(twos > fives ? twos : fives);
+        if (exact_places <= MAX_EXACT_FRACTION_DIGITS) {
+            places = exact_places;
+        }
+    }
+
+    // scaled = round(|num| * 10^places / den)
+    mpz_ui_pow_ui(scaled, 10, places);
+    mpz_mul(scaled, scaled, mpq_numref(value));
+    mpz_abs(scaled, scaled);
+    mpz_mul_2exp(scaled, scaled, 1);
+    mpz_add(scaled, scaled, mpq_denref(value));
+    mpz_mul_2exp(twice_den, mpq_denref(value), 1);
+    mpz_fdiv_q(scaled, scaled, twice_den);
+
+    char *digits = mpz_get_str(NULL, 10, scaled);
+    size_t len = strlen(digits);
+    int negative = mpq_sgn(value) < 0 && mpz_sgn(scaled) != 0;
+    size_t int_len = len > (size_t)places ? len - places : 1;
+    size_t needed = negative + int_len + (places > 0 ? 1 + places : 0);
+
+    int ok = needed < size;
+    if (ok) {
+        char *p = buf;
+        if (negative) {
+            *p++ = '-';
+        }
+        if (len > (size_t)places) {
+            memcpy(p, digits, int_len);
+            p += int_len;
+        } else {
+            *p++ = '0';
+        }
+        if (places > 0) {
+            *p++ = '.';
+            for (size_t k = len; k < (size_t)places; k++) {
+                *p++ = '0'; // Leading zeros of the fraction
+            }
+            size_t frac_len = len > (size_t)places ? (size_t)places : len;
+            memcpy(p, digits + len - frac_len, frac_len);
+            p += frac_len;
+        }
+        *p = '\0';
+    }
+
+    void (*free_func)(void *, size_t);
+    mp_get_memory_functions(NULL, NULL, &free_func);
+    free_func(digits, len + 1);
+    mpz_clears(rest, scaled, twice_den, NULL);
+    return ok;
+}
+
+// Is the exponent of the OP_POW at pc an integer literal, possibly negated?
+int power_has_integer_literal(const CalcProgram *prog, int pc) {
+    int k = pc - 1;
+    if (k > 0 && prog->code[k].op == OP_NEG) {
+        k--;
+    }
+    return k >= 0 && prog->code[k].op == OP_PUSH && prog->code[k].value == floor(prog->code[k].value);
+}
+
+// Is the OP_BUILTIN at pc the factorial of an integer literal, such as 10000!?
+int factorial_of_integer_literal(const CalcProgram *prog, int pc) {
+    return builtin_functions[prog->code[pc].slot].scalar == builtin_fact && pc > 0 &&
+           prog->code[pc - 1].op == OP_PUSH && prog->code[pc - 1].value == floor(prog->code[pc - 1].value);
+}
+
+// Does the program round, directly or through the definitions it uses? Built-in
+// functions do (except n! of an integer literal), and so do powers unless the
+// exponent is written as an integer.
+int program_rounds(const CalcProgram *prog, unsigned char *visited) {
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        if ((instr->op == OP_BUILTIN && !factorial_of_integer_literal(prog, pc)) ||
+            (instr->op == OP_POW && !power_has_integer_literal(prog, pc))) {
+            return 1;
+        }
+        if ((instr->op == OP_LOAD || instr->op == OP_CALL) && !visited[instr->slot] &&
+            symbol_at(instr->slot)->source != NULL) {
+            visited[instr->slot] = 1;
+            if (program_rounds(&symbol_at(instr->slot)->body, visited)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Evaluate in exact-arithmetic mode: stays on the hardware integer path when
+// the result is provably exact, otherwise falls back to big rationals.
+// Writes the decimal text to buf and the nearest double to the result value.
+CalcResult run_program_exact(const CalcProgram *prog, int precision, char *buf, size_t size) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    if (run_program_int64(prog, &res.int_value)) {
+        snprintf(buf, size, "%lld", res.int_value);
+        res.value = (double)res.int_value;
+        res.is_integer = 1;
+        return res;
+    }
+
+    // Rounded results (built-ins, fractional powers) are shown like fast mode does
+    unsigned char visited[MAX_SYMBOLS] = { 0 };
+    if (program_rounds(prog, visited)) {
+        buf[0] = '\0';
+        return run_program_result(prog);
+    }
+
+    mpq_t exact;
+    mpq_init(exact);
+    res.error = run_program_rational(prog, exact, &res.error_offset);
+    if (res.error == CALC_OK) {
+        res.value = mpq_get_d(exact);
+        if (!format_rational(exact, precision, buf, size)) {
+            // Too long for the display: fall back to scientific notation, which
+            // big floats give even beyond the range of a double (10000! = 2.846259e+35659)
+            mpf_t approx;
+            mpf_init2(approx, 64 + 4 * precision);
+            mpf_set_q(approx, exact);
+            gmp_snprintf(buf, size, "%.*Fe", precision, approx);
+            mpf_clear(approx);
+        }
+    }
+    mpq_clear(exact);
+    return res;
+}
+
+CalcResult evaluate_expression_exact(const char *expr, int precision, char *buf, size_t size) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    CalcProgram prog;
+    res.error = compile_expression(expr, &prog, &res.error_offset);
+    if (res.error != CALC_OK) {
+        return res;
+    }
+    res = run_program_exact(&prog, precision, buf, size);
+    free_program(&prog);
+    return res;
+}
+
+// A parsed "name = body" or "name(a, b) = body" line
+typedef struct {
+    char name[MAX_SYMBOL_NAME];
+    char params[MAX_FUNCTION_PARAMS][MAX_SYMBOL_NAME];
+    int param_count;
+    int is_function;
+    int body_offset; // Offset of the body in the line
+} CalcDefinition;
+
+// Parse a name at text[*pos] into dest, advancing *pos (returns 0 if there is none)
+int parse_name(const char *text, int *pos, char *dest) {
+    int start = *pos;
+    if (!is_name_start(text[start])) {
+        return 0;
+    }
+    int end = start;
+    while (is_name_char(text[end])) {
+        end++;
+    }
+    if (end - start >= MAX_SYMBOL_NAME) {
+        return 0;
+    }
+    memcpy(dest, text + start, end - start);
+    dest[end - start] = '\0';
+    *pos = end;
+    return 1;
+}
+
+// Parse a definition head ("name" or "name(a, b)") at the start of text.
+// Returns the offset just past the head and trailing spaces, or -1.
+int parse_definition_head(const char *text, CalcDefinition *def) {
+    int pos = 0;
+    memset(def, 0, sizeof(*def));
+    while (text[pos] == ' ') pos++;
+    if (!parse_name(text, &pos, def->name)) {
+        return -1;
+    }
+    while (text[pos] == ' ') pos++;
+
+    if (text[pos] == '(') {
+        def->is_function = 1;
+        pos++;
+        while (text[pos] == ' ') pos++;
+        while (text[pos] != ')') {
+            if (def->param_count >= MAX_FUNCTION_PARAMS ||
+                !parse_name(text, &pos, def->params[def->param_count])) {
+                return -1;
+            }
+            for (int k = 0; k < def->param_count; k++) {
+                if (strcmp(def->params[k], def->params[def->param_count]) == 0) {
+                    return -1; // Duplicate parameter
+                }
+            }
+            def->param_count++;
+            while (text[pos] == ' ') pos++;
+            if (text[pos] == ',') {
+                pos++;
+                while (text[pos] == ' ') pos++;
+            } else if (text[pos] != ')') {
+                return -1;
+            }
+        }
+        pos++;
+        while (text[pos] == ' ') pos++;
+    }
+    return pos;
+}
+
+// Recognize "head = body"; returns 1 and fills def if the line is a definition
+int parse_definition(const char *line, CalcDefinition *def) {
+    int pos = parse_definition_head(line, def);
+    if (pos < 0 || line[pos] != '=' || line[pos + 1] == '=') {
+        return 0;
+    }
+    def->body_offset = pos + 1;
+    return 1;
+}
+
+// Does the program use the given slot, directly or through the definitions it refers to?
+int program_references(const CalcProgram *prog, int target, unsigned char *visited) {
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        if (instr->op != OP_LOAD && instr->op != OP_CALL) {
+            continue;
+        }
+        if (instr->slot == target) {
+            return 1;
+        }
+        if (!visited[instr->slot] && symbol_at(instr->slot)->source != NULL) {
+            visited[instr->slot] = 1;
+            if (program_references(&symbol_at(instr->slot)->body, target, visited)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void refresh_symbol(int slot, unsigned char *dirty);
+
+// Bring every dirty variable read by a program (or the functions it calls) up to date
+void refresh_inputs(const CalcProgram *prog, unsigned char *dirty, unsigned char *visited) {
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        if (instr->op != OP_LOAD && instr->op != OP_CALL) {
+            continue;
+        }
+        if (dirty[instr->slot]) {
+            refresh_symbol(instr->slot, dirty);
+        } else if (instr->op == OP_CALL && !visited[instr->slot]) {
+            visited[instr->slot] = 1;
+            refresh_inputs(&symbol_at(instr->slot)->body, dirty, visited);
+        }
+    }
+}
+
+// Stage a defined variable's value, given the result of running its body, in
+// the form every evaluator reads (its inputs must be up to date)
+void symbol_store(int slot, CalcResult res) {
+    SymbolUpdate *update = symbol_update;
+    SymbolExact *exact = &update->exact[slot];
+    int offset;
+    update->values[slot] = res.error == CALC_OK ? res.value : NAN;
+    exact->has_int64 = res.error == CALC_OK && res.is_integer;
+    exact->int64 = res.int_value;
+    if (!exact->rational_ready) {
+        mpq_init(exact->rational);
+        exact->rational_ready = 1;
+    }
+    exact->rational_error = run_program_rational(&symbol_at(slot)->body, exact->rational, &offset);
+    run_program_interval(&symbol_at(slot)->body, &exact->lo, &exact->hi);
+    update->staged[slot] = 1;
+}
+
+// Recompute a cached variable after its own dirty inputs (topological order)
+void refresh_symbol(int slot, unsigned char *dirty) {
+    unsigned char visited[MAX_SYMBOLS] = { 0 };
+    dirty[slot] = 0;
+    refresh_inputs(&symbol_at(slot)->body, dirty, visited);
+    symbol_store(slot, run_program_result(&symbol_at(slot)->body));
+}
+
+// Re-evaluate only the cached variables that depend on a redefined symbol
+void refresh_dependents(int changed) {
+    unsigned char dirty[MAX_SYMBOLS] = { 0 };
+    for (int slot = 0; slot < symbol_count; slot++) {
+        const Symbol *sym = symbol_at(slot);
+        if (slot != changed && sym->kind == SYMBOL_VARIABLE && sym->source != NULL) {
+            unsigned char visited[MAX_SYMBOLS] = { 0 };
+            dirty[slot] = program_references(&sym->body, changed, visited);
+        }
+    }
+    for (int slot = 0; slot < symbol_count; slot++) {
+        if (dirty[slot]) {
+            refresh_symbol(slot, dirty);
+        }
+    }
+}
+
+// Main thread: check and compile a definition line into a new update, ready
+// for symbol_compute. Error offsets are relative to the line.
+CalcResult symbol_prepare(const char *line, const CalcDefinition *def, SymbolUpdate **out) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    int slot = find_symbol(def->name, (int)strlen(def->name));
+    SymbolKind kind = def->is_function ? SYMBOL_FUNCTION : SYMBOL_VARIABLE;
+
+    // Built-in names are reserved; redefinitions keep their slot, so they may not change shape
+    if (slot == ANS_SLOT || find_builtin(def->name, (int)strlen(def->name)) >= 0 || (slot >= 0 && (symbols[slot].kind != kind ||
+                                           symbols[slot].param_count != def->param_count))) {
+        res.error = CALC_ERR_INVALID_DEFINITION;
+        return res;
+    }
+    if (slot < 0 && symbol_count >= MAX_SYMBOLS) {
+        res.error = CALC_ERR_OUT_OF_MEMORY;
+        return res;
+    }
+
+    SymbolUpdate *update = calloc(1, sizeof(SymbolUpdate));
+    char *source = strdup(line + def->body_offset);
+    if (update == NULL || source == NULL) {
+        free(update);
+        free(source);
+        res.error = CALC_ERR_OUT_OF_MEMORY;
+        return res;
+    }
+    CalcProgram body;
+    CompileScope scope = { (char (*)[MAX_SYMBOL_NAME])def->params, def->param_count, -1, 0, 0 };
+    res.error = compile_expression_scoped(source, &scope, &body, &res.error_offset);
+    if (res.error == CALC_OK && slot >= 0) {
+        unsigned char visited[MAX_SYMBOLS] = { 0 };
+        if (program_references(&body, slot, visited)) {
+            res.error = CALC_ERR_CIRCULAR_DEFINITION;
+            res.error_offset = 0;
+        }
+    }
+    if (res.error != CALC_OK) {
+        res.error_offset += def->body_offset;
+        free_program(&body);
+        free(source);
+        free(update);
+        return res;
+    }
+
+    update->slot = slot >= 0 ? slot : symbol_count;
+    update->body_offset = def->body_offset;
+    Symbol *sym = &update->symbol;
+    strcpy(sym->name, def->name);
+    sym->kind = kind;
+    sym->param_count = def->param_count;
+    sym->source = source;
+    sym->body = body;
+    *out = update;
+    return res;
+}
+
+// Run a prepared definition on the calling thread, staging a variable's value
+// and the new values of everything that depends on the symbol. The thread goes
+// on reading the table through the update until its caller clears symbol_update.
+CalcResult symbol_compute(SymbolUpdate *update) {
+    CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+    symbol_update = update;
+    if (update->symbol.kind == SYMBOL_VARIABLE) {
+        res = run_program_result(&update->symbol.body);
+        if (res.error != CALC_OK) {
+            res.error_offset += update->body_offset;
+            return res;
+        }
+        symbol_store(update->slot, res);
+    }
+    refresh_dependents(update->slot);
+    return res;
+}
+
+// Free an update, with the definition it holds unless that was committed
+void symbol_update_free(SymbolUpdate *update) {
+    if (update->symbol.source != NULL) {
+        free_program(&update->symbol.body);
+        free(update->symbol.source);
+    }
+    for (int slot = 0; slot < MAX_SYMBOLS; slot++) {
+        if (update->exact[slot].rational_ready) {
+            mpq_clear(update->exact[slot].rational);
+        }
+    }
+    free(update);
+}
+
+// Main thread, between jobs: install a computed definition and the values it
+// changed, then free the update
+void symbol_commit(SymbolUpdate *update) {
+    int slot = update->slot;
+    if (slot == symbol_count) {
+        symbol_count++;
+    } else {
+        free_program(&symbols[slot].body);
+        free(symbols[slot].source);
+    }
+    symbols[slot] = update->symbol;
+    update->symbol.source = NULL; // The table owns the definition now
+    if (symbols[slot].kind == SYMBOL_FUNCTION) {
+        symbol_values[slot] = 0;
+    }
+
+    for (int k = 0; k < symbol_count; k++) {
+        if (!update->staged[k]) {
+            continue;
+        }
+        SymbolExact *exact = &symbol_exact[k];
+        const SymbolExact *staged = &update->exact[k];
+        symbol_values[k] = update->values[k];
+        exact->has_int64 = staged->has_int64;
+        exact->int64 = staged->int64;
+        if (!exact->rational_ready) {
+            mpq_init(exact->rational);
+            exact->rational_ready = 1;
+        }
+        mpq_swap(exact->rational, update->exact[k].rational); // The old value is freed with the update
+        exact->rational_error = staged->rational_error;
+        exact->lo = staged->lo;
+        exact->hi = staged->hi;
+    }
+    symbol_update_free(update);
+}
+
+// Define or redefine a variable or user function, all on the calling thread.
+// Variables return their new value; error offsets are relative to the line.
+CalcResult define_symbol(const char *line, const CalcDefinition *def) {
+    SymbolUpdate *update;
+    CalcResult res = symbol_prepare(line, def, &update);
+    if (res.error != CALC_OK) {
+        return res;
+    }
+    res = symbol_compute(update);
+    symbol_update = NULL;
+    if (res.error == CALC_OK) {
+        symbol_commit(update);
+    } else {
+        symbol_update_free(update);
+    }
+    return res;
+}
+
+// Evaluate one line of input: a definition or an expression.
+// *defined_function is set when the line defined a function (no value).
+CalcResult evaluate_line(const char *line, int *defined_function) {
+    CalcDefinition def;
+    *defined_function = 0;
+    CalcResult res;
+    if (parse_definition(line, &def)) {
+        *defined_function = def.is_function;
+        res = define_symbol(line, &def);
+    } else {
+        res = evaluate_expression_result(line);
+    }
+    if (res.error == CALC_OK && !*defined_function) {
+        symbol_values[ANS_SLOT] = res.value;
+    }
+    return res;
+}
+
+// Function plot: an expression in x drawn with Cairo beside the display.
+// Samples are placed adaptively (more where the curve bends), evaluated in
+// parallel column batches and cached across pan and zoom, so a view change only
+// evaluates the parts of the curve that were never sampled at that resolution.
+#define PLOT_BASE_SAMPLES 128      // Coarsest spacing: this many intervals per view
+#define PLOT_MAX_PASSES 10         // Refinement passes per view change
+#define PLOT_TOLERANCE 0.5         // Allowed bend between samples, in pixels
+#define PLOT_MAX_SAMPLES (1 << 18) // Cache size before it is rebuilt from scratch
+#define PLOT_PARALLEL_MIN 1024     // Smallest batch worth splitting across threads
+#define PLOT_MAX_THREADS 8
+
+typedef struct {
+    double x;
+    double y;
+    CalcError error;
+} PlotSample;
+
+typedef struct {
+    char expr[1024];
+    CalcProgram prog;
+    int has_program;
+    double x_min, x_max;  // Visible window
+    double y_min, y_max;
+    PlotSample *samples;  // Sorted by x and kept across pan/zoom
+    int count;
+    int capacity;
+    double covered_lo;    // x range the cache has been sampled over
+    double covered_hi;
+    int dragging;
+    double drag_x, drag_y;
+} PlotState;
+
+PlotState plot_state;
+GtkWidget *plot_area;
+
+typedef struct {
+    const CalcProgram *prog;
+    const double *x;
+    double *y;
+    CalcError *errors;
+    long rows;
+} PlotChunk;
+
+gpointer plot_chunk_worker(gpointer data) {
+    PlotChunk *chunk = data;
+    const double *columns[1] = { chunk->x };
+    run_program_columns(chunk->prog, columns, 1, chunk->rows, chunk->y, chunk->errors);
+    return NULL;
+}
+
+// Evaluate the plotted program at n points, splitting large batches across threads
+void plot_evaluate(const double *x, long n, double *y, CalcError *errors) {
+    if (n <= 0) {
+        return;
+    }
+    jit_note_rows(&plot_state.prog, n);
+    int threads = 1;
+    if (n >= PLOT_PARALLEL_MIN) {
+        threads = MAX(MIN((int)g_get_num_processors(), PLOT_MAX_THREADS), 1);
+    }
+    long per_thread = (n + threads - 1) / threads;
+    per_thread = (per_thread + COLUMN_BLOCK - 1) / COLUMN_BLOCK * COLUMN_BLOCK;
+
+    PlotChunk chunks[PLOT_MAX_THREADS];
+    GThread *workers[PLOT_MAX_THREADS];
+    int chunk_count = 0;
+    for (long start = 0; start < n; start += per_thread) {
+        chunks[chunk_count].prog = &plot_state.prog;
+        chunks[chunk_count].x = x + start;
+        chunks[chunk_count].y = y + start;
+        chunks[chunk_count].errors = errors + start;
+        chunks[chunk_count].rows = MIN(per_thread, n - start);
+        chunk_count++;
+    }
+
+    // The calling thread evaluates the first chunk itself
+    for (int t = 1; t < chunk_count; t++) {
+        workers[t] = g_thread_new("plot", plot_chunk_worker, &chunks[t]);
+    }
+    plot_chunk_worker(&chunks[0]);
+    for (int t = 1; t < chunk_count; t++) {
+        g_thread_join(workers[t]);
+    }
+}
+
+int plot_reserve(int needed) {
+    if (needed <= plot_state.capacity) {
+        return 1;
+    }
+    int new_capacity = MAX(plot_state.capacity * 2, needed);
+    PlotSample *grown = realloc(plot_state.samples, sizeof(PlotSample) * new_capacity);
+    if (grown == NULL) {
+        return 0;
+    }
+    plot_state.samples = grown;
+    plot_state.capacity = new_capacity;
+    return 1;
+}
+
+// Evaluate new x positions (sorted) and merge them into the sorted cache
+int plot_add_samples(const double *x, int n) {
+    if (n == 0) {
+        return 1;
+    }
+    double *y = malloc(sizeof(double) * n);
+    CalcError *errors = malloc(sizeof(CalcError) * n);
+    if (y == NULL || errors == NULL || !plot_reserve(plot_state.count + n)) {
+        free(y);
+        free(errors);
+        return 0;
+    }
+    plot_evaluate(x, n, y, errors);
+
+    // Merge from the back so the cache is updated in place
+    int i = plot_state.count - 1;
+    int j = n - 1;
+    for (int k = plot_state.count + n - 1; j >= 0; k--) {
+        if (i >= 0 && plot_state.samples[i].x > x[j]) {
+            plot_state.samples[k] = plot_state.samples[i--];
+        } else {
+            plot_state.samples[k].x = x[j];
+            plot_state.samples[k].y = y[j];
+            plot_state.samples[k].error = errors[j];
+            j--;
+        }
+    }
+    plot_state.count += n;
+    free(y);
+    free(errors);
+    return 1;
+}
+
+// Sample [from, to) uniformly with the given step
+int plot_sample_range(double from, double to, double step) {
+    int n = (int)ceil((to - from) / step);
+    if (n <= 0) {
+        return 1;
+    }
+    double *x = malloc(sizeof(double) * n);
+    if (x == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        x[i] = from + step * i;
+    }
+    int ok = plot_add_samples(x, n);
+    free(x);
+    return ok;
+}
+
+// How far sample i strays (in y units) from the line through its neighbours
+double plot_bend(int i) {
+    if (i <= 0 || i >= plot_state.count - 1) {
+        return 0;
+    }
+    const PlotSample *a = &plot_state.samples[i - 1];
+    const PlotSample *m = &plot_state.samples[i];
+    const PlotSample *b = &plot_state.samples[i + 1];
+    if (a->error != CALC_OK || m->error != CALC_OK || b->error != CALC_OK) {
+        return 0;
+    }
+    double t = (m->x - a->x) / (b->x - a->x);
+    return fabs(m->y - (a->y + (b->y - a->y) * t));
+}
+
+// Bring the sample cache up to date for the visible window at the given pixel size
+void plot_update_samples(int width, int height) {
+    if (!plot_state.has_program || width <= 0 || height <= 0) {
+        return;
+    }
+    double view = plot_state.x_max - plot_state.x_min;
+    double coarse_step = view / PLOT_BASE_SAMPLES;
+    double fine_step = view / width / 2; // Half a pixel
+    double tolerance = PLOT_TOLERANCE * (plot_state.y_max - plot_state.y_min) / height;
+
+    // Zooming far out makes the old cache useless; start again
+    if (plot_state.count > PLOT_MAX_SAMPLES) {
+        plot_state.count = 0;
+    }
+
+    // Extend the cached range to cover the window
+    if (plot_state.count == 0) {
+        plot_sample_range(plot_state.x_min, plot_state.x_max + coarse_step / 2, coarse_step);
+        plot_state.covered_lo = plot_state.x_min;
+        plot_state.covered_hi = plot_state.x_max;
+    } else {
+        if (plot_state.x_min < plot_state.covered_lo) {
+            plot_sample_range(plot_state.x_min, plot_state.covered_lo, coarse_step);
+            plot_state.covered_lo = plot_state.x_min;
+        }
+        if (plot_state.x_max > plot_state.covered_hi) {
+            double from = plot_state.samples[plot_state.count - 1].x + coarse_step;
+            plot_sample_range(from, plot_state.x_max + coarse_step / 2, coarse_step);
+            plot_state.covered_hi = plot_state.x_max;
+        }
+    }
+
+    // Split intervals that are too wide for this zoom or where the curve bends or breaks
+    double *mid = NULL;
+    for (int pass = 0; pass < PLOT_MAX_PASSES; pass++) {
+        int n = 0;
+        mid = realloc(mid, sizeof(double) * MAX(plot_state.count, 1));
+        if (mid == NULL) {
+            break;
+        }
+        for (int i = 0; i + 1 < plot_state.count; i++) {
+            const PlotSample *a = &plot_state.samples[i];
+            const PlotSample *b = &plot_state.samples[i + 1];
+            if (b->x < plot_state.x_min || a->x > plot_state.x_max) {
+                continue;
+            }
+            double dx = b->x - a->x;
+            int split = dx > coarse_step;
+            if (!split && dx > fine_step) {
+                split = a->error != b->error || plot_bend(i) > tolerance || plot_bend(i + 1) > tolerance;
+            }
+            if (split) {
+                mid[n++] = a->x + dx / 2;
+            }
+        }
+        if (n == 0 || plot_state.count + n > PLOT_MAX_SAMPLES || !plot_add_samples(mid, n)) {
+            break;
+        }
+    }
+    free(mid);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Fit the y range to the samples in view, ignoring the outer 2% on each side
+// so a pole doesn't flatten the rest of the curve
+void plot_fit_y(void) {
+    double lo = -1;
+    double hi = 1;
+    double *ys = malloc(sizeof(double) * MAX(plot_state.count, 1));
+    int n = 0;
+    for (int i = 0; ys != NULL && i < plot_state.count; i++) {
+        const PlotSample *s = &plot_state.samples[i];
+        if (s->error == CALC_OK && s->x >= plot_state.x_min && s->x <= plot_state.x_max) {
+            ys[n++] = s->y;
+        }
+    }
+    if (n > 0) {
+        qsort(ys, n, sizeof(double), compare_doubles);
+        lo = ys[n / 50];
+        hi = ys[n - 1 - n / 50];
+    }
+    free(ys);
+    if (hi - lo < 1e-12 * MAX(1, fabs(hi))) {
+        lo -= 1;
+        hi += 1;
+    }
+    double margin = (hi - lo) * 0.1;
+    plot_state.y_min = lo - margin;
+    plot_state.y_max = hi + margin;
+}
+
+// Plot an expression in x; returns 0 (leaving the old plot) if it doesn't compile
+int plot_set_expression(const char *expr) {
+    char params[1][MAX_SYMBOL_NAME] = { "x" };
+    CompileScope scope = { params, 1, -1, 0, 0 };
+    CalcProgram prog;
+    int offset;
+    if (compile_expression_scoped(expr, &scope, &prog, &offset) != CALC_OK) {
+        return 0;
+    }
+    if (plot_state.has_program) {
+        free_program(&plot_state.prog);
+    }
+    safe_strcpy(plot_state.expr, expr, sizeof(plot_state.expr));
+    plot_state.prog = prog;
+    plot_state.has_program = 1;
+    plot_state.count = 0;
+    plot_state.x_min = -10;
+    plot_state.x_max = 10;
+    plot_state.y_min = -1;
+    plot_state.y_max = 1;
+
+    int width = plot_area != NULL ? gtk_widget_get_allocated_width(plot_area) : 0;
+    int height = plot_area != NULL ? gtk_widget_get_allocated_height(plot_area) : 0;
+    plot_update_samples(MAX(width, 200), MAX(height, 100));
+    plot_fit_y();
+    return 1;
+}
+
+// Redraw after the window moved: sample what is missing, then repaint
+void plot_view_changed(void) {
+    plot_update_samples(gtk_widget_get_allocated_width(plot_area), gtk_widget_get_allocated_height(plot_area));
+    gtk_widget_queue_draw(plot_area);
+}
+
+// Index of the last sample left of the window (so the curve enters from the edge)
+int plot_first_visible(void) {
+    int lo = 0;
+    int hi = plot_state.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (plot_state.samples[mid].x < plot_state.x_min) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : 0;
+}
+
+void on_plot_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer data) {
+    (void)widget; (void)allocation; (void)data;
+    plot_view_changed();
+}
+
+gboolean on_plot_draw(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    (void)data;
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    cairo_set_source_rgb(cr, 1, 1, 1);
+    cairo_paint(cr);
+    if (!plot_state.has_program) {
+        return FALSE;
+    }
+
+    double x_scale = width / (plot_state.x_max - plot_state.x_min);
+    double y_scale = height / (plot_state.y_max - plot_state.y_min);
+
+    // Axes
+    cairo_set_source_rgb(cr, 0.75, 0.75, 0.75);
+    cairo_set_line_width(cr, 1);
+    if (plot_state.x_min < 0 && plot_state.x_max > 0) {
+        double px = -plot_state.x_min * x_scale;
+        cairo_move_to(cr, px, 0);
+        cairo_line_to(cr, px, height);
+    }
+    if (plot_state.y_min < 0 && plot_state.y_max > 0) {
+        double py = plot_state.y_max * y_scale;
+        cairo_move_to(cr, 0, py);
+        cairo_line_to(cr, width, py);
+    }
+    cairo_stroke(cr);
+
+    // Curve, broken at errors and at jumps taller than the view (asymptotes)
+    cairo_set_source_rgb(cr, 0x4A / 255.0, 0x90 / 255.0, 0xE2 / 255.0);
+    cairo_set_line_width(cr, 1.5);
+    int pen_down = 0;
+    double last_py = 0;
+    for (int i = plot_first_visible(); i < plot_state.count; i++) {
+        const PlotSample *s = &plot_state.samples[i];
+        if (s->error != CALC_OK) {
+            pen_down = 0;
+            continue;
+        }
+        double px = (s->x - plot_state.x_min) * x_scale;
+        double py = (plot_state.y_max - s->y) * y_scale;
+        py = MAX(-height, MIN(2.0 * height, py)); // Keep Cairo coordinates sane
+        if (pen_down && fabs(py - last_py) < height) {
+            cairo_line_to(cr, px, py);
+        } else {
+            cairo_move_to(cr, px, py);
+        }
+        pen_down = 1;
+        last_py = py;
+        if (s->x > plot_state.x_max) {
+            break;
+        }
+    }
+    cairo_stroke(cr);
+
+    cairo_set_source_rgb(cr, 0.3, 0.3, 0.3);
+    cairo_set_font_size(cr, 11);
+    cairo_move_to(cr, 4, 14);
+    cairo_show_text(cr, plot_state.expr);
+    return FALSE;
+}
+
+// Scroll zooms around the pointer
+gboolean on_plot_scroll(GtkWidget *widget, GdkEventScroll *event, gpointer data) {
+    (void)data;
+    double factor;
+    if (event->direction == GDK_SCROLL_UP) {
+        factor = 0.8;
+    } else if (event->direction == GDK_SCROLL_DOWN) {
+        factor = 1.25;
+    } else if (event->direction == GDK_SCROLL_SMOOTH && event->delta_y != 0) {
+        factor = pow(1.25, event->delta_y);
+    } else {
+        return FALSE;
+    }
+    int width = gtk_widget_get_allocated_width(widget);
+    int height = gtk_widget_get_allocated_height(widget);
+    double cx = plot_state.x_min + (plot_state.x_max - plot_state.x_min) * event->x / width;
+    double cy = plot_state.y_max - (plot_state.y_max - plot_state.y_min) * event->y / height;
+    plot_state.x_min = cx + (plot_state.x_min - cx) * factor;
+    plot_state.x_max = cx + (plot_state.x_max - cx) * factor;
+    plot_state.y_min = cy + (plot_state.y_min - cy) * factor;
+    plot_state.y_max = cy + (plot_state.y_max - cy) * factor;
+    plot_view_changed();
+    return TRUE;
+}
+
+// Dragging pans the view
+gboolean on_plot_button(GtkWidget *widget, GdkEventButton *event, gpointer data) {
+    (void)widget; (void)data;
+    if (event->button != 1) {
+        return FALSE;
+    }
+    plot_state.dragging = event->type == GDK_BUTTON_PRESS;
+    plot_state.drag_x = event->x;
+    plot_state.drag_y = event->y;
+    return TRUE;
+}
+
+gboolean on_plot_motion(GtkWidget *widget, GdkEventMotion *event, gpointer data) {
+    (void)data;
+    if (!plot_state.dragging) {
+        return FALSE;
+    }
+    double dx = (event->x - plot_state.drag_x) * (plot_state.x_max - plot_state.x_min) /
+                gtk_widget_get_allocated_width(widget);
+    double dy = (event->y - plot_state.drag_y) * (plot_state.y_max - plot_state.y_min) /
+                gtk_widget_get_allocated_height(widget);
+    plot_state.x_min -= dx;
+    plot_state.x_max -= dx;
+    plot_state.y_min += dy;
+    plot_state.y_max += dy;
+    plot_state.drag_x = event->x;
+    plot_state.drag_y = event->y;
+    plot_view_changed();
+    return TRUE;
+}
+
+// Write the visible samples as CSV (x, y, error)
+int plot_export_table(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return 0;
+    }
+    fprintf(out, "x,y,error\n");
+    for (int i = 0; i < plot_state.count; i++) {
+        const PlotSample *s = &plot_state.samples[i];
+        if (s->x < plot_state.x_min || s->x > plot_state.x_max) {
+            continue;
+        }
+        if (s->error == CALC_OK) {
+            fprintf(out, "%.17g,%.17g,\n", s->x, s->y);
+        } else {
+            fprintf(out, "%.17g,,\"%s\"\n", s->x, calc_error_message(s->error));
+        }
+    }
+    return fclose(out) == 0;
+}
+
+void on_export_table_clicked(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    GtkWidget *window = GTK_WIDGET(user_data);
+    if (!plot_state.has_program) {
+        append_to_history("No plot to export");
+        return;
+    }
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Export Table", GTK_WINDOW(window),
+                                                    GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL,
+                                                    "_Save", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "table.csv");
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        gchar *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        if (!plot_export_table(path)) {
+            append_to_history("Could not write table");
+        }
+        g_free(path);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+void update_plot_menu_labels() {
+    gtk_menu_item_set_label(GTK_MENU_ITEM(plot_hidden),
+        !show_plot ? "<span foreground=\"#4A90E2\">Hidden</span>" : "Hidden");
+    gtk_menu_item_set_label(GTK_MENU_ITEM(plot_beside),
+        show_plot ? "<span foreground=\"#4A90E2\">Beside display</span>" : "Beside display");
+}
+
+void set_plot_visible(int visible) {
+    if (show_plot != visible) {
+        show_plot = visible;
+        update_plot_menu_labels();
+        g_idle_add(save_settings_idle, NULL);
+    }
+    gtk_widget_set_visible(plot_area, show_plot);
+}
+
+void on_plot_visibility_changed(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    set_plot_visible(GPOINTER_TO_INT(user_data));
+}
+
+// History export and import. Jobs run on a worker thread so large histories
+// don't freeze the window; the main thread polls their progress and applies
+// the result. Export walks entries that are never modified once linked, so the
+// worker can read them while the user keeps calculating.
+#define HISTORY_BINARY_MAGIC "CALCHIST" // Followed by a version byte
+#define HISTORY_BINARY_VERSION 1
+#define HISTORY_MAX_LINE 65536           // Longest entry accepted on import
+#define HISTORY_PROGRESS_INTERVAL 100    // Milliseconds between progress updates
+
+typedef enum {
+    HISTORY_CSV,    // entry,value with a header row
+    HISTORY_JSONL,  // {"entry": "...", "value": 5} per line
+    HISTORY_BINARY  // Magic, then per entry: double value, uint32 length, text
+} HistoryFormat;
+
+typedef struct {
+    char *path;
+    HistoryFormat format;
+    int importing;
+    GThread *thread;
+    gint progress;   // Per mille, written by the worker
+    gint cancelled;  // Set by the main thread
+    gint finished;   // Set by the worker when it stops
+    HistoryEntry **entries; // Export: oldest first, kept alive by the job's reference
+    long entry_count;
+    HistoryEntry *top;      // Import: newest entry read so far
+    HistoryEntry *bottom;   // Import: oldest entry read, linked to the history when done
+    long line;              // Import: line (or record) being read
+    int ok;
+} HistoryJob;
+
+HistoryJob *history_job = NULL; // At most one at a time
+GtkWidget *history_progress_box, *history_progress_bar;
+
+HistoryFormat history_format_for_path(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot != NULL && (g_ascii_strcasecmp(dot, ".jsonl") == 0 || g_ascii_strcasecmp(dot, ".json") == 0)) {
+        return HISTORY_JSONL;
+    }
+    if (dot != NULL && g_ascii_strcasecmp(dot, ".calchist") == 0) {
+        return HISTORY_BINARY;
+    }
+    return HISTORY_CSV;
+}
+
+void history_set_progress(HistoryJob *job, long done, long total) {
+    g_atomic_int_set(&job->progress, total > 0 ? (gint)(done * 1000 / total) : 0);
+}
+
+void write_csv_field(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const char *c = text; *c; c++) {
+        if (*c == '"') {
+            fputc('"', out);
+        }
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+void write_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const char *c = text; *c; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch == '"' || ch == '\\') {
+            fputc('\\', out);
+            fputc(ch, out);
+        } else if (ch < 0x20) {
+            fprintf(out, "\\u%04x", ch);
+        } else {
+            fputc(ch, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Write the job's entries, oldest first
+int history_export(HistoryJob *job) {
+    FILE *out = fopen(job->path, job->format == HISTORY_BINARY ? "wb" : "w");
+    if (out == NULL) {
+        return 0;
+    }
+    if (job->format == HISTORY_CSV) {
+        fputs("entry,value\n", out);
+    } else if (job->format == HISTORY_BINARY) {
+        fputs(HISTORY_BINARY_MAGIC, out);
+        fputc(HISTORY_BINARY_VERSION, out);
+    }
+
+    for (long i = 0; i < job->entry_count && !g_atomic_int_get(&job->cancelled); i++) {
+        const HistoryEntry *entry = job->entries[i];
+        if (job->format == HISTORY_BINARY) {
+            uint32_t length = (uint32_t)strlen(entry->text);
+            fwrite(&entry->value, sizeof(entry->value), 1, out);
+            fwrite(&length, sizeof(length), 1, out);
+            fwrite(entry->text, 1, length, out);
+        } else if (job->format == HISTORY_JSONL) {
+            fputs("{\"entry\": ", out);
+            write_json_string(out, entry->text);
+            if (isnan(entry->value)) {
+                fputs(", \"value\": null}\n", out);
+            } else {
+                fprintf(out, ", \"value\": %.17g}\n", entry->value);
+            }
+        } else {
+            write_csv_field(out, entry->text);
+            if (isnan(entry->value)) {
+                fputs(",\n", out);
+            } else {
+                fprintf(out, ",%.17g\n", entry->value);
+            }
+        }
+        if ((i & 4095) == 0) {
+            history_set_progress(job, i, job->entry_count);
+        }
+    }
+    int ok = !ferror(out);
+    return fclose(out) == 0 && ok && !g_atomic_int_get(&job->cancelled);
+}
+
+// Add one imported entry on top of those read so far
+int history_import_entry(HistoryJob *job, const char *text, size_t length, double value) {
+    HistoryEntry *entry = history_link(job->top, text, length, value);
+    if (entry == NULL) {
+        return 0;
+    }
+    if (job->bottom == NULL) {
+        job->bottom = entry;
+    }
+    job->top = entry;
+    return 1;
+}
+
+// Parse a value field: empty or null means no value
+int parse_history_value(const char **pos, double *value) {
+    const char *p = *pos;
+    char *end;
+    *value = NAN;
+    if (strncmp(p, "null", 4) == 0) {
+        *pos = p + 4;
+        return 1;
+    }
+    if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '}' || *p == ',') {
+        return 1;
+    }
+    *value = parse_decimal(p, &end);
+    *pos = end;
+    return end != p;
+}
+
+// "entry","value": the entry is quoted with "" for a quote; returns the text length or -1
+long parse_csv_line(char *line, double *value) {
+    char *out = line;
+    const char *p = line;
+    if (*p++ != '"') {
+        return -1;
+    }
+    for (;; p++) {
+        if (*p == '\0') {
+            return -1;
+        }
+        if (*p == '"') {
+            if (p[1] != '"') {
+                break;
+            }
+            p++;
+        }
+        *out++ = *p;
+    }
+    long length = out - line;
+    p++;
+    if (*p++ != ',' || !parse_history_value(&p, value)) {
+        return -1;
+    }
+    return *p == '\0' || *p == '\n' || *p == '\r' ? length : -1;
+}
+
+// Decode a JSON string starting after its opening quote, in place; returns its end or NULL
+char *parse_json_string(char *p, char **out_end) {
+    char *out = p;
+    for (; *p != '"'; p++) {
+        if (*p == '\0') {
+            return NULL;
+        }
+        if (*p == '\\') {
+            p++;
+            switch (*p) {
+                case 'n': *out++ = '\n'; continue;
+                case 't': *out++ = '\t'; continue;
+                case 'r': *out++ = '\r'; continue;
+                case 'b': *out++ = '\b'; continue;
+                case 'f': *out++ = '\f'; continue;
+                case 'u': {
+                    unsigned code = 0;
+                    for (int k = 1; k <= 4; k++) {
+                        if (!g_ascii_isxdigit(p[k])) {
+                            return NULL;
+                        }
+                        code = code * 16 + g_ascii_xdigit_value(p[k]);
+                    }
+                    p += 4;
+                    *out++ = code < 0x80 ? (char)code : '?'; // History text is ASCII
+                    continue;
+                }
+                case '\0': return NULL;
+                default: *out++ = *p; continue; // \" \\ \/
+            }
+        }
+        *out++ = *p;
+    }
+    *out_end = out;
+    return p + 1;
+}
+
+static inline char *skip_json_space(char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+// {"entry": "...", "value": number or null}, keys in any order; returns the text length or -1
+long parse_jsonl_line(char *line, char **text, double *value) {
+    char *p = skip_json_space(line);
+    long length = -1;
+    *value = NAN;
+    if (*p++ != '{') {
+        return -1;
+    }
+    for (p = skip_json_space(p); *p != '}'; p = skip_json_space(p)) {
+        char *key_end;
+        if (*p++ != '"') {
+            return -1;
+        }
+        char *key = p;
+        if ((p = parse_json_string(p, &key_end)) == NULL) {
+            return -1;
+        }
+        p = skip_json_space(p);
+        if (*p++ != ':') {
+            return -1;
+        }
+        p = skip_json_space(p);
+        if (key_end - key == 5 && strncmp(key, "entry", 5) == 0) {
+            char *text_end;
+            if (*p++ != '"') {
+                return -1;
+            }
+            *text = p;
+            if ((p = parse_json_string(p, &text_end)) == NULL) {
+                return -1;
+            }
+            length = text_end - *text;
+        } else if (key_end - key == 5 && strncmp(key, "value", 5) == 0) {
+            if (!parse_history_value((const char **)&p, value)) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+        p = skip_json_space(p);
+        if (*p == ',') {
+            p++;
+        } else if (*p != '}') {
+            return -1;
+        }
+    }
+    return length;
+}
+
+int history_import_binary(HistoryJob *job, FILE *in, long size) {
+    char magic[sizeof(HISTORY_BINARY_MAGIC)];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+        memcmp(magic, HISTORY_BINARY_MAGIC, sizeof(magic) - 1) != 0 ||
+        magic[sizeof(magic) - 1] != HISTORY_BINARY_VERSION) {
+        return 0;
+    }
+    char *text = malloc(HISTORY_MAX_LINE);
+    if (text == NULL) {
+        return 0;
+    }
+    int ok = 1;
+    double value;
+    uint32_t length;
+    for (job->line = 1; ok && !g_atomic_int_get(&job->cancelled); job->line++) {
+        if (fread(&value, sizeof(value), 1, in) != 1) {
+            break; // End of file
+        }
+        ok = fread(&length, sizeof(length), 1, in) == 1 && length < HISTORY_MAX_LINE &&
+             fread(text, 1, length, in) == length && memchr(text, '\0', length) == NULL &&
+             history_import_entry(job, text, length, value);
+        if ((job->line & 4095) == 0) {
+            history_set_progress(job, ftell(in), size);
+        }
+    }
+    free(text);
+    return ok;
+}
+
+// Read entries into a list of their own, linked to the history when done
+int history_import(HistoryJob *job) {
+    FILE *in = fopen(job->path, job->format == HISTORY_BINARY ? "rb" : "r");
+    if (in == NULL) {
+        return 0;
+    }
+    long size = 0;
+    if (fseek(in, 0, SEEK_END) == 0) {
+        size = ftell(in);
+        rewind(in);
+    }
+    int ok = 1;
+    if (job->format == HISTORY_BINARY) {
+        ok = history_import_binary(job, in, size);
+    } else {
+        char *line = NULL;
+        size_t capacity = 0;
+        ssize_t read;
+        for (job->line = 1; ok && !g_atomic_int_get(&job->cancelled) &&
+                            (read = getline(&line, &capacity, in)) >= 0; job->line++) {
+            char *text = line;
+            double value;
+            long length;
+            if (read <= 1 || (job->line == 1 && job->format == HISTORY_CSV && strncmp(line, "entry,", 6) == 0)) {
+                continue; // Blank line or CSV header
+            }
+            if (job->format == HISTORY_CSV) {
+                length = parse_csv_line(line, &value);
+            } else {
+                length = parse_jsonl_line(line, &text, &value);
+            }
+            ok = length >= 0 && length < HISTORY_MAX_LINE && memchr(text, '\0', length) == NULL &&
+                 history_import_entry(job, text, length, value);
+            if ((job->line & 4095) == 0) {
+                history_set_progress(job, ftell(in), size);
+            }
+        }
+        free(line);
+    }
+    fclose(in);
+    return ok && !g_atomic_int_get(&job->cancelled);
+}
+
+gpointer history_job_worker(gpointer data) {
+    HistoryJob *job = data;
+    job->ok = job->importing ? history_import(job) : history_export(job);
+    g_atomic_int_set(&job->finished, 1);
+    return NULL;
+}
+
+// Main thread: show progress, and once the worker stops apply and report the result
+gboolean history_job_poll(gpointer data) {
+    HistoryJob *job = data;
+    if (!g_atomic_int_get(&job->finished)) {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(history_progress_bar),
+                                      g_atomic_int_get(&job->progress) / 1000.0);
+        return G_SOURCE_CONTINUE;
+    }
+    g_thread_join(job->thread);
+    gtk_widget_hide(history_progress_box);
+
+    char message[512];
+    long imported = job->top != NULL ? job->top->count : 0;
+    if (job->importing && job->ok && job->top != NULL) {
+        // Splice the imported list on top of the history in one step
+        long base = history != NULL ? history->count : 0;
+        for (HistoryEntry *entry = job->top; entry != NULL; entry = entry->older) {
+            entry->count += base;
+        }
+        job->bottom->older = history;
+        history = job->top;
+        job->top = NULL;
+    }
+    if (g_atomic_int_get(&job->cancelled)) {
+        snprintf(message, sizeof(message), "%s cancelled", job->importing ? "Import" : "Export");
+    } else if (!job->ok && job->importing) {
+        snprintf(message, sizeof(message), "Could not import %s (record %ld)", job->path, job->line);
+    } else if (!job->ok) {
+        snprintf(message, sizeof(message), "Could not export %s", job->path);
+    } else {
+        snprintf(message, sizeof(message), "%s %ld entries", job->importing ? "Imported" : "Exported",
+                 job->importing ? imported : job->entry_count);
+    }
+
+    history_release(job->top); // A failed or cancelled import is dropped
+    if (job->entry_count > 0) {
+        history_release(job->entries[job->entry_count - 1]);
+    }
+    free(job->entries);
+    g_free(job->path);
+    free(job);
+    history_job = NULL;
+    append_to_history(message);
+    return G_SOURCE_REMOVE;
+}
+
+void history_job_start(HistoryJob *job) {
+    history_job = job;
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(history_progress_bar), 0);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(history_progress_bar), job->importing ? "Importing" : "Exporting");
+    gtk_widget_show(history_progress_box);
+    job->thread = g_thread_new("history-io", history_job_worker, job);
+    g_timeout_add(HISTORY_PROGRESS_INTERVAL, history_job_poll, job);
+}
+
+// Ask for a file; returns a new job for it or NULL
+HistoryJob *history_job_new(GtkWidget *window, int importing) {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(importing ? "Import History" : "Export History", GTK_WINDOW(window),
+                                                    importing ? GTK_FILE_CHOOSER_ACTION_OPEN : GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL,
+                                                    importing ? "_Open" : "_Save", GTK_RESPONSE_ACCEPT, NULL);
+    if (!importing) {
+        gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+        gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "history.csv");
+    }
+    HistoryJob *job = NULL;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        job = calloc(1, sizeof(HistoryJob));
+        if (job != NULL) {
+            job->path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+            job->format = history_format_for_path(job->path);
+            job->importing = importing;
+        }
+    }
+    gtk_widget_destroy(dialog);
+    return job;
+}
+
+void on_history_export_clicked(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    if (history_job != NULL) {
+        return;
+    }
+    if (history == NULL) {
+        append_to_history("No history to export");
+        return;
+    }
+    HistoryJob *job = history_job_new(GTK_WIDGET(user_data), 0);
+    if (job == NULL) {
+        return;
+    }
+
+    // The job keeps the history as it is now, oldest entry first
+    job->entries = malloc(sizeof(HistoryEntry *) * history->count);
+    if (job->entries == NULL) {
+        g_free(job->path);
+        free(job);
+        append_to_history("Not enough memory to export");
+        return;
+    }
+    job->entry_count = history->count;
+    long i = job->entry_count;
+    for (HistoryEntry *entry = history; entry != NULL; entry = entry->older) {
+        job->entries[--i] = entry;
+    }
+    history_retain(history);
+    history_job_start(job);
+}
+
+void on_history_import_clicked(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    if (history_job != NULL) {
+        return;
+    }
+    HistoryJob *job = history_job_new(GTK_WIDGET(user_data), 1);
+    if (job != NULL) {
+        history_job_start(job);
+    }
+}
+
+void on_history_cancel_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    if (history_job != NULL) {
+        g_atomic_int_set(&history_job->cancelled, 1);
+    }
+}
+
+// Calculate appropriate precision for displaying a result
+int get_display_precision(double value) {
+    int display_precision = result_precision;
+    double abs_result = fabs(value);
+
+    // For numbers less than 1, use significant digit precision
+    if (abs_result < 1.0 && abs_result > 0.0) {
+        // Find how many decimal places needed for significant digits
+        double log_val = log10(abs_result);
+        int first_sig_digit_pos = -floor(log_val); // Position after decimal
+        display_precision = first_sig_digit_pos + (result_precision - 1);
+
+        // Cap at reasonable maximum to prevent excessive output
+        if (display_precision > 12) {
+            display_precision = 12;
+        }
+    }
+
+    return display_precision;
+}
+
+#define COMPLEX_DISPLAY_NOISE 1e-15 // Size of a part, relative to |z|, shown as zero
+
+// A number as the display shows it (every digit when precision is negative),
+// for the parts of complex numbers and the elements of matrices
+int format_display_number(double value, int precision, char *buf, size_t size) {
+    if (precision < 0) {
+        return snprintf(buf, size, "%.17g", value);
+    }
+    if (value == floor(value) && fabs(value) < EXACT_DOUBLE_LIMIT) {
+        return snprintf(buf, size, "%.0f", value);
+    }
+    return snprintf(buf, size, "%.*f", get_display_precision(value), value);
+}
+
+// Write z in "a + bi" form, dropping a zero part. A negative precision keeps
+// every digit; otherwise parts that are only rounding noise next to the other
+// (the imaginary part of exp(i * pi)) are shown as zero.
+void format_complex(Complex z, int precision, char *buf, size_t size) {
+    if (precision >= 0) {
+        double noise = complex_abs(z) * COMPLEX_DISPLAY_NOISE;
+        if (fabs(z.re) < noise) z.re = 0;
+        if (fabs(z.im) < noise) z.im = 0;
+    }
+    char re[64], im[64];
+    format_display_number(z.re, precision, re, sizeof(re));
+    format_display_number(fabs(z.im), precision, im, sizeof(im));
+    const char *unit = strcmp(im, "1") == 0 ? "" : im;
+    if (z.im == 0) {
+        snprintf(buf, size, "%s", re);
+    } else if (z.re == 0) {
+        snprintf(buf, size, "%s%si", z.im < 0 ? "-" : "", unit);
+    } else {
+        snprintf(buf, size, "%s %c %si", re, z.im < 0 ? '-' : '+', unit);
+    }
+}
+
+#define MATRIX_DISPLAY_ELEMENTS 64 // Larger results are shown by their shape
+
+// Append a matrix in the "[a, b; c, d]" form it is typed in. With a
+// non-negative precision, large matrices are summarised as "RxC matrix".
+void format_matrix(const MatrixValue *m, int precision, GString *out) {
+    char buf[64];
+    if (m->data == NULL) {
+        format_display_number(m->number, precision, buf, sizeof(buf));
+        g_string_append(out, buf);
+        return;
+    }
+    if (precision >= 0 && m->rows * m->cols > MATRIX_DISPLAY_ELEMENTS) {
+        g_string_append_printf(out, "%dx%d matrix", m->rows, m->cols);
+        return;
+    }
+    g_string_append_c(out, '[');
+    for (int i = 0; i < m->rows; i++) {
+        for (int j = 0; j < m->cols; j++) {
+            if (i > 0 || j > 0) {
+                g_string_append(out, j > 0 ? ", " : "; ");
+            }
+            format_display_number(m->data[(size_t)i * m->cols + j], precision, buf, sizeof(buf));
+            g_string_append(out, buf);
+        }
+    }
+    g_string_append_c(out, ']');
+}
+
+// Equation solver. "lhs = rhs" is compiled once as lhs - (rhs) with its one
+// undefined name as the parameter, and sampled on a grid that is fine near
+// zero and widens geometrically out to SOLVE_RANGE. Every sign change between
+// neighbouring samples brackets a root, refined by Newton steps on the exact
+// derivative from dual numbers and kept safe by bisection. Minima of |g|
+// that touch zero without a sign change, such as (x - 1)^2 = 0, are polished
+// by plain Newton. The grid is split across threads, each sampling and
+// refining its own brackets.
+#define SOLVE_HALF_SAMPLES 1024  // Samples on each side of zero
+#define SOLVE_RANGE 1e9          // Roots are searched for in [-SOLVE_RANGE, SOLVE_RANGE]
+#define SOLVE_MAX_ITERATIONS 100
+#define SOLVE_TOUCH_TOLERANCE 1e-12 // Largest |g| at a touching root, relative to its neighbours
+#define SOLVE_SNAP_DISTANCE 1e-6 // Relative distance from a whole number a root is snapped across
+#define SOLVE_MAX_ROOTS 8        // Roots listed; those nearest zero are kept
+#define SOLVE_MAX_THREADS 8
+
+typedef struct {
+    char unknown[MAX_SYMBOL_NAME];
+    double roots[SOLVE_MAX_ROOTS]; // Ascending
+    int count;
+    int more; // Further roots were found than listed
+} SolveResult;
+
+CalcError run_program_dual_with(const CalcProgram *prog, const Dual *params, int call_depth, Dual *out,
+                                int *error_offset) {
+    Dual values[MAX_EVAL_DEPTH];
+    int top = -1;
+
+    for (int pc = 0; pc < prog->count; pc++) {
+        const CalcInstr *instr = &prog->code[pc];
+        CalcError error = CALC_OK;
+        switch (instr->op) {
+            case OP_PUSH:
+                values[++top] = dual_make(instr->value, 0);
+                continue;
+            case OP_LOAD:
+                if (isnan(symbol_value(instr->slot))) {
+                    *error_offset = instr->start;
+                    return CALC_ERR_UNDEFINED_NAME;
+                }
+                values[++top] = dual_make(symbol_value(instr->slot), 0);
+                continue;
+            case OP_PARAM:
+                values[++top] = params[instr->slot];
+                continue;
+            case OP_CALL:
+                if ((error = call_permitted(call_depth)) != CALC_OK) {
+                    *error_offset = instr->start;
+                    return error;
+                }
+                top -= instr->arg_count - 1;
+                error = run_program_dual_with(&symbol_at(instr->slot)->body, &values[top], call_depth + 1, &values[top],
+                                              error_offset);
+                break;
+            case OP_BUILTIN: {
+                const BuiltinFunction *fn = &builtin_functions[instr->slot];
+                double args[MAX_FUNCTION_PARAMS];
+                top -= fn->arity - 1;
+                for (int k = 0; k < fn->arity; k++) {
+                    args[k] = values[top + k].value;
+                }
+                error = fn->domain != NULL ? fn->domain(args) : CALC_OK;
+                if (error == CALC_OK) {
+                    values[top] = fn->dual_kernel(&values[top]);
+                }
+                break;
+            }
+            case OP_NEG:
+                values[top] = dual_make(-values[top].value, -values[top].slope);
+                continue;
+            default: {
+                Dual b = values[top--];
+                Dual a = values[top];
+                switch (instr->op) {
+                    case OP_ADD: values[top] = dual_make(a.value + b.value, a.slope + b.slope); break;
+                    case OP_SUB: values[top] = dual_make(a.value - b.value, a.slope - b.slope); break;
+                    case OP_MUL: values[top] = dual_make(a.value * b.value, a.slope * b.value + a.value * b.slope); break;
+                    case OP_DIV:
+                        if (b.value == 0) {
+                            error = CALC_ERR_DIVISION_BY_ZERO;
+                        } else {
+                            double q = a.value / b.value;
+                            values[top] = dual_make(q, (a.slope - q * b.slope) / b.value);
+                        }
+                        break;
+                    case OP_POW: {
+                        double args[2] = { a.value, b.value };
+                        error = domain_power(args);
+                        if (error == CALC_OK) {
+                            Dual pair[2] = { a, b };
+                            values[top] = dual_builtin_pow(pair);
+                        }
+                        break;
+                    }
+                    default: values[top] = dual_make(0, 0); break;
+                }
+                break;
+            }
+        }
+        if (error == CALC_OK && isinf(values[top].value)) {
+            error = CALC_ERR_OVERFLOW;
+        }
+        if (error != CALC_OK) {
+            *error_offset = instr->start; // Calls report the call site
+            return error;
+        }
+    }
+
+    *out = top >= 0 ? values[top] : dual_make(0, 0);
+    return CALC_OK;
+}
+
+// g(x) and g'(x)
+CalcError solve_evaluate(const CalcProgram *prog, double x, Dual *out) {
+    Dual param = dual_make(x, 1);
+    int offset;
+    CalcError error = run_program_dual_with(prog, &param, 0, out, &offset);
+    if (error == CALC_OK && !isfinite(out->slope)) {
+        out->slope = 0; // A vertical tangent: leave the step to bisection
+    }
+    return error;
+}
+
+// Refine the root in [a, b], where g(a) and g(b) have opposite signs. Newton
+// steps are taken while they stay inside the bracket and at least halve it;
+// otherwise the bracket is bisected. A sign change at a pole (1/x) is not a
+// root: |g| grows there instead of vanishing, so such brackets are dropped.
+int solve_bracket(const CalcProgram *prog, double a, double ga, double b, double gb, double *root) {
+    double lo = ga < 0 ? a : b; // g(lo) < 0 < g(hi)
+    double hi = ga < 0 ? b : a;
+    double x = a + (b - a) / 2;
+    double step = fabs(b - a);
+    double last_step = step;
+    Dual g = dual_make(NAN, 0);
+    for (int iteration = 0; iteration < SOLVE_MAX_ITERATIONS; iteration++) {
+        if (evaluation_cancelled() || solve_evaluate(prog, x, &g) != CALC_OK) {
+            return 0;
+        }
+        if (g.value == 0) {
+            break;
+        }
+        if (g.value < 0) {
+            lo = x;
+        } else {
+            hi = x;
+        }
+        double next = x - g.value / g.slope;
+        double previous = x;
+        if (g.slope == 0 || !((next - lo) * (next - hi) < 0) || fabs(2 * g.value) > fabs(last_step * g.slope)) {
+            last_step = step;
+            x = lo + (hi - lo) / 2;
+        } else {
+            last_step = step;
+            x = next;
+        }
+        step = fabs(x - previous);
+        if (x == previous || fabs(hi - lo) <= 4 * DBL_EPSILON * fabs(x)) {
+            break;
+        }
+    }
+    if (!(fabs(g.value) <= fmin(fabs(ga), fabs(gb)))) {
+        return 0;
+    }
+    *root = x;
+    return 1;
+}
+
+// Polish a touching root from x, a local minimum of |g| between left and right
+int solve_touching(const CalcProgram *prog, double x, double left, double right, double scale, double *root) {
+    double best = x;
+    double best_value = INFINITY;
+    Dual g;
+    for (int iteration = 0; iteration < SOLVE_MAX_ITERATIONS; iteration++) {
+        if (evaluation_cancelled() || solve_evaluate(prog, x, &g) != CALC_OK) {
+            break;
+        }
+        if (fabs(g.value) < best_value) {
+            best = x;
+            best_value = fabs(g.value);
+        }
+        if (g.value == 0 || g.slope == 0) {
+            break;
+        }
+        double next = x - g.value / g.slope;
+        if (!(next > left && next < right) || next == x) {
+            break;
+        }
+        x = next;
+    }
+    if (best_value > SOLVE_TOUCH_TOLERANCE * scale) {
+        return 0;
+    }
+    *root = best;
+    return 1;
+}
+
+// A root near a whole number is taken as that number when g is at least as
+// small there, so x^2 - 5x + 6 = 0 gives 2 and 3. The distance allows for
+// multiple roots, which are only found to a fraction of the digits.
+double solve_snap(const CalcProgram *prog, double root) {
+    double whole = round(root);
+    Dual at_root, at_whole;
+    if (whole != root && fabs(root - whole) <= SOLVE_SNAP_DISTANCE * fmax(1, fabs(whole)) &&
+        solve_evaluate(prog, root, &at_root) == CALC_OK && solve_evaluate(prog, whole, &at_whole) == CALC_OK &&
+        fabs(at_whole.value) <= fabs(at_root.value)) {
+        root = whole;
+    }
+    return root + 0.0; // No -0
+}
+
+typedef struct {
+    const CalcProgram *prog;
+    const double *x; // The whole grid
+    double *g;
+    CalcError *errors;
+    int n;
+    int first;       // Samples [first, last] are this chunk's
+    int last;
+    int refine;      // Set once every sample is evaluated: look for roots
+    double *roots;
+    int count;
+    int capacity;
+    gint *cancel_flag; // The solving job's, passed on to the chunk's thread
+} SolveChunk;
+
+int solve_chunk_add(SolveChunk *chunk, double root) {
+    if (chunk->count == chunk->capacity) {
+        int capacity = chunk->capacity > 0 ? chunk->capacity * 2 : 16;
+        double *grown = realloc(chunk->roots, sizeof(double) * capacity);
+        if (grown == NULL) {
+            return 0;
+        }
+        chunk->roots = grown;
+        chunk->capacity = capacity;
+    }
+    chunk->roots[chunk->count++] = root;
+    return 1;
+}
+
+// First pass: evaluate the chunk's samples. Second pass: refine the brackets
+// starting in the chunk and the touching roots at its samples.
+gpointer solve_chunk_worker(gpointer data) {
+    SolveChunk *chunk = data;
+    evaluation_cancel_flag = chunk->cancel_flag;
+    const double *x = chunk->x;
+    const double *g = chunk->g;
+    const CalcError *errors = chunk->errors;
+    if (!chunk->refine) {
+        const double *columns[1] = { x + chunk->first };
+        run_program_columns(chunk->prog, columns, 1, chunk->last - chunk->first + 1, chunk->g + chunk->first,
+                            chunk->errors + chunk->first);
+        return NULL;
+    }
+
+    for (int k = chunk->first; k <= chunk->last; k++) {
+        double root;
+        if (errors[k] != CALC_OK) {
+            continue;
+        }
+        if (g[k] == 0) {
+            solve_chunk_add(chunk, x[k]);
+            continue;
+        }
+        if (k + 1 < chunk->n && errors[k + 1] == CALC_OK && g[k + 1] != 0 && (g[k] < 0) != (g[k + 1] < 0)) {
+            if (solve_bracket(chunk->prog, x[k], g[k], x[k + 1], g[k + 1], &root)) {
+                solve_chunk_add(chunk, root);
+            }
+            continue;
+        }
+        if (k > 0 && k + 1 < chunk->n && errors[k - 1] == CALC_OK && errors[k + 1] == CALC_OK &&
+            (g[k - 1] < 0) == (g[k] < 0) && (g[k + 1] < 0) == (g[k] < 0) &&
+            fabs(g[k]) < fabs(g[k - 1]) && fabs(g[k]) < fabs(g[k + 1])) {
+            double scale = fmax(fabs(g[k - 1]), fabs(g[k + 1]));
+            if (solve_touching(chunk->prog, x[k], x[k - 1], x[k + 1], scale, &root)) {
+                solve_chunk_add(chunk, root);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run one pass over the chunks, the calling thread taking the first
+void solve_run_chunks(SolveChunk *chunks, int chunk_count, int refine) {
+    GThread *workers[SOLVE_MAX_THREADS];
+    for (int t = 0; t < chunk_count; t++) {
+        chunks[t].refine = refine;
+        chunks[t].cancel_flag = evaluation_cancel_flag;
+    }
+    for (int t = 1; t < chunk_count; t++) {
+        workers[t] = g_thread_new("solve", solve_chunk_worker, &chunks[t]);
+    }
+    solve_chunk_worker(&chunks[0]);
+    for (int t = 1; t < chunk_count; t++) {
+        g_thread_join(workers[t]);
+    }
+}
+
+int compare_magnitudes(const void *a, const void *b) {
+    double x = fabs(*(const double *)a);
+    double y = fabs(*(const double *)b);
+    return (x > y) - (x < y);
+}
+
+// Find the real roots of g over the grid (sorted and without duplicates)
+CalcError solve_program(const CalcProgram *prog, SolveResult *out) {
+    int n = 2 * SOLVE_HALF_SAMPLES + 1;
+    double *x = malloc(sizeof(double) * n);
+    double *g = malloc(sizeof(double) * n);
+    CalcError *errors = malloc(sizeof(CalcError) * n);
+    if (x == NULL || g == NULL || errors == NULL) {
+        free(x);
+        free(g);
+        free(errors);
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    // x = sinh(t) for evenly spaced t: about 0.02 apart near zero, 2% apart far out
+    double t_max = asinh(SOLVE_RANGE);
+    for (int k = 0; k <= SOLVE_HALF_SAMPLES; k++) {
+        double v = sinh(t_max * k / SOLVE_HALF_SAMPLES);
+        x[SOLVE_HALF_SAMPLES + k] = v;
+        x[SOLVE_HALF_SAMPLES - k] = -v;
+    }
+
+    int threads = MAX(MIN((int)g_get_num_processors(), SOLVE_MAX_THREADS), 1);
+    int per_thread = (n + threads - 1) / threads;
+    SolveChunk chunks[SOLVE_MAX_THREADS];
+    int chunk_count = 0;
+    for (int first = 0; first < n; first += per_thread) {
+        SolveChunk *chunk = &chunks[chunk_count++];
+        memset(chunk, 0, sizeof(*chunk));
+        chunk->prog = prog;
+        chunk->x = x;
+        chunk->g = g;
+        chunk->errors = errors;
+        chunk->n = n;
+        chunk->first = first;
+        chunk->last = MIN(first + per_thread, n) - 1;
+    }
+    solve_run_chunks(chunks, chunk_count, 0);
+    solve_run_chunks(chunks, chunk_count, 1);
+
+    // Gather (the sample values are no longer needed), drop duplicates, and keep the roots nearest zero
+    int total = 0;
+    for (int t = 0; t < chunk_count; t++) {
+        for (int k = 0; k < chunks[t].count; k++) {
+            g[total++] = chunks[t].roots[k];
+        }
+        free(chunks[t].roots);
+    }
+    for (int k = 0; k < total; k++) {
+        g[k] = solve_snap(prog, g[k]);
+    }
+    qsort(g, total, sizeof(double), compare_doubles);
+    int unique = 0;
+    for (int k = 0; k < total; k++) {
+        if (unique == 0 || fabs(g[k] - g[unique - 1]) > 1e-9 * fmax(1, fabs(g[k]))) {
+            g[unique++] = g[k];
+        }
+    }
+    qsort(g, unique, sizeof(double), compare_magnitudes);
+    out->count = MIN(unique, SOLVE_MAX_ROOTS);
+    out->more = unique > SOLVE_MAX_ROOTS;
+    memcpy(out->roots, g, sizeof(double) * out->count);
+    qsort(out->roots, out->count, sizeof(double), compare_doubles);
+
+    free(x);
+    free(g);
+    free(errors);
+    if (evaluation_cancelled()) {
+        return CALC_ERR_CANCELLED;
+    }
+    return out->count > 0 ? CALC_OK : CALC_ERR_NO_SOLUTION;
+}
+
+// Is the line an equation to solve rather than a definition? Any "lhs = rhs"
+// that isn't a definition is, and so is "f(x) = c" for a built-in f, or for an
+// existing function f when c doesn't use f's parameters (redefining f as a
+// constant is rarely meant).
+int is_equation(const char *line) {
+    const char *equals = strchr(line, '=');
+    if (equals == NULL || strchr(equals + 1, '=') != NULL) {
+        return 0;
+    }
+    CalcDefinition def;
+    if (!parse_definition(line, &def) || find_builtin(def.name, (int)strlen(def.name)) >= 0) {
+        return 1; // Built-ins can't be redefined, so sin(x) = 0.5 is an equation
+    }
+    int slot = find_symbol(def.name, (int)strlen(def.name));
+    if (!def.is_function || slot < 0 || symbols[slot].kind != SYMBOL_FUNCTION) {
+        return 0;
+    }
+    CalcProgram body;
+    int offset;
+    if (compile_expression(line + def.body_offset, &body, &offset) != CALC_OK) {
+        return 0;
+    }
+    free_program(&body);
+    return 1;
+}
+
+// Does the expression use a name that isn't defined (an unknown to solve for)?
+int has_unknown(const char *expr) {
+    CalcProgram prog;
+    int offset;
+    CalcError error = compile_expression(expr, &prog, &offset);
+    if (error == CALC_OK) {
+        free_program(&prog);
+    }
+    return error == CALC_ERR_UNDEFINED_NAME;
+}
+
+// Solve "lhs = rhs" for its one undefined name. Error offsets are in the equation.
+CalcError solve_equation(const char *equation, SolveResult *out, int *error_offset) {
+    memset(out, 0, sizeof(*out));
+    const char *equals = strchr(equation, '=');
+    int split = (int)(equals - equation);
+    const char *p = equation;
+    while (*p == ' ') p++;
+    const char *q = equals + 1;
+    while (*q == ' ') q++;
+    if (p == equals || *q == '\0') {
+        *error_offset = split;
+        return CALC_ERR_MISSING_OPERAND;
+    }
+
+    // g = lhs-(rhs): the left side keeps its offsets, the right side's move by one
+    char text[1100];
+    if (snprintf(text, sizeof(text), "%.*s-(%s)", split, equation, equals + 1) >= (int)sizeof(text)) {
+        *error_offset = 0;
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    CalcProgram prog;
+    int offset = 0;
+    CalcError error = compile_expression(text, &prog, &offset);
+    if (error == CALC_OK) {
+        free_program(&prog);
+        *error_offset = split;
+        return CALC_ERR_NO_UNKNOWN;
+    }
+    int pos = offset;
+    if (error == CALC_ERR_UNDEFINED_NAME && parse_name(text, &pos, out->unknown)) {
+        char params[1][MAX_SYMBOL_NAME];
+        strcpy(params[0], out->unknown);
+        CompileScope scope = { params, 1, -1, 0, 0 };
+        error = compile_expression_scoped(text, &scope, &prog, &offset);
+    }
+    if (error != CALC_OK) {
+        *error_offset = offset < split ? offset : offset - 1;
+        return error;
+    }
+    error = solve_program(&prog, out);
+    free_program(&prog);
+    *error_offset = split;
+    return error;
+}
+
+// Evaluation runs on a worker thread so that an expensive expression (a big
+// exact power, a large factorial, deeply nested functions) leaves the window
+// responsive. The worker gets its own copy of the text and the mode and posts
+// the job back with g_idle_add. A definition is compiled on the main thread,
+// run (with the variables that depend on it) by the worker, and committed to
+// the symbol table when the job comes back; worksheet updates are jobs too.
+// Only one job runs at a time: '=' while one is pending queues its job, and
+// queued jobs start in order as each one comes back, so fast typing, a replayed
+// trace or a forwarded expression all keep every line, and the symbol table
+// only changes between jobs.
+#define EVALUATION_SPINNER_DELAY 150 // Milliseconds before a pending evaluation shows the spinner
+
+typedef struct {
+    char expression[sizeof(expression)]; // As typed, for the history line
+    char value_expr[sizeof(expression)]; // What is evaluated: the expression, or the name it defined
+    int is_definition;
+    int solving; // An equation, solved instead of evaluated
+    SolveResult solution;
+    int mode;
+    int precision;
+    int base;
+    CalcResult res;
+    char exact_str[256];
+    char bounds_str[128];
+    char continue_str[sizeof(result_text)]; // Text continued calculations start from, if not exact_str
+    GString *matrix_str;                    // The history line, when the result is a matrix
+    GThread *thread;
+    guint spinner_source;
+    gint cancelled;          // Set by Escape; the worker's evaluation_cancel_flag
+    SymbolUpdate *update;    // A definition's, committed when the job comes back
+    int defines_function;
+    gchar **worksheet_texts; // A worksheet update: the editor's lines
+    int *recomputed;         // The worksheet lines it re-ran (see worksheet_update)
+    int recomputed_count;
+} EvaluationJob;
+
+EvaluationJob *evaluation_job = NULL;
+GQueue evaluation_queue = G_QUEUE_INIT; // Jobs waiting for evaluation_job, oldest first
+GtkWidget *evaluation_spinner;
+
+int evaluation_pending(void) {
+    return evaluation_job != NULL;
+}
+
+int worksheet_update(char **texts, int n, int **recomputed);
+void worksheet_show(const int *recomputed, int count);
+
+// Worker thread: evaluate in the job's mode, leaving the display text in the job
+void evaluate_job(EvaluationJob *job) {
+    CalcResult *res = &job->res;
+    if (job->worksheet_texts != NULL) {
+        job->recomputed_count = worksheet_update(job->worksheet_texts, (int)g_strv_length(job->worksheet_texts),
+                                                 &job->recomputed);
+        return;
+    }
+    if (job->update != NULL) {
+        // Run the definition; a variable's value is then shown in the job's mode
+        *res = symbol_compute(job->update);
+    }
+    if (res->error != CALC_OK || job->defines_function) {
+        // A definition that failed, or a function, which has no value
+    } else if (job->solving) {
+        res->error = solve_equation(job->expression, &job->solution, &res->error_offset);
+        res->value = res->error == CALC_OK ? job->solution.roots[0] : NAN;
+    } else if (strchr(job->value_expr, '[') != NULL) {
+        // Matrix literals are evaluated in doubles whatever the mode
+        MatrixArena arena = { NULL };
+        MatrixValue m;
+        res->error = evaluate_expression_matrix(job->value_expr, &arena, &m, &res->error_offset);
+        if (res->error == CALC_OK && m.data != NULL) {
+            job->matrix_str = g_string_new(job->expression);
+            g_string_append(job->matrix_str, " = ");
+            format_matrix(&m, job->precision, job->matrix_str);
+        } else if (res->error == CALC_OK) {
+            res->value = m.number;
+        }
+        matrix_arena_release(&arena);
+    } else if (job->mode == ARITHMETIC_COMPLEX) {
+        Complex z;
+        res->error = evaluate_expression_complex(job->value_expr, &z, &res->error_offset);
+        if (res->error == CALC_OK) {
+            format_complex(z, job->precision, job->exact_str, sizeof(job->exact_str));
+            res->value = z.im == 0 ? z.re : NAN; // No real value to keep as ans
+            if (z.im != 0) {
+                // Continued calculations need the parts grouped
+                snprintf(job->continue_str, sizeof(job->continue_str), "(%.*s)", (int)sizeof(job->continue_str) - 3,
+                         job->exact_str);
+            }
+        }
+    } else if (job->mode == ARITHMETIC_PROGRAMMER) {
+        uint64_t bits;
+        res->error = evaluate_expression_programmer(job->value_expr, &bits, &res->error_offset);
+        if (res->error == CALC_OK) {
+            // The chosen base, with the decimal value alongside; the literal carries on exactly
+            char literal[PROGRAMMER_FORMAT_SIZE];
+            format_programmer(bits, job->base, literal);
+            strcpy(job->continue_str, literal);
+            if (job->base == 10) {
+                strcpy(job->exact_str, literal);
+            } else {
+                char decimal[PROGRAMMER_FORMAT_SIZE];
+                format_programmer(bits, 10, decimal);
+                snprintf(job->exact_str, sizeof(job->exact_str), "%s (%s)", literal, decimal);
+            }
+            res->value = programmer_to_double(bits);
+        }
+    } else if (job->mode == ARITHMETIC_EXACT) {
+        *res = evaluate_expression_exact(job->value_expr, job->precision, job->exact_str, sizeof(job->exact_str));
+    } else {
+        *res = evaluate_expression_result(job->value_expr);
+        if (res->error == CALC_OK && res->is_integer) {
+            snprintf(job->exact_str, sizeof(job->exact_str), "%lld", res->int_value);
+        }
+
+        // Report how much rounding error the double result can carry
+        double lo, hi;
+        if (job->mode == ARITHMETIC_INTERVAL && res->error == CALC_OK &&
+            evaluate_expression_interval(job->value_expr, &lo, &hi)) {
+            snprintf(job->bounds_str, sizeof(job->bounds_str), "  [%.17g, %.17g]", lo, hi);
+        }
+    }
+
+    // A cancelled job may have finished on a partial result; it isn't shown or committed
+    if (evaluation_cancelled()) {
+        res->error = CALC_ERR_CANCELLED;
+    }
+}
+
+// Main thread: put the job's result (or error) in the history. The edit line
+// was handed to the job when it started, so whatever has been typed since stays.
+void evaluation_show(EvaluationJob *job) {
+    CalcResult res = job->res;
+    int line_empty = strlen(expression) == 0 && strlen(current_input) == 0;
+
+    if (job->worksheet_texts != NULL) {
+        worksheet_show(job->recomputed, job->recomputed_count);
+        return;
+    }
+    if (job->defines_function && res.error == CALC_OK) {
+        has_result = FALSE;
+        append_to_history(job->expression);
+        return;
+    }
+
+    if (job->matrix_str != NULL && res.error == CALC_OK) {
+        // A matrix can't be kept as ans, so the next calculation starts fresh
+        has_result = FALSE;
+        append_to_history(job->matrix_str->str);
+        return;
+    }
+
+    // An expression in x that can't be evaluated on its own is plotted instead
+    if (res.error == CALC_ERR_UNDEFINED_NAME && !job->is_definition && !job->solving &&
+        plot_set_expression(job->expression)) {
+        char plot_str[1100];
+        snprintf(plot_str, sizeof(plot_str), "y = %s", job->expression);
+        set_plot_visible(1);
+        plot_view_changed();
+        has_result = FALSE;
+        append_to_history(plot_str);
+        return;
+    }
+
+    // Check for evaluation errors
+    if (res.error != CALC_OK) {
+        // Show what went wrong and where (1-based column in the expression)
+        const char *separator = job->solving ? ":" : " =";
+        char error_str[sizeof(job->expression) + 64];
+        if (res.error == CALC_ERR_CANCELLED || res.error == CALC_ERR_NO_SOLUTION) {
+            snprintf(error_str, sizeof(error_str), "%s%s %s", job->expression, separator,
+                     calc_error_message(res.error));
+        } else {
+            snprintf(error_str, sizeof(error_str), "%s%s %s (col %d)", job->expression, separator,
+                     calc_error_message(res.error), res.error_offset + 1);
+        }
+        has_result = FALSE;
+        append_to_history(error_str);
+        return;
+    }
+
+    // Show the full expression with result; an equation lists its roots
+    double calc_result = res.value;
+    char result_str[sizeof(job->expression) + sizeof(job->exact_str) + sizeof(job->bounds_str)];
+    if (job->solving) {
+        int length = snprintf(result_str, sizeof(result_str), "%s: %s = ", job->expression, job->solution.unknown);
+        for (int k = 0; k < job->solution.count && length < (int)sizeof(result_str); k++) {
+            char root[64];
+            format_display_number(job->solution.roots[k], job->precision, root, sizeof(root));
+            length += snprintf(result_str + length, sizeof(result_str) - length, "%s%s", k > 0 ? ", " : "", root);
+        }
+        if (job->solution.more && length < (int)sizeof(result_str)) {
+            snprintf(result_str + length, sizeof(result_str) - length, ", ...");
+        }
+    } else if (strlen(job->exact_str) > 0) {
+        snprintf(result_str, sizeof(result_str), "%s = %s", job->expression, job->exact_str);
+    } else if (calc_result == floor(calc_result) && fabs(calc_result) < EXACT_DOUBLE_LIMIT) {
+        snprintf(result_str, sizeof(result_str), "%s = %.0f", job->expression, calc_result);
+    } else {
+        snprintf(result_str, sizeof(result_str), "%s = %.*f", job->expression, get_display_precision(calc_result),
+                 calc_result);
+    }
+    if (strlen(job->bounds_str) > 0 && strlen(result_str) + strlen(job->bounds_str) < sizeof(result_str)) {
+        strcat(result_str, job->bounds_str);
+    }
+
+    // Store result for next calculation (and as "ans"). Input typed while the
+    // job ran is left alone rather than replaced by the result.
+    result = calc_result;
+    symbol_values[ANS_SLOT] = calc_result;
+    if (line_empty) {
+        // Keep the exact text so continued calculations don't lose digits
+        if (strlen(job->continue_str) > 0) {
+            strcpy(result_text, job->continue_str);
+        } else if (strchr(job->exact_str, 'e') == NULL) {
+            strcpy(result_text, job->exact_str);
+        } else {
+            strcpy(result_text, "");
+        }
+        has_result = TRUE;
+    }
+
+    // Add to history
+    append_value_to_history(result_str, calc_result);
+}
+
+void evaluation_start(EvaluationJob *job);
+
+void evaluation_free(EvaluationJob *job) {
+    if (job->update != NULL) {
+        symbol_update_free(job->update);
+    }
+    if (job->matrix_str != NULL) {
+        g_string_free(job->matrix_str, TRUE);
+    }
+    g_strfreev(job->worksheet_texts);
+    free(job->recomputed);
+    free(job);
+}
+
+gboolean evaluation_finished(gpointer data) {
+    EvaluationJob *job = data;
+    g_thread_join(job->thread);
+    if (job->spinner_source != 0) {
+        g_source_remove(job->spinner_source);
+    }
+    gtk_spinner_stop(GTK_SPINNER(evaluation_spinner));
+    gtk_widget_hide(evaluation_spinner);
+    evaluation_job = NULL;
+
+    // A definition takes effect now, unless it failed or was cancelled
+    if (job->update != NULL && job->res.error == CALC_OK) {
+        symbol_commit(job->update);
+        job->update = NULL;
+    }
+    evaluation_show(job);
+    int cancelled = job->res.error == CALC_ERR_CANCELLED;
+    evaluation_free(job);
+
+    // A cancel covers the queued calculations as well; worksheet updates only
+    // carry the worksheet's text, so they still run
+    EvaluationJob *next;
+    if (cancelled) {
+        GQueue kept = G_QUEUE_INIT;
+        while ((next = g_queue_pop_head(&evaluation_queue)) != NULL) {
+            if (next->worksheet_texts != NULL) {
+                g_queue_push_tail(&kept, next);
+            } else {
+                next->res.error = CALC_ERR_CANCELLED;
+                evaluation_show(next);
+                evaluation_free(next);
+            }
+        }
+        evaluation_queue = kept;
+    }
+    while (evaluation_job == NULL && (next = g_queue_pop_head(&evaluation_queue)) != NULL) {
+        evaluation_start(next);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+gpointer evaluation_worker(gpointer data) {
+    EvaluationJob *job = data;
+    evaluation_cancel_flag = &job->cancelled;
+    evaluate_job(job);
+    symbol_update = NULL;
+    g_idle_add(evaluation_finished, data);
+    return NULL;
+}
+
+// Only evaluations that take a noticeable time show the spinner
+gboolean evaluation_show_spinner(gpointer data) {
+    EvaluationJob *job = data;
+    job->spinner_source = 0;
+    gtk_widget_show(evaluation_spinner);
+    gtk_spinner_start(GTK_SPINNER(evaluation_spinner));
+    return G_SOURCE_REMOVE;
+}
+
+// Escape while an evaluation is pending: the evaluators stop at their next
+// function call and the job, with any queued behind it, comes back as cancelled
+void evaluation_cancel(void) {
+    if (evaluation_job != NULL) {
+        g_atomic_int_set(&evaluation_job->cancelled, 1);
+    }
+}
+
+// Start a job: equations are solved; definitions are compiled here and run by
+// the job, and a variable then shows its value in the job's mode. A definition
+// that doesn't compile is shown at once.
+void evaluation_start(EvaluationJob *job) {
+    CalcDefinition def;
+    if (job->worksheet_texts != NULL) {
+        // Runs as it is
+    } else if (is_equation(job->expression)) {
+        job->solving = 1;
+    } else if (parse_definition(job->expression, &def)) {
+        job->is_definition = 1;
+        job->defines_function = def.is_function;
+        job->res = symbol_prepare(job->expression, &def, &job->update);
+        strcpy(job->value_expr, def.name);
+    }
+    if (job->res.error != CALC_OK) {
+        // The definition was rejected
+        evaluation_show(job);
+        evaluation_free(job);
+        return;
+    }
+    evaluation_job = job;
+    job->spinner_source = g_timeout_add(EVALUATION_SPINNER_DELAY, evaluation_show_spinner, job);
+    job->thread = g_thread_new("evaluate", evaluation_worker, job);
+}
+
+// Function to handle equals button click
+void on_equals_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+
+    // If we have a result displayed and no new input, start fresh new calculation
+    if (has_result && strlen(current_input) == 0 && strlen(expression) == 0 && evaluation_job == NULL) {
+        has_result = FALSE;
+        clear_history();  // Clear history for fresh start
+        update_display();
+        return;
+    }
+
+    // Check if we have something to evaluate
+    if (strlen(current_input) > 0 || strlen(expression) > 0) {
+        // Complete the expression with any remaining input
+        if (strlen(current_input) > 0) {
+            if (strlen(expression) > 0) {
+                if (!safe_strcat(expression, " ", sizeof(expression))) return;
+            }
+            if (!safe_strcat(expression, current_input, sizeof(expression))) return;
+        }
+
+        // Only evaluate if we have a complete expression
+        if (strlen(expression) > 0) {
+            EvaluationJob *job = calloc(1, sizeof(EvaluationJob));
+            if (job == NULL) {
+                append_to_history("Not enough memory to evaluate");
+                return;
+            }
+            strcpy(job->expression, expression);
+            strcpy(job->value_expr, expression);
+            job->mode = arithmetic_mode;
+            job->precision = result_precision;
+            job->base = programmer_base;
+
+            // The display keeps showing the expression until the job comes back
+            strcpy(expression, "");
+            strcpy(current_input, "");
+            if (evaluation_job != NULL) {
+                g_queue_push_tail(&evaluation_queue, job);
+            } else {
+                evaluation_start(job);
+            }
+        }
+    }
+}
+
+// Function to handle clear button click
+void on_clear_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    clear_calculator();
+}
+
+// Function to handle decimal point
+void on_decimal_clicked(GtkWidget *widget, gpointer data) {
+    if (has_result) {
+        strcpy(expression, "");
+        has_result = FALSE;
+    }
+
+    if (strchr(current_input, '.') == NULL) {
+        if (strlen(current_input) == 0) {
+            strcat(current_input, "0");
+        }
+        strcat(current_input, ".");
+        update_display();
+    }
+}
+
+// Function to handle backspace (delete one character)
+void on_backspace_clicked(GtkWidget *widget, gpointer data) {
+    size_t len = strlen(current_input);
+    if (len > 0) {
         current_input[len - 1] = '\0';
         update_display();
-    } else if (strlen(expression) > 0) {
-        // Remove last part of expression
-        char *last_space = strrchr(expression, ' ');
-        if (last_space != NULL) {
-            *last_space = '\0';
+    } else if (strlen(expression) > 0) {
+        // Remove last part of expression
+        char *last_space = strrchr(expression, ' ');
+        if (last_space != NULL) {
+            *last_space = '\0';
+        } else {
+            expression[0] = '\0';
+        }
+        update_display();
+    }
+}
+
+// Function to handle delete key (clear everything including history)
+void on_delete_clicked(GtkWidget *widget, gpointer data) {
+    strcpy(current_input, "");
+    strcpy(expression, "");
+    clear_history();
+    has_result = FALSE;
+    update_display();
+}
+
+// '=' after a bare name or "name(a, b)" starts a definition, and after an
+// expression with an unknown in it an equation; otherwise it evaluates
+void on_assign_key(void) {
+    char head[sizeof(expression) + sizeof(current_input)];
+    CalcDefinition def;
+    snprintf(head, sizeof(head), "%s%s%s", expression,
+             strlen(expression) > 0 && strlen(current_input) > 0 ? " " : "", current_input);
+
+    int pos = parse_definition_head(head, &def);
+    int starts = pos >= 0 && head[pos] == '\0';
+    if (has_result || strchr(head, '=') != NULL || (!starts && !has_unknown(head))) {
+        on_equals_clicked(NULL, NULL);
+        return;
+    }
+    if (!safe_strcpy(expression, head, sizeof(expression)) ||
+        !safe_strcat(expression, " =", sizeof(expression))) {
+        return;
+    }
+    strcpy(current_input, "");
+    update_display();
+}
+
+// Worksheet: a multi-line editor where every line is an expression or a
+// "name = expression" definition, and can use the value of an earlier line by
+// its name or as L<n> (its line number). Each line is compiled once, with the
+// lines it refers to as parameters, and keeps a list of the lines that refer
+// to it. Editing a line recompiles only that line and re-runs its transitive
+// dependents in line order, which is topological because references only go
+// backwards. Dependents that don't refer to each other form a level; large
+// levels are split across threads. Updates run as evaluation jobs, so the
+// worksheet belongs to the job's thread while one is pending and the main
+// thread only formats its results once it comes back.
+#define WORKSHEET_PARALLEL_MIN 512  // Smallest level of independent lines worth splitting across threads
+#define WORKSHEET_MAX_THREADS 8
+#define WORKSHEET_STACK_PARAMS 64   // References a line can make before its parameters go on the heap
+#define WORKSHEET_REFRESH_LIMIT 256 // Beyond this many changed results the result column is rebuilt
+
+typedef struct {
+    char *source;               // Line text, owned
+    char name[MAX_SYMBOL_NAME]; // Name the line defines ("" for a plain expression)
+    int body_offset;            // Offset of the expression in source
+    int blank;                  // Nothing to evaluate; L<n> can't refer to it
+    int previous_name;          // Earlier line defining the same name, or -1
+    CalcProgram prog;
+    int has_program;
+    int *refs;                  // Line supplying each program parameter
+    int ref_count;
+    int *dependents;            // Lines whose programs refer to this one
+    int dependent_count;
+    int dependent_capacity;
+    double value;
+    CalcError error;
+    int error_offset;           // Offset in source
+    int error_line;             // Referenced line that failed, or -1
+    int level;                  // Longest chain of changed lines leading here
+    int dirty;
+} WorksheetLine;
+
+typedef struct {
+    WorksheetLine *lines;
+    int count;
+    GHashTable *names; // Name -> 1 + last line defining it
+} Worksheet;
+
+Worksheet worksheet;
+
+// Line number of an "L<n>" reference, or 0 for any other name
+int worksheet_line_number(const char *name, int length) {
+    if (length < 2 || length > 9 || name[0] != 'L') {
+        return 0;
+    }
+    int number = 0;
+    for (int k = 1; k < length; k++) {
+        if (name[k] < '0' || name[k] > '9') {
+            return 0;
+        }
+        number = number * 10 + (name[k] - '0');
+    }
+    return number;
+}
+
+// Find the next name in an expression at or after *pos, skipping numbers.
+// Returns its offset (and *pos past it), or -1 at the end.
+int worksheet_next_name(const char *text, int *pos) {
+    int i = *pos;
+    while (text[i] != '\0') {
+        if (is_name_start(text[i])) {
+            int start = i;
+            while (is_name_char(text[i])) {
+                i++;
+            }
+            *pos = i;
+            return start;
+        }
+        if ((text[i] >= '0' && text[i] <= '9') || text[i] == '.') {
+            // Exponents and digits stay part of the number
+            while (is_name_char(text[i]) || text[i] == '.') {
+                i++;
+            }
+        } else {
+            i++;
+        }
+    }
+    *pos = i;
+    return -1;
+}
+
+// Does a line's expression mention the given name?
+int worksheet_mentions(const WorksheetLine *line, const char *name) {
+    const char *body = line->source + line->body_offset;
+    int length = (int)strlen(name);
+    int pos = 0;
+    int start;
+    while ((start = worksheet_next_name(body, &pos)) >= 0) {
+        if (pos - start == length && strncmp(body + start, name, length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The line a name refers to from a line before `before`, or -1
+int worksheet_resolve(const char *name, int length, int before) {
+    int number = worksheet_line_number(name, length);
+    if (number > 0) {
+        return number <= before && !worksheet.lines[number - 1].blank ? number - 1 : -1;
+    }
+    char key[MAX_SYMBOL_NAME];
+    if (length >= MAX_SYMBOL_NAME) {
+        return -1;
+    }
+    memcpy(key, name, length);
+    key[length] = '\0';
+    int line = GPOINTER_TO_INT(g_hash_table_lookup(worksheet.names, key)) - 1;
+    while (line >= before) {
+        line = worksheet.lines[line].previous_name;
+    }
+    return line;
+}
+
+// Find the name and expression of a line; definitions of functions and
+// reserved names are left to worksheet_compile to report
+void worksheet_parse(WorksheetLine *line) {
+    CalcDefinition def;
+    const char *p = line->source;
+    while (*p == ' ' || *p == '\t') p++;
+    line->blank = *p == '\0';
+    line->name[0] = '\0';
+    line->body_offset = 0;
+    if (parse_definition(line->source, &def)) {
+        line->body_offset = def.body_offset;
+        int length = (int)strlen(def.name);
+        if (!def.is_function && worksheet_line_number(def.name, length) == 0 &&
+            find_builtin(def.name, length) < 0 && strcmp(def.name, "ans") != 0) {
+            strcpy(line->name, def.name);
+        }
+    }
+}
+
+// Chain every line defining a name to the previous one, for worksheet_resolve
+void worksheet_index_names(void) {
+    g_hash_table_remove_all(worksheet.names);
+    for (int i = 0; i < worksheet.count; i++) {
+        WorksheetLine *line = &worksheet.lines[i];
+        line->previous_name = -1;
+        if (line->name[0] != '\0') {
+            line->previous_name = GPOINTER_TO_INT(g_hash_table_lookup(worksheet.names, line->name)) - 1;
+            g_hash_table_insert(worksheet.names, line->name, GINT_TO_POINTER(i + 1));
+        }
+    }
+}
+
+int worksheet_add_dependent(int target, int line) {
+    WorksheetLine *t = &worksheet.lines[target];
+    if (t->dependent_count == t->dependent_capacity) {
+        int capacity = t->dependent_capacity > 0 ? t->dependent_capacity * 2 : 4;
+        int *grown = realloc(t->dependents, capacity * sizeof(int));
+        if (grown == NULL) {
+            return 0;
+        }
+        t->dependents = grown;
+        t->dependent_capacity = capacity;
+    }
+    t->dependents[t->dependent_count++] = line;
+    return 1;
+}
+
+// Drop a line's program and its entries in the dependent lists of the lines it used
+void worksheet_unlink(int i) {
+    WorksheetLine *line = &worksheet.lines[i];
+    for (int k = 0; k < line->ref_count; k++) {
+        WorksheetLine *t = &worksheet.lines[line->refs[k]];
+        for (int d = 0; d < t->dependent_count; d++) {
+            if (t->dependents[d] == i) {
+                t->dependents[d] = t->dependents[--t->dependent_count];
+                break;
+            }
+        }
+    }
+    free(line->refs);
+    line->refs = NULL;
+    line->ref_count = 0;
+    if (line->has_program) {
+        free_program(&line->prog);
+        line->has_program = 0;
+    }
+}
+
+// Compile line i with each earlier line it names as a parameter
+void worksheet_compile(int i) {
+    WorksheetLine *line = &worksheet.lines[i];
+    worksheet_unlink(i);
+    line->value = NAN;
+    line->error = CALC_OK;
+    line->error_offset = 0;
+    line->error_line = -1;
+    if (line->blank) {
+        return;
+    }
+    CalcDefinition def;
+    if (line->body_offset > 0 && line->name[0] == '\0' && parse_definition(line->source, &def)) {
+        line->error = CALC_ERR_INVALID_DEFINITION; // Functions and reserved names
+        return;
+    }
+
+    const char *body = line->source + line->body_offset;
+    char (*params)[MAX_SYMBOL_NAME] = NULL;
+    int *refs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int pos = 0;
+    int start;
+    while ((start = worksheet_next_name(body, &pos)) >= 0) {
+        int length = pos - start;
+        int target = worksheet_resolve(body + start, length, i);
+        if (target < 0) {
+            continue; // A global name, or an error the compiler reports
+        }
+        int seen = 0;
+        for (int k = 0; k < count && !seen; k++) {
+            seen = (int)strlen(params[k]) == length && strncmp(params[k], body + start, length) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 8;
+            char (*grown_params)[MAX_SYMBOL_NAME] = realloc(params, capacity * sizeof(*params));
+            int *grown_refs = grown_params != NULL ? realloc(refs, capacity * sizeof(int)) : NULL;
+            params = grown_params != NULL ? grown_params : params;
+            refs = grown_refs != NULL ? grown_refs : refs;
+            if (grown_refs == NULL) {
+                free(params);
+                free(refs);
+                line->error = CALC_ERR_OUT_OF_MEMORY;
+                return;
+            }
+        }
+        memcpy(params[count], body + start, length);
+        params[count][length] = '\0';
+        refs[count++] = target;
+    }
+
+    CompileScope scope = { params, count, -1, 0, 0 };
+    line->error = compile_expression_scoped(body, &scope, &line->prog, &line->error_offset);
+    free(params);
+    if (line->error != CALC_OK) {
+        line->error_offset += line->body_offset;
+        free(refs);
+        return;
+    }
+    line->has_program = 1;
+    line->refs = refs;
+    line->ref_count = count;
+    for (int k = 0; k < count; k++) {
+        if (!worksheet_add_dependent(refs[k], i)) {
+            line->ref_count = k; // Only the linked references are unlinked later
+            line->error = CALC_ERR_OUT_OF_MEMORY;
+            free_program(&line->prog);
+            line->has_program = 0;
+            return;
+        }
+    }
+}
+
+// Evaluate one compiled line from the current values of the lines it uses
+void worksheet_run(int i) {
+    WorksheetLine *line = &worksheet.lines[i];
+    if (!line->has_program) {
+        return; // Blank, or kept its compile error
+    }
+    double stack_params[WORKSHEET_STACK_PARAMS];
+    double *params = line->ref_count <= WORKSHEET_STACK_PARAMS ? stack_params : malloc(line->ref_count * sizeof(double));
+    line->error_line = -1;
+    line->value = NAN;
+    if (params == NULL) {
+        line->error = CALC_ERR_OUT_OF_MEMORY;
+        return;
+    }
+    for (int k = 0; k < line->ref_count; k++) {
+        const WorksheetLine *ref = &worksheet.lines[line->refs[k]];
+        if (ref->error != CALC_OK) {
+            line->error = ref->error;
+            line->error_line = line->refs[k];
+            line->error_offset = 0;
+            if (params != stack_params) {
+                free(params);
+            }
+            return;
+        }
+        params[k] = ref->value;
+    }
+    double value;
+    line->error = run_program_with(&line->prog, params, 0, &value, &line->error_offset);
+    if (line->error == CALC_OK) {
+        line->value = value;
+    } else {
+        line->error_offset += line->body_offset;
+    }
+    if (params != stack_params) {
+        free(params);
+    }
+}
+
+typedef struct {
+    const int *lines;
+    int count;
+    gint *cancel_flag; // The update job's, passed on to the chunk's thread
+} WorksheetChunk;
+
+gpointer worksheet_chunk_worker(gpointer data) {
+    WorksheetChunk *chunk = data;
+    evaluation_cancel_flag = chunk->cancel_flag;
+    for (int k = 0; k < chunk->count; k++) {
+        worksheet_run(chunk->lines[k]);
+    }
+    return NULL;
+}
+
+// Evaluate lines that don't refer to each other, splitting large batches across threads
+void worksheet_run_level(const int *lines, int n) {
+    int threads = 1;
+    if (n >= WORKSHEET_PARALLEL_MIN) {
+        threads = MAX(MIN((int)g_get_num_processors(), WORKSHEET_MAX_THREADS), 1);
+    }
+    int per_thread = (n + threads - 1) / threads;
+
+    WorksheetChunk chunks[WORKSHEET_MAX_THREADS];
+    GThread *workers[WORKSHEET_MAX_THREADS];
+    int chunk_count = 0;
+    for (int start = 0; start < n; start += per_thread) {
+        chunks[chunk_count].lines = lines + start;
+        chunks[chunk_count].count = MIN(per_thread, n - start);
+        chunks[chunk_count].cancel_flag = evaluation_cancel_flag;
+        chunk_count++;
+    }
+
+    // The calling thread evaluates the first chunk itself
+    for (int t = 1; t < chunk_count; t++) {
+        workers[t] = g_thread_new("worksheet", worksheet_chunk_worker, &chunks[t]);
+    }
+    if (chunk_count > 0) {
+        worksheet_chunk_worker(&chunks[0]);
+    }
+    for (int t = 1; t < chunk_count; t++) {
+        g_thread_join(workers[t]);
+    }
+}
+
+int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Re-run the changed lines and everything that depends on them, a level at a
+// time. Returns how many lines were re-run and stores them in `order`, which
+// must have room for every line.
+int worksheet_recompute(const int *changed, int changed_count, int *order) {
+    int count = 0;
+    for (int k = 0; k < changed_count; k++) {
+        if (!worksheet.lines[changed[k]].dirty) {
+            worksheet.lines[changed[k]].dirty = 1;
+            order[count++] = changed[k];
+        }
+    }
+    for (int k = 0; k < count; k++) {
+        const WorksheetLine *line = &worksheet.lines[order[k]];
+        for (int d = 0; d < line->dependent_count; d++) {
+            if (!worksheet.lines[line->dependents[d]].dirty) {
+                worksheet.lines[line->dependents[d]].dirty = 1;
+                order[count++] = line->dependents[d];
+            }
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    qsort(order, count, sizeof(int), compare_ints);
+
+    // A line's level is one more than its deepest dirty reference
+    int levels = 0;
+    for (int k = 0; k < count; k++) {
+        WorksheetLine *line = &worksheet.lines[order[k]];
+        line->level = 0;
+        for (int r = 0; r < line->ref_count; r++) {
+            const WorksheetLine *ref = &worksheet.lines[line->refs[r]];
+            if (ref->dirty && ref->level >= line->level) {
+                line->level = ref->level + 1;
+            }
+        }
+        levels = MAX(levels, line->level + 1);
+    }
+
+    // Group the lines by level, keeping line order within each
+    int *level_start = calloc(levels + 1, sizeof(int));
+    int *by_level = malloc(count * sizeof(int));
+    if (level_start == NULL || by_level == NULL) {
+        free(level_start);
+        free(by_level);
+        for (int k = 0; k < count; k++) {
+            worksheet_run(order[k]); // Line order is already topological
+            worksheet.lines[order[k]].dirty = 0;
+        }
+        return count;
+    }
+    for (int k = 0; k < count; k++) {
+        level_start[worksheet.lines[order[k]].level + 1]++;
+    }
+    for (int l = 0; l < levels; l++) {
+        level_start[l + 1] += level_start[l];
+    }
+    for (int k = 0; k < count; k++) {
+        by_level[level_start[worksheet.lines[order[k]].level]++] = order[k];
+    }
+    int start = 0;
+    for (int l = 0; l < levels; l++) {
+        worksheet_run_level(by_level + start, level_start[l] - start);
+        start = level_start[l];
+    }
+    for (int k = 0; k < count; k++) {
+        worksheet.lines[order[k]].dirty = 0;
+    }
+    free(level_start);
+    free(by_level);
+    return count;
+}
+
+void worksheet_clear(void) {
+    for (int i = 0; i < worksheet.count; i++) {
+        WorksheetLine *line = &worksheet.lines[i];
+        if (line->has_program) {
+            free_program(&line->prog);
+        }
+        free(line->refs);
+        free(line->dependents);
+        free(line->source);
+    }
+    free(worksheet.lines);
+    worksheet.lines = NULL;
+    worksheet.count = 0;
+}
+
+// Bring the worksheet up to date with its new text, one string per line.
+// Returns the number of lines re-run (stored in *recomputed, to be freed), or
+// -1 when every line was rebuilt because lines were added or removed.
+int worksheet_update(char **texts, int n, int **recomputed) {
+    *recomputed = NULL;
+    if (worksheet.names == NULL) {
+        worksheet.names = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    int *changed = malloc(MAX(n, 1) * sizeof(int));
+    int *order = malloc(MAX(n, 1) * sizeof(int));
+    if (changed == NULL || order == NULL) {
+        free(changed);
+        free(order);
+        return 0;
+    }
+    int changed_count = 0;
+    int rebuilt = n != worksheet.count;
+
+    if (rebuilt) {
+        // Inserting or deleting lines renumbers everything after them
+        worksheet_clear();
+        worksheet.lines = calloc(MAX(n, 1), sizeof(WorksheetLine));
+        if (worksheet.lines == NULL) {
+            free(changed);
+            free(order);
+            return 0;
+        }
+        for (int i = 0; i < n; i++) {
+            worksheet.lines[i].source = strdup(texts[i]);
+            if (worksheet.lines[i].source == NULL) {
+                worksheet.count = i;
+                free(changed);
+                free(order);
+                return 0;
+            }
+            worksheet_parse(&worksheet.lines[i]);
+        }
+        worksheet.count = n;
+        worksheet_index_names();
+        for (int i = 0; i < n; i++) {
+            worksheet_compile(i);
+            changed[changed_count++] = i;
+        }
+    } else {
+        // Remember which names an edit moves, so lines that use them can be relinked
+        GPtrArray *moved = g_ptr_array_new_with_free_func(g_free);
+        int first_edit = n;
+        for (int i = 0; i < n; i++) {
+            WorksheetLine *line = &worksheet.lines[i];
+            if (strcmp(line->source, texts[i]) == 0) {
+                continue;
+            }
+            char *source = strdup(texts[i]);
+            if (source == NULL) {
+                continue;
+            }
+            char old_name[MAX_SYMBOL_NAME];
+            int old_blank = line->blank;
+            strcpy(old_name, line->name);
+            free(line->source);
+            line->source = source;
+            worksheet_parse(line);
+            if (strcmp(old_name, line->name) != 0) {
+                if (old_name[0] != '\0') g_ptr_array_add(moved, g_strdup(old_name));
+                if (line->name[0] != '\0') g_ptr_array_add(moved, g_strdup(line->name));
+            }
+            if (old_blank != line->blank) {
+                g_ptr_array_add(moved, g_strdup_printf("L%d", i + 1));
+            }
+            first_edit = MIN(first_edit, i);
+            changed[changed_count++] = i;
+        }
+        if (moved->len > 0) {
+            worksheet_index_names();
+        }
+        for (int k = 0; k < changed_count; k++) {
+            worksheet_compile(changed[k]);
+        }
+        int edited_count = changed_count;
+        for (int i = first_edit + 1; i < n && moved->len > 0; i++) {
+            int edited = 0;
+            for (int k = 0; k < edited_count && !edited; k++) {
+                edited = changed[k] == i;
+            }
+            for (guint m = 0; m < moved->len && !edited; m++) {
+                if (worksheet_mentions(&worksheet.lines[i], g_ptr_array_index(moved, m))) {
+                    worksheet_compile(i);
+                    changed[changed_count++] = i;
+                    break;
+                }
+            }
+        }
+        g_ptr_array_free(moved, TRUE);
+
+        // Lines a cancelled update left unfinished run again
+        for (int i = 0; i < n; i++) {
+            if (worksheet.lines[i].error == CALC_ERR_CANCELLED) {
+                changed[changed_count++] = i;
+            }
+        }
+    }
+
+    int count = changed_count > 0 ? worksheet_recompute(changed, changed_count, order) : 0;
+    free(changed);
+    if (rebuilt) {
+        free(order);
+        return -1;
+    }
+    *recomputed = order;
+    return count;
+}
+
+// Result column text for one line
+void worksheet_format(int i, char *buf, size_t size) {
+    const WorksheetLine *line = &worksheet.lines[i];
+    if (line->blank) {
+        buf[0] = '\0';
+    } else if (line->error_line >= 0) {
+        snprintf(buf, size, "L%d: error in L%d", i + 1, line->error_line + 1);
+    } else if (line->error != CALC_OK) {
+        snprintf(buf, size, "L%d: %s (col %d)", i + 1, calc_error_message(line->error), line->error_offset + 1);
+    } else if (line->value == floor(line->value) && fabs(line->value) < EXACT_DOUBLE_LIMIT) {
+        snprintf(buf, size, "L%d = %.0f", i + 1, line->value);
+    } else {
+        snprintf(buf, size, "L%d = %.*f", i + 1, get_display_precision(line->value), line->value);
+    }
+}
+
+GtkWidget *worksheet_window;
+GtkTextBuffer *worksheet_buffer, *worksheet_results;
+guint worksheet_sync_source = 0;
+int worksheet_job_pending = 0; // An update is queued or running
+int worksheet_stale = 0;       // The editor changed after that update took its text
+
+void on_worksheet_changed(GtkTextBuffer *buffer, gpointer data);
+
+// Main thread, when an update comes back: refresh the results of the lines that ran
+void worksheet_show(const int *recomputed, int count) {
+    worksheet_job_pending = 0;
+    if (worksheet_stale) {
+        worksheet_stale = 0;
+        on_worksheet_changed(worksheet_buffer, NULL);
+    }
+
+    char buf[256];
+    if (count < 0 || count > WORKSHEET_REFRESH_LIMIT ||
+        gtk_text_buffer_get_line_count(worksheet_results) != worksheet.count) {
+        GString *results = g_string_new(NULL);
+        for (int i = 0; i < worksheet.count; i++) {
+            worksheet_format(i, buf, sizeof(buf));
+            g_string_append(results, buf);
+            if (i + 1 < worksheet.count) {
+                g_string_append_c(results, '\n');
+            }
+        }
+        gtk_text_buffer_set_text(worksheet_results, results->str, (gint)results->len);
+        g_string_free(results, TRUE);
+    } else {
+        for (int k = 0; k < count; k++) {
+            GtkTextIter line_start, line_end;
+            gtk_text_buffer_get_iter_at_line(worksheet_results, &line_start, recomputed[k]);
+            line_end = line_start;
+            if (!gtk_text_iter_ends_line(&line_end)) {
+                gtk_text_iter_forward_to_line_end(&line_end);
+            }
+            gtk_text_buffer_delete(worksheet_results, &line_start, &line_end);
+            worksheet_format(recomputed[k], buf, sizeof(buf));
+            gtk_text_buffer_insert(worksheet_results, &line_start, buf, -1);
+        }
+    }
+}
+
+// Hand the editor's text to an update job. While one is pending the text waits,
+// and the next update takes whatever the editor holds when that one is back.
+gboolean worksheet_sync(gpointer data) {
+    (void)data;
+    worksheet_sync_source = 0;
+    if (worksheet_job_pending) {
+        worksheet_stale = 1;
+        return G_SOURCE_REMOVE;
+    }
+    EvaluationJob *job = calloc(1, sizeof(EvaluationJob));
+    if (job == NULL) {
+        return G_SOURCE_REMOVE;
+    }
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds(worksheet_buffer, &start, &end);
+    gchar *text = gtk_text_buffer_get_text(worksheet_buffer, &start, &end, FALSE);
+    job->worksheet_texts = g_strsplit(text, "\n", -1);
+    g_free(text);
+    worksheet_job_pending = 1;
+    if (evaluation_job != NULL) {
+        g_queue_push_tail(&evaluation_queue, job);
+    } else {
+        evaluation_start(job);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Edits are batched until the main loop is idle, so a paste recomputes once
+void on_worksheet_changed(GtkTextBuffer *buffer, gpointer data) {
+    (void)buffer; (void)data;
+    if (worksheet_sync_source == 0) {
+        worksheet_sync_source = g_idle_add(worksheet_sync, NULL);
+    }
+}
+
+// Worksheet window: the lines on the left, their results on the right
+void on_worksheet_clicked(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    if (worksheet_window == NULL) {
+        worksheet_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_title(GTK_WINDOW(worksheet_window), "Worksheet");
+        gtk_window_set_transient_for(GTK_WINDOW(worksheet_window), GTK_WINDOW(user_data));
+        gtk_window_set_default_size(GTK_WINDOW(worksheet_window), 600, 400);
+        g_signal_connect(worksheet_window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+
+        GtkWidget *editor = gtk_text_view_new();
+        gtk_text_view_set_monospace(GTK_TEXT_VIEW(editor), TRUE);
+        worksheet_buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(editor));
+        g_signal_connect(worksheet_buffer, "changed", G_CALLBACK(on_worksheet_changed), NULL);
+
+        GtkWidget *results = gtk_text_view_new();
+        gtk_text_view_set_editable(GTK_TEXT_VIEW(results), FALSE);
+        gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(results), FALSE);
+        gtk_text_view_set_monospace(GTK_TEXT_VIEW(results), TRUE);
+        worksheet_results = gtk_text_view_get_buffer(GTK_TEXT_VIEW(results));
+
+        // Both columns scroll together, so each result stays beside its line
+        GtkWidget *columns = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+        gtk_box_pack_start(GTK_BOX(columns), editor, TRUE, TRUE, 0);
+        gtk_box_pack_start(GTK_BOX(columns), results, TRUE, TRUE, 0);
+        GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+        gtk_container_add(GTK_CONTAINER(scrolled), columns);
+        gtk_container_add(GTK_CONTAINER(worksheet_window), scrolled);
+        gtk_widget_show_all(scrolled);
+    }
+    gtk_window_present(GTK_WINDOW(worksheet_window));
+}
+
+// Memory registers shared by every calculator the user is running. The bank
+// lives in a POSIX shared-memory segment; registers are updated with
+// compare-and-swap, so no instance ever holds a lock another one could wait on.
+// Each change bumps a generation counter that doubles as a futex, which wakes
+// a watcher thread in every instance to refresh its memory indicator.
+#define MEMORY_SHM_PREFIX "/calculator-memory-" // Followed by the user id
+#define MEMORY_MAGIC 0x4d454d31                 // "MEM1": layout version of the bank
+#define MEMORY_REGISTERS 32
+#define MEMORY_NAME_MAX 16
+#define MEMORY_DEFAULT "M"       // Register used when no name is typed
+#define MEMORY_CLAIM_SPINS 10000 // Wait this long for another instance to name a register
+
+// Register states (a slot is never freed once named, so lookups can't race a reuse)
+#define MEMORY_EMPTY 0
+#define MEMORY_CLAIMING 1
+#define MEMORY_READY 2
+
+typedef struct {
+    uint32_t state;
+    char name[MEMORY_NAME_MAX];
+    uint64_t bits; // Bit pattern of the double value
+} MemoryRegister;
+
+// A freshly created segment is all zeros, which is already a valid empty bank
+typedef struct {
+    uint32_t magic;
+    uint32_t generation; // Futex word, incremented after every change
+    MemoryRegister registers[MEMORY_REGISTERS];
+} MemoryBank;
+
+MemoryBank *memory_bank = NULL;
+GtkWidget *memory_label;
+gint memory_refresh_pending = 0;
+
+static inline double memory_bits_to_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline uint64_t memory_double_to_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Map the shared bank, creating it if this is the first instance
+int memory_open(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%u", MEMORY_SHM_PREFIX, (unsigned)getuid());
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+
+    // Growing to the same size is a no-op, so racing creators are harmless
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < (off_t)sizeof(MemoryBank) && ftruncate(fd, sizeof(MemoryBank)) < 0)) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, sizeof(MemoryBank), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+
+    // Refuse a bank left behind by an incompatible version
+    MemoryBank *bank = map;
+    uint32_t magic = 0;
+    if (!__atomic_compare_exchange_n(&bank->magic, &magic, MEMORY_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        magic != MEMORY_MAGIC) {
+        munmap(map, sizeof(MemoryBank));
+        return 0;
+    }
+    memory_bank = bank;
+    return 1;
+}
+
+// Find a register by name, naming a free one if create is set (-1 if none)
+int memory_find(const char *name, int create) {
+    if (memory_bank == NULL || strlen(name) >= MEMORY_NAME_MAX) {
+        return -1;
+    }
+
+    // Probe from the name's hash so every instance agrees on where a name lives
+    unsigned hash = 5381;
+    for (const char *c = name; *c; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    for (int probe = 0; probe < MEMORY_REGISTERS; probe++) {
+        MemoryRegister *reg = &memory_bank->registers[(hash + probe) % MEMORY_REGISTERS];
+        uint32_t state = __atomic_load_n(&reg->state, __ATOMIC_ACQUIRE);
+        if (state == MEMORY_EMPTY) {
+            if (!create) {
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(&reg->state, &state, MEMORY_CLAIMING, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                strcpy(reg->name, name);
+                __atomic_store_n(&reg->state, MEMORY_READY, __ATOMIC_RELEASE);
+                return (hash + probe) % MEMORY_REGISTERS;
+            }
+        }
+
+        // Another instance may be naming this register right now
+        for (int spin = 0; state == MEMORY_CLAIMING && spin < MEMORY_CLAIM_SPINS; spin++) {
+            sched_yield();
+            state = __atomic_load_n(&reg->state, __ATOMIC_ACQUIRE);
+        }
+        if (state == MEMORY_READY && strcmp(reg->name, name) == 0) {
+            return (hash + probe) % MEMORY_REGISTERS;
+        }
+    }
+    return -1;
+}
+
+// Wake every instance waiting on the bank
+void memory_notify(void) {
+    __atomic_add_fetch(&memory_bank->generation, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &memory_bank->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Add delta to a register (store replaces the value instead)
+int memory_update(const char *name, double delta, int store) {
+    int index = memory_find(name, 1);
+    if (index < 0) {
+        return 0;
+    }
+    MemoryRegister *reg = &memory_bank->registers[index];
+    uint64_t old_bits = __atomic_load_n(&reg->bits, __ATOMIC_RELAXED);
+    uint64_t new_bits;
+    do {
+        new_bits = memory_double_to_bits(store ? delta : memory_bits_to_double(old_bits) + delta);
+    } while (!__atomic_compare_exchange_n(&reg->bits, &old_bits, new_bits, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    memory_notify();
+    return 1;
+}
+
+int memory_recall(const char *name, double *value) {
+    int index = memory_find(name, 0);
+    if (index < 0) {
+        return 0;
+    }
+    *value = memory_bits_to_double(__atomic_load_n(&memory_bank->registers[index].bits, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+// Show every non-zero register, e.g. "M 42   a 3.5"
+gboolean memory_refresh_indicator(gpointer data) {
+    (void)data;
+    g_atomic_int_set(&memory_refresh_pending, 0);
+    char text[512] = "";
+    for (int i = 0; memory_bank != NULL && i < MEMORY_REGISTERS; i++) {
+        MemoryRegister *reg = &memory_bank->registers[i];
+        double value = memory_bits_to_double(__atomic_load_n(&reg->bits, __ATOMIC_ACQUIRE));
+        if (__atomic_load_n(&reg->state, __ATOMIC_ACQUIRE) == MEMORY_READY && value != 0) {
+            char entry[64];
+            snprintf(entry, sizeof(entry), "%s%s %.10g", strlen(text) > 0 ? "   " : "", reg->name, value);
+            safe_strcat(text, entry, sizeof(text));
+        }
+    }
+    gtk_label_set_text(GTK_LABEL(memory_label), text);
+    return G_SOURCE_REMOVE;
+}
+
+// Sleep on the generation futex and refresh the indicator whenever it moves
+gpointer memory_watcher(gpointer data) {
+    (void)data;
+    for (;;) {
+        uint32_t generation = __atomic_load_n(&memory_bank->generation, __ATOMIC_ACQUIRE);
+        if (!g_atomic_int_get(&memory_refresh_pending)) {
+            g_atomic_int_set(&memory_refresh_pending, 1);
+            g_idle_add(memory_refresh_indicator, NULL);
+        }
+        // Returns at once if another change landed since the load above
+        syscall(SYS_futex, &memory_bank->generation, FUTEX_WAIT, generation, NULL, NULL, 0);
+    }
+    return NULL;
+}
+
+// A bare name typed before a memory button picks the register; otherwise it's "M"
+const char *memory_target(void) {
+    if (strlen(current_input) > 0 && is_name_start(current_input[0])) {
+        for (const char *c = current_input; *c; c++) {
+            if (!is_name_char(*c)) {
+                return MEMORY_DEFAULT;
+            }
+        }
+        return current_input;
+    }
+    return MEMORY_DEFAULT;
+}
+
+// M+ and M- use the number being typed, or else the last result
+void on_memory_add_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget;
+    const char *name = memory_target();
+    int named = name == current_input;
+    double value = result;
+    if (strlen(current_input) > 0 && !named) {
+        char *end;
+        value = strtod(current_input, &end);
+        if (*end != '\0') {
+            return;
+        }
+    }
+    if (memory_update(name, GPOINTER_TO_INT(data) < 0 ? -value : value, 0) && named) {
+        strcpy(current_input, "");
+        update_display();
+    }
+}
+
+// The shortest digits that read back as the same double, as a literal the
+// parser accepts (large and small values keep their exponent)
+void format_round_trip(double value, char *buf, size_t size) {
+    for (int digits = 15; digits <= 17; digits++) {
+        snprintf(buf, size, "%.*g", digits, value);
+        if (strtod(buf, NULL) == value) {
+            break;
+        }
+    }
+}
+
+// MR types the register's value as if it had been entered digit by digit
+void on_memory_recall_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    double value;
+    if (!memory_recall(memory_target(), &value)) {
+        value = 0;
+    }
+    if (has_result) {
+        strcpy(expression, "");
+        has_result = FALSE;
+    }
+    format_round_trip(value, current_input, sizeof(current_input));
+    update_display();
+}
+
+void on_memory_clear_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    const char *name = memory_target();
+    double value;
+    if (memory_recall(name, &value) && memory_update(name, 0, 1) && name == current_input) {
+        strcpy(current_input, "");
+        update_display();
+    }
+}
+
+// Function to handle keyboard input
+gboolean handle_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data) {
+    guint key = event->keyval;
+
+    // Ctrl+Z undoes; Ctrl+Shift+Z and Ctrl+Y redo
+    if (event->state & GDK_CONTROL_MASK) {
+        if (key == 'z' && !(event->state & GDK_SHIFT_MASK)) {
+            undo_step(&undo_stack, &redo_stack);
+            return TRUE;
+        }
+        if (key == 'Z' || key == 'z' || key == 'y' || key == 'Y') {
+            undo_step(&redo_stack, &undo_stack);
+            return TRUE;
+        }
+    }
+
+    // Handle number keys (0-9) and numpad keys
+    if (key >= '0' && key <= '9') {
+        char num_str[2] = {(char)key, '\0'};
+        on_number_clicked(NULL, (gpointer)num_str);
+        return TRUE;
+    }
+
+    // Handle numpad number keys
+    switch (key) {
+        case GDK_KEY_KP_0:
+            on_number_clicked(NULL, (gpointer)"0");
+            return TRUE;
+        case GDK_KEY_KP_1:
+            on_number_clicked(NULL, (gpointer)"1");
+            return TRUE;
+        case GDK_KEY_KP_2:
+            on_number_clicked(NULL, (gpointer)"2");
+            return TRUE;
+        case GDK_KEY_KP_3:
+            on_number_clicked(NULL, (gpointer)"3");
+            return TRUE;
+        case GDK_KEY_KP_4:
+            on_number_clicked(NULL, (gpointer)"4");
+            return TRUE;
+        case GDK_KEY_KP_5:
+            on_number_clicked(NULL, (gpointer)"5");
+            return TRUE;
+        case GDK_KEY_KP_6:
+            on_number_clicked(NULL, (gpointer)"6");
+            return TRUE;
+        case GDK_KEY_KP_7:
+            on_number_clicked(NULL, (gpointer)"7");
+            return TRUE;
+        case GDK_KEY_KP_8:
+            on_number_clicked(NULL, (gpointer)"8");
+            return TRUE;
+        case GDK_KEY_KP_9:
+            on_number_clicked(NULL, (gpointer)"9");
+            return TRUE;
+    }
+
+    // Lowercase letters and '_' spell variable and function names (and hex digits)
+    if ((key >= 'a' && key <= 'z') || key == '_') {
+        char name_str[2] = {(char)key, '\0'};
+        on_number_clicked(NULL, (gpointer)name_str);
+        return TRUE;
+    }
+
+    // Handle operation keys
+    switch (key) {
+        case '+':
+        case GDK_KEY_KP_Add:
+            on_operation_clicked(NULL, (gpointer)"+");
+            return TRUE;
+        case '-':
+        case GDK_KEY_KP_Subtract:
+            on_operation_clicked(NULL, (gpointer)"-");
+            return TRUE;
+        case '*':
+        case GDK_KEY_KP_Multiply:
+            on_operation_clicked(NULL, (gpointer)"*");
+            return TRUE;
+        case '/':
+        case GDK_KEY_KP_Divide:
+            on_operation_clicked(NULL, (gpointer)"/");
+            return TRUE;
+        case '^':
+            on_operation_clicked(NULL, (gpointer)"^");
+            return TRUE;
+        case '%':
+            on_operation_clicked(NULL, (gpointer)"%");
+            return TRUE;
+        case '!':
+            on_operation_clicked(NULL, (gpointer)"!");
+            return TRUE;
+        case '&':
+            on_operation_clicked(NULL, (gpointer)"&");
+            return TRUE;
+        case '|':
+            on_operation_clicked(NULL, (gpointer)"|");
+            return TRUE;
+        case '~':
+            on_operation_clicked(NULL, (gpointer)"~");
+            return TRUE;
+        case '<':
+            on_operation_clicked(NULL, (gpointer)"<<");
+            return TRUE;
+        case '>':
+            on_operation_clicked(NULL, (gpointer)">>");
+            return TRUE;
+        case '(':
+            on_operation_clicked(NULL, (gpointer)"(");
+            return TRUE;
+        case ')':
+            on_operation_clicked(NULL, (gpointer)")");
+            return TRUE;
+        case ',':
+            on_operation_clicked(NULL, (gpointer)",");
+            return TRUE;
+        case '[':
+            on_operation_clicked(NULL, (gpointer)"[");
+            return TRUE;
+        case ']':
+            on_operation_clicked(NULL, (gpointer)"]");
+            return TRUE;
+        case ';':
+            on_operation_clicked(NULL, (gpointer)";");
+            return TRUE;
+        case '=':
+            on_assign_key();
+            return TRUE;
+        case GDK_KEY_Return:
+        case GDK_KEY_KP_Enter:
+            on_equals_clicked(NULL, NULL);
+            return TRUE;
+        case '.':
+        case GDK_KEY_KP_Decimal:
+            on_decimal_clicked(NULL, NULL);
+            return TRUE;
+        case GDK_KEY_Escape:
+            if (evaluation_pending()) {
+                evaluation_cancel();
+                return TRUE;
+            }
+            on_clear_clicked(NULL, NULL);
+            return TRUE;
+        case 'C':
+            on_clear_clicked(NULL, NULL);
+            return TRUE;
+        case GDK_KEY_BackSpace:
+            on_backspace_clicked(NULL, NULL);
+            return TRUE;
+        case GDK_KEY_Delete:
+            on_delete_clicked(NULL, NULL);
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+// Every key press is traced and timed until its change reaches the screen
+gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data) {
+    trace_record_key(event);
+    frame_latency_key_started();
+    gboolean handled = handle_key_press(widget, event, data);
+    frame_latency_key_finished();
+    return handled;
+}
+
+// Streaming statistics over batch and table results (--stats). Every value is
+// folded into an accumulator as soon as it is computed, so memory stays fixed
+// however many rows there are: the sum is compensated (Neumaier), the variance
+// uses Welford's update, and quantiles come from a sketch of log-spaced
+// buckets. Each thread fills its own accumulator and they are merged at the end.
+#define STATS_SKETCH_BUCKETS 4096 // Buckets per sign: 64 binades at full resolution
+#define STATS_SKETCH_SUBBITS 6    // Mantissa bits in a bucket key: 64 buckets per binade, under 1% error
+#define STATS_BLOCK_LINES 4096    // Batch lines read before a block is evaluated across threads
+#define STATS_PARALLEL_MIN 256    // Smallest block of lines worth splitting across threads
+#define STATS_MAX_THREADS 8
+
+typedef struct {
+    int used;     // Set once the first value is counted
+    int offset;   // Key of counts[0]
+    int high_key; // Largest key counted, which the window must keep
+    unsigned long long counts[STATS_SKETCH_BUCKETS];
+} SketchStore;
+
+// Quantile sketch with bounded relative error. A magnitude's key is the top
+// bits of its IEEE representation (exponent and leading mantissa bits), which
+// orders like the values themselves. When the keys in use span more buckets
+// than a store has, the smallest magnitudes are folded into its lowest bucket.
+// Sketches merge by adding counts, so per-thread sketches combine exactly.
+typedef struct {
+    SketchStore positive;
+    SketchStore negative; // Counted by magnitude
+    unsigned long long zeros;
+} QuantileSketch;
+
+typedef struct {
+    long count;
+    long errors;
+    double sum;          // sum + compensation is the compensated total
+    double compensation;
+    double mean;         // Running mean and sum of squared deviations from it
+    double m2;
+    double min;
+    double max;
+    QuantileSketch sketch;
+} StatsAccumulator;
+
+static inline int sketch_key(double magnitude) {
+    uint64_t bits;
+    memcpy(&bits, &magnitude, sizeof(bits));
+    return (int)(bits >> (52 - STATS_SKETCH_SUBBITS));
+}
+
+// Middle of the range of magnitudes a key covers
+double sketch_key_value(int key) {
+    uint64_t lo_bits = (uint64_t)key << (52 - STATS_SKETCH_SUBBITS);
+    uint64_t hi_bits = (uint64_t)(key + 1) << (52 - STATS_SKETCH_SUBBITS);
+    double lo, hi;
+    memcpy(&lo, &lo_bits, sizeof(lo));
+    memcpy(&hi, &hi_bits, sizeof(hi));
+    return lo + (hi - lo) / 2;
+}
+
+// Move the window to start at new_offset. Moving up folds the buckets that
+// fall off the bottom into the new lowest one; moving down only ever drops
+// empty buckets off the top.
+void sketch_store_shift(SketchStore *s, int new_offset) {
+    int shift = new_offset - s->offset;
+    if (shift > 0) {
+        int dropped = MIN(shift, STATS_SKETCH_BUCKETS);
+        unsigned long long folded = 0;
+        for (int k = 0; k < dropped; k++) {
+            folded += s->counts[k];
+        }
+        memmove(s->counts, s->counts + dropped, sizeof(s->counts[0]) * (STATS_SKETCH_BUCKETS - dropped));
+        memset(s->counts + STATS_SKETCH_BUCKETS - dropped, 0, sizeof(s->counts[0]) * dropped);
+        s->counts[0] += folded;
+    } else if (shift < 0) {
+        int moved = -shift;
+        memmove(s->counts + moved, s->counts, sizeof(s->counts[0]) * (STATS_SKETCH_BUCKETS - moved));
+        memset(s->counts, 0, sizeof(s->counts[0]) * moved);
+    }
+    s->offset = new_offset;
+}
+
+static inline void sketch_store_add(SketchStore *s, int key, unsigned long long n) {
+    if (!s->used) {
+        s->used = 1;
+        s->offset = key - STATS_SKETCH_BUCKETS / 2; // Room to grow either way
+        s->high_key = key;
+    }
+    if (key >= s->offset + STATS_SKETCH_BUCKETS) {
+        sketch_store_shift(s, key - STATS_SKETCH_BUCKETS + 1);
+    } else if (key < s->offset) {
+        // Reach down as far as the largest key allows; anything lower is folded
+        int lowest = MAX(key, s->high_key - STATS_SKETCH_BUCKETS + 1);
+        if (lowest < s->offset) {
+            sketch_store_shift(s, lowest);
+        }
+    }
+    s->high_key = MAX(s->high_key, key);
+    s->counts[MAX(key - s->offset, 0)] += n;
+}
+
+static inline void sketch_add(QuantileSketch *q, double x) {
+    if (x > 0) {
+        sketch_store_add(&q->positive, sketch_key(x), 1);
+    } else if (x < 0) {
+        sketch_store_add(&q->negative, sketch_key(-x), 1);
+    } else {
+        q->zeros++;
+    }
+}
+
+void sketch_store_merge(SketchStore *into, const SketchStore *from) {
+    for (int k = 0; from->used && k < STATS_SKETCH_BUCKETS; k++) {
+        if (from->counts[k] > 0) {
+            sketch_store_add(into, from->offset + k, from->counts[k]);
+        }
+    }
+}
+
+// Value at the given rank (0 is the smallest), walking the buckets in value order
+double sketch_value_at(const QuantileSketch *q, unsigned long long rank) {
+    unsigned long long seen = 0;
+    for (int k = STATS_SKETCH_BUCKETS - 1; q->negative.used && k >= 0; k--) {
+        seen += q->negative.counts[k];
+        if (seen > rank) {
+            return -sketch_key_value(q->negative.offset + k);
+        }
+    }
+    seen += q->zeros;
+    if (seen > rank) {
+        return 0;
+    }
+    for (int k = 0; q->positive.used && k < STATS_SKETCH_BUCKETS; k++) {
+        seen += q->positive.counts[k];
+        if (seen > rank) {
+            return sketch_key_value(q->positive.offset + k);
+        }
+    }
+    return NAN;
+}
+
+void stats_init(StatsAccumulator *acc) {
+    memset(acc, 0, sizeof(*acc));
+    acc->min = INFINITY;
+    acc->max = -INFINITY;
+}
+
+// Neumaier's variant of Kahan summation, which also holds up when an addend
+// is larger than the running sum
+static inline void neumaier_add(double *sum, double *compensation, double x) {
+    double t = *sum + x;
+    if (fabs(*sum) >= fabs(x)) {
+        *compensation += (*sum - t) + x;
+    } else {
+        *compensation += (x - t) + *sum;
+    }
+    *sum = t;
+}
+
+static inline void stats_add(StatsAccumulator *acc, double x) {
+    acc->count++;
+    neumaier_add(&acc->sum, &acc->compensation, x);
+    double delta = x - acc->mean;
+    acc->mean += delta / acc->count;
+    acc->m2 += delta * (x - acc->mean);
+    acc->min = MIN(acc->min, x);
+    acc->max = MAX(acc->max, x);
+    sketch_add(&acc->sketch, x);
+}
+
+// Fold one partial aggregate into another (Chan et al. for the variance)
+void stats_merge(StatsAccumulator *into, const StatsAccumulator *from) {
+    into->errors += from->errors;
+    if (from->count == 0) {
+        return;
+    }
+    long n = into->count + from->count;
+    double delta = from->mean - into->mean;
+    into->mean += delta * ((double)from->count / n);
+    into->m2 += from->m2 + delta * delta * ((double)into->count * from->count / n);
+    into->count = n;
+    neumaier_add(&into->sum, &into->compensation, from->sum);
+    into->compensation += from->compensation;
+    into->min = MIN(into->min, from->min);
+    into->max = MAX(into->max, from->max);
+    sketch_store_merge(&into->sketch.positive, &from->sketch.positive);
+    sketch_store_merge(&into->sketch.negative, &from->sketch.negative);
+    into->sketch.zeros += from->sketch.zeros;
+}
+
+// Quantile by rank interpolation, kept within the exact minimum and maximum
+double stats_quantile(const StatsAccumulator *acc, double fraction) {
+    if (acc->count == 0) {
+        return NAN;
+    }
+    double rank = fraction * (acc->count - 1);
+    double lo = sketch_value_at(&acc->sketch, (unsigned long long)floor(rank));
+    double hi = sketch_value_at(&acc->sketch, (unsigned long long)ceil(rank));
+    double value = lo + (hi - lo) * (rank - floor(rank));
+    return MIN(MAX(value, acc->min), acc->max);
+}
+
+void stats_print(const StatsAccumulator *acc) {
+    printf("count     %ld\n", acc->count);
+    printf("errors    %ld\n", acc->errors);
+    if (acc->count == 0) {
+        return;
+    }
+    double variance = acc->count > 1 ? acc->m2 / (acc->count - 1) : 0;
+    printf("sum       %.17g\n", acc->sum + acc->compensation);
+    printf("mean      %.17g\n", acc->mean);
+    printf("variance  %.17g\n", variance);
+    printf("stddev    %.17g\n", sqrt(variance));
+    printf("min       %.17g\n", acc->min);
+    printf("p25       %.6g\n", stats_quantile(acc, 0.25));
+    printf("median    %.6g\n", stats_quantile(acc, 0.50));
+    printf("p75       %.6g\n", stats_quantile(acc, 0.75));
+    printf("p90       %.6g\n", stats_quantile(acc, 0.90));
+    printf("p99       %.6g\n", stats_quantile(acc, 0.99));
+    printf("max       %.17g\n", acc->max);
+}
+
+// A block of independent batch lines, split across threads
+typedef struct {
+    char **lines;
+    int start;
+    int end;
+    StatsAccumulator *acc;
+    int last_ok;      // Index of the last line that evaluated, or -1
+    double last_value;
+} StatsChunk;
+
+gpointer stats_chunk_worker(gpointer data) {
+    StatsChunk *chunk = data;
+    chunk->last_ok = -1;
+    for (int i = chunk->start; i < chunk->end; i++) {
+        CalcResult res = evaluate_expression_result(chunk->lines[i]);
+        if (res.error != CALC_OK || !isfinite(res.value)) {
+            chunk->acc->errors++;
+            continue;
+        }
+        stats_add(chunk->acc, res.value);
+        chunk->last_ok = i;
+        chunk->last_value = res.value;
+    }
+    return NULL;
+}
+
+// Evaluate a block of lines that neither define names nor use ans, each
+// thread into its own accumulator, then merge them into acc in order
+void stats_evaluate_block(char **lines, int n, StatsAccumulator **partials, StatsAccumulator *acc) {
+    if (n <= 0) {
+        return;
+    }
+    int threads = 1;
+    if (n >= STATS_PARALLEL_MIN) {
+        threads = MAX(MIN((int)g_get_num_processors(), STATS_MAX_THREADS), 1);
+    }
+    int per_thread = (n + threads - 1) / threads;
+
+    StatsChunk chunks[STATS_MAX_THREADS];
+    GThread *workers[STATS_MAX_THREADS];
+    int chunk_count = 0;
+    for (int start = 0; start < n; start += per_thread) {
+        stats_init(partials[chunk_count]);
+        chunks[chunk_count].lines = lines;
+        chunks[chunk_count].start = start;
+        chunks[chunk_count].end = MIN(start + per_thread, n);
+        chunks[chunk_count].acc = partials[chunk_count];
+        chunk_count++;
+    }
+
+    // The calling thread evaluates the first chunk itself
+    for (int t = 1; t < chunk_count; t++) {
+        workers[t] = g_thread_new("stats", stats_chunk_worker, &chunks[t]);
+    }
+    stats_chunk_worker(&chunks[0]);
+    for (int t = 1; t < chunk_count; t++) {
+        g_thread_join(workers[t]);
+    }
+    for (int t = 0; t < chunk_count; t++) {
+        stats_merge(acc, partials[t]);
+        if (chunks[t].last_ok >= 0) {
+            symbol_values[ANS_SLOT] = chunks[t].last_value; // As if the lines ran in order
+        }
+    }
+}
+
+// Does a batch line depend on the lines before it? Definitions change names,
+// and ans is the previous line's result.
+int stats_line_ordered(const char *line) {
+    CalcDefinition def;
+    if (parse_definition(line, &def)) {
+        return 1;
+    }
+    int pos = 0;
+    int start;
+    while ((start = worksheet_next_name(line, &pos)) >= 0) {
+        if (pos - start == 3 && strncmp(line + start, "ans", 3) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Aggregate a batch instead of printing each result. Independent lines are
+// evaluated a block at a time across threads; a definition or a use of ans
+// first finishes the block before it, so results match an in-order run.
+int run_batch_stats(FILE *in) {
+    StatsAccumulator *acc = malloc(sizeof(StatsAccumulator));
+    StatsAccumulator *partials[STATS_MAX_THREADS];
+    char *lines[STATS_BLOCK_LINES];
+    size_t capacities[STATS_BLOCK_LINES];
+    int ok = acc != NULL;
+    for (int t = 0; t < STATS_MAX_THREADS; t++) {
+        partials[t] = malloc(sizeof(StatsAccumulator));
+        ok = ok && partials[t] != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+        free(acc);
+        for (int t = 0; t < STATS_MAX_THREADS; t++) {
+            free(partials[t]);
+        }
+        return 1;
+    }
+    stats_init(acc);
+    memset(lines, 0, sizeof(lines));
+    memset(capacities, 0, sizeof(capacities));
+
+    int pending = 0;
+    ssize_t len;
+    while ((len = getline(&lines[pending], &capacities[pending], in)) != -1) {
+        char *line = lines[pending];
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (!stats_line_ordered(line)) {
+            if (++pending == STATS_BLOCK_LINES) {
+                stats_evaluate_block(lines, pending, partials, acc);
+                pending = 0;
+            }
+            continue;
+        }
+        stats_evaluate_block(lines, pending, partials, acc);
+        pending = 0;
+        int defined_function = 0;
+        CalcDefinition def;
+        int definition = parse_definition(line, &def);
+        CalcResult res = evaluate_line(line, &defined_function);
+        if (res.error != CALC_OK || !isfinite(res.value)) {
+            acc->errors++;
+        } else if (!definition) {
+            stats_add(acc, res.value); // Definitions aren't results
+        }
+    }
+    stats_evaluate_block(lines, pending, partials, acc);
+    stats_print(acc);
+    fflush(stdout);
+
+    long errors = acc->errors;
+    for (int k = 0; k < STATS_BLOCK_LINES; k++) {
+        free(lines[k]);
+    }
+    for (int t = 0; t < STATS_MAX_THREADS; t++) {
+        free(partials[t]);
+    }
+    free(acc);
+    return errors > 0 ? 2 : 0;
+}
+
+// Rows of a table aggregated by one thread, a column block at a time
+typedef struct {
+    const CalcProgram *prog;
+    double from;
+    double to;
+    long steps;
+    long start;
+    long end;
+    StatsAccumulator *acc;
+} StatsTableChunk;
+
+gpointer stats_table_worker(gpointer data) {
+    StatsTableChunk *chunk = data;
+    double x[COLUMN_BLOCK];
+    double y[COLUMN_BLOCK];
+    CalcError errors[COLUMN_BLOCK];
+    const double *columns[1] = { x };
+    for (long row = chunk->start; row < chunk->end; row += COLUMN_BLOCK) {
+        int n = (int)MIN(COLUMN_BLOCK, chunk->end - row);
+        for (int r = 0; r < n; r++) {
+            x[r] = chunk->from + (chunk->to - chunk->from) * (row + r) / chunk->steps;
+        }
+        run_program_columns(chunk->prog, columns, 1, n, y, errors);
+        for (int r = 0; r < n; r++) {
+            if (errors[r] != CALC_OK || !isfinite(y[r])) {
+                chunk->acc->errors++;
+            } else {
+                stats_add(chunk->acc, y[r]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Aggregate an expression in x over a range without storing the rows
+int run_table_stats(const char *expr, double from, double to, long steps) {
+    char params[1][MAX_SYMBOL_NAME] = { "x" };
+    CompileScope scope = { params, 1, -1, 0, 0 };
+    CalcProgram prog;
+    int offset;
+    CalcError error = compile_expression_scoped(expr, &scope, &prog, &offset);
+    if (error != CALC_OK) {
+        fprintf(stderr, "error: offset %d: %s\n", offset, calc_error_message(error));
+        return 1;
+    }
+    if (steps < 1) {
+        steps = 1;
+    }
+    long rows = steps + 1;
+    jit_note_rows(&prog, rows); // Compiled once, before the threads share the program
+
+    int threads = 1;
+    if (rows >= (long)STATS_PARALLEL_MIN * COLUMN_BLOCK) {
+        threads = MAX(MIN((int)g_get_num_processors(), STATS_MAX_THREADS), 1);
+    }
+    long per_thread = (rows + threads - 1) / threads;
+    per_thread = (per_thread + COLUMN_BLOCK - 1) / COLUMN_BLOCK * COLUMN_BLOCK;
+
+    StatsTableChunk chunks[STATS_MAX_THREADS];
+    GThread *workers[STATS_MAX_THREADS];
+    int chunk_count = 0;
+    for (long start = 0; start < rows; start += per_thread) {
+        StatsAccumulator *acc = malloc(sizeof(StatsAccumulator));
+        if (acc == NULL) {
+            break;
+        }
+        stats_init(acc);
+        chunks[chunk_count].prog = &prog;
+        chunks[chunk_count].from = from;
+        chunks[chunk_count].to = to;
+        chunks[chunk_count].steps = steps;
+        chunks[chunk_count].start = start;
+        chunks[chunk_count].end = MIN(start + per_thread, rows);
+        chunks[chunk_count].acc = acc;
+        chunk_count++;
+    }
+    if (chunk_count == 0 || chunks[chunk_count - 1].end < rows) {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+        for (int t = 0; t < chunk_count; t++) {
+            free(chunks[t].acc);
+        }
+        free_program(&prog);
+        return 1;
+    }
+
+    // The calling thread aggregates the first chunk itself
+    for (int t = 1; t < chunk_count; t++) {
+        workers[t] = g_thread_new("stats", stats_table_worker, &chunks[t]);
+    }
+    stats_table_worker(&chunks[0]);
+    for (int t = 1; t < chunk_count; t++) {
+        g_thread_join(workers[t]);
+    }
+    for (int t = 1; t < chunk_count; t++) {
+        stats_merge(chunks[0].acc, chunks[t].acc);
+        free(chunks[t].acc);
+    }
+    stats_print(chunks[0].acc);
+    free(chunks[0].acc);
+    free_program(&prog);
+    return 0;
+}
+
+// Decimal places of batch results in exact mode whose expansion doesn't terminate
+#define BATCH_EXACT_PLACES 20
+
+// Evaluate one expression or definition per line from a file (or stdin) and print one result per line.
+// Failed lines print "error: line N, offset M: message" so output stays aligned with input.
+// With stats set, only a summary of the results is printed (see run_batch_stats).
+int run_batch(const char *path, int stats) {
+    FILE *in = stdin;
+    if (path != NULL && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+    if (stats) {
+        int status = run_batch_stats(in);
+        if (in != stdin) {
+            fclose(in);
+        }
+        return status;
+    }
+
+    static char out_buffer[1 << 16];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t len;
+    long line_number = 0;
+    long failures = 0;
+    while ((len = getline(&line, &line_capacity, in)) != -1) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+
+        int defined_function = 0;
+        CalcResult res = { NAN, 0, 0, CALC_OK, 0 };
+        CalcDefinition def;
+        if (arithmetic_mode == ARITHMETIC_PROGRAMMER && !parse_definition(line, &def)) {
+            uint64_t bits;
+            res.error = evaluate_expression_programmer(line, &bits, &res.error_offset);
+            if (res.error == CALC_OK) {
+                char text[PROGRAMMER_FORMAT_SIZE + 1];
+                int length = format_programmer(bits, programmer_base, text);
+                text[length++] = '\n';
+                fwrite(text, 1, length, stdout);
+                continue;
+            }
+        } else if (arithmetic_mode == ARITHMETIC_EXACT && !parse_definition(line, &def)) {
+            // Every digit is printed, so 10000! comes out in full
+            static char exact_text[1 << 20];
+            res = evaluate_expression_exact(line, BATCH_EXACT_PLACES, exact_text, sizeof(exact_text));
+            if (res.error == CALC_OK && exact_text[0] != '\0') {
+                fputs(exact_text, stdout);
+                putchar('\n');
+                continue;
+            }
+        } else if (arithmetic_mode == ARITHMETIC_COMPLEX && !parse_definition(line, &def)) {
+            Complex z;
+            res.error = evaluate_expression_complex(line, &z, &res.error_offset);
+            if (res.error == CALC_OK) {
+                char text[96];
+                format_complex(z, -1, text, sizeof(text));
+                printf("%s\n", text);
+                continue;
+            }
+        } else if (strchr(line, '[') != NULL && !parse_definition(line, &def)) {
+            MatrixArena arena = { NULL };
+            MatrixValue m;
+            res.error = evaluate_expression_matrix(line, &arena, &m, &res.error_offset);
+            if (res.error == CALC_OK) {
+                GString *text = g_string_new(NULL);
+                format_matrix(&m, -1, text);
+                printf("%s\n", text->str);
+                g_string_free(text, TRUE);
+            }
+            matrix_arena_release(&arena);
+            if (res.error == CALC_OK) {
+                continue;
+            }
+        } else {
+            res = evaluate_line(line, &defined_function);
+        }
+        if (res.error != CALC_OK) {
+            printf("error: line %ld, offset %d: %s\n", line_number, res.error_offset,
+                   calc_error_message(res.error));
+            failures++;
+        } else if (defined_function) {
+            printf("defined\n");
+        } else if (res.is_integer) {
+            printf("%lld\n", res.int_value);
+        } else {
+            printf("%.17g\n", res.value);
+        }
+    }
+
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    fflush(stdout);
+    if (failures > 0) {
+        fprintf(stderr, "%ld of %ld lines failed\n", failures, line_number);
+    }
+    return failures > 0 ? 2 : 0;
+}
+
+// Streaming evaluation of a single expression of any length (--stream). The
+// text is read in fixed-size chunks and evaluated as it is parsed, with the
+// same precedence rules as compile_expression_scoped: an operator waits on a
+// frame only until one that binds less tightly arrives, so a flat sum of any
+// length keeps one pending operator and one partial result. The value and
+// frame stacks grow with nesting depth alone, never with the expression's length.
+#define STREAM_CHUNK_SIZE (1 << 16)
+
+typedef struct {
+    FILE *in;
+    char buffer[STREAM_CHUNK_SIZE];
+    size_t pos;
+    size_t length;
+    long long offset; // Stream offset of buffer[0]
+} StreamReader;
+
+static inline int stream_refill(StreamReader *r) {
+    r->offset += (long long)r->length;
+    r->length = fread(r->buffer, 1, sizeof(r->buffer), r->in);
+    r->pos = 0;
+    return r->length > 0;
+}
+
+// The next character, or EOF at the end of the stream
+static inline int stream_peek(StreamReader *r) {
+    if (r->pos == r->length && !stream_refill(r)) {
+        return EOF;
+    }
+    return (unsigned char)r->buffer[r->pos];
+}
+
+static inline long long stream_offset(const StreamReader *r) {
+    return r->offset + (long long)r->pos;
+}
+
+// A pending operator, parenthesis or call. Calls remember where their
+// arguments start on the value stack.
+typedef struct {
+    FrameKind kind;
+    CalcOpcode op;
+    int power;
+    long long start; // Stream offset of the operator, '(' or function name
+    int slot;        // Function slot (calls)
+    int arity;       // Parameters the function takes (calls)
+    int args;        // Arguments completed so far (calls)
+    int base;        // Value stack height when the call opened
+} StreamFrame;
+
+typedef struct {
+    double *values;
+    int value_count;
+    int value_capacity;
+    StreamFrame *frames;
+    int frame_count;
+    int frame_capacity;
+    CalcError error; // First error found
+    long long error_offset;
+} StreamEvaluator;
+
+static inline void stream_error(StreamEvaluator *e, CalcError error, long long offset) {
+    if (e->error == CALC_OK) {
+        e->error = error;
+        e->error_offset = offset;
+    }
+}
+
+// Grow a stack by doubling; returns 0 when out of memory
+int stream_reserve(void **items, int *capacity, int count, size_t item_size) {
+    if (count < *capacity) {
+        return 1;
+    }
+    int new_capacity = *capacity > 0 ? *capacity * 2 : 64;
+    void *grown = realloc(*items, item_size * new_capacity);
+    if (grown == NULL) {
+        return 0;
+    }
+    *items = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static inline void stream_push_value(StreamEvaluator *e, double value, long long offset) {
+    if (!stream_reserve((void **)&e->values, &e->value_capacity, e->value_count, sizeof(double))) {
+        stream_error(e, CALC_ERR_OUT_OF_MEMORY, offset);
+        return;
+    }
+    e->values[e->value_count++] = value;
+}
+
+static inline StreamFrame *stream_push_frame(StreamEvaluator *e, FrameKind kind, CalcOpcode op, int power,
+                                             long long start) {
+    if (!stream_reserve((void **)&e->frames, &e->frame_capacity, e->frame_count, sizeof(StreamFrame))) {
+        stream_error(e, CALC_ERR_OUT_OF_MEMORY, start);
+        return NULL;
+    }
+    StreamFrame *frame = &e->frames[e->frame_count++];
+    frame->kind = kind;
+    frame->op = op;
+    frame->power = power;
+    frame->start = start;
+    return frame;
+}
+
+// Apply a built-in or user function to the arguments on top of the stack,
+// with the same checks as run_program_with
+void stream_call(StreamEvaluator *e, const StreamFrame *frame) {
+    double *args = &e->values[frame->base];
+    double result;
+    CalcError error = CALC_OK;
+    if (frame->op == OP_BUILTIN) {
+        const BuiltinFunction *fn = &builtin_functions[frame->slot];
+        error = fn->domain != NULL ? fn->domain(args) : CALC_OK;
+        result = error == CALC_OK ? fn->scalar(args) : 0;
+    } else {
+        int offset;
+        error = run_program_with(&symbols[frame->slot].body, args, 1, &result, &offset);
+    }
+    if (error == CALC_OK && isinf(result)) {
+        error = CALC_ERR_OVERFLOW;
+    }
+    if (error != CALC_OK) {
+        stream_error(e, error, frame->start); // Calls report the call site
+        return;
+    }
+    e->value_count = frame->base;
+    e->values[e->value_count++] = result;
+}
+
+// Complete the innermost pending operator
+static inline void stream_reduce(StreamEvaluator *e) {
+    const StreamFrame *frame = &e->frames[--e->frame_count];
+    double *top = &e->values[e->value_count - 1];
+    if (frame->kind == FRAME_PREFIX) {
+        *top = -*top;
+        return;
+    }
+    double b = *top;
+    double *a = top - 1;
+    e->value_count--;
+    switch (frame->op) {
+        case OP_ADD: *a += b; break;
+        case OP_SUB: *a -= b; break;
+        case OP_MUL: *a *= b; break;
+        case OP_DIV:
+            if (b == 0) {
+                stream_error(e, CALC_ERR_DIVISION_BY_ZERO, frame->start);
+                return;
+            }
+            *a /= b;
+            break;
+        default: {
+            double args[2] = { *a, b };
+            CalcError error = domain_power(args);
+            if (error != CALC_OK) {
+                stream_error(e, error, frame->start);
+                return;
+            }
+            *a = pow(*a, b);
+            break;
+        }
+    }
+    if (isinf(*a)) {
+        stream_error(e, CALC_ERR_OVERFLOW, frame->start);
+    }
+}
+
+static inline void stream_reduce_operators(StreamEvaluator *e, int min_power) {
+    while (e->error == CALC_OK && e->frame_count > 0 && e->frames[e->frame_count - 1].kind <= FRAME_INFIX &&
+           e->frames[e->frame_count - 1].power > min_power) {
+        stream_reduce(e);
+    }
+}
+
+// Read a number the way parse_number does, so results match the other paths.
+// Literals too long for the buffer are copied to the heap.
+static inline double stream_number(StreamEvaluator *e, StreamReader *r) {
+    char literal[128];
+    GString *longer = NULL;
+    int length = 0;
+    int decimal_place = 0;
+    int exponent = -1; // Offset of the 'e', once seen
+    int exponent_digits = 0;
+    for (int c = stream_peek(r); c != EOF; c = stream_peek(r)) {
+        if (c == '.' && !decimal_place && exponent < 0) {
+            decimal_place = 1;
+        } else if ((c == 'e' || c == 'E') && exponent < 0) {
+            exponent = length;
+        } else if ((c == '+' || c == '-') && exponent == length - 1) {
+            // Sign of the exponent
+        } else if (c >= '0' && c <= '9') {
+            exponent_digits += exponent >= 0;
+        } else {
+            break;
+        }
+        if (length < (int)sizeof(literal) - 1) {
+            literal[length] = (char)c;
+        } else {
+            if (longer == NULL) {
+                longer = g_string_new_len(literal, length);
+            }
+            g_string_append_c(longer, (char)c);
+        }
+        length++;
+        r->pos++;
+    }
+    literal[length < (int)sizeof(literal) ? length : (int)sizeof(literal) - 1] = '\0';
+    const char *text = longer != NULL ? longer->str : literal;
+    if (exponent >= 0) {
+        int magnitude = 0;
+        for (const char *q = text + exponent + 1; *q != '\0'; q++) {
+            if (*q >= '0' && *q <= '9' && magnitude < MAX_LITERAL_EXPONENT) {
+                magnitude = magnitude * 10 + (*q - '0');
+            }
+        }
+        // Unlike parse_number the 'e' can't be given back, so "2e" is reported
+        // where the name it would have started is
+        if (exponent_digits == 0 || magnitude >= MAX_LITERAL_EXPONENT) {
+            stream_error(e, exponent_digits == 0 ? CALC_ERR_MISSING_OPERATOR : CALC_ERR_OVERFLOW,
+                         stream_offset(r) - length + exponent);
+        }
+    }
+    char *end;
+    double num = parse_decimal(text, &end);
+    if (longer != NULL) {
+        g_string_free(longer, TRUE);
+    }
+    return num;
+}
+
+// Read a name and act on it: a variable pushes its value, and a function
+// opens a call frame (setting *called) once its '(' has been read
+void stream_identifier(StreamEvaluator *e, StreamReader *r, int *called) {
+    long long start = stream_offset(r);
+    char name[MAX_SYMBOL_NAME];
+    int length = 0;
+    for (int c = stream_peek(r); c != EOF && is_name_char((char)c); c = stream_peek(r)) {
+        if (length == MAX_SYMBOL_NAME - 1) {
+            stream_error(e, CALC_ERR_UNDEFINED_NAME, start); // Longer than any name can be
+            return;
+        }
+        name[length++] = (char)c;
+        r->pos++;
+    }
+    int c = stream_peek(r);
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        r->pos++;
+        c = stream_peek(r);
+    }
+    *called = c == '(';
+
+    int builtin = find_builtin(name, length);
+    int slot = builtin < 0 ? find_symbol(name, length) : -1;
+    if (builtin >= 0 || (slot >= 0 && symbols[slot].kind == SYMBOL_FUNCTION)) {
+        if (!*called) {
+            stream_error(e, CALC_ERR_ARGUMENT_COUNT, start);
+            return;
+        }
+        StreamFrame *frame = stream_push_frame(e, FRAME_CALL, builtin >= 0 ? OP_BUILTIN : OP_CALL, 0, start);
+        if (frame != NULL) {
+            frame->slot = builtin >= 0 ? builtin : slot;
+            frame->arity = builtin >= 0 ? builtin_functions[builtin].arity : symbols[slot].param_count;
+            frame->args = 0;
+            frame->base = e->value_count;
+        }
+        r->pos++;
+        return;
+    }
+    *called = 0;
+    if (slot < 0 || c == '(' || isnan(symbol_values[slot])) {
+        stream_error(e, CALC_ERR_UNDEFINED_NAME, start);
+        return;
+    }
+    stream_push_value(e, symbol_values[slot], start);
+}
+
+// Evaluate one expression read from a stream, in doubles
+CalcError evaluate_stream(FILE *in, double *out, long long *error_offset) {
+    StreamReader *r = malloc(sizeof(StreamReader));
+    if (r == NULL) {
+        *error_offset = 0;
+        return CALC_ERR_OUT_OF_MEMORY;
+    }
+    r->in = in;
+    r->pos = 0;
+    r->length = 0;
+    r->offset = 0;
+    StreamEvaluator e = { NULL, 0, 0, NULL, 0, 0, CALC_OK, 0 };
+
+    int expect_operand = 1;
+    int empty = 1;
+    long long previous = 0; // Start of the last token read
+    while (e.error == CALC_OK) {
+        int c = stream_peek(r);
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            r->pos++;
+            continue;
+        }
+        long long start = stream_offset(r);
+        if (c == EOF && empty) {
+            break; // An empty expression evaluates to 0
+        }
+        empty = 0;
+
+        if (expect_operand) {
+            if ((c >= '0' && c <= '9') || c == '.') {
+                stream_push_value(&e, stream_number(&e, r), start);
+                expect_operand = 0;
+            } else if (c != EOF && is_name_start((char)c)) {
+                int called;
+                stream_identifier(&e, r, &called);
+                expect_operand = called;
+            } else if (c == '(') {
+                stream_push_frame(&e, FRAME_GROUP, OP_PUSH, 0, start);
+                r->pos++;
+            } else if (c == '-') {
+                stream_push_frame(&e, FRAME_PREFIX, OP_NEG, PREFIX_POWER, start);
+                r->pos++;
+            } else if (c == '+') {
+                r->pos++; // Unary plus does nothing
+            } else if (c == ')' && e.frame_count > 0 && e.frames[e.frame_count - 1].kind == FRAME_CALL &&
+                       e.frames[e.frame_count - 1].args == 0) {
+                // "f()": a call without arguments
+                StreamFrame frame = e.frames[--e.frame_count];
+                if (frame.arity != 0) {
+                    stream_error(&e, CALC_ERR_ARGUMENT_COUNT, frame.start);
+                } else if (stream_reserve((void **)&e.values, &e.value_capacity, e.value_count, sizeof(double))) {
+                    stream_call(&e, &frame);
+                } else {
+                    stream_error(&e, CALC_ERR_OUT_OF_MEMORY, start);
+                }
+                r->pos++;
+                expect_operand = 0;
+            } else if (c == EOF) {
+                stream_error(&e, CALC_ERR_MISSING_OPERAND, previous);
+            } else if (c == ')' && e.frame_count == 0) {
+                stream_error(&e, CALC_ERR_MISMATCHED_PAREN, start);
+            } else if (c == ')' || c == ',' || find_infix_operator((char)c) != NULL) {
+                stream_error(&e, CALC_ERR_MISSING_OPERAND, start);
+            } else {
+                stream_error(&e, CALC_ERR_INVALID_CHARACTER, start);
+            }
+        } else {
+            const InfixOperator *infix = c != EOF ? find_infix_operator((char)c) : NULL;
+            if (c == '!') {
+                // Postfix factorial of the operand just completed
+                StreamFrame frame = { FRAME_CALL, OP_BUILTIN, 0, start, find_builtin("fact", 4), 1, 1,
+                                      e.value_count - 1 };
+                stream_call(&e, &frame);
+                r->pos++;
+            } else if (infix != NULL) {
+                stream_reduce_operators(&e, infix->left_power);
+                stream_push_frame(&e, FRAME_INFIX, infix->op, infix->right_power, start);
+                r->pos++;
+                expect_operand = 1;
+            } else if (c == ')' || c == ',' || c == EOF) {
+                stream_reduce_operators(&e, 0);
+                if (e.error != CALC_OK) {
+                    break;
+                }
+                StreamFrame *frame = e.frame_count > 0 ? &e.frames[e.frame_count - 1] : NULL;
+                if (c == EOF) {
+                    if (frame != NULL) {
+                        stream_error(&e, CALC_ERR_MISMATCHED_PAREN, frame->start);
+                    }
+                    break;
+                }
+                if (frame == NULL) {
+                    stream_error(&e, c == ')' ? CALC_ERR_MISMATCHED_PAREN : CALC_ERR_INVALID_CHARACTER, start);
+                } else if (c == ',') {
+                    if (frame->kind != FRAME_CALL) {
+                        stream_error(&e, CALC_ERR_INVALID_CHARACTER, start); // Not in a call
+                    } else {
+                        frame->args++;
+                        expect_operand = 1;
+                    }
+                } else {
+                    e.frame_count--;
+                    if (frame->kind == FRAME_CALL) {
+                        if (frame->args + 1 != frame->arity) {
+                            stream_error(&e, CALC_ERR_ARGUMENT_COUNT, frame->start);
+                        } else {
+                            stream_call(&e, frame);
+                        }
+                    }
+                }
+                r->pos++;
+            } else if (c == '(' || is_name_start((char)c) || (c >= '0' && c <= '9') || c == '.') {
+                stream_error(&e, CALC_ERR_MISSING_OPERATOR, start);
+            } else {
+                stream_error(&e, CALC_ERR_INVALID_CHARACTER, start);
+            }
+        }
+        previous = start;
+    }
+
+    if (e.error == CALC_OK) {
+        *out = e.value_count > 0 ? e.values[e.value_count - 1] : 0;
+    } else {
+        *error_offset = e.error_offset;
+    }
+    free(e.values);
+    free(e.frames);
+    free(r);
+    return e.error;
+}
+
+// Evaluate the single expression in a file (or stdin) and print its value
+int run_stream(const char *path) {
+    FILE *in = stdin;
+    if (path != NULL && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (in == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+    double value;
+    long long error_offset;
+    CalcError error = evaluate_stream(in, &value, &error_offset);
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (error != CALC_OK) {
+        printf("error: offset %lld: %s\n", error_offset, calc_error_message(error));
+        return 2;
+    }
+    printf("%.17g\n", value);
+    return 0;
+}
+
+// Evaluate a file as a worksheet, printing one result per line
+int run_worksheet(const char *path) {
+    gchar *text;
+    gsize length;
+    GError *error = NULL;
+    if (!g_file_get_contents(path, &text, &length, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+    if (length > 0 && text[length - 1] == '\n') {
+        text[length - 1] = '\0'; // The last line's newline doesn't start another
+    }
+    gchar **texts = g_strsplit(text, "\n", -1);
+    int *recomputed;
+    worksheet_update(texts, (int)g_strv_length(texts), &recomputed);
+    g_strfreev(texts);
+    g_free(text);
+
+    long failures = 0;
+    for (int i = 0; i < worksheet.count; i++) {
+        const WorksheetLine *line = &worksheet.lines[i];
+        if (line->blank) {
+            printf("\n");
+        } else if (line->error_line >= 0) {
+            printf("error: line %d, uses line %d\n", i + 1, line->error_line + 1);
+            failures++;
+        } else if (line->error != CALC_OK) {
+            printf("error: line %d, offset %d: %s\n", i + 1, line->error_offset, calc_error_message(line->error));
+            failures++;
+        } else {
+            printf("%.17g\n", line->value);
+        }
+    }
+    fflush(stdout);
+    if (failures > 0) {
+        fprintf(stderr, "%ld of %d lines failed\n", failures, worksheet.count);
+    }
+    return failures > 0 ? 2 : 0;
+}
+
+// Tabulate a complex expression in x. Every column, including x and the
+// imaginary unit, is a pair of real and imaginary arrays.
+int run_table_complex(const char *expr, double from, double to, long steps) {
+    char params[2][MAX_SYMBOL_NAME] = { "x", "i" };
+    CompileScope scope = { params, 2, 1, 0, 0 };
+    CalcProgram prog;
+    int offset;
+    CalcError error = compile_expression_scoped(expr, &scope, &prog, &offset);
+    if (error != CALC_OK) {
+        fprintf(stderr, "error: offset %d: %s\n", offset, calc_error_message(error));
+        return 1;
+    }
+    if (steps < 1) {
+        steps = 1;
+    }
+
+    long rows = steps + 1;
+    double *x = malloc(sizeof(double) * rows);
+    double *zeros = calloc(rows, sizeof(double));
+    double *ones = malloc(sizeof(double) * rows);
+    double *y_re = malloc(sizeof(double) * rows);
+    double *y_im = malloc(sizeof(double) * rows);
+    CalcError *errors = malloc(sizeof(CalcError) * rows);
+    int ok = x != NULL && zeros != NULL && ones != NULL && y_re != NULL && y_im != NULL && errors != NULL;
+    if (ok) {
+        for (long i = 0; i < rows; i++) {
+            x[i] = from + (to - from) * i / steps;
+            ones[i] = 1;
+        }
+        const double *columns_re[2] = { x, zeros };
+        const double *columns_im[2] = { zeros, ones };
+        run_program_complex_columns(&prog, columns_re, columns_im, 2, rows, y_re, y_im, errors);
+
+        char text[96];
+        for (long i = 0; i < rows; i++) {
+            if (errors[i] != CALC_OK) {
+                printf("%.17g\terror: %s\n", x[i], calc_error_message(errors[i]));
+            } else {
+                format_complex(complex_make(y_re[i], y_im[i]), -1, text, sizeof(text));
+                printf("%.17g\t%s\n", x[i], text);
+            }
+        }
+    } else {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+    }
+    free(x);
+    free(zeros);
+    free(ones);
+    free(y_re);
+    free(y_im);
+    free(errors);
+    free_program(&prog);
+    return ok ? 0 : 1;
+}
+
+// Tabulate an expression in x over [from, to] with the columnar evaluator
+int run_table(const char *expr, double from, double to, long steps) {
+    if (arithmetic_mode == ARITHMETIC_COMPLEX) {
+        return run_table_complex(expr, from, to, steps);
+    }
+    char params[1][MAX_SYMBOL_NAME] = { "x" };
+    CompileScope scope = { params, 1, -1, 0, 0 };
+    CalcProgram prog;
+    int offset;
+    CalcError error = compile_expression_scoped(expr, &scope, &prog, &offset);
+    if (error != CALC_OK) {
+        fprintf(stderr, "error: offset %d: %s\n", offset, calc_error_message(error));
+        return 1;
+    }
+    if (steps < 1) {
+        steps = 1;
+    }
+
+    long rows = steps + 1;
+    double *x = malloc(sizeof(double) * rows);
+    double *y = malloc(sizeof(double) * rows);
+    CalcError *errors = malloc(sizeof(CalcError) * rows);
+    if (x == NULL || y == NULL || errors == NULL) {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+        free(x);
+        free(y);
+        free(errors);
+        free_program(&prog);
+        return 1;
+    }
+    for (long i = 0; i < rows; i++) {
+        x[i] = from + (to - from) * i / steps;
+    }
+    const double *columns[1] = { x };
+    jit_note_rows(&prog, rows);
+    run_program_columns(&prog, columns, 1, rows, y, errors);
+
+    for (long i = 0; i < rows; i++) {
+        if (errors[i] != CALC_OK) {
+            printf("%.17g\terror: %s\n", x[i], calc_error_message(errors[i]));
+        } else {
+            printf("%.17g\t%.17g\n", x[i], y[i]);
+        }
+    }
+    free(x);
+    free(y);
+    free(errors);
+    free_program(&prog);
+    return 0;
+}
+
+// Compare evaluation strategies on an expression in x over many rows
+int run_bench(const char *expr, long rows) {
+    char params[1][MAX_SYMBOL_NAME] = { "x" };
+    CompileScope scope = { params, 1, -1, 0, 0 };
+    CalcProgram prog;
+    int offset;
+    CalcError error = compile_expression_scoped(expr, &scope, &prog, &offset);
+    if (error != CALC_OK) {
+        fprintf(stderr, "error: offset %d: %s\n", offset, calc_error_message(error));
+        return 1;
+    }
+
+    double *x = malloc(sizeof(double) * rows);
+    double *y = malloc(sizeof(double) * rows);
+    CalcError *errors = malloc(sizeof(CalcError) * rows);
+    if (x == NULL || y == NULL || errors == NULL) {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+        return 1;
+    }
+    for (long i = 0; i < rows; i++) {
+        x[i] = 1.0 + (double)i / rows;
+    }
+    const double *columns[1] = { x };
+    double checksum = 0;
+
+    // evaluate_expression re-parses the text for every row (x substituted in)
+    long text_rows = MIN(rows, 100000);
+    char text[1024];
+    gint64 start = g_get_monotonic_time();
+    for (long i = 0; i < text_rows; i++) {
+        char value[32];
+        snprintf(value, sizeof(value), "(%.17g)", x[i]);
+        text[0] = '\0';
+        for (const char *p = expr; *p != '\0'; p++) {
+            if (*p == 'x' && !is_name_char(p[1]) && (p == expr || !is_name_char(p[-1]))) {
+                safe_strcat(text, value, sizeof(text));
+            } else {
+                char c[2] = { *p, '\0' };
+                safe_strcat(text, c, sizeof(text));
+            }
+        }
+        checksum += evaluate_expression(text);
+    }
+    double text_rate = text_rows / ((g_get_monotonic_time() - start) / 1e6);
+
+    // Compiled program, one row at a time
+    start = g_get_monotonic_time();
+    for (long i = 0; i < rows; i++) {
+        double value;
+        run_program_with(&prog, &x[i], 0, &value, &offset);
+        checksum += value;
+    }
+    double scalar_rate = rows / ((g_get_monotonic_time() - start) / 1e6);
+
+    // Columnar interpreter
+    start = g_get_monotonic_time();
+    run_program_columns(&prog, columns, 1, rows, y, errors);
+    double column_rate = rows / ((g_get_monotonic_time() - start) / 1e6);
+    checksum += y[rows - 1];
+
+    // Columnar path with native code
+    double jit_rate = 0;
+    jit_note_rows(&prog, JIT_HOT_ROWS);
+    if (prog.jit != NULL) {
+        start = g_get_monotonic_time();
+        run_program_columns(&prog, columns, 1, rows, y, errors);
+        jit_rate = rows / ((g_get_monotonic_time() - start) / 1e6);
+        checksum += y[rows - 1];
+    }
+
+    printf("%s over %ld rows (checksum %g)\n", expr, rows, checksum);
+    printf("  evaluate_expression  %12.0f rows/s\n", text_rate);
+    printf("  compiled, per row    %12.0f rows/s  %6.1fx\n", scalar_rate, scalar_rate / text_rate);
+    printf("  columnar             %12.0f rows/s  %6.1fx\n", column_rate, column_rate / text_rate);
+    if (prog.jit != NULL) {
+        printf("  columnar + JIT       %12.0f rows/s  %6.1fx\n", jit_rate, jit_rate / text_rate);
+    } else {
+        printf("  columnar + JIT       unavailable for this expression or platform\n");
+    }
+
+    free(x);
+    free(y);
+    free(errors);
+    free_program(&prog);
+    return 0;
+}
+
+// Time the matrix kernels on random n x n matrices, against a plain triple loop
+int run_bench_matrix(int n) {
+    MatrixArena arena = { NULL };
+    MatrixValue a, b, c, t, x, rhs;
+    double *naive = malloc(sizeof(double) * n * n);
+    if (naive == NULL || matrix_new(&arena, n, n, &a) != CALC_OK || matrix_new(&arena, n, n, &b) != CALC_OK ||
+        matrix_new(&arena, n, 1, &rhs) != CALC_OK) {
+        fprintf(stderr, "%s\n", calc_error_message(CALC_ERR_OUT_OF_MEMORY));
+        free(naive);
+        matrix_arena_release(&arena);
+        return 1;
+    }
+    srand(1);
+    for (int k = 0; k < n * n; k++) {
+        a.data[k] = (double)rand() / RAND_MAX - 0.5;
+        b.data[k] = (double)rand() / RAND_MAX - 0.5;
+    }
+    for (int i = 0; i < n; i++) {
+        rhs.data[i] = (double)rand() / RAND_MAX - 0.5;
+    }
+
+    gint64 start = g_get_monotonic_time();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            double sum = 0;
+            for (int k = 0; k < n; k++) {
+                sum += a.data[(size_t)i * n + k] * b.data[(size_t)k * n + j];
+            }
+            naive[(size_t)i * n + j] = sum;
+        }
+    }
+    double naive_ms = (g_get_monotonic_time() - start) / 1e3;
+
+    start = g_get_monotonic_time();
+    CalcError error = matrix_product(&arena, &a, &b, &c);
+    double multiply_ms = (g_get_monotonic_time() - start) / 1e3;
+    double multiply_diff = 0;
+    for (int k = 0; error == CALC_OK && k < n * n; k++) {
+        multiply_diff = MAX(multiply_diff, fabs(c.data[k] - naive[k]));
+    }
+
+    start = g_get_monotonic_time();
+    t = a;
+    if (error == CALC_OK) {
+        error = matrix_builtin_transpose(&arena, &t);
+    }
+    double transpose_ms = (g_get_monotonic_time() - start) / 1e3;
+
+    start = g_get_monotonic_time();
+    MatrixValue det = a;
+    if (error == CALC_OK) {
+        error = matrix_builtin_det(&arena, &det);
+    }
+    double det_ms = (g_get_monotonic_time() - start) / 1e3;
+
+    start = g_get_monotonic_time();
+    MatrixValue inverse = a;
+    if (error == CALC_OK) {
+        error = matrix_builtin_inv(&arena, &inverse);
+    }
+    double inv_ms = (g_get_monotonic_time() - start) / 1e3;
+
+    start = g_get_monotonic_time();
+    if (error == CALC_OK) {
+        error = matrix_solve(&arena, &a, &rhs, &x);
+    }
+    double solve_ms = (g_get_monotonic_time() - start) / 1e3;
+
+    if (error != CALC_OK) {
+        fprintf(stderr, "%s\n", calc_error_message(error));
+        free(naive);
+        matrix_arena_release(&arena);
+        return 1;
+    }
+    // How well the solution satisfies a x = rhs
+    double residual = 0;
+    for (int i = 0; i < n; i++) {
+        double sum = -rhs.data[i];
+        for (int k = 0; k < n; k++) {
+            sum += a.data[(size_t)i * n + k] * x.data[k];
+        }
+        residual = MAX(residual, fabs(sum));
+    }
+
+    double flops = 2.0 * n * n * n;
+    printf("%dx%d matrices\n", n, n);
+    printf("  multiply, triple loop %10.1f ms  %6.2f GFLOP/s\n", naive_ms, flops / naive_ms / 1e6);
+    printf("  multiply, blocked     %10.1f ms  %6.2f GFLOP/s  %5.1fx  (max difference %.3g)\n", multiply_ms,
+           flops / multiply_ms / 1e6, naive_ms / multiply_ms, multiply_diff);
+    printf("  transpose             %10.1f ms\n", transpose_ms);
+    printf("  det                   %10.1f ms  (det = %.6g)\n", det_ms, det.number);
+    printf("  inv                   %10.1f ms\n", inv_ms);
+    printf("  solve                 %10.1f ms  (max residual %.3g)\n", solve_ms, residual);
+
+    free(naive);
+    matrix_arena_release(&arena);
+    return 0;
+}
+
+// Evaluation server: newline-delimited expressions over a Unix domain socket.
+// The event loop reads pipelined requests, hands each read's complete lines to
+// the worker pool as one batch, and writes batches back in request order.
+#define SERVE_DEFAULT_SOCKET "calculator.sock"
+#define SERVE_MAX_BATCH 256      // Lines per batch handed to a worker
+#define SERVE_MAX_LINE 4096      // Longest request line accepted
+#define SERVE_RESULT_MAX 128     // Longest formatted reply line
+#define SERVE_LATENCY_BUCKETS 256
+
+typedef struct ServeBatch ServeBatch;
+
+typedef struct {
+    int fd;
+    char *in;              // Unparsed request bytes
+    size_t in_len;
+    size_t in_cap;
+    char *out;             // Replies not yet accepted by the socket
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    unsigned long next_batch; // Sequence number of the next batch created
+    unsigned long next_reply; // Sequence number of the next batch to write
+    ServeBatch *ready;     // Finished batches waiting for earlier ones, sorted by sequence
+    int pending;           // Batches queued or being evaluated
+    int eof;               // Peer finished sending; close once replies are written
+    int closed;            // Socket is gone; free once pending reaches 0
+    int want_write;        // EPOLLOUT is registered
+} ServeConnection;
+
+struct ServeBatch {
+    ServeConnection *conn;
+    unsigned long seq;
+    int count;
+    char *lines;           // count NUL-terminated lines, back to back
+    char *results;         // Replies written by a worker
+    size_t results_len;
+    gint64 received;       // Monotonic time the lines were read
+    ServeBatch *next;
+};
+
+typedef struct {
+    GMutex lock;
+    GCond work_ready;
+    ServeBatch *work_head; // Batches waiting for a worker
+    ServeBatch *work_tail;
+    ServeBatch *done;      // Finished batches for the event loop
+    int stopping;
+    int wake_fd;           // eventfd the workers signal when a batch finishes
+
+    // Latency histogram in microseconds: 8 sub-buckets per power of two
+    GMutex stats_lock;
+    unsigned long latency[SERVE_LATENCY_BUCKETS];
+    unsigned long requests;
+    gint64 started;
+} ServeState;
+
+ServeState serve_state;
+volatile sig_atomic_t serve_stop_requested = 0;
+
+void serve_on_signal(int sig) {
+    (void)sig;
+    serve_stop_requested = 1;
+}
+
+int latency_bucket(gint64 us) {
+    if (us < 8) {
+        return us < 0 ? 0 : (int)us;
+    }
+    int k = 63 - __builtin_clzll((unsigned long long)us);
+    int bucket = k * 8 + (int)((us >> (k - 3)) & 7) - 16;
+    return bucket < SERVE_LATENCY_BUCKETS ? bucket : SERVE_LATENCY_BUCKETS - 1;
+}
+
+// Upper bound (in microseconds) of the values recorded in a bucket
+gint64 latency_bucket_limit(int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    int k = (bucket + 16) / 8;
+    return ((gint64)(8 + (bucket + 16) % 8 + 1) << (k - 3)) - 1;
+}
+
+// Latency below which the given fraction of a histogram's samples fall
+gint64 histogram_percentile(const unsigned long *histogram, unsigned long total, double fraction) {
+    unsigned long rank = (unsigned long)ceil(fraction * total);
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < SERVE_LATENCY_BUCKETS; bucket++) {
+        seen += histogram[bucket];
+        if (seen >= rank && seen > 0) {
+            return latency_bucket_limit(bucket);
+        }
+    }
+    return 0;
+}
+
+// Latency below which the given fraction of requests completed (caller holds stats_lock)
+gint64 latency_percentile(double fraction) {
+    return histogram_percentile(serve_state.latency, serve_state.requests, fraction);
+}
+
+// Evaluate every line of a batch; "stats" reports the server's counters instead
+void serve_evaluate_batch(ServeBatch *batch) {
+    gint64 latencies[SERVE_MAX_BATCH];
+    const char *line = batch->lines;
+    char *out = batch->results;
+
+    for (int i = 0; i < batch->count; i++) {
+        size_t room = SERVE_RESULT_MAX;
+        if (strcmp(line, "stats") == 0) {
+            g_mutex_lock(&serve_state.stats_lock);
+            double seconds = (g_get_monotonic_time() - serve_state.started) / 1e6;
+            snprintf(out, room, "stats: requests %lu, p50 %lld us, p99 %lld us, %.1f req/s\n",
+                     serve_state.requests, (long long)latency_percentile(0.50),
+                     (long long)latency_percentile(0.99), seconds > 0 ? serve_state.requests / seconds : 0);
+            g_mutex_unlock(&serve_state.stats_lock);
+        } else {
+            CalcResult res = evaluate_expression_result(line);
+            if (res.error != CALC_OK) {
+                snprintf(out, room, "error: offset %d: %s\n", res.error_offset, calc_error_message(res.error));
+            } else if (res.is_integer) {
+                snprintf(out, room, "%lld\n", res.int_value);
+            } else {
+                snprintf(out, room, "%.17g\n", res.value);
+            }
+        }
+        latencies[i] = g_get_monotonic_time() - batch->received;
+        out += strlen(out);
+        line += strlen(line) + 1;
+    }
+    batch->results_len = out - batch->results;
+
+    g_mutex_lock(&serve_state.stats_lock);
+    for (int i = 0; i < batch->count; i++) {
+        serve_state.latency[latency_bucket(latencies[i])]++;
+    }
+    serve_state.requests += batch->count;
+    g_mutex_unlock(&serve_state.stats_lock);
+}
+
+gpointer serve_worker(gpointer data) {
+    (void)data;
+    g_mutex_lock(&serve_state.lock);
+    while (1) {
+        while (serve_state.work_head == NULL && !serve_state.stopping) {
+            g_cond_wait(&serve_state.work_ready, &serve_state.lock);
+        }
+        if (serve_state.stopping) {
+            break;
+        }
+        ServeBatch *batch = serve_state.work_head;
+        serve_state.work_head = batch->next;
+        if (serve_state.work_head == NULL) {
+            serve_state.work_tail = NULL;
+        }
+        g_mutex_unlock(&serve_state.lock);
+
+        serve_evaluate_batch(batch);
+
+        g_mutex_lock(&serve_state.lock);
+        batch->next = serve_state.done;
+        serve_state.done = batch;
+        uint64_t one = 1;
+        if (write(serve_state.wake_fd, &one, sizeof(one)) < 0) {
+            // The counter is already non-zero; the event loop will wake anyway
+        }
+    }
+    g_mutex_unlock(&serve_state.lock);
+    return NULL;
+}
+
+void serve_free_batch(ServeBatch *batch) {
+    free(batch->lines);
+    free(batch->results);
+    free(batch);
+}
+
+void serve_free_connection(ServeConnection *conn) {
+    while (conn->ready != NULL) {
+        ServeBatch *next = conn->ready->next;
+        serve_free_batch(conn->ready);
+        conn->ready = next;
+    }
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+// Stop using a connection's socket; the struct lives on until its batches return
+void serve_close(int epoll_fd, ServeConnection *conn) {
+    if (!conn->closed) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->closed = 1;
+    }
+    if (conn->pending == 0) {
+        serve_free_connection(conn);
+    }
+}
+
+void serve_watch(int epoll_fd, ServeConnection *conn, int want_write) {
+    if (conn->want_write == want_write) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = (conn->eof ? 0 : EPOLLIN) | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->want_write = want_write;
+}
+
+int serve_reserve(char **buf, size_t *cap, size_t needed) {
+    if (needed <= *cap) {
+        return 1;
+    }
+    size_t new_cap = *cap > 0 ? *cap : 4096;
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+    char *grown = realloc(*buf, new_cap);
+    if (grown == NULL) {
+        return 0;
+    }
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
+}
+
+// Write finished batches in sequence order, then as much output as the socket takes
+void serve_flush(int epoll_fd, ServeConnection *conn) {
+    while (conn->ready != NULL && conn->ready->seq == conn->next_reply) {
+        ServeBatch *batch = conn->ready;
+        conn->ready = batch->next;
+        conn->next_reply++;
+        if (serve_reserve(&conn->out, &conn->out_cap, conn->out_len + batch->results_len)) {
+            memcpy(conn->out + conn->out_len, batch->results, batch->results_len);
+            conn->out_len += batch->results_len;
+        }
+        serve_free_batch(batch);
+    }
+
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                serve_watch(epoll_fd, conn, 1);
+                return;
+            }
+            serve_close(epoll_fd, conn);
+            return;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    serve_watch(epoll_fd, conn, 0);
+
+    if (conn->eof && conn->pending == 0 && conn->ready == NULL) {
+        serve_close(epoll_fd, conn);
+    }
+}
+
+// Queue the complete lines of a connection's input as batches for the workers
+int serve_dispatch(ServeConnection *conn) {
+    size_t start = 0;
+    gint64 now = g_get_monotonic_time();
+    while (1) {
+        ServeBatch *batch;
+        size_t pos = start;
+        int count = 0;
+        while (count < SERVE_MAX_BATCH) {
+            char *newline = memchr(conn->in + pos, '\n', conn->in_len - pos);
+            if (newline == NULL) {
+                break;
+            }
+            pos = newline - conn->in + 1;
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+
+        batch = calloc(1, sizeof(ServeBatch));
+        if (batch == NULL || (batch->lines = malloc(pos - start)) == NULL ||
+            (batch->results = malloc((size_t)count * SERVE_RESULT_MAX)) == NULL) {
+            if (batch != NULL) {
+                serve_free_batch(batch);
+            }
+            return 0;
+        }
+        // Copy the lines NUL-terminated, dropping carriage returns
+        char *dest = batch->lines;
+        for (size_t i = start; i < pos; i++) {
+            if (conn->in[i] == '\n') {
+                *dest++ = '\0';
+            } else if (conn->in[i] != '\r') {
+                *dest++ = conn->in[i];
+            }
+        }
+        batch->conn = conn;
+        batch->seq = conn->next_batch++;
+        batch->count = count;
+        batch->received = now;
+        conn->pending++;
+
+        g_mutex_lock(&serve_state.lock);
+        if (serve_state.work_tail != NULL) {
+            serve_state.work_tail->next = batch;
+        } else {
+            serve_state.work_head = batch;
+        }
+        serve_state.work_tail = batch;
+        g_cond_signal(&serve_state.work_ready);
+        g_mutex_unlock(&serve_state.lock);
+        start = pos;
+    }
+
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+    return conn->in_len <= SERVE_MAX_LINE;
+}
+
+void serve_read(int epoll_fd, ServeConnection *conn) {
+    while (1) {
+        if (!serve_reserve(&conn->in, &conn->in_cap, conn->in_len + 65536)) {
+            serve_close(epoll_fd, conn);
+            return;
+        }
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            // End of requests: a final unterminated line still counts
+            if (n == 0 && conn->in_len > 0 && serve_reserve(&conn->in, &conn->in_cap, conn->in_len + 1)) {
+                conn->in[conn->in_len++] = '\n';
+                serve_dispatch(conn);
+            }
+            conn->eof = n == 0;
+            if (!conn->eof) {
+                serve_close(epoll_fd, conn);
+                return;
+            }
+            struct epoll_event ev;
+            ev.events = conn->want_write ? EPOLLOUT : 0;
+            ev.data.ptr = conn;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+            serve_flush(epoll_fd, conn);
+            return;
+        }
+        conn->in_len += n;
+        if (!serve_dispatch(conn)) {
+            serve_close(epoll_fd, conn); // Line longer than SERVE_MAX_LINE
+            return;
+        }
+    }
+}
+
+// Hand each finished batch back to its connection and write whatever is now in order
+void serve_collect(int epoll_fd) {
+    uint64_t count;
+    if (read(serve_state.wake_fd, &count, sizeof(count)) < 0) {
+        // Spurious wakeup; nothing to collect
+    }
+    g_mutex_lock(&serve_state.lock);
+    ServeBatch *done = serve_state.done;
+    serve_state.done = NULL;
+    g_mutex_unlock(&serve_state.lock);
+
+    while (done != NULL) {
+        ServeBatch *batch = done;
+        done = batch->next;
+        ServeConnection *conn = batch->conn;
+        conn->pending--;
+        if (conn->closed) {
+            serve_free_batch(batch);
+            if (conn->pending == 0) {
+                serve_free_connection(conn);
+            }
+            continue;
+        }
+
+        ServeBatch **link = &conn->ready;
+        while (*link != NULL && (*link)->seq < batch->seq) {
+            link = &(*link)->next;
+        }
+        batch->next = *link;
+        *link = batch;
+        serve_flush(epoll_fd, conn);
+    }
+}
+
+// Serve requests on a Unix domain socket until SIGINT or SIGTERM
+int run_server(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path); // Remove a stale socket from an earlier run
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(listen_fd);
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    serve_state.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    serve_state.started = g_get_monotonic_time();
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.ptr = &serve_state.wake_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serve_state.wake_fd, &ev);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int worker_count = (int)g_get_num_processors();
+    GThread **workers = malloc(sizeof(GThread *) * worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        workers[i] = g_thread_new("calc-worker", serve_worker, NULL);
+    }
+    fprintf(stderr, "Serving on %s with %d workers\n", path, worker_count);
+
+    struct epoll_event events[64];
+    while (!serve_stop_requested) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_fd) {
+                int fd;
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                    ServeConnection *conn = calloc(1, sizeof(ServeConnection));
+                    if (conn == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+                        free(conn);
+                        close(fd);
+                        continue;
+                    }
+                    conn->fd = fd;
+                    struct epoll_event cev;
+                    cev.events = EPOLLIN;
+                    cev.data.ptr = conn;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+                }
+            } else if (events[i].data.ptr == &serve_state.wake_fd) {
+                serve_collect(epoll_fd);
+            } else {
+                ServeConnection *conn = events[i].data.ptr;
+                if ((events[i].events & (EPOLLHUP | EPOLLERR)) && conn->eof) {
+                    serve_close(epoll_fd, conn); // Peer is gone; replies can't be delivered
+                } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    serve_read(epoll_fd, conn);
+                } else if (events[i].events & EPOLLOUT) {
+                    serve_flush(epoll_fd, conn);
+                }
+            }
+        }
+    }
+
+    g_mutex_lock(&serve_state.lock);
+    serve_state.stopping = 1;
+    g_cond_broadcast(&serve_state.work_ready);
+    g_mutex_unlock(&serve_state.lock);
+    for (int i = 0; i < worker_count; i++) {
+        g_thread_join(workers[i]);
+    }
+    free(workers);
+    close(listen_fd);
+    close(epoll_fd);
+    close(serve_state.wake_fd);
+    unlink(path);
+    return 0;
+}
+
+// Single-instance activation
+#define APPLICATION_ID "com.basiccalculator.Calculator"
+
+GtkWidget *main_window;
+int daemon_mode = 0; // Keep running with the window hidden (--daemon)
+
+// In daemon mode closing the window only hides it, so the next launch is instant
+gboolean on_window_delete(GtkWidget *widget, GdkEvent *event, gpointer data) {
+    (void)event; (void)data;
+    if (daemon_mode) {
+        gtk_widget_hide(widget);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Evaluate an expression passed on the command line as if it had been typed
+void evaluate_forwarded(const char *expr) {
+    if (!safe_strcpy(expression, expr, sizeof(expression))) {
+        return;
+    }
+    strcpy(current_input, "");
+    has_result = FALSE;
+    on_equals_clicked(NULL, NULL);
+}
+
+// Key-to-pixel latency. Each key press is tagged when on_key_press starts,
+// followed through update_display and scroll_display_to_bottom, and matched
+// to the first frame painted after the scroll. Its latency ends when the
+// frame clock reports that frame presented (or painted, if the backend can't
+// tell). The most recent keys form a rolling histogram shown in the latency
+// panel and checked against the typing budget.
+#define FRAME_LATENCY_WINDOW 1000  // Keys kept in the rolling histogram
+#define FRAME_LATENCY_PENDING 64   // Keys waiting for their frame
+#define FRAME_LATENCY_RETRY_MS 20  // Recheck for presentation times that arrive late
+
+typedef struct {
+    gint64 pressed;   // on_key_press started
+    gint64 updated;   // update_display set the text
+    gint64 scrolled;  // scroll_display_to_bottom ran
+    gint64 painted;   // After-paint of the frame that showed the change
+    gint64 presented; // The compositor put that frame on screen
+    gint64 frame;     // Frame counter of that frame
+} KeyLatency;
+
+typedef struct {
+    gint64 key_pressed; // Set while on_key_press runs
+    int key_tagged;     // The running key already has a tag
+    KeyLatency pending[FRAME_LATENCY_PENDING];
+    int pending_count;
+    KeyLatency recent[FRAME_LATENCY_WINDOW]; // Ring of finished keys
+    int recent_count;
+    int recent_next;
+    unsigned long histogram[SERVE_LATENCY_BUCKETS]; // Over the keys in recent[]
+    int retry_scheduled;
+} FrameLatencyState;
+
+FrameLatencyState frame_latency;
+GtkWidget *latency_window, *latency_label;
+
+void frame_latency_key_started(void) {
+    frame_latency.key_pressed = g_get_monotonic_time();
+    frame_latency.key_tagged = 0;
+}
+
+void frame_latency_key_finished(void) {
+    frame_latency.key_pressed = 0;
+}
+
+// The running key changed the display: start following it
+void frame_latency_updated(void) {
+    if (frame_latency.key_pressed == 0 || frame_latency.key_tagged) {
+        return;
+    }
+    if (frame_latency.pending_count == FRAME_LATENCY_PENDING) {
+        // Nothing is being painted; forget the oldest key
+        memmove(&frame_latency.pending[0], &frame_latency.pending[1], sizeof(KeyLatency) * (FRAME_LATENCY_PENDING - 1));
+        frame_latency.pending_count--;
+    }
+    KeyLatency *key = &frame_latency.pending[frame_latency.pending_count++];
+    memset(key, 0, sizeof(*key));
+    key->pressed = frame_latency.key_pressed;
+    key->updated = g_get_monotonic_time();
+    frame_latency.key_tagged = 1;
+}
+
+// The display scrolled to its new last line; make sure a frame follows even if
+// the scroll changed nothing, so the key is matched without waiting for another
+void frame_latency_scrolled(void) {
+    gint64 now = g_get_monotonic_time();
+    int marked = 0;
+    for (int i = 0; i < frame_latency.pending_count; i++) {
+        if (frame_latency.pending[i].scrolled == 0) {
+            frame_latency.pending[i].scrolled = now;
+            marked = 1;
+        }
+    }
+    GdkFrameClock *clock = main_window != NULL ? gtk_widget_get_frame_clock(main_window) : NULL;
+    if (marked && clock != NULL) {
+        gdk_frame_clock_request_phase(clock, GDK_FRAME_CLOCK_PHASE_AFTER_PAINT);
+    }
+}
+
+void frame_latency_record(const KeyLatency *key) {
+    if (frame_latency.recent_count == FRAME_LATENCY_WINDOW) {
+        const KeyLatency *evicted = &frame_latency.recent[frame_latency.recent_next];
+        frame_latency.histogram[latency_bucket(evicted->presented - evicted->pressed)]--;
+    } else {
+        frame_latency.recent_count++;
+    }
+    frame_latency.recent[frame_latency.recent_next] = *key;
+    frame_latency.recent_next = (frame_latency.recent_next + 1) % FRAME_LATENCY_WINDOW;
+    frame_latency.histogram[latency_bucket(key->presented - key->pressed)]++;
+}
+
+gboolean frame_latency_retry(gpointer data);
+
+// Finish the keys whose frame timings are complete
+void frame_latency_collect(GdkFrameClock *clock) {
+    int kept = 0;
+    for (int i = 0; i < frame_latency.pending_count; i++) {
+        KeyLatency *key = &frame_latency.pending[i];
+        GdkFrameTimings *timings = key->painted != 0 ? gdk_frame_clock_get_timings(clock, key->frame) : NULL;
+        if (key->painted == 0 || (timings != NULL && !gdk_frame_timings_get_complete(timings))) {
+            frame_latency.pending[kept++] = *key;
+            continue;
+        }
+        key->presented = timings != NULL ? gdk_frame_timings_get_presentation_time(timings) : 0;
+        if (key->presented < key->painted) {
+            key->presented = key->painted; // No presentation time from this backend
+        }
+        frame_latency_record(key);
+    }
+    frame_latency.pending_count = kept;
+
+    // Presentation times arrive after the frame, without another paint to report them
+    for (int i = 0; i < kept && !frame_latency.retry_scheduled; i++) {
+        if (frame_latency.pending[i].painted != 0) {
+            frame_latency.retry_scheduled = 1;
+            g_timeout_add(FRAME_LATENCY_RETRY_MS, frame_latency_retry, clock);
+        }
+    }
+}
+
+gboolean frame_latency_retry(gpointer data) {
+    frame_latency.retry_scheduled = 0;
+    frame_latency_collect(data);
+    return G_SOURCE_REMOVE;
+}
+
+void on_frame_after_paint(GdkFrameClock *clock, gpointer data) {
+    (void)data;
+    gint64 now = g_get_monotonic_time();
+    gint64 counter = gdk_frame_clock_get_frame_counter(clock);
+    for (int i = 0; i < frame_latency.pending_count; i++) {
+        KeyLatency *key = &frame_latency.pending[i];
+        if (key->scrolled != 0 && key->painted == 0) {
+            key->frame = counter;
+            key->painted = now;
+        }
+    }
+    frame_latency_collect(clock);
+}
+
+void frame_latency_reset(void) {
+    memset(frame_latency.histogram, 0, sizeof(frame_latency.histogram));
+    frame_latency.recent_count = 0;
+    frame_latency.recent_next = 0;
+    frame_latency.pending_count = 0;
+}
+
+// Percentile of the rolling window in microseconds
+gint64 frame_latency_percentile(double fraction) {
+    return histogram_percentile(frame_latency.histogram, frame_latency.recent_count, fraction);
+}
+
+// Summary, stage breakdown and (if full) every non-empty bucket
+void frame_latency_report(GString *out, int full) {
+    int n = frame_latency.recent_count;
+    gint64 budget = (gint64)latency_budget * 1000;
+    gint64 worst = 0;
+    gint64 stages[4] = { 0, 0, 0, 0 };
+    int over = 0;
+    for (int i = 0; i < n; i++) {
+        const KeyLatency *key = &frame_latency.recent[i];
+        gint64 latency = key->presented - key->pressed;
+        worst = MAX(worst, latency);
+        over += latency > budget;
+        stages[0] += key->updated - key->pressed;
+        stages[1] += key->scrolled - key->updated;
+        stages[2] += key->painted - key->scrolled;
+        stages[3] += key->presented - key->painted;
+    }
+    g_string_append_printf(out, "keys: %d (last %d), budget %d ms: %d over\n", n, FRAME_LATENCY_WINDOW,
+                           latency_budget, over);
+    if (n == 0) {
+        return;
+    }
+    g_string_append_printf(out, "key to pixel: p50 %.1f ms  p90 %.1f ms  p99 %.1f ms  max %.1f ms\n",
+                           frame_latency_percentile(0.50) / 1000.0, frame_latency_percentile(0.90) / 1000.0,
+                           frame_latency_percentile(0.99) / 1000.0, worst / 1000.0);
+    g_string_append_printf(out, "mean stages: update %.2f ms, scroll %.2f ms, paint %.2f ms, present %.2f ms\n",
+                           stages[0] / 1000.0 / n, stages[1] / 1000.0 / n, stages[2] / 1000.0 / n, stages[3] / 1000.0 / n);
+    if (full) {
+        g_string_append(out, "up to ms,keys\n");
+        for (int bucket = 0; bucket < SERVE_LATENCY_BUCKETS; bucket++) {
+            if (frame_latency.histogram[bucket] > 0) {
+                g_string_append_printf(out, "%.3f,%lu\n", latency_bucket_limit(bucket) / 1000.0,
+                                       frame_latency.histogram[bucket]);
+            }
+        }
+    }
+}
+
+// Whether the slowest 1% of recent keys still meets the budget
+int frame_latency_within_budget(void) {
+    return frame_latency.recent_count == 0 || frame_latency_percentile(0.99) <= (gint64)latency_budget * 1000;
+}
+
+gboolean latency_panel_refresh(gpointer data) {
+    (void)data;
+    if (latency_window == NULL || !gtk_widget_get_visible(latency_window)) {
+        return G_SOURCE_REMOVE;
+    }
+    GString *text = g_string_new(NULL);
+    frame_latency_report(text, 1);
+    gtk_label_set_text(GTK_LABEL(latency_label), text->str);
+    g_string_free(text, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+void on_latency_save_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Save Latency Histogram", GTK_WINDOW(latency_window),
+                                                    GTK_FILE_CHOOSER_ACTION_SAVE,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL,
+                                                    "_Save", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+    gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), "latency.txt");
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        gchar *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+        GString *text = g_string_new(NULL);
+        frame_latency_report(text, 1);
+        if (!g_file_set_contents(path, text->str, text->len, NULL)) {
+            append_to_history("Could not write latency histogram");
+        }
+        g_string_free(text, TRUE);
+        g_free(path);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+void on_latency_reset_clicked(GtkWidget *widget, gpointer data) {
+    (void)widget; (void)data;
+    frame_latency_reset();
+    latency_panel_refresh(NULL);
+}
+
+// Debug panel with the live histogram, refreshed every second while it is open
+void on_latency_panel_clicked(GtkMenuItem *menuitem, gpointer user_data) {
+    (void)menuitem;
+    if (latency_window == NULL) {
+        latency_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_title(GTK_WINDOW(latency_window), "Typing Latency");
+        gtk_window_set_transient_for(GTK_WINDOW(latency_window), GTK_WINDOW(user_data));
+        gtk_container_set_border_width(GTK_CONTAINER(latency_window), 10);
+        g_signal_connect(latency_window, "delete-event", G_CALLBACK(gtk_widget_hide_on_delete), NULL);
+
+        latency_label = gtk_label_new("");
+        gtk_label_set_selectable(GTK_LABEL(latency_label), TRUE);
+        gtk_widget_set_name(latency_label, "latency-report");
+
+        GtkWidget *buttons = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+        GtkWidget *button = gtk_button_new_with_label("Save...");
+        g_signal_connect(button, "clicked", G_CALLBACK(on_latency_save_clicked), NULL);
+        gtk_box_pack_end(GTK_BOX(buttons), button, FALSE, FALSE, 0);
+        button = gtk_button_new_with_label("Reset");
+        g_signal_connect(button, "clicked", G_CALLBACK(on_latency_reset_clicked), NULL);
+        gtk_box_pack_end(GTK_BOX(buttons), button, FALSE, FALSE, 0);
+
+        GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
+        gtk_box_pack_start(GTK_BOX(box), latency_label, TRUE, TRUE, 0);
+        gtk_box_pack_start(GTK_BOX(box), buttons, FALSE, FALSE, 0);
+        gtk_container_add(GTK_CONTAINER(latency_window), box);
+        gtk_widget_show_all(box);
+    }
+    if (!gtk_widget_get_visible(latency_window)) {
+        gtk_widget_show(latency_window);
+        g_timeout_add_seconds(1, latency_panel_refresh, NULL);
+    }
+    latency_panel_refresh(NULL);
+    gtk_window_present(GTK_WINDOW(latency_window));
+}
+
+// Input traces. --record FILE appends every key press and button click in the
+// window, with its time, to FILE; --replay FILE feeds them back (at recorded
+// speed, or with --fast as soon as the previous event is on screen) and reports
+// how long each took to handle and to reach the display.
+#define TRACE_HEADER "calculator-trace 1"
+#define TRACE_MAX_LABEL 32
+#define TRACE_SLOWEST 5 // Events listed individually in the replay report
+
+typedef struct {
+    gint64 time;  // Microseconds since recording started
+    int is_key;
+    guint keyval;
+    guint state;  // Modifier keys held
+    char label[TRACE_MAX_LABEL]; // Button label
+} TraceEvent;
+
+typedef struct {
+    TraceEvent *events;
+    int count;
+    int next;           // Next event to dispatch
+    int drawn;          // Events whose display update has been painted
+    int fast;
+    gint64 start;
+    gint64 *dispatched; // When each event was handed to its handler
+    gint64 *handler_us; // Time spent in the handler
+    gint64 *display_us; // Time until the display was next painted
+    GApplicationCommandLine *cmdline; // Where the report goes
+} TraceReplay;
+
+FILE *trace_out = NULL;
+gint64 trace_start = 0;
+TraceReplay *trace_replay = NULL;
+
+// Open a trace for recording; events are flushed line by line so a crash keeps them
+int trace_open(const char *path) {
+    trace_out = fopen(path, "w");
+    if (trace_out == NULL) {
+        return 0;
+    }
+    setvbuf(trace_out, NULL, _IOLBF, 0);
+    fprintf(trace_out, "%s\n", TRACE_HEADER);
+    trace_start = g_get_monotonic_time();
+    return 1;
+}
+
+void trace_record_key(const GdkEventKey *event) {
+    if (trace_out != NULL) {
+        fprintf(trace_out, "%lld key %u %u\n", (long long)(g_get_monotonic_time() - trace_start),
+                event->keyval, event->state & (GDK_CONTROL_MASK | GDK_SHIFT_MASK));
+    }
+}
+
+// Emission hooks run before any handler, so the time is when the click arrived
+gboolean trace_clicked_hook(GSignalInvocationHint *hint, guint n_params, const GValue *params, gpointer data) {
+    (void)hint; (void)n_params; (void)data;
+    GtkWidget *button = GTK_WIDGET(g_value_get_object(&params[0]));
+    const char *label = gtk_button_get_label(GTK_BUTTON(button));
+    if (trace_out != NULL && label != NULL && gtk_widget_get_toplevel(button) == main_window &&
+        strlen(label) < TRACE_MAX_LABEL && strchr(label, ' ') == NULL) {
+        fprintf(trace_out, "%lld button %s\n", (long long)(g_get_monotonic_time() - trace_start), label);
+    }
+    return TRUE; // Stay installed
+}
+
+// Read a whole trace; returns the number of events or -1
+int trace_load(const char *path, TraceEvent **events) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char line[128];
+    int count = 0, capacity = 0;
+    *events = NULL;
+    if (fgets(line, sizeof(line), in) == NULL || strncmp(line, TRACE_HEADER, strlen(TRACE_HEADER)) != 0) {
+        fclose(in);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 256;
+            TraceEvent *grown = realloc(*events, sizeof(TraceEvent) * capacity);
+            if (grown == NULL) {
+                count = -1;
+                break;
+            }
+            *events = grown;
+        }
+        TraceEvent *ev = &(*events)[count];
+        long long time;
+        memset(ev, 0, sizeof(*ev));
+        if (sscanf(line, "%lld key %u %u", &time, &ev->keyval, &ev->state) == 3) {
+            ev->is_key = 1;
+        } else if (sscanf(line, "%lld button %31s", &time, ev->label) != 2) {
+            count = -1;
+            break;
+        }
+        ev->time = time;
+        count++;
+    }
+    fclose(in);
+    if (count < 0) {
+        free(*events);
+        *events = NULL;
+    }
+    return count;
+}
+
+GtkWidget *find_button(GtkWidget *widget, const char *label) {
+    if (GTK_IS_BUTTON(widget) && g_strcmp0(gtk_button_get_label(GTK_BUTTON(widget)), label) == 0) {
+        return widget;
+    }
+    GtkWidget *found = NULL;
+    if (GTK_IS_CONTAINER(widget)) {
+        GList *children = gtk_container_get_children(GTK_CONTAINER(widget));
+        for (GList *iter = children; iter != NULL && found == NULL; iter = iter->next) {
+            found = find_button(GTK_WIDGET(iter->data), label);
+        }
+        g_list_free(children);
+    }
+    return found;
+}
+
+void trace_dispatch(TraceReplay *r) {
+    int i = r->next++;
+    const TraceEvent *ev = &r->events[i];
+    gint64 t0 = g_get_monotonic_time();
+    r->dispatched[i] = t0;
+    if (ev->is_key) {
+        GdkEventKey key;
+        memset(&key, 0, sizeof(key));
+        key.type = GDK_KEY_PRESS;
+        key.keyval = ev->keyval;
+        key.state = ev->state;
+        on_key_press(main_window, &key, NULL);
+    } else {
+        GtkWidget *button = find_button(main_window, ev->label);
+        if (button != NULL) {
+            gtk_button_clicked(GTK_BUTTON(button));
+        }
+    }
+    r->handler_us[i] = g_get_monotonic_time() - t0;
+    gtk_widget_queue_draw(display); // Every event waits for a paint, even if nothing changed
+}
+
+gboolean trace_replay_next(gpointer data) {
+    TraceReplay *r = data;
+    trace_dispatch(r);
+
+    // At recorded speed the next event is due at its offset from the start
+    if (!r->fast && r->next < r->count) {
+        gint64 due = r->start + r->events[r->next].time - r->events[0].time;
+        g_timeout_add((guint)MAX(due - g_get_monotonic_time(), 0) / 1000, trace_replay_next, r);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+void trace_print_latency(GApplicationCommandLine *cmdline, const char *name, const gint64 *us, int n) {
+    double *sorted = malloc(sizeof(double) * n);
+    if (sorted == NULL) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        sorted[i] = (double)us[i];
+    }
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    g_application_command_line_print(cmdline, "%s (us): p50 %.0f  p90 %.0f  p99 %.0f  max %.0f\n", name,
+                                     sorted[n / 2], sorted[n * 9 / 10], sorted[n * 99 / 100], sorted[n - 1]);
+    free(sorted);
+}
+
+gboolean trace_replay_finish(gpointer data) {
+    TraceReplay *r = data;
+    GApplicationCommandLine *cmdline = r->cmdline;
+    g_application_command_line_print(cmdline, "events: %d, replayed in %.3f s%s\n", r->count,
+                                     (g_get_monotonic_time() - r->start) / 1e6, r->fast ? " (fast)" : "");
+    trace_print_latency(cmdline, "handler", r->handler_us, r->count);
+    trace_print_latency(cmdline, "display", r->display_us, r->count);
+
+    // Replayed keys were timed to the screen too; missing the budget fails the run
+    GString *keys = g_string_new(NULL);
+    frame_latency_report(keys, 0);
+    g_application_command_line_print(cmdline, "%s", keys->str);
+    g_string_free(keys, TRUE);
+    if (!frame_latency_within_budget()) {
+        g_application_command_line_print(cmdline, "p99 key to pixel latency is over the %d ms budget\n", latency_budget);
+        g_application_command_line_set_exit_status(cmdline, 3);
+    }
+
+    // The slowest events to reach the screen, by position in the trace
+    unsigned char *listed = calloc(r->count, 1);
+    for (int k = 0; listed != NULL && k < TRACE_SLOWEST && k < r->count; k++) {
+        int worst = -1;
+        for (int i = 0; i < r->count; i++) {
+            if (!listed[i] && (worst < 0 || r->display_us[i] > r->display_us[worst])) {
+                worst = i;
+            }
+        }
+        listed[worst] = 1;
+        const TraceEvent *ev = &r->events[worst];
+        char what[TRACE_MAX_LABEL + 16];
+        if (ev->is_key) {
+            snprintf(what, sizeof(what), "key %s", gdk_keyval_name(ev->keyval) ? gdk_keyval_name(ev->keyval) : "?");
         } else {
-            expression[0] = '\0';
+            snprintf(what, sizeof(what), "button %s", ev->label);
         }
-        update_display();
+        g_application_command_line_print(cmdline, "slow #%d %s: handler %lld us, display %lld us\n", worst + 1, what,
+                                         (long long)r->handler_us[worst], (long long)r->display_us[worst]);
+    }
+    free(listed);
+
+    // A replay started by this process's own launch ends it
+    int own_launch = !g_application_command_line_get_is_remote(cmdline);
+    free(r->events);
+    free(r->dispatched);
+    free(r->handler_us);
+    free(r->display_us);
+    free(r);
+    trace_replay = NULL;
+    g_object_unref(cmdline); // Lets a remote launcher exit
+    if (own_launch) {
+        g_application_quit(g_application_get_default());
     }
+    return G_SOURCE_REMOVE;
 }
 
-// Function to handle delete key (clear everything including history)
-void on_delete_clicked(GtkWidget *widget, gpointer data) {
-    strcpy(current_input, "");
-    strcpy(expression, "");
-    strcpy(history_buffer, "");
-    has_result = FALSE;
-    gtk_text_buffer_set_text(text_buffer, "", -1);
+// Paints of the display mark every dispatched event as shown
+gboolean on_display_drawn(GtkWidget *widget, cairo_t *cr, gpointer data) {
+    (void)widget; (void)cr; (void)data;
+    TraceReplay *r = trace_replay;
+    if (r == NULL || r->drawn == r->next) {
+        return FALSE;
+    }
+    gint64 now = g_get_monotonic_time();
+    for (; r->drawn < r->next; r->drawn++) {
+        r->display_us[r->drawn] = now - r->dispatched[r->drawn];
+    }
+    if (r->drawn == r->count) {
+        g_idle_add(trace_replay_finish, r);
+    } else if (r->fast) {
+        g_idle_add(trace_replay_next, r);
+    }
+    return FALSE;
 }
 
-// Function to handle keyboard input
-gboolean on_key_press(GtkWidget *widget, GdkEventKey *event, gpointer data) {
-    guint key = event->keyval;
+// Start replaying a trace from a clean display; the report goes to cmdline
+int trace_replay_start(const char *path, int fast, GApplicationCommandLine *cmdline) {
+    if (trace_replay != NULL) {
+        return 0;
+    }
+    TraceReplay *r = calloc(1, sizeof(TraceReplay));
+    if (r == NULL) {
+        return 0;
+    }
+    r->count = trace_load(path, &r->events);
+    r->dispatched = malloc(sizeof(gint64) * MAX(r->count, 1));
+    r->handler_us = malloc(sizeof(gint64) * MAX(r->count, 1));
+    r->display_us = malloc(sizeof(gint64) * MAX(r->count, 1));
+    if (r->count <= 0 || r->dispatched == NULL || r->handler_us == NULL || r->display_us == NULL) {
+        free(r->events);
+        free(r->dispatched);
+        free(r->handler_us);
+        free(r->display_us);
+        free(r);
+        return 0;
+    }
+    r->fast = fast;
+    r->cmdline = g_object_ref(cmdline);
+    trace_replay = r;
 
-    // Handle number keys (0-9) and numpad keys
-    if (key >= '0' && key <= '9') {
-        char num_str[2] = {(char)key, '\0'};
-        on_number_clicked(NULL, (gpointer)num_str);
-        return TRUE;
+    clear_history();
+    clear_calculator();
+    frame_latency_reset();
+    r->start = g_get_monotonic_time();
+    g_idle_add(trace_replay_next, r);
+    return 1;
+}
+
+// File names on a forwarded command line are relative to the launcher's directory
+gchar *command_line_path(GApplicationCommandLine *cmdline, const char *path) {
+    const gchar *cwd = g_application_command_line_get_cwd(cmdline);
+    return g_path_is_absolute(path) || cwd == NULL ? g_strdup(path) : g_build_filename(cwd, path, NULL);
+}
+
+// Runs in the primary instance for its own launch and for every later one:
+// calculator [--daemon | --quit] [--record FILE | --replay FILE [--fast]] [EXPRESSION]
+int on_app_command_line(GApplication *application, GApplicationCommandLine *cmdline, gpointer data) {
+    (void)data;
+    int argc;
+    gchar **argv = g_application_command_line_get_arguments(cmdline, &argc);
+    const char *expr = NULL;
+    const char *record = NULL;
+    const char *replay = NULL;
+    int start_daemon = 0;
+    int quit = 0;
+    int fast = 0;
+    int status = 0;
+
+    for (int i = 1; i < argc && status == 0; i++) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            start_daemon = 1;
+        } else if (strcmp(argv[i], "--quit") == 0) {
+            quit = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            fast = 1;
+        } else if (strncmp(argv[i], "--", 2) == 0 || expr != NULL) {
+            status = 1;
+        } else {
+            expr = argv[i];
+        }
+    }
+    if (status != 0 || (record != NULL && replay != NULL)) {
+        g_application_command_line_printerr(cmdline, "Usage: calculator [--daemon | --quit] "
+                                             "[--record FILE | --replay FILE [--fast]] [EXPRESSION]\n");
+        status = 1;
     }
 
-    // Handle numpad number keys
-    switch (key) {
-        case GDK_KEY_KP_0:
-            on_number_clicked(NULL, (gpointer)"0");
-            return TRUE;
-        case GDK_KEY_KP_1:
-            on_number_clicked(NULL, (gpointer)"1");
-            return TRUE;
-        case GDK_KEY_KP_2:
-            on_number_clicked(NULL, (gpointer)"2");
-            return TRUE;
-        case GDK_KEY_KP_3:
-            on_number_clicked(NULL, (gpointer)"3");
-            return TRUE;
-        case GDK_KEY_KP_4:
-            on_number_clicked(NULL, (gpointer)"4");
-            return TRUE;
-        case GDK_KEY_KP_5:
-            on_number_clicked(NULL, (gpointer)"5");
-            return TRUE;
-        case GDK_KEY_KP_6:
-            on_number_clicked(NULL, (gpointer)"6");
-            return TRUE;
-        case GDK_KEY_KP_7:
-            on_number_clicked(NULL, (gpointer)"7");
-            return TRUE;
-        case GDK_KEY_KP_8:
-            on_number_clicked(NULL, (gpointer)"8");
-            return TRUE;
-        case GDK_KEY_KP_9:
-            on_number_clicked(NULL, (gpointer)"9");
-            return TRUE;
+    if (status == 0 && record != NULL) {
+        gchar *path = command_line_path(cmdline, record);
+        if (trace_out != NULL) {
+            fclose(trace_out);
+        }
+        if (trace_open(path)) {
+            g_signal_add_emission_hook(g_signal_lookup("clicked", GTK_TYPE_BUTTON), 0, trace_clicked_hook, NULL, NULL);
+        } else {
+            g_application_command_line_printerr(cmdline, "Cannot write trace %s\n", path);
+            status = 1;
+        }
+        g_free(path);
+    }
+    if (status == 0 && replay != NULL) {
+        gchar *path = command_line_path(cmdline, replay);
+        if (!trace_replay_start(path, fast, cmdline)) {
+            g_application_command_line_printerr(cmdline, "Cannot replay trace %s\n", path);
+            status = 1;
+        }
+        g_free(path);
     }
 
-    // Handle operation keys
-    switch (key) {
-        case '+':
-        case GDK_KEY_KP_Add:
-            on_operation_clicked(NULL, (gpointer)"+");
-            return TRUE;
-        case '-':
-        case GDK_KEY_KP_Subtract:
-            on_operation_clicked(NULL, (gpointer)"-");
-            return TRUE;
-        case '*':
-        case GDK_KEY_KP_Multiply:
-            on_operation_clicked(NULL, (gpointer)"*");
-            return TRUE;
-        case '/':
-        case GDK_KEY_KP_Divide:
-            on_operation_clicked(NULL, (gpointer)"/");
-            return TRUE;
-        case '(':
-            on_operation_clicked(NULL, (gpointer)"(");
-            return TRUE;
-        case ')':
-            on_operation_clicked(NULL, (gpointer)")");
-            return TRUE;
-        case GDK_KEY_Return:
-        case GDK_KEY_KP_Enter:
-        case '=':
-            on_equals_clicked(NULL, NULL);
-            return TRUE;
-        case '.':
-        case GDK_KEY_KP_Decimal:
-            on_decimal_clicked(NULL, NULL);
-            return TRUE;
-        case 'c':
-        case 'C':
-        case GDK_KEY_Escape:
-            on_clear_clicked(NULL, NULL);
-            return TRUE;
-        case GDK_KEY_BackSpace:
-            on_backspace_clicked(NULL, NULL);
-            return TRUE;
-        case GDK_KEY_Delete:
-            on_delete_clicked(NULL, NULL);
-            return TRUE;
-        default:
-            return FALSE;
+    if (status == 0 && quit) {
+        g_application_quit(application);
+    } else if (status == 0) {
+        // The daemon holds the application so it outlives its hidden window
+        if (start_daemon && !daemon_mode) {
+            daemon_mode = 1;
+            g_application_hold(application);
+        }
+        if (expr != NULL) {
+            evaluate_forwarded(expr);
+        }
+        if (!start_daemon || expr != NULL || replay != NULL) {
+            gtk_window_present(GTK_WINDOW(main_window));
+        }
     }
+    g_strfreev(argv);
+    return status;
 }
 
-int main(int argc, char *argv[]) {
+// Build the window once per process; later launches only present it
+void on_app_startup(GApplication *application, gpointer data) {
+    (void)data;
     GtkWidget *window;
     GtkWidget *grid;
     GtkWidget *button;
 
-    // Initialize GTK
-    gtk_init(&argc, &argv);
-
     // Create CSS provider for styling
     css_provider = gtk_css_provider_new();
     gtk_style_context_add_provider_for_screen(gdk_screen_get_default(), GTK_STYLE_PROVIDER(css_provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
@@ -1147,6 +11176,7 @@ int main(int argc, char *argv[]) {
 
     // Create main window
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    gtk_window_set_application(GTK_WINDOW(window), GTK_APPLICATION(application));
     gtk_window_set_title(GTK_WINDOW(window), "Basic Calculator");
     gtk_window_set_default_size(GTK_WINDOW(window), window_width, window_height);
 
@@ -1167,7 +11197,7 @@ int main(int argc, char *argv[]) {
 
 
     gtk_container_set_border_width(GTK_CONTAINER(window), 10);
-    g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
+    g_signal_connect(window, "delete-event", G_CALLBACK(on_window_delete), NULL);
     g_signal_connect(window, "key-press-event", G_CALLBACK(on_key_press), NULL);
     g_signal_connect(window, "configure-event", G_CALLBACK(on_window_resize), NULL);
     g_signal_connect(window, "show", G_CALLBACK(on_window_show), NULL);
@@ -1193,6 +11223,26 @@ int main(int argc, char *argv[]) {
     GtkWidget *display_item = gtk_menu_item_new_with_label("Display Height");
     gtk_menu_item_set_submenu(GTK_MENU_ITEM(display_item), display_menu);
 
+    // Arithmetic mode submenu
+    GtkWidget *arithmetic_menu = gtk_menu_new();
+    GtkWidget *arithmetic_item = gtk_menu_item_new_with_label("Arithmetic");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(arithmetic_item), arithmetic_menu);
+
+    // Programmer mode submenu
+    GtkWidget *programmer_menu = gtk_menu_new();
+    GtkWidget *programmer_item = gtk_menu_item_new_with_label("Programmer");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(programmer_item), programmer_menu);
+
+    // Plot submenu
+    GtkWidget *plot_menu = gtk_menu_new();
+    GtkWidget *plot_item = gtk_menu_item_new_with_label("Plot");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(plot_item), plot_menu);
+
+    // History submenu
+    GtkWidget *history_menu = gtk_menu_new();
+    GtkWidget *history_item = gtk_menu_item_new_with_label("History");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(history_item), history_menu);
+
     // Precision options (regular menu items with markup support)
     precision_0 = gtk_menu_item_new_with_label("0 decimal places");
     precision_1 = gtk_menu_item_new_with_label("1 decimal place");
@@ -1209,6 +11259,40 @@ int main(int argc, char *argv[]) {
     display_medium = gtk_menu_item_new_with_label("Medium (120px)");
     display_large = gtk_menu_item_new_with_label("Large (160px)");
 
+    // Arithmetic mode options
+    arithmetic_fast = gtk_menu_item_new_with_label("Fast (double)");
+    arithmetic_exact = gtk_menu_item_new_with_label("Exact decimal");
+    arithmetic_interval = gtk_menu_item_new_with_label("Interval bounds");
+    arithmetic_complex = gtk_menu_item_new_with_label("Complex");
+    arithmetic_programmer = gtk_menu_item_new_with_label("Programmer");
+
+    // Programmer mode options: base, then width, then signedness
+    base_10 = gtk_menu_item_new_with_label("Decimal");
+    base_16 = gtk_menu_item_new_with_label("Hexadecimal");
+    base_8 = gtk_menu_item_new_with_label("Octal");
+    base_2 = gtk_menu_item_new_with_label("Binary");
+    width_8 = gtk_menu_item_new_with_label("8-bit");
+    width_16 = gtk_menu_item_new_with_label("16-bit");
+    width_32 = gtk_menu_item_new_with_label("32-bit");
+    width_64 = gtk_menu_item_new_with_label("64-bit");
+    integers_signed = gtk_menu_item_new_with_label("Signed");
+    integers_unsigned = gtk_menu_item_new_with_label("Unsigned");
+
+    // Plot options
+    plot_hidden = gtk_menu_item_new_with_label("Hidden");
+    plot_beside = gtk_menu_item_new_with_label("Beside display");
+    GtkWidget *plot_export = gtk_menu_item_new_with_label("Export Table...");
+
+    // History options
+    GtkWidget *history_export = gtk_menu_item_new_with_label("Export...");
+    GtkWidget *history_import = gtk_menu_item_new_with_label("Import...");
+
+    // Worksheet window
+    GtkWidget *worksheet_item = gtk_menu_item_new_with_label("Worksheet...");
+
+    // Latency debug panel
+    GtkWidget *latency_item = gtk_menu_item_new_with_label("Typing Latency...");
+
     // Enable markup for all menu items initially
     gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(precision_0))), TRUE);
     gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(precision_1))), TRUE);
@@ -1225,9 +11309,35 @@ int main(int argc, char *argv[]) {
     gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(display_medium))), TRUE);
     gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(display_large))), TRUE);
 
+    // Enable markup for arithmetic mode menu items
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(arithmetic_fast))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(arithmetic_exact))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(arithmetic_interval))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(arithmetic_complex))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(arithmetic_programmer))), TRUE);
+
+    // Enable markup for programmer mode menu items
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(base_10))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(base_16))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(base_8))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(base_2))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(width_8))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(width_16))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(width_32))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(width_64))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(integers_signed))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(integers_unsigned))), TRUE);
+
+    // Enable markup for plot menu items
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(plot_hidden))), TRUE);
+    gtk_label_set_use_markup(GTK_LABEL(gtk_bin_get_child(GTK_BIN(plot_beside))), TRUE);
+
     // Update labels to show current selection with blue color
     update_precision_menu_labels();
     update_display_height_menu_labels();
+    update_arithmetic_menu_labels();
+    update_programmer_menu_labels();
+    update_plot_menu_labels();
 
     g_signal_connect(precision_0, "activate", G_CALLBACK(on_precision_changed), GINT_TO_POINTER(0));
     g_signal_connect(precision_1, "activate", G_CALLBACK(on_precision_changed), GINT_TO_POINTER(1));
@@ -1243,6 +11353,32 @@ int main(int argc, char *argv[]) {
     g_signal_connect(display_medium, "activate", G_CALLBACK(on_display_height_changed), GINT_TO_POINTER(120));
     g_signal_connect(display_large, "activate", G_CALLBACK(on_display_height_changed), GINT_TO_POINTER(160));
 
+    g_signal_connect(arithmetic_fast, "activate", G_CALLBACK(on_arithmetic_changed), GINT_TO_POINTER(ARITHMETIC_FAST));
+    g_signal_connect(arithmetic_exact, "activate", G_CALLBACK(on_arithmetic_changed), GINT_TO_POINTER(ARITHMETIC_EXACT));
+    g_signal_connect(arithmetic_interval, "activate", G_CALLBACK(on_arithmetic_changed), GINT_TO_POINTER(ARITHMETIC_INTERVAL));
+    g_signal_connect(arithmetic_complex, "activate", G_CALLBACK(on_arithmetic_changed), GINT_TO_POINTER(ARITHMETIC_COMPLEX));
+    g_signal_connect(arithmetic_programmer, "activate", G_CALLBACK(on_arithmetic_changed), GINT_TO_POINTER(ARITHMETIC_PROGRAMMER));
+
+    g_signal_connect(base_10, "activate", G_CALLBACK(on_programmer_base_changed), GINT_TO_POINTER(10));
+    g_signal_connect(base_16, "activate", G_CALLBACK(on_programmer_base_changed), GINT_TO_POINTER(16));
+    g_signal_connect(base_8, "activate", G_CALLBACK(on_programmer_base_changed), GINT_TO_POINTER(8));
+    g_signal_connect(base_2, "activate", G_CALLBACK(on_programmer_base_changed), GINT_TO_POINTER(2));
+    g_signal_connect(width_8, "activate", G_CALLBACK(on_programmer_width_changed), GINT_TO_POINTER(8));
+    g_signal_connect(width_16, "activate", G_CALLBACK(on_programmer_width_changed), GINT_TO_POINTER(16));
+    g_signal_connect(width_32, "activate", G_CALLBACK(on_programmer_width_changed), GINT_TO_POINTER(32));
+    g_signal_connect(width_64, "activate", G_CALLBACK(on_programmer_width_changed), GINT_TO_POINTER(64));
+    g_signal_connect(integers_signed, "activate", G_CALLBACK(on_programmer_signed_changed), GINT_TO_POINTER(1));
+    g_signal_connect(integers_unsigned, "activate", G_CALLBACK(on_programmer_signed_changed), GINT_TO_POINTER(0));
+
+    g_signal_connect(plot_hidden, "activate", G_CALLBACK(on_plot_visibility_changed), GINT_TO_POINTER(0));
+    g_signal_connect(plot_beside, "activate", G_CALLBACK(on_plot_visibility_changed), GINT_TO_POINTER(1));
+    g_signal_connect(plot_export, "activate", G_CALLBACK(on_export_table_clicked), window);
+
+    g_signal_connect(history_export, "activate", G_CALLBACK(on_history_export_clicked), window);
+    g_signal_connect(history_import, "activate", G_CALLBACK(on_history_import_clicked), window);
+    g_signal_connect(worksheet_item, "activate", G_CALLBACK(on_worksheet_clicked), window);
+    g_signal_connect(latency_item, "activate", G_CALLBACK(on_latency_panel_clicked), window);
+
     gtk_menu_shell_append(GTK_MENU_SHELL(precision_menu), precision_0);
     gtk_menu_shell_append(GTK_MENU_SHELL(precision_menu), precision_1);
     gtk_menu_shell_append(GTK_MENU_SHELL(precision_menu), precision_2);
@@ -1257,9 +11393,41 @@ int main(int argc, char *argv[]) {
     gtk_menu_shell_append(GTK_MENU_SHELL(display_menu), display_medium);
     gtk_menu_shell_append(GTK_MENU_SHELL(display_menu), display_large);
 
+    gtk_menu_shell_append(GTK_MENU_SHELL(arithmetic_menu), arithmetic_fast);
+    gtk_menu_shell_append(GTK_MENU_SHELL(arithmetic_menu), arithmetic_exact);
+    gtk_menu_shell_append(GTK_MENU_SHELL(arithmetic_menu), arithmetic_interval);
+    gtk_menu_shell_append(GTK_MENU_SHELL(arithmetic_menu), arithmetic_complex);
+    gtk_menu_shell_append(GTK_MENU_SHELL(arithmetic_menu), arithmetic_programmer);
+
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), base_10);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), base_16);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), base_8);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), base_2);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), gtk_separator_menu_item_new());
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), width_8);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), width_16);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), width_32);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), width_64);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), gtk_separator_menu_item_new());
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), integers_signed);
+    gtk_menu_shell_append(GTK_MENU_SHELL(programmer_menu), integers_unsigned);
+
+    gtk_menu_shell_append(GTK_MENU_SHELL(plot_menu), plot_hidden);
+    gtk_menu_shell_append(GTK_MENU_SHELL(plot_menu), plot_beside);
+    gtk_menu_shell_append(GTK_MENU_SHELL(plot_menu), plot_export);
+
+    gtk_menu_shell_append(GTK_MENU_SHELL(history_menu), history_export);
+    gtk_menu_shell_append(GTK_MENU_SHELL(history_menu), history_import);
+
     // Add precision menu to view menu (fonts are now automatic)
     gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), precision_item);
     gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), display_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), arithmetic_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), programmer_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), plot_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), history_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), worksheet_item);
+    gtk_menu_shell_append(GTK_MENU_SHELL(view_menu), latency_item);
 
     // Add view menu to menu bar
     gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), view_menu_item);
@@ -1277,12 +11445,37 @@ int main(int argc, char *argv[]) {
 
     // Set display widget name for CSS targeting
     gtk_widget_set_name(display, "display");
+    g_signal_connect_after(display, "draw", G_CALLBACK(on_display_drawn), NULL);
 
     // Add scrolling
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled_window),
         GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     gtk_container_add(GTK_CONTAINER(scrolled_window), display);
+    gtk_widget_set_hexpand(scrolled_window, TRUE);
+
+    // Plot area beside the display (hidden unless enabled)
+    plot_area = gtk_drawing_area_new();
+    gtk_widget_set_size_request(plot_area, 200, -1);
+    gtk_widget_add_events(plot_area, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK | GDK_BUTTON_PRESS_MASK |
+                                     GDK_BUTTON_RELEASE_MASK | GDK_BUTTON1_MOTION_MASK);
+    g_signal_connect(plot_area, "draw", G_CALLBACK(on_plot_draw), NULL);
+    g_signal_connect(plot_area, "size-allocate", G_CALLBACK(on_plot_size_allocate), NULL);
+    g_signal_connect(plot_area, "scroll-event", G_CALLBACK(on_plot_scroll), NULL);
+    g_signal_connect(plot_area, "button-press-event", G_CALLBACK(on_plot_button), NULL);
+    g_signal_connect(plot_area, "button-release-event", G_CALLBACK(on_plot_button), NULL);
+    g_signal_connect(plot_area, "motion-notify-event", G_CALLBACK(on_plot_motion), NULL);
+    gtk_widget_set_no_show_all(plot_area, TRUE);
+    gtk_widget_set_visible(plot_area, show_plot);
+
+    // Spinner shown while a slow evaluation is pending
+    evaluation_spinner = gtk_spinner_new();
+    gtk_widget_set_no_show_all(evaluation_spinner, TRUE);
+
+    GtkWidget *display_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(display_box), scrolled_window, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(display_box), evaluation_spinner, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(display_box), plot_area, FALSE, TRUE, 0);
 
     // Create grid for buttons
     grid = gtk_grid_new();
@@ -1293,7 +11486,7 @@ int main(int argc, char *argv[]) {
 
     // Create buttons
     // Row 0: Display
-    gtk_grid_attach(GTK_GRID(grid), scrolled_window, 0, 0, 4, 1);
+    gtk_grid_attach(GTK_GRID(grid), display_box, 0, 0, 4, 1);
 
     // Row 1: Clear and operations
     button = gtk_button_new_with_label("C");
@@ -1376,19 +11569,178 @@ int main(int argc, char *argv[]) {
     g_signal_connect(button, "clicked", G_CALLBACK(on_operation_clicked), (gpointer)"(");
     gtk_grid_attach(GTK_GRID(grid), button, 3, 5, 1, 1);
 
+    // Row 6: Memory registers shared with other instances
+    button = gtk_button_new_with_label("MC");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_memory_clear_clicked), NULL);
+    gtk_grid_attach(GTK_GRID(grid), button, 0, 6, 1, 1);
+
+    button = gtk_button_new_with_label("MR");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_memory_recall_clicked), NULL);
+    gtk_grid_attach(GTK_GRID(grid), button, 1, 6, 1, 1);
+
+    button = gtk_button_new_with_label("M+");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_memory_add_clicked), GINT_TO_POINTER(1));
+    gtk_grid_attach(GTK_GRID(grid), button, 2, 6, 1, 1);
+
+    button = gtk_button_new_with_label("M-");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_memory_add_clicked), GINT_TO_POINTER(-1));
+    gtk_grid_attach(GTK_GRID(grid), button, 3, 6, 1, 1);
+
+    // Memory indicator under the menu bar (empty while every register is zero)
+    memory_label = gtk_label_new("");
+    gtk_widget_set_name(memory_label, "memory-indicator");
+    gtk_widget_set_halign(memory_label, GTK_ALIGN_END);
+    gtk_label_set_ellipsize(GTK_LABEL(memory_label), PANGO_ELLIPSIZE_END);
+
     // Create vertical box to hold menu and grid
     GtkWidget *vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
     gtk_box_pack_start(GTK_BOX(vbox), menu_bar, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), memory_label, FALSE, FALSE, 0);
+
+    // Progress of a history export or import (hidden unless one is running)
+    history_progress_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(history_progress_bar), TRUE);
+    button = gtk_button_new_with_label("Cancel");
+    g_signal_connect(button, "clicked", G_CALLBACK(on_history_cancel_clicked), NULL);
+    history_progress_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start(GTK_BOX(history_progress_box), history_progress_bar, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(history_progress_box), button, FALSE, FALSE, 0);
+    gtk_widget_show_all(history_progress_box);
+    gtk_widget_set_no_show_all(history_progress_box, TRUE);
+    gtk_widget_hide(history_progress_box);
+    gtk_box_pack_start(GTK_BOX(vbox), history_progress_box, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), grid, TRUE, TRUE, 0);
 
+    // Without a shared bank the memory buttons do nothing
+    if (memory_open()) {
+        g_thread_unref(g_thread_new("memory-watch", memory_watcher, NULL));
+    } else {
+        g_warning("Shared memory registers are unavailable");
+    }
+
     // Add vbox to window
     gtk_container_add(GTK_CONTAINER(window), vbox);
 
-    // Show all widgets
-    gtk_widget_show_all(window);
+    // Show all widgets, but leave the window itself to the command-line handler
+    gtk_widget_show_all(vbox);
+    gtk_widget_realize(window);
+    main_window = window;
 
-    // Start GTK main loop87
-    gtk_main();
+    // Frames painted after a key press finish its latency measurement
+    g_signal_connect(gtk_widget_get_frame_clock(window), "after-paint", G_CALLBACK(on_frame_after_paint), NULL);
+}
 
-    return 0;
+int main(int argc, char *argv[]) {
+    // The JIT can be switched off to compare against (or work around) native code
+    if (getenv("CALCULATOR_NO_JIT") != NULL) {
+        jit_enabled = 0;
+    }
+
+    // --complex in front of --batch or --table evaluates in complex arithmetic
+    if (argc > 1 && strcmp(argv[1], "--complex") == 0) {
+        arithmetic_mode = ARITHMETIC_COMPLEX;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    // --exact in front of --batch prints exact decimal results in full
+    if (argc > 1 && strcmp(argv[1], "--exact") == 0) {
+        arithmetic_mode = ARITHMETIC_EXACT;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    // --programmer in front of --batch evaluates fixed-width integers, optionally
+    // followed by --base 2|8|10|16, --width 8|16|32|64 and --unsigned
+    if (argc > 1 && strcmp(argv[1], "--programmer") == 0) {
+        arithmetic_mode = ARITHMETIC_PROGRAMMER;
+        programmer_base = 10;
+        int next = 2;
+        while (next < argc) {
+            if (next + 1 < argc && strcmp(argv[next], "--base") == 0) {
+                programmer_base = atoi(argv[next + 1]);
+                next += 2;
+            } else if (next + 1 < argc && strcmp(argv[next], "--width") == 0) {
+                programmer_width = atoi(argv[next + 1]);
+                next += 2;
+            } else if (strcmp(argv[next], "--unsigned") == 0) {
+                programmer_signed = 0;
+                next++;
+            } else {
+                break;
+            }
+        }
+        if ((programmer_base != 2 && programmer_base != 8 && programmer_base != 10 && programmer_base != 16) ||
+            (programmer_width != 8 && programmer_width != 16 && programmer_width != 32 && programmer_width != 64)) {
+            fprintf(stderr, "--base must be 2, 8, 10 or 16 and --width 8, 16, 32 or 64\n");
+            return 1;
+        }
+        argv[next - 1] = argv[0];
+        argv += next - 1;
+        argc -= next - 1;
+    }
+
+    // --stats in front of --batch or --table prints a summary of the results instead
+    int stats = 0;
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+        if (arithmetic_mode != ARITHMETIC_FAST) {
+            fprintf(stderr, "--stats summarises double results and can't follow --complex, --exact or --programmer\n");
+            return 1;
+        }
+        stats = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    // Batch mode evaluates expressions from a file or pipe without opening a window
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argc > 2 ? argv[2] : NULL, stats);
+    }
+
+    // Stream mode evaluates one expression of any length from a file or pipe
+    if (argc > 1 && strcmp(argv[1], "--stream") == 0) {
+        return run_stream(argc > 2 ? argv[2] : NULL);
+    }
+
+    // Worksheet mode evaluates a file of lines that refer to each other
+    if (argc > 2 && strcmp(argv[1], "--worksheet") == 0) {
+        return run_worksheet(argv[2]);
+    }
+
+    // Table mode evaluates an expression in x over a range of rows
+    if (argc > 4 && strcmp(argv[1], "--table") == 0) {
+        if (stats) {
+            return run_table_stats(argv[2], strtod(argv[3], NULL), strtod(argv[4], NULL), argc > 5 ? atol(argv[5]) : 10);
+        }
+        return run_table(argv[2], strtod(argv[3], NULL), strtod(argv[4], NULL), argc > 5 ? atol(argv[5]) : 10);
+    }
+
+    // Benchmark mode compares evaluate_expression, the interpreter and the JIT
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        return run_bench(argc > 2 ? argv[2] : "(x * 2.5 + 1) / (x - 0.5) * sqrt(x + 3) - sq(x) / 7",
+                         argc > 3 ? atol(argv[3]) : 10000000);
+    }
+
+    // Matrix benchmark times the blocked kernels on random n x n matrices
+    if (argc > 1 && strcmp(argv[1], "--bench-matrix") == 0) {
+        int n = argc > 2 ? atoi(argv[2]) : 1000;
+        return run_bench_matrix(n > 0 ? n : 1000);
+    }
+
+    // Server mode answers expression requests on a Unix domain socket
+    if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+        return run_server(argc > 2 ? argv[2] : SERVE_DEFAULT_SOCKET);
+    }
+
+    // Everything else runs in a single instance: later launches hand their
+    // command line to the running one over D-Bus and exit
+    GtkApplication *app = gtk_application_new(APPLICATION_ID, G_APPLICATION_HANDLES_COMMAND_LINE);
+    g_signal_connect(app, "startup", G_CALLBACK(on_app_startup), NULL);
+    g_signal_connect(app, "command-line", G_CALLBACK(on_app_command_line), NULL);
+    int status = g_application_run(G_APPLICATION(app), argc, argv);
+    g_object_unref(app);
+    return status;
 }
\ No newline at end of file
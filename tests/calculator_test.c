@@ -0,0 +1,221 @@
+// Tests for the calculator, built against main.c itself so static helpers are
+// reachable. Run with "make check".
+#define main calculator_main
+#include "../main.c"
+#undef main
+
+int failures = 0;
+
+#define CHECK(condition, ...)                               \
+    do {                                                    \
+        if (!(condition)) {                                 \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);                   \
+            fputc('\n', stderr);                            \
+            failures++;                                     \
+        }                                                   \
+    } while (0)
+
+// MR must type something the parser reads back as the stored value
+void test_memory_recall_round_trip(void) {
+    const double values[] = { 1e20, 1e-5, -1e-5, 0.1, 123.456, 1.7976931348623157e308, 5e-324 };
+    for (size_t k = 0; k < sizeof(values) / sizeof(values[0]); k++) {
+        char text[sizeof(current_input)];
+        format_round_trip(values[k], text, sizeof(text));
+        CalcResult res = evaluate_expression_result(text);
+        CHECK(res.error == CALC_OK, "\"%s\": %s", text, calc_error_message(res.error));
+        CHECK(res.value == values[k], "\"%s\" read back as %.17g, not %.17g", text, res.value, values[k]);
+    }
+}
+
+void test_exponent_literals(void) {
+    CalcResult res = evaluate_expression_result("2.5e3 + 1E-1");
+    CHECK(res.error == CALC_OK && res.value == 2500.1, "2.5e3 + 1E-1 = %.17g", res.value);
+    res = evaluate_expression_result("2e");
+    CHECK(res.error == CALC_ERR_MISSING_OPERATOR && res.error_offset == 1, "2e: %s", calc_error_message(res.error));
+    res = evaluate_expression_result("1e99999");
+    CHECK(res.error == CALC_ERR_OVERFLOW, "1e99999: %s", calc_error_message(res.error));
+
+    // The streaming evaluator reads literals the same way
+    const char *streamed[] = { "2.5e3 + 1E-1", "0.00001 - 1e-5", "2e+x" };
+    for (int k = 0; k < 3; k++) {
+        FILE *in = fmemopen((void *)streamed[k], strlen(streamed[k]), "r");
+        double value;
+        long long offset;
+        CalcError error = evaluate_stream(in, &value, &offset);
+        fclose(in);
+        res = evaluate_expression_result(streamed[k]);
+        CHECK(error == res.error && (error != CALC_OK || value == res.value),
+              "stream \"%s\" gave %s %.17g", streamed[k], calc_error_message(error), value);
+    }
+
+    char exact[64];
+    res = evaluate_expression_exact("1e-5 * 3e2", 10, exact, sizeof(exact));
+    CHECK(res.error == CALC_OK && strcmp(exact, "0.003") == 0, "exact 1e-5 * 3e2 = %s", exact);
+}
+
+// '=' pressed while an evaluation is pending queues its line instead of dropping
+// it, and a queued definition is made before the line after it is evaluated
+void drain_evaluations(void) {
+    while (evaluation_pending()) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+void test_equals_while_pending(void) {
+    text_buffer = gtk_text_buffer_new(NULL);
+    evaluation_spinner = gtk_spinner_new();
+    const char *lines[] = { "2 + 3", "y = 7", "y * 2" };
+    for (int k = 0; k < 3; k++) {
+        strcpy(expression, lines[k]);
+        on_equals_clicked(NULL, NULL);
+        CHECK(evaluation_pending(), "\"%s\" did not leave an evaluation pending", lines[k]);
+    }
+    drain_evaluations();
+
+    const char *expected[] = { "y * 2 = 14", "y = 7 = 7", "2 + 3 = 5" };
+    HistoryEntry *entry = history;
+    for (int k = 0; k < 3; k++, entry = entry->older) {
+        CHECK(entry != NULL, "history is missing \"%s\"", expected[k]);
+        if (entry == NULL) {
+            return;
+        }
+        CHECK(strcmp(entry->text, expected[k]) == 0, "history has \"%s\", expected \"%s\"", entry->text, expected[k]);
+    }
+}
+
+void define(const char *line) {
+    CalcDefinition def;
+    CHECK(parse_definition(line, &def), "\"%s\" is not a definition", line);
+    CalcResult res = define_symbol(line, &def);
+    CHECK(res.error == CALC_OK, "\"%s\": %s", line, calc_error_message(res.error));
+}
+
+// Every evaluator reads a variable's cached value rather than re-running its
+// definition, so a chain where each link doubles the last stays cheap, and a
+// redefinition reaches the end of the chain in every mode
+void test_chained_definitions(void) {
+    char line[64], exact[64];
+    double lo, hi;
+    define("v1 = 1.1");
+    for (int k = 2; k <= 40; k++) {
+        snprintf(line, sizeof(line), "v%d = v%d + v%d", k, k - 1, k - 1);
+        define(line);
+    }
+    CalcResult res = evaluate_expression_result("v40");
+    CHECK(res.error == CALC_OK && res.value == 1.1 * 549755813888.0, "v40 = %.17g", res.value);
+    res = evaluate_expression_exact("v40", 10, exact, sizeof(exact));
+    CHECK(res.error == CALC_OK && strcmp(exact, "604731395276.8") == 0, "exact v40 = %s", exact);
+    CHECK(evaluate_expression_interval("v40", &lo, &hi) && lo <= 604731395276.8 && hi >= 604731395276.8 &&
+          hi - lo < 1e-3, "v40 in [%.17g, %.17g]", lo, hi);
+
+    define("v1 = 3");
+    res = evaluate_expression_result("v40");
+    CHECK(res.error == CALC_OK && res.is_integer && res.int_value == 1649267441664LL, "v40 = %lld after v1 = 3",
+          res.int_value);
+    res = evaluate_expression_exact("v40 + 0.5", 10, exact, sizeof(exact));
+    CHECK(res.error == CALC_OK && strcmp(exact, "1649267441664.5") == 0, "exact v40 + 0.5 = %s after v1 = 3", exact);
+    CHECK(evaluate_expression_interval("v40", &lo, &hi) && lo == 1649267441664.0 && hi == 1649267441664.0,
+          "v40 in [%.17g, %.17g] after v1 = 3", lo, hi);
+}
+
+// Definitions made with '=' run in the job and take effect when it comes back,
+// in queue order, with the variables that depend on them brought up to date
+void test_definition_jobs(void) {
+    const char *lines[] = { "dj = 2", "fj(x) = x + dj", "fj(1)", "dj = 5", "fj(1)", "dk = fj(dj)" };
+    for (int k = 0; k < 6; k++) {
+        strcpy(expression, lines[k]);
+        on_equals_clicked(NULL, NULL);
+    }
+    CalcResult res = evaluate_expression_result("dj");
+    CHECK(res.error == CALC_ERR_UNDEFINED_NAME, "dj was defined before its job came back");
+    drain_evaluations();
+
+    const char *expected[] = { "dk = fj(dj) = 10", "fj(1) = 6", "dj = 5 = 5", "fj(1) = 3", "fj(x) = x + dj", "dj = 2 = 2" };
+    HistoryEntry *entry = history;
+    for (int k = 0; k < 6; k++, entry = entry->older) {
+        CHECK(entry != NULL, "history is missing \"%s\"", expected[k]);
+        if (entry == NULL) {
+            return;
+        }
+        CHECK(strcmp(entry->text, expected[k]) == 0, "history has \"%s\", expected \"%s\"", entry->text, expected[k]);
+    }
+
+    define("fj(x) = x * dj");
+    res = evaluate_expression_result("dk");
+    CHECK(res.error == CALC_OK && res.value == 25, "dk = %g after fj was redefined", res.value);
+}
+
+// Worksheet updates are evaluation jobs, queued in order with the calculations
+void test_worksheet_jobs(void) {
+    worksheet_results = gtk_text_buffer_new(NULL);
+    strcpy(expression, "wg = 4");
+    on_equals_clicked(NULL, NULL);
+    EvaluationJob *job = calloc(1, sizeof(EvaluationJob));
+    job->worksheet_texts = g_strsplit("a = wg / 2\nb = a * 3\nL2 + 1", "\n", -1);
+    worksheet_job_pending = 1;
+    g_queue_push_tail(&evaluation_queue, job);
+    drain_evaluations();
+    CHECK(!worksheet_job_pending, "the worksheet update did not come back");
+    CHECK(worksheet.count == 3 && worksheet.lines[2].error == CALC_OK && worksheet.lines[2].value == 7,
+          "worksheet L3 = %g", worksheet.count == 3 ? worksheet.lines[2].value : NAN);
+}
+
+// Escape cancels the pending job only: later definitions and evaluations,
+// which call functions too, must not see it as cancelled
+void test_cancel_ends_with_job(void) {
+    char line[64];
+    define("slow0(x) = x");
+    for (int k = 1; k <= 40; k++) {
+        snprintf(line, sizeof(line), "slow%d(x) = slow%d(x) + slow%d(x)", k, k - 1, k - 1);
+        define(line);
+    }
+    define("kept = 1");
+    strcpy(expression, "kept = slow40(1)");
+    on_equals_clicked(NULL, NULL);
+    evaluation_cancel();
+    drain_evaluations();
+    CHECK(strstr(history->text, "cancelled") != NULL, "history has \"%s\"", history->text);
+    CalcResult kept = evaluate_expression_result("kept");
+    CHECK(kept.error == CALC_OK && kept.value == 1, "a cancelled definition changed kept to %g", kept.value);
+
+    define("twice(x) = 2 * x");
+    define("doubled = twice(2)");
+    CalcResult res = evaluate_expression_result("doubled + twice(3)");
+    CHECK(res.error == CALC_OK && res.value == 10, "doubled + twice(3) after a cancel: %s %g",
+          calc_error_message(res.error), res.value);
+}
+
+// Exact mode keeps every digit of a long literal, such as a continued 2^500
+void test_exact_long_literals(void) {
+    char power[256], sum[256], line[300];
+    CalcResult res = evaluate_expression_exact("2^500", 10, power, sizeof(power));
+    CHECK(res.error == CALC_OK && strlen(power) == 151, "exact 2^500 = %s", power);
+    snprintf(line, sizeof(line), "%s + 1 - 2^500", power);
+    res = evaluate_expression_exact(line, 10, sum, sizeof(sum));
+    CHECK(res.error == CALC_OK && strcmp(sum, "1") == 0, "exact %s = %s", line, sum);
+    snprintf(line, sizeof(line), "0.%s - 2^500 / 10^151", power);
+    res = evaluate_expression_exact(line, 10, sum, sizeof(sum));
+    CHECK(res.error == CALC_OK && strcmp(sum, "0") == 0, "exact 0.(2^500 digits) - 2^500 / 10^151 = %s", sum);
+}
+
+int main(int argc, char *argv[]) {
+    test_memory_recall_round_trip();
+    test_exponent_literals();
+    test_exact_long_literals();
+    test_chained_definitions();
+    if (gtk_init_check(&argc, &argv)) {
+        test_equals_while_pending();
+        test_definition_jobs();
+        test_worksheet_jobs();
+        test_cancel_ends_with_job();
+    } else {
+        printf("No display: skipping the tests that need GTK\n");
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}